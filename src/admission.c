@@ -0,0 +1,422 @@
+/*
+    RedStore - a lightweight RDF triplestore powered by Redland
+    Copyright (C) 2010-2011 Nicholas J Humfrey <njh@aelius.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Admission control
+
+  Requests wait on one of four queues, or lanes, in the HTTP server (see
+  redhttp/queue.c), chosen when the request has been read:
+
+  - interactive: HEAD and GET of pages, the graph list, and graphs that
+    are small enough to send quickly
+  - queries: SPARQL queries, dumps, and GETs of large graphs
+  - analytic: queries with the analytic argument, or an estimated cost
+    of at least analytic-cost (see query.c)
+  - writes: requests which might change the store
+
+  Each lane has its own limit, so a burst of expensive queries can't
+  fill the space that the cheap reads need. Once a lane is full, further
+  requests for it are refused with 503 and a Retry-After header, rather
+  than waiting in the listen backlog until the client gives up.
+
+  The lanes are dispatched by weighted round-robin, with most of the
+  turns going to interactive requests, so they don't wait behind a queue
+  of SPARQL queries. Analytic queries also need one of a fixed number of
+  slots, shared by the worker processes and the children they fork
+  through shared memory; while all the slots are taken, the analytic
+  lane is closed and its queries wait. The remaining processes are left
+  for the other lanes.
+
+  Before any of that, a connection has to send its request within the
+  header timeout, with headers of limited size and number, or it is
+  closed without taking up any of the server's time (see
+  redhttp/deadline.c).
+
+  Queries and writes can also be limited to a rate for each client (see
+  ratelimit.c), so that one client can't take all of the turns of its
+  lane. The budget is taken when the request is classified, and one that
+  is over its rate is answered straight away with 429, rather than
+  waiting in the lane it would have filled. Requests on HTTP/2
+  connections, which aren't classified, are limited in the same way by
+  a handler.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
+
+#include "redstore.h"
+
+#define DEFAULT_BACKLOG                 (128)
+#define DEFAULT_MAX_QUEUED_READS        (64)
+#define DEFAULT_MAX_QUEUED_QUERIES      (16)
+#define DEFAULT_MAX_QUEUED_ANALYTIC     (8)
+#define DEFAULT_MAX_QUEUED_WRITES       (32)
+#define DEFAULT_RETRY_AFTER             (1)
+#define DEFAULT_INTERACTIVE_GRAPH_SIZE  (10000)
+#define DEFAULT_HEADER_TIMEOUT          (10000)
+#define DEFAULT_BODY_TIMEOUT            (30000)
+#define DEFAULT_WRITE_TIMEOUT           (30000)
+#define DEFAULT_MAX_HEADER_SIZE         (16384)
+#define DEFAULT_MAX_HEADER_COUNT        (100)
+#define DEFAULT_RATE_LIMIT_CLIENTS      (4096)
+
+#define LANE_INTERACTIVE             (0)
+#define LANE_QUERIES                 (1)
+#define LANE_WRITES                  (2)
+#define LANE_ANALYTIC                (3)
+#define LANE_COUNT                   (4)
+
+// Share of the dispatches each lane gets while they all have requests waiting
+static const int lane_weights[LANE_COUNT] = { 8, 2, 4, 1 };
+
+
+static redhttp_server_t *admission_server = NULL;
+static long retry_after = DEFAULT_RETRY_AFTER;
+static long interactive_graph_size = DEFAULT_INTERACTIVE_GRAPH_SIZE;
+
+// The header holding clients' API keys, if they are rate limited by key
+static char *rate_limit_header = NULL;
+
+// The number of analytic queries running, shared between processes
+static int *analytic_running = NULL;
+static long analytic_slots = 0;
+
+
+static int is_query_request(redhttp_request_t * request)
+{
+  const char *path = redhttp_request_get_path(request);
+
+  if (strcmp(path, "/sparql") != 0 && strcmp(path, "/sparql/") != 0 &&
+      strcmp(path, "/query") != 0)
+    return 0;
+
+  return redhttp_request_get_argument(request, "query") != NULL;
+}
+
+// Choose the lane that a request waits on
+static int choose_lane(redhttp_request_t * request)
+{
+  const char *method = redhttp_request_get_method(request);
+  const char *path = redhttp_request_get_path(request);
+
+  if (redstore_is_write_request(method, path))
+    return LANE_WRITES;
+
+  if (is_query_request(request)) {
+    const char *query_string = redhttp_request_get_argument(request, "query");
+    if (redstore_is_analytic_query(request, query_string))
+      return LANE_ANALYTIC;
+    return LANE_QUERIES;
+  }
+
+  // Dumps write out the whole store
+  if (strcmp(path, "/dump") == 0)
+    return LANE_QUERIES;
+
+  if (strcmp(method, "GET") == 0 && strncmp(path, "/data", 5) == 0 &&
+      interactive_graph_size > 0 &&
+      redstore_data_count_triples(request) >= interactive_graph_size)
+    return LANE_QUERIES;
+
+  return LANE_INTERACTIVE;
+}
+
+// Take a token from the client's budget for the lane; returns -1 if the
+// client is over its rate
+static int rate_limit(redhttp_request_t * request, int lane, long *seconds)
+{
+  const char *key = redhttp_request_get_remote_addr(request);
+  char api_key[256];
+  int budget;
+
+  if (redhttp_request_get_admitted(request))
+    return 0;
+
+  if (lane == LANE_WRITES) {
+    budget = RATELIMIT_WRITES;
+  } else if (lane == LANE_QUERIES || lane == LANE_ANALYTIC) {
+    budget = RATELIMIT_QUERIES;
+  } else {
+    budget = -1;
+  }
+
+  if (budget >= 0 && rate_limit_header) {
+    const char *value = redhttp_request_get_header(request, rate_limit_header);
+    // Keys are kept apart from addresses, so a key can't use up an address's budget
+    if (value && value[0]) {
+      snprintf(api_key, sizeof(api_key), "key %s", value);
+      key = api_key;
+    }
+  }
+
+  if (budget >= 0 && redstore_ratelimit_take(key, budget, seconds))
+    return -1;
+
+  redhttp_request_set_admitted(request, 1);
+  return 0;
+}
+
+static int classify_request(redhttp_request_t * request, void *user_data)
+{
+  int lane = choose_lane(request);
+
+  // Dispatched straight away, to be refused by handle_rate_limit()
+  if (redstore_ratelimit_is_enabled() && rate_limit(request, lane, NULL))
+    return -1;
+
+  return lane;
+}
+
+// Keep the analytic lane closed while all of its slots are taken
+static int lane_is_open(int lane, void *user_data)
+{
+  if (lane != LANE_ANALYTIC || analytic_slots == 0)
+    return 1;
+
+  return __atomic_load_n(analytic_running, __ATOMIC_ACQUIRE) < analytic_slots;
+}
+
+static int get_int_option(const char *option, long default_value, int *value)
+{
+  long result = redstore_get_option_long(option, default_value);
+
+  if (result > INT_MAX) {
+    redstore_error("%s is too large.", option);
+    return -1;
+  }
+
+  *value = result;
+  return 0;
+}
+
+static int set_limit(int queue, const char *option, long default_value)
+{
+  int limit;
+
+  if (get_int_option(option, default_value, &limit))
+    return -1;
+
+  redhttp_server_set_queue_limit(admission_server, queue, limit);
+  redhttp_server_set_queue_weight(admission_server, queue, lane_weights[queue]);
+  return 0;
+}
+
+// Close connections which are too slow to send their requests, or to read
+// the responses, or whose headers are too large
+static int set_deadlines(redhttp_server_t * server)
+{
+  int header_timeout, body_timeout, write_timeout, max_header_size, max_header_count;
+
+  if (get_int_option("header-timeout", DEFAULT_HEADER_TIMEOUT, &header_timeout) ||
+      get_int_option("body-timeout", DEFAULT_BODY_TIMEOUT, &body_timeout) ||
+      get_int_option("write-timeout", DEFAULT_WRITE_TIMEOUT, &write_timeout) ||
+      get_int_option("max-header-size", DEFAULT_MAX_HEADER_SIZE, &max_header_size) ||
+      get_int_option("max-header-count", DEFAULT_MAX_HEADER_COUNT, &max_header_count))
+    return -1;
+
+  redhttp_server_set_header_timeout(server, header_timeout);
+  redhttp_server_set_body_timeout(server, body_timeout);
+  redhttp_server_set_write_timeout(server, write_timeout);
+  redhttp_server_set_max_header_size(server, max_header_size);
+  redhttp_server_set_max_header_count(server, max_header_count);
+
+  return 0;
+}
+
+static int set_rate_limits(void)
+{
+  long query_rate = redstore_get_option_long("query-rate", 0);
+  long write_rate = redstore_get_option_long("write-rate", 0);
+  long clients;
+
+  if (query_rate == 0 && write_rate == 0)
+    return 0;
+
+  // By default, a client can send ten seconds' worth of requests at once
+  redstore_ratelimit_set_budget(RATELIMIT_QUERIES, query_rate,
+                                redstore_get_option_long("query-burst", query_rate / 6));
+  redstore_ratelimit_set_budget(RATELIMIT_WRITES, write_rate,
+                                redstore_get_option_long("write-burst", write_rate / 6));
+  rate_limit_header = redstore_get_option_string("rate-limit-header");
+
+  clients = redstore_get_option_long("rate-limit-clients", DEFAULT_RATE_LIMIT_CLIENTS);
+  return redstore_ratelimit_init(clients);
+}
+
+// By default, analytic queries may take half of the processes which
+// answer requests: the workers, or otherwise the child processes
+static long default_analytic_slots(void)
+{
+  long workers = redstore_get_option_long("workers", 0);
+  long processes = workers > 0 ? workers : redstore_children_max();
+
+  return processes > 1 ? processes / 2 : 1;
+}
+
+
+int redstore_admission_init(redhttp_server_t * server)
+{
+  long backlog = redstore_get_option_long("backlog", DEFAULT_BACKLOG);
+
+  admission_server = server;
+
+  if (backlog < 1 || backlog > INT_MAX) {
+    redstore_error("backlog must be at least 1.");
+    return -1;
+  }
+  redhttp_server_set_backlog_size(server, backlog);
+
+  if (set_deadlines(server) || set_rate_limits())
+    return -1;
+
+  if (set_limit(LANE_INTERACTIVE, "max-queued-reads", DEFAULT_MAX_QUEUED_READS) ||
+      set_limit(LANE_QUERIES, "max-queued-queries", DEFAULT_MAX_QUEUED_QUERIES) ||
+      set_limit(LANE_ANALYTIC, "max-queued-analytic", DEFAULT_MAX_QUEUED_ANALYTIC) ||
+      set_limit(LANE_WRITES, "max-queued-writes", DEFAULT_MAX_QUEUED_WRITES))
+    return -1;
+
+  analytic_slots = redstore_get_option_long("analytic-slots", default_analytic_slots());
+  if (analytic_slots > INT_MAX) {
+    redstore_error("analytic-slots is too large.");
+    return -1;
+  }
+
+  // Created before the workers are forked, so that they all share it
+  analytic_running = mmap(NULL, sizeof(int), PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_ANON, -1, 0);
+  if (analytic_running == MAP_FAILED) {
+    redstore_error("Failed to allocate shared memory: %s", strerror(errno));
+    analytic_running = NULL;
+    return -1;
+  }
+  *analytic_running = 0;
+
+  interactive_graph_size =
+    redstore_get_option_long("interactive-graph-size", DEFAULT_INTERACTIVE_GRAPH_SIZE);
+  retry_after = redstore_get_option_long("retry-after", DEFAULT_RETRY_AFTER);
+  redhttp_server_set_retry_after(server, retry_after > INT_MAX ? INT_MAX : retry_after);
+  redhttp_server_set_classifier(server, classify_request, NULL);
+  redhttp_server_set_queue_gate(server, lane_is_open, NULL);
+
+  return 0;
+}
+
+// Called in a forked child, which only answers the request it was forked for
+void redstore_admission_forked(void)
+{
+  if (admission_server)
+    redhttp_server_release_queued(admission_server);
+}
+
+// Take one of the slots for running analytic queries; returns -1 if they
+// are all taken
+int redstore_admission_acquire_analytic(void)
+{
+  int running;
+
+  if (!analytic_running)
+    return 0;
+
+  running = __atomic_load_n(analytic_running, __ATOMIC_ACQUIRE);
+  do {
+    if (analytic_slots > 0 && running >= analytic_slots)
+      return -1;
+  } while (!__atomic_compare_exchange_n(analytic_running, &running, running + 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+  return 0;
+}
+
+void redstore_admission_release_analytic(void)
+{
+  if (analytic_running)
+    __atomic_fetch_sub(analytic_running, 1, __ATOMIC_ACQ_REL);
+}
+
+// Refuse queries and writes from clients which are over their rate
+redhttp_response_t *handle_rate_limit(redhttp_request_t * request, void *user_data)
+{
+  redhttp_response_t *response;
+  long seconds = 0;
+  char value[32];
+
+  if (!redstore_ratelimit_is_enabled() ||
+      !rate_limit(request, choose_lane(request), &seconds))
+    return NULL;
+
+  response = redstore_page_new_with_message(
+    request, LIBRDF_LOG_INFO, REDHTTP_TOO_MANY_REQUESTS,
+    "Too many requests from this client; please slow down."
+  );
+  if (response) {
+    snprintf(value, sizeof(value), "%ld", seconds);
+    redhttp_response_add_header(response, "Retry-After", value);
+  }
+
+  return response;
+}
+
+// Tell a client that has been refused when it is worth trying again
+void redstore_add_retry_after(redhttp_response_t * response)
+{
+  char value[32];
+
+  if (!response || retry_after <= 0)
+    return;
+
+  snprintf(value, sizeof(value), "%ld", retry_after);
+  redhttp_response_add_header(response, "Retry-After", value);
+}
+
+// Returns the number of requests waiting, the number refused so far, and
+// the number of analytic queries running in all processes
+void redstore_admission_get_stats(int *queued, unsigned long *refused, int *analytic)
+{
+  int i;
+
+  if (queued)
+    *queued = 0;
+  if (refused)
+    *refused = 0;
+  if (analytic)
+    *analytic = analytic_running ? __atomic_load_n(analytic_running, __ATOMIC_ACQUIRE) : 0;
+  if (!admission_server)
+    return;
+
+  for (i = 0; i < LANE_COUNT; i++) {
+    if (queued)
+      *queued += redhttp_server_get_queue_length(admission_server, i);
+    if (refused)
+      *refused += redhttp_server_get_queue_rejected(admission_server, i);
+  }
+}
+
+// Returns the number of connections closed because they were too slow,
+// the number of requests refused because of their headers, and the
+// number refused because their clients were over their rate
+void redstore_admission_get_offenders(unsigned long *timed_out, unsigned long *headers_refused,
+                                      unsigned long *rate_limited)
+{
+  *timed_out = admission_server ? redhttp_server_get_timed_out(admission_server) : 0;
+  *headers_refused = admission_server ? redhttp_server_get_headers_refused(admission_server) : 0;
+  *rate_limited = redstore_ratelimit_refused();
+}
@@ -0,0 +1,397 @@
+/*
+    RedStore - a lightweight RDF triplestore powered by Redland
+    Copyright (C) 2010-2011 Nicholas J Humfrey <njh@aelius.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Graph catalogue
+
+  An in-memory list of the named graphs in the store, with the number of
+  triples in each, an estimate of their size in bytes, and when they were
+  last changed. It is built by walking the store once at startup, and is
+  then kept up to date by the functions in store.c, so that listing the
+  graphs or checking whether one exists does not touch the storage.
+
+  A graph is in the catalogue for as long as it contains any triples.
+
+  The catalogue also keeps a running total of the triples in the whole
+  store, including the default graph, so that redstore_store_size() does
+  not have to ask the storage to count them (which is a full scan for
+  some storage modules). If the storage cannot count its triples at
+  startup, the total is left as unknown (-1).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "redstore.h"
+
+#define INITIAL_SLOT_COUNT   (64)
+
+
+static redstore_graph_info_t **slots = NULL;
+static unsigned int slot_count = 0;
+static int graph_count = 0;
+static long triple_count = -1;
+
+
+static const char *graph_key(librdf_node * graph, size_t * len)
+{
+  librdf_uri *uri = NULL;
+
+  if (graph)
+    uri = librdf_node_get_uri(graph);
+  if (!uri)
+    return NULL;
+
+  return (const char *) librdf_uri_as_counted_string(uri, len);
+}
+
+static size_t node_size(librdf_node * node)
+{
+  size_t len = 0;
+
+  if (!node)
+    return 0;
+
+  if (librdf_node_is_resource(node)) {
+    librdf_uri_as_counted_string(librdf_node_get_uri(node), &len);
+  } else if (librdf_node_is_literal(node)) {
+    librdf_uri *datatype = librdf_node_get_literal_value_datatype_uri(node);
+    char *lang = librdf_node_get_literal_value_language(node);
+    size_t datatype_len = 0;
+
+    librdf_node_get_literal_value_as_counted_string(node, &len);
+    if (lang)
+      len += strlen(lang);
+    if (datatype) {
+      librdf_uri_as_counted_string(datatype, &datatype_len);
+      len += datatype_len;
+    }
+  } else if (librdf_node_is_blank(node)) {
+    librdf_node_get_counted_blank_identifier(node, &len);
+  }
+
+  return len;
+}
+
+static size_t statement_size(librdf_statement * statement)
+{
+  return node_size(librdf_statement_get_subject(statement)) +
+      node_size(librdf_statement_get_predicate(statement)) +
+      node_size(librdf_statement_get_object(statement));
+}
+
+static redstore_graph_info_t *find_graph(const char *uri, size_t len, int create)
+{
+  redstore_graph_info_t *info;
+  uint32_t hash;
+
+  if (!slots)
+    return NULL;
+
+  hash = redstore_hash_bytes((const unsigned char *) uri, len);
+  for (info = slots[hash % slot_count]; info; info = info->next) {
+    if (info->hash == hash && strcmp(info->uri, uri) == 0)
+      return info;
+  }
+
+  if (!create)
+    return NULL;
+
+  // Keep the chains short
+  if (graph_count >= (int) slot_count) {
+    unsigned int new_count = slot_count * 2;
+    redstore_graph_info_t **new_slots = calloc(new_count, sizeof(redstore_graph_info_t *));
+    unsigned int i;
+
+    if (new_slots) {
+      for (i = 0; i < slot_count; i++) {
+        while (slots[i]) {
+          redstore_graph_info_t *moved = slots[i];
+          slots[i] = moved->next;
+          moved->next = new_slots[moved->hash % new_count];
+          new_slots[moved->hash % new_count] = moved;
+        }
+      }
+      free(slots);
+      slots = new_slots;
+      slot_count = new_count;
+    }
+  }
+
+  info = calloc(1, sizeof(redstore_graph_info_t));
+  if (!info)
+    return NULL;
+  info->uri = malloc(len + 1);
+  if (!info->uri) {
+    free(info);
+    return NULL;
+  }
+  memcpy(info->uri, uri, len + 1);
+  info->hash = hash;
+  info->next = slots[hash % slot_count];
+  slots[hash % slot_count] = info;
+  graph_count++;
+
+  return info;
+}
+
+static void remove_graph(redstore_graph_info_t * info)
+{
+  redstore_graph_info_t **ptr;
+
+  for (ptr = &slots[info->hash % slot_count]; *ptr; ptr = &(*ptr)->next) {
+    if (*ptr == info) {
+      *ptr = info->next;
+      free(info->uri);
+      free(info);
+      graph_count--;
+      return;
+    }
+  }
+}
+
+static int compare_graph_uris(const void *a, const void *b)
+{
+  const redstore_graph_info_t *info_a = *(const redstore_graph_info_t * const *) a;
+  const redstore_graph_info_t *info_b = *(const redstore_graph_info_t * const *) b;
+
+  return strcmp(info_a->uri, info_b->uri);
+}
+
+
+static int count_graph(librdf_node * graph, time_t now)
+{
+  redstore_graph_info_t *info = NULL;
+  librdf_stream *stream = NULL;
+  const char *uri;
+  size_t len = 0;
+
+  uri = graph_key(graph, &len);
+  if (!uri)
+    return 0;
+
+  stream = librdf_model_context_as_stream(redstore_graph_model(graph), graph);
+  if (!stream) {
+    redstore_error("Failed to stream graph: %s", uri);
+    return -1;
+  }
+
+  while (!librdf_stream_end(stream)) {
+    librdf_statement *statement = librdf_stream_get_object(stream);
+
+    if (!info) {
+      info = find_graph(uri, len, 1);
+      if (!info) {
+        redstore_error("Failed to allocate memory for graph catalogue.");
+        librdf_free_stream(stream);
+        return -1;
+      }
+      info->modified = now;
+    }
+    info->triples++;
+    info->bytes += statement_size(statement);
+
+    librdf_stream_next(stream);
+  }
+  librdf_free_stream(stream);
+
+  return 0;
+}
+
+
+// Walk the store and count the triples in each graph
+int redstore_catalogue_init(void)
+{
+  librdf_iterator *iterator = NULL;
+  time_t now = time(NULL);
+  int err = 0;
+
+  redstore_catalogue_free();
+
+  // Count once, before the catalogue is ready and redstore_store_size() uses it
+  triple_count = redstore_store_size();
+
+  slots = calloc(INITIAL_SLOT_COUNT, sizeof(redstore_graph_info_t *));
+  if (!slots) {
+    redstore_error("Failed to allocate memory for graph catalogue.");
+    return -1;
+  }
+  slot_count = INITIAL_SLOT_COUNT;
+
+  iterator = redstore_store_get_contexts();
+  if (!iterator) {
+    redstore_error("Failed to get list of graphs to build graph catalogue.");
+    redstore_catalogue_free();
+    return -1;
+  }
+
+  while (!err && !librdf_iterator_end(iterator)) {
+    librdf_node *graph = (librdf_node *) librdf_iterator_get_object(iterator);
+    if (graph)
+      err = count_graph(graph, now);
+    librdf_iterator_next(iterator);
+  }
+  librdf_free_iterator(iterator);
+
+  if (err) {
+    redstore_catalogue_free();
+    return -1;
+  }
+
+  redstore_debug("Graph catalogue holds %d graphs.", graph_count);
+
+  return 0;
+}
+
+int redstore_catalogue_is_ready(void)
+{
+  return slots != NULL;
+}
+
+void redstore_catalogue_add(librdf_node * graph, librdf_statement * statement)
+{
+  redstore_graph_info_t *info;
+  const char *uri;
+  size_t len = 0;
+
+  if (slots && triple_count >= 0)
+    triple_count++;
+
+  uri = graph_key(graph, &len);
+  if (!uri || !slots)
+    return;
+
+  info = find_graph(uri, len, 1);
+  if (!info) {
+    redstore_error("Failed to allocate memory for graph catalogue.");
+    return;
+  }
+
+  info->triples++;
+  info->bytes += statement_size(statement);
+  info->modified = time(NULL);
+}
+
+void redstore_catalogue_remove(librdf_node * graph, librdf_statement * statement)
+{
+  redstore_graph_info_t *info;
+  const char *uri;
+  size_t len = 0;
+  size_t size;
+
+  if (slots && triple_count > 0)
+    triple_count--;
+
+  uri = graph_key(graph, &len);
+  if (!uri || !(info = find_graph(uri, len, 0)))
+    return;
+
+  if (info->triples <= 1) {
+    remove_graph(info);
+    return;
+  }
+
+  size = statement_size(statement);
+  info->triples--;
+  info->bytes = info->bytes > size ? info->bytes - size : 0;
+  info->modified = time(NULL);
+}
+
+void redstore_catalogue_clear(librdf_node * graph)
+{
+  redstore_graph_info_t *info;
+  const char *uri;
+  size_t len = 0;
+
+  uri = graph_key(graph, &len);
+  if (uri && (info = find_graph(uri, len, 0))) {
+    if (triple_count >= 0)
+      triple_count = triple_count > (long) info->triples ? triple_count - (long) info->triples : 0;
+    remove_graph(info);
+  }
+}
+
+redstore_graph_info_t *redstore_catalogue_lookup(librdf_node * graph)
+{
+  const char *uri;
+  size_t len = 0;
+
+  uri = graph_key(graph, &len);
+  if (!uri)
+    return NULL;
+
+  return find_graph(uri, len, 0);
+}
+
+int redstore_catalogue_count(void)
+{
+  return graph_count;
+}
+
+// Total number of triples in the store, or -1 if it is not known
+long redstore_catalogue_triples(void)
+{
+  return triple_count;
+}
+
+// Returns an array of the graphs, sorted by URI, which the caller should free
+redstore_graph_info_t **redstore_catalogue_list(int *count)
+{
+  redstore_graph_info_t **list = NULL;
+  redstore_graph_info_t *info;
+  unsigned int i;
+  int n = 0;
+
+  list = malloc((graph_count + 1) * sizeof(redstore_graph_info_t *));
+  if (!list)
+    return NULL;
+
+  for (i = 0; i < slot_count; i++) {
+    for (info = slots[i]; info; info = info->next)
+      list[n++] = info;
+  }
+
+  qsort(list, n, sizeof(redstore_graph_info_t *), compare_graph_uris);
+  *count = n;
+
+  return list;
+}
+
+void redstore_catalogue_free(void)
+{
+  unsigned int i;
+
+  for (i = 0; i < slot_count; i++) {
+    while (slots[i]) {
+      redstore_graph_info_t *info = slots[i];
+      slots[i] = info->next;
+      free(info->uri);
+      free(info);
+    }
+  }
+
+  if (slots)
+    free(slots);
+  slots = NULL;
+  slot_count = 0;
+  graph_count = 0;
+  triple_count = -1;
+}
@@ -0,0 +1,217 @@
+/*
+    RedStore - a lightweight RDF triplestore powered by Redland
+    Copyright (C) 2010-2011 Nicholas J Humfrey <njh@aelius.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Redland is not thread-safe, so long running read-only requests are
+  handed to a forked child process instead. This is only done with an
+  in-memory store: the child then reads its own copy-on-write copy of
+  the store as it was when it was forked, while the parent carries on
+  serving requests and applying writes. That is the only isolation
+  there is - there are no versioned reads within a process, and the
+  storage modules which can't be forked aren't isolated at all.
+
+  The store version is just a count of the changes made (see store.c).
+  The registry below records the version each child was forked at, so
+  that the service description can show how far behind the oldest
+  running child is; it doesn't keep any version of the store alive.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "redstore.h"
+
+#define DEFAULT_MAX_CHILDREN   (8)
+
+
+typedef struct {
+  pid_t pid;
+  unsigned long version;
+  int analytic;
+} child_t;
+
+static child_t *children = NULL;
+static int child_count = 0;
+static long max_children = DEFAULT_MAX_CHILDREN;
+
+
+static void child_remove(pid_t pid)
+{
+  int i;
+
+  for (i = 0; i < child_count; i++) {
+    if (children[i].pid == pid) {
+      redstore_debug("Child process %d, forked at store version %lu, has exited.",
+                     (int) pid, children[i].version);
+      if (children[i].analytic)
+        redstore_admission_release_analytic();
+      children[i] = children[--child_count];
+      return;
+    }
+  }
+}
+
+static void sigchld_handler(int signum)
+{
+  // Nothing to do here - the signal interrupts select() and the
+  // children are reaped by the main loop
+}
+
+
+int redstore_children_init(void)
+{
+  struct sigaction sa;
+
+  max_children = redstore_get_option_long("max-children", DEFAULT_MAX_CHILDREN);
+  if (max_children > 0) {
+    children = calloc(max_children, sizeof(child_t));
+    if (!children) {
+      redstore_error("Failed to allocate memory for child process table.");
+      return -1;
+    }
+  }
+
+  // Don't restart system calls, so that select() returns
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = sigchld_handler;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_NOCLDSTOP;
+  if (sigaction(SIGCHLD, &sa, NULL)) {
+    redstore_error("Failed to install SIGCHLD handler: %s", strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+int redstore_storage_is_in_memory(void)
+{
+  if (strcmp(storage_type, "memory") == 0)
+    return 1;
+
+  if (strcmp(storage_type, "hashes") == 0 && public_storage_options &&
+      strstr(public_storage_options, "hash-type='memory'"))
+    return 1;
+
+  return 0;
+}
+
+pid_t redstore_fork_child(void)
+{
+  pid_t pid;
+
+  if (child_count >= max_children) {
+    redstore_warn("Too many child processes running (%d).", child_count);
+    errno = EAGAIN;
+    return -1;
+  }
+
+  pid = fork();
+  if (pid < 0) {
+    redstore_error("Failed to fork child process: %s", strerror(errno));
+  } else if (pid == 0) {
+    // The child is stopped by its parent, not by signals meant for the server
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_IGN);
+    signal(SIGHUP, SIG_IGN);
+    redstore_admission_forked();
+  } else {
+    children[child_count].pid = pid;
+    children[child_count].version = store_version;
+    children[child_count].analytic = 0;
+    child_count++;
+    redstore_debug("Forked child process %d at store version %lu.", (int) pid, store_version);
+  }
+
+  return pid;
+}
+
+void redstore_reap_children(void)
+{
+  pid_t pid;
+  int status;
+
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    if (redstore_workers_reaped(pid, status))
+      continue;
+    child_remove(pid);
+    redstore_wal_reaped(pid, status);
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+      redstore_debug("Child process %d finished.", (int) pid);
+    } else {
+      redstore_warn("Child process %d exited with status %d.", (int) pid, status);
+    }
+  }
+}
+
+// The child is running an analytic query; its slot is released when it exits
+void redstore_children_hold_analytic(pid_t pid)
+{
+  int i;
+
+  for (i = 0; i < child_count; i++) {
+    if (children[i].pid == pid)
+      children[i].analytic = 1;
+  }
+}
+
+int redstore_children_count(void)
+{
+  return child_count;
+}
+
+int redstore_children_max(void)
+{
+  return max_children;
+}
+
+// Returns the number of children, and the oldest version any of them was forked at
+int redstore_children_oldest_version(unsigned long *version)
+{
+  int i;
+
+  *version = store_version;
+  for (i = 0; i < child_count; i++) {
+    if (children[i].version < *version)
+      *version = children[i].version;
+  }
+
+  return child_count;
+}
+
+void redstore_children_free(void)
+{
+  // Wait for children to finish sending their responses
+  while (child_count > 0) {
+    pid_t pid = waitpid(-1, NULL, 0);
+    if (pid < 0 && errno != EINTR)
+      break;
+    if (pid > 0)
+      child_remove(pid);
+  }
+
+  if (children)
+    free(children);
+  children = NULL;
+}
@@ -0,0 +1,371 @@
+/*
+    RedStore - a lightweight RDF triplestore powered by Redland
+    Copyright (C) 2010-2011 Nicholas J Humfrey <njh@aelius.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "redstore.h"
+
+// Term type codes used in the binary encoding of nodes
+#define TERM_NONE      (0)
+#define TERM_URI       (1)
+#define TERM_BLANK     (2)
+#define TERM_LITERAL   (3)
+
+
+int redstore_buffer_reserve(redstore_buffer_t * buffer, size_t length)
+{
+  size_t new_size;
+  unsigned char *new_data;
+
+  assert(buffer != NULL);
+
+  if (buffer->length + length <= buffer->size)
+    return 0;
+
+  new_size = buffer->size ? buffer->size : BUFSIZ;
+  while (new_size < buffer->length + length)
+    new_size *= 2;
+
+  new_data = realloc(buffer->data, new_size);
+  if (!new_data) {
+    redstore_error("Failed to allocate memory for buffer.");
+    return -1;
+  }
+
+  buffer->data = new_data;
+  buffer->size = new_size;
+
+  return 0;
+}
+
+int redstore_buffer_append(redstore_buffer_t * buffer, const void *data, size_t length)
+{
+  if (redstore_buffer_reserve(buffer, length))
+    return -1;
+
+  if (length)
+    memcpy(&buffer->data[buffer->length], data, length);
+  buffer->length += length;
+
+  return 0;
+}
+
+int redstore_buffer_append_byte(redstore_buffer_t * buffer, unsigned char byte)
+{
+  if (redstore_buffer_reserve(buffer, 1))
+    return -1;
+
+  buffer->data[buffer->length++] = byte;
+
+  return 0;
+}
+
+int redstore_buffer_append_varint(redstore_buffer_t * buffer, uint64_t value)
+{
+  if (redstore_buffer_reserve(buffer, 10))
+    return -1;
+
+  // Seven bits at a time, least significant group first
+  while (value >= 0x80) {
+    buffer->data[buffer->length++] = (value & 0x7F) | 0x80;
+    value >>= 7;
+  }
+  buffer->data[buffer->length++] = value;
+
+  return 0;
+}
+
+int redstore_buffer_append_uint32(redstore_buffer_t * buffer, uint32_t value)
+{
+  if (redstore_buffer_reserve(buffer, 4))
+    return -1;
+
+  redstore_put_uint32(&buffer->data[buffer->length], value);
+  buffer->length += 4;
+
+  return 0;
+}
+
+static int buffer_append_counted(redstore_buffer_t * buffer, const void *data, size_t length)
+{
+  if (redstore_buffer_append_varint(buffer, length))
+    return -1;
+
+  return redstore_buffer_append(buffer, data, length);
+}
+
+void redstore_buffer_reset(redstore_buffer_t * buffer)
+{
+  buffer->length = 0;
+}
+
+void redstore_buffer_free(redstore_buffer_t * buffer)
+{
+  if (buffer->data)
+    free(buffer->data);
+
+  buffer->data = NULL;
+  buffer->length = 0;
+  buffer->size = 0;
+}
+
+
+void redstore_put_uint32(unsigned char *ptr, uint32_t value)
+{
+  ptr[0] = value & 0xFF;
+  ptr[1] = (value >> 8) & 0xFF;
+  ptr[2] = (value >> 16) & 0xFF;
+  ptr[3] = (value >> 24) & 0xFF;
+}
+
+void redstore_put_uint64(unsigned char *ptr, uint64_t value)
+{
+  redstore_put_uint32(ptr, value & 0xFFFFFFFF);
+  redstore_put_uint32(ptr + 4, value >> 32);
+}
+
+uint32_t redstore_get_uint32(const unsigned char *ptr)
+{
+  return (uint32_t) ptr[0] |
+         ((uint32_t) ptr[1] << 8) | ((uint32_t) ptr[2] << 16) | ((uint32_t) ptr[3] << 24);
+}
+
+uint64_t redstore_get_uint64(const unsigned char *ptr)
+{
+  return (uint64_t) redstore_get_uint32(ptr) | ((uint64_t) redstore_get_uint32(ptr + 4) << 32);
+}
+
+
+// FNV-1a hash, used for hash tables and to pick shards
+uint32_t redstore_hash_bytes(const unsigned char *data, size_t length)
+{
+  uint32_t hash = 2166136261U;
+  size_t i;
+
+  for (i = 0; i < length; i++) {
+    hash ^= data[i];
+    hash *= 16777619U;
+  }
+
+  return hash;
+}
+
+int redstore_encode_node(redstore_buffer_t * buffer, librdf_node * node)
+{
+  const unsigned char *str = NULL;
+  size_t str_len = 0;
+
+  // A NULL node is used for the default graph
+  if (!node)
+    return redstore_buffer_append_byte(buffer, TERM_NONE);
+
+  if (librdf_node_is_resource(node)) {
+    str = librdf_uri_as_counted_string(librdf_node_get_uri(node), &str_len);
+    if (redstore_buffer_append_byte(buffer, TERM_URI))
+      return -1;
+    return buffer_append_counted(buffer, str, str_len);
+
+  } else if (librdf_node_is_blank(node)) {
+    str = librdf_node_get_counted_blank_identifier(node, &str_len);
+    if (redstore_buffer_append_byte(buffer, TERM_BLANK))
+      return -1;
+    return buffer_append_counted(buffer, str, str_len);
+
+  } else if (librdf_node_is_literal(node)) {
+    const char *lang = librdf_node_get_literal_value_language(node);
+    librdf_uri *datatype = librdf_node_get_literal_value_datatype_uri(node);
+    const unsigned char *dt_str = NULL;
+    size_t dt_len = 0;
+
+    if (datatype)
+      dt_str = librdf_uri_as_counted_string(datatype, &dt_len);
+
+    str = librdf_node_get_literal_value_as_counted_string(node, &str_len);
+    if (redstore_buffer_append_byte(buffer, TERM_LITERAL) ||
+        buffer_append_counted(buffer, str, str_len) ||
+        buffer_append_counted(buffer, lang, lang ? strlen(lang) : 0) ||
+        buffer_append_counted(buffer, dt_str, dt_len))
+      return -1;
+    return 0;
+  }
+
+  redstore_error("Unable to encode node of unknown type.");
+  return -1;
+}
+
+
+const unsigned char *redstore_decode_varint(const unsigned char *ptr, const unsigned char *end,
+                                            uint64_t * value)
+{
+  unsigned int shift = 0;
+
+  *value = 0;
+  while (ptr < end && shift < 64) {
+    unsigned char byte = *ptr++;
+    *value |= (uint64_t) (byte & 0x7F) << shift;
+    if (!(byte & 0x80))
+      return ptr;
+    shift += 7;
+  }
+
+  // Truncated or over-long varint
+  return NULL;
+}
+
+static const unsigned char *decode_counted(const unsigned char *ptr, const unsigned char *end,
+                                           const unsigned char **str, size_t * str_len)
+{
+  uint64_t length;
+
+  ptr = redstore_decode_varint(ptr, end, &length);
+  if (!ptr || length > (uint64_t) (end - ptr))
+    return NULL;
+
+  *str = ptr;
+  *str_len = length;
+
+  return ptr + length;
+}
+
+const unsigned char *redstore_decode_node(const unsigned char *ptr, const unsigned char *end,
+                                          librdf_node ** node)
+{
+  const unsigned char *str = NULL;
+  size_t str_len = 0;
+  unsigned char type;
+
+  *node = NULL;
+  if (ptr >= end)
+    return NULL;
+
+  type = *ptr++;
+  if (type == TERM_NONE)
+    return ptr;
+
+  ptr = decode_counted(ptr, end, &str, &str_len);
+  if (!ptr)
+    return NULL;
+
+  switch (type) {
+  case TERM_URI:
+    *node = librdf_new_node_from_counted_uri_string(world, str, str_len);
+    break;
+  case TERM_BLANK:
+    *node = librdf_new_node_from_counted_blank_identifier(world, str, str_len);
+    break;
+  case TERM_LITERAL:{
+      const unsigned char *lang = NULL, *dt_str = NULL;
+      size_t lang_len = 0, dt_len = 0;
+      librdf_uri *datatype = NULL;
+
+      ptr = decode_counted(ptr, end, &lang, &lang_len);
+      if (ptr)
+        ptr = decode_counted(ptr, end, &dt_str, &dt_len);
+      if (!ptr)
+        return NULL;
+
+      if (dt_len) {
+        datatype = librdf_new_uri2(world, dt_str, dt_len);
+        if (!datatype)
+          return NULL;
+      }
+
+      *node = librdf_new_node_from_typed_counted_literal(world, str, str_len,
+                                                         lang_len ? (const char *) lang : NULL,
+                                                         lang_len, datatype);
+      if (datatype)
+        librdf_free_uri(datatype);
+      break;
+    }
+  default:
+    redstore_error("Unknown term type in binary encoding: %d", type);
+    return NULL;
+  }
+
+  return *node ? ptr : NULL;
+}
+
+// A change to the store is encoded as the operation, a sequence number,
+// the graph node, and for additions and removals the subject, predicate
+// and object nodes.
+int redstore_encode_change(redstore_buffer_t * buffer, int op, uint64_t sequence,
+                           librdf_node * graph, librdf_statement * statement)
+{
+  if (redstore_buffer_append_byte(buffer, op) ||
+      redstore_buffer_append_varint(buffer, sequence) || redstore_encode_node(buffer, graph))
+    return -1;
+
+  if (statement) {
+    if (redstore_encode_node(buffer, librdf_statement_get_subject(statement)) ||
+        redstore_encode_node(buffer, librdf_statement_get_predicate(statement)) ||
+        redstore_encode_node(buffer, librdf_statement_get_object(statement)))
+      return -1;
+  }
+
+  return 0;
+}
+
+const unsigned char *redstore_decode_change(const unsigned char *ptr, const unsigned char *end,
+                                            int *op, uint64_t * sequence,
+                                            librdf_node ** graph, librdf_statement ** statement)
+{
+  librdf_node *nodes[3] = { NULL, NULL, NULL };
+  int i;
+
+  *graph = NULL;
+  *statement = NULL;
+
+  if (ptr >= end)
+    return NULL;
+
+  *op = *ptr++;
+  ptr = redstore_decode_varint(ptr, end, sequence);
+  if (ptr)
+    ptr = redstore_decode_node(ptr, end, graph);
+  if (!ptr)
+    return NULL;
+
+  if (*op == WAL_OP_ADD || *op == WAL_OP_REMOVE) {
+    for (i = 0; i < 3 && ptr; i++)
+      ptr = redstore_decode_node(ptr, end, &nodes[i]);
+
+    if (ptr && nodes[0] && nodes[1] && nodes[2]) {
+      // The statement takes ownership of the nodes
+      *statement = librdf_new_statement_from_nodes(world, nodes[0], nodes[1], nodes[2]);
+      nodes[0] = nodes[1] = nodes[2] = NULL;
+    }
+
+    for (i = 0; i < 3; i++) {
+      if (nodes[i])
+        librdf_free_node(nodes[i]);
+    }
+
+    if (!*statement)
+      ptr = NULL;
+  }
+
+  if (!ptr && *graph) {
+    librdf_free_node(*graph);
+    *graph = NULL;
+  }
+
+  return ptr;
+}
@@ -0,0 +1,641 @@
+/*
+    RedStore - a lightweight RDF triplestore powered by Redland
+    Copyright (C) 2010-2011 Nicholas J Humfrey <njh@aelius.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Compression of responses and request bodies
+
+  The content coding of a response is chosen from the Accept-Encoding
+  header of the request: zstd (when built with libzstd), then gzip, then
+  deflate (both when built with zlib), using the q values given by the
+  client and otherwise preferring them in that order.
+
+  Responses which are built in memory are compressed by a response filter,
+  just before their headers are sent. Responses which are streamed to the
+  client, such as query results, send their headers with
+  redstore_compress_stream_open(), which returns the stream to write the
+  body to; when compressing, this is a stdio stream which compresses what
+  is written to it on its way to the socket, and it must be finished with
+  redstore_compress_stream_close().
+
+  The compression-level option sets the level used by both zlib and zstd
+  (0 disables compression), and responses built in memory which are
+  smaller than compression-min-size bytes are sent as they are. Every
+  response which could have been compressed has Vary: Accept-Encoding.
+
+  Request bodies with a Content-Encoding of gzip, deflate or zstd are kept
+  compressed until they are parsed, and are then read through a stdio
+  stream which decompresses them a chunk at a time, as the parser asks for
+  more (see redstore_decompress_open()), so the whole of the decompressed
+  data is never held in memory.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "redstore.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define DEFAULT_COMPRESSION_LEVEL      (6)
+#define DEFAULT_COMPRESSION_MIN_SIZE   (1024)
+#define COMPRESS_BUFFER_SIZE           (64 * 1024)
+
+#define ENCODING_NONE       (0)
+#define ENCODING_ZSTD       (1)
+#define ENCODING_GZIP       (2)
+#define ENCODING_DEFLATE    (3)
+
+
+typedef struct {
+  int encoding;
+  FILE *socket;
+  redstore_buffer_t buffer;
+#ifdef HAVE_ZLIB
+  z_stream zlib;
+#endif
+#ifdef HAVE_ZSTD
+  ZSTD_CStream *zstd;
+#endif
+  unsigned char out[COMPRESS_BUFFER_SIZE];
+} compressor_t;
+
+
+// The encodings that can be used, in order of preference
+static const struct {
+  int encoding;
+  const char *name;
+} encodings[] = {
+#ifdef HAVE_ZSTD
+  { ENCODING_ZSTD, "zstd" },
+#endif
+#ifdef HAVE_ZLIB
+  { ENCODING_GZIP, "gzip" },
+  { ENCODING_DEFLATE, "deflate" },
+#endif
+  { ENCODING_NONE, NULL }
+};
+
+typedef struct {
+  int encoding;
+#ifdef HAVE_ZLIB
+  z_stream zlib;
+#endif
+#ifdef HAVE_ZSTD
+  ZSTD_DStream *zstd;
+  ZSTD_inBuffer zstd_input;
+  size_t zstd_remaining;
+#endif
+  int finished;
+} decompressor_t;
+
+
+static long compression_level = 0;
+static long compression_min_size = DEFAULT_COMPRESSION_MIN_SIZE;
+
+
+static const char *encoding_name(int encoding)
+{
+  int i;
+
+  for (i = 0; encodings[i].name; i++) {
+    if (encodings[i].encoding == encoding)
+      return encodings[i].name;
+  }
+
+  return NULL;
+}
+
+static int encoding_from_name(const char *name)
+{
+  int i;
+
+  if (strcmp(name, "x-gzip") == 0)
+    name = "gzip";
+
+  for (i = 0; encodings[i].name; i++) {
+    if (strcmp(encodings[i].name, name) == 0)
+      return encodings[i].encoding;
+  }
+
+  return ENCODING_NONE;
+}
+
+// Types which are already compressed are not worth compressing again
+static int is_compressible_type(const char *type)
+{
+  if (!type)
+    return 0;
+
+  if (strncmp(type, "image/", 6) == 0)
+    return strcmp(type, "image/svg+xml") == 0 || strcmp(type, "image/x-icon") == 0;
+
+  return strncmp(type, "audio/", 6) != 0 && strncmp(type, "video/", 6) != 0 &&
+      strcmp(type, "application/zip") != 0 && strcmp(type, "application/gzip") != 0;
+}
+
+// Choose the encoding with the highest q value given by the client
+static int choose_encoding(redhttp_request_t * request)
+{
+  const char *accept_str = redhttp_request_get_header(request, "Accept-Encoding");
+  redhttp_negotiate_t *accept = NULL;
+  int best = ENCODING_NONE, best_q = 0;
+  int i, a;
+
+  if (!accept_str || !*accept_str)
+    return ENCODING_NONE;
+
+  accept = redhttp_negotiate_parse(accept_str);
+  if (!accept)
+    return ENCODING_NONE;
+
+  for (i = 0; encodings[i].name; i++) {
+    const char *type = NULL;
+    int q = 0, wildcard_q = -1, exact_q = -1;
+
+    for (a = 0; redhttp_negotiate_get(&accept, a, &type, &q) == 0; a++) {
+      if (strcmp(type, encodings[i].name) == 0)
+        exact_q = q;
+      else if (strcmp(type, "*") == 0)
+        wildcard_q = q;
+    }
+
+    q = exact_q >= 0 ? exact_q : wildcard_q;
+    if (q > best_q) {
+      best_q = q;
+      best = encodings[i].encoding;
+    }
+  }
+
+  redhttp_negotiate_free(&accept);
+
+  return best;
+}
+
+// Decide whether a response should be compressed, and how; the length of
+// a response built in memory, or -1 for a streamed response
+static int response_encoding(redhttp_request_t * request, redhttp_response_t * response,
+                             long length)
+{
+  const char *method = redhttp_request_get_method(request);
+  const char *etag = NULL;
+  int encoding;
+
+  if (compression_level <= 0 || !encodings[0].name)
+    return ENCODING_NONE;
+  if (redhttp_response_get_header(response, "Content-Encoding"))
+    return ENCODING_NONE;
+  if (!is_compressible_type(redhttp_response_get_header(response, "Content-Type")))
+    return ENCODING_NONE;
+
+  // The response depends on Accept-Encoding, even if it isn't compressed
+  // this time - because it is small, or a HEAD, or the client didn't ask -
+  // so that a cache doesn't give the uncompressed copy to every client
+  redhttp_response_add_header(response, "Vary", "Accept-Encoding");
+
+  if (method && strcmp(method, "HEAD") == 0)
+    return ENCODING_NONE;
+  if (length >= 0 && length < compression_min_size)
+    return ENCODING_NONE;
+
+  encoding = choose_encoding(request);
+  if (encoding == ENCODING_NONE)
+    return ENCODING_NONE;
+
+  // Compressed content is a different representation, which is only weakly
+  // equal to the uncompressed one
+  etag = redhttp_response_get_header(response, "ETag");
+  if (etag && strncmp(etag, "W/", 2) != 0) {
+    char *weak = malloc(strlen(etag) + 3);
+    if (weak) {
+      sprintf(weak, "W/%s", etag);
+      redhttp_response_set_header(response, "ETag", weak);
+      free(weak);
+    }
+  }
+
+  return encoding;
+}
+
+
+static int compressor_init(compressor_t * comp, int encoding, FILE * socket)
+{
+  memset(comp, 0, sizeof(compressor_t));
+  comp->encoding = encoding;
+  comp->socket = socket;
+
+  switch (encoding) {
+#ifdef HAVE_ZLIB
+  case ENCODING_GZIP:
+  case ENCODING_DEFLATE:
+    // Adding 16 to the window bits gives a gzip header and trailer
+    if (deflateInit2(&comp->zlib, compression_level > 9 ? 9 : compression_level, Z_DEFLATED,
+                     encoding == ENCODING_GZIP ? 15 + 16 : 15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+      return -1;
+    return 0;
+#endif
+#ifdef HAVE_ZSTD
+  case ENCODING_ZSTD:
+    comp->zstd = ZSTD_createCStream();
+    if (!comp->zstd)
+      return -1;
+    if (ZSTD_isError(ZSTD_CCtx_setParameter(comp->zstd, ZSTD_c_compressionLevel,
+                                            compression_level))) {
+      ZSTD_freeCStream(comp->zstd);
+      comp->zstd = NULL;
+      return -1;
+    }
+    return 0;
+#endif
+  }
+
+  return -1;
+}
+
+static int compressor_output(compressor_t * comp, size_t length)
+{
+  if (length == 0)
+    return 0;
+
+  if (comp->socket)
+    return fwrite(comp->out, 1, length, comp->socket) == length ? 0 : -1;
+  else
+    return redstore_buffer_append(&comp->buffer, comp->out, length);
+}
+
+// Compress some data, finishing the compressed stream if finish is set
+static int compressor_write(compressor_t * comp, const void *data, size_t length, int finish)
+{
+#ifdef HAVE_ZLIB
+  if (comp->encoding == ENCODING_GZIP || comp->encoding == ENCODING_DEFLATE) {
+    comp->zlib.next_in = (Bytef *) data;
+    comp->zlib.avail_in = length;
+    do {
+      comp->zlib.next_out = comp->out;
+      comp->zlib.avail_out = sizeof(comp->out);
+      if (deflate(&comp->zlib, finish ? Z_FINISH : Z_NO_FLUSH) == Z_STREAM_ERROR)
+        return -1;
+      if (compressor_output(comp, sizeof(comp->out) - comp->zlib.avail_out))
+        return -1;
+    } while (comp->zlib.avail_out == 0);
+    return 0;
+  }
+#endif
+#ifdef HAVE_ZSTD
+  if (comp->encoding == ENCODING_ZSTD) {
+    ZSTD_inBuffer input = { data, length, 0 };
+    size_t remaining;
+    do {
+      ZSTD_outBuffer output = { comp->out, sizeof(comp->out), 0 };
+      remaining = ZSTD_compressStream2(comp->zstd, &output, &input,
+                                       finish ? ZSTD_e_end : ZSTD_e_continue);
+      if (ZSTD_isError(remaining))
+        return -1;
+      if (compressor_output(comp, output.pos))
+        return -1;
+    } while (finish ? remaining != 0 : input.pos < input.size);
+    return 0;
+  }
+#endif
+
+  return -1;
+}
+
+static void compressor_end(compressor_t * comp)
+{
+#ifdef HAVE_ZLIB
+  if (comp->encoding == ENCODING_GZIP || comp->encoding == ENCODING_DEFLATE)
+    deflateEnd(&comp->zlib);
+#endif
+#ifdef HAVE_ZSTD
+  if (comp->zstd)
+    ZSTD_freeCStream(comp->zstd);
+  comp->zstd = NULL;
+#endif
+}
+
+
+static int decompressor_init(decompressor_t * decomp, int encoding, const unsigned char *buffer,
+                             size_t length)
+{
+  memset(decomp, 0, sizeof(decompressor_t));
+  decomp->encoding = encoding;
+
+  switch (encoding) {
+#ifdef HAVE_ZLIB
+  case ENCODING_GZIP:
+  case ENCODING_DEFLATE:
+    decomp->zlib.next_in = (Bytef *) buffer;
+    decomp->zlib.avail_in = length;
+    // Adding 32 to the window bits detects either a zlib or a gzip header
+    if (inflateInit2(&decomp->zlib, 15 + 32) != Z_OK)
+      return -1;
+    return 0;
+#endif
+#ifdef HAVE_ZSTD
+  case ENCODING_ZSTD:
+    decomp->zstd = ZSTD_createDStream();
+    if (!decomp->zstd)
+      return -1;
+    decomp->zstd_input.src = buffer;
+    decomp->zstd_input.size = length;
+    decomp->zstd_input.pos = 0;
+    decomp->zstd_remaining = 1;
+    return 0;
+#endif
+  }
+
+  return -1;
+}
+
+// Decompress as much as will fit in data; returns 0 at the end of the
+// compressed data, or -1 if it is invalid or truncated
+static long decompressor_read(decompressor_t * decomp, char *data, size_t size)
+{
+  if (decomp->finished || size == 0)
+    return 0;
+
+#ifdef HAVE_ZLIB
+  if (decomp->encoding == ENCODING_GZIP || decomp->encoding == ENCODING_DEFLATE) {
+    decomp->zlib.next_out = (Bytef *) data;
+    decomp->zlib.avail_out = size;
+    while (decomp->zlib.avail_out == size) {
+      int ret = inflate(&decomp->zlib, Z_NO_FLUSH);
+      if (ret == Z_STREAM_END) {
+        decomp->finished = 1;
+        break;
+      } else if (ret != Z_OK) {
+        return -1;
+      }
+    }
+    return size - decomp->zlib.avail_out;
+  }
+#endif
+#ifdef HAVE_ZSTD
+  if (decomp->encoding == ENCODING_ZSTD) {
+    ZSTD_outBuffer output = { data, size, 0 };
+    while (output.pos == 0) {
+      if (decomp->zstd_input.pos >= decomp->zstd_input.size) {
+        // A frame which has not been finished means the data was truncated
+        if (decomp->zstd_remaining != 0)
+          return -1;
+        decomp->finished = 1;
+        break;
+      }
+      decomp->zstd_remaining = ZSTD_decompressStream(decomp->zstd, &output, &decomp->zstd_input);
+      if (ZSTD_isError(decomp->zstd_remaining))
+        return -1;
+    }
+    return output.pos;
+  }
+#endif
+
+  return -1;
+}
+
+static void decompressor_end(decompressor_t * decomp)
+{
+#ifdef HAVE_ZLIB
+  if (decomp->encoding == ENCODING_GZIP || decomp->encoding == ENCODING_DEFLATE)
+    inflateEnd(&decomp->zlib);
+#endif
+#ifdef HAVE_ZSTD
+  if (decomp->zstd)
+    ZSTD_freeDStream(decomp->zstd);
+  decomp->zstd = NULL;
+#endif
+}
+
+
+// Compress responses which have been built in memory
+static void compress_filter(redhttp_request_t * request, redhttp_response_t * response,
+                            void *user_data)
+{
+  char *content = redhttp_response_get_content_buffer(response);
+  int length = redhttp_response_get_content_length(response);
+  compressor_t *comp = NULL;
+  int encoding;
+
+  encoding = response_encoding(request, response, content ? length : 0);
+  if (encoding == ENCODING_NONE || !content)
+    return;
+
+  comp = malloc(sizeof(compressor_t));
+  if (!comp || compressor_init(comp, encoding, NULL)) {
+    redstore_error("Failed to start compressing response.");
+    if (comp)
+      free(comp);
+    return;
+  }
+
+  if (compressor_write(comp, content, length, 1) == 0 && comp->buffer.length < (size_t) length) {
+    redhttp_response_set_content(response, (char *) comp->buffer.data, comp->buffer.length, free);
+    redhttp_response_add_header(response, "Content-Encoding", encoding_name(encoding));
+  } else {
+    redstore_buffer_free(&comp->buffer);
+  }
+
+  compressor_end(comp);
+  free(comp);
+}
+
+
+#if defined(HAVE_FOPENCOOKIE) || defined(HAVE_FUNOPEN)
+static int stream_write(void *cookie, const char *data, size_t length)
+{
+  return compressor_write((compressor_t *) cookie, data, length, 0) ? -1 : (int) length;
+}
+
+static int stream_close(void *cookie)
+{
+  compressor_t *comp = (compressor_t *) cookie;
+  int err = compressor_write(comp, NULL, 0, 1);
+
+  compressor_end(comp);
+  if (fflush(comp->socket))
+    err = -1;
+  free(comp);
+
+  return err ? EOF : 0;
+}
+
+static int read_stream_close(void *cookie)
+{
+  decompressor_end((decompressor_t *) cookie);
+  free(cookie);
+
+  return 0;
+}
+#endif
+
+#ifdef HAVE_FOPENCOOKIE
+static ssize_t cookie_write(void *cookie, const char *data, size_t length)
+{
+  int written = stream_write(cookie, data, length);
+  return written < 0 ? 0 : written;
+}
+
+static ssize_t cookie_read(void *cookie, char *data, size_t length)
+{
+  return decompressor_read((decompressor_t *) cookie, data, length);
+}
+
+static FILE *open_stream(compressor_t * comp)
+{
+  cookie_io_functions_t functions = { NULL, cookie_write, NULL, stream_close };
+  return fopencookie(comp, "w", functions);
+}
+
+static FILE *open_read_stream(decompressor_t * decomp)
+{
+  cookie_io_functions_t functions = { cookie_read, NULL, NULL, read_stream_close };
+  return fopencookie(decomp, "r", functions);
+}
+#elif defined(HAVE_FUNOPEN)
+static int funopen_write(void *cookie, const char *data, int length)
+{
+  return stream_write(cookie, data, length);
+}
+
+static int funopen_read(void *cookie, char *data, int length)
+{
+  return decompressor_read((decompressor_t *) cookie, data, length);
+}
+
+static FILE *open_stream(compressor_t * comp)
+{
+  return funopen(comp, NULL, funopen_write, NULL, stream_close);
+}
+
+static FILE *open_read_stream(decompressor_t * decomp)
+{
+  return funopen(decomp, funopen_read, NULL, NULL, read_stream_close);
+}
+#else
+// Streams can not be compressed or decompressed on this platform
+static FILE *open_stream(compressor_t * comp)
+{
+  return NULL;
+}
+
+static FILE *open_read_stream(decompressor_t * decomp)
+{
+  return NULL;
+}
+#endif
+
+// Send the headers for a streamed response, and return the stream that
+// the body should be written to
+FILE *redstore_compress_stream_open(redhttp_request_t * request, redhttp_response_t * response)
+{
+  FILE *socket = redhttp_request_get_socket(request);
+  compressor_t *comp = NULL;
+  FILE *stream = NULL;
+  int encoding;
+
+  encoding = response_encoding(request, response, -1);
+  if (encoding != ENCODING_NONE) {
+    comp = malloc(sizeof(compressor_t));
+    if (comp && compressor_init(comp, encoding, socket) == 0) {
+      stream = open_stream(comp);
+      if (!stream)
+        compressor_end(comp);
+    }
+    if (stream) {
+      setvbuf(stream, NULL, _IOFBF, COMPRESS_BUFFER_SIZE);
+      redhttp_response_add_header(response, "Content-Encoding", encoding_name(encoding));
+    } else if (comp) {
+      free(comp);
+    }
+  }
+
+  redhttp_response_send(response, request);
+
+  return stream ? stream : socket;
+}
+
+// Finish writing a streamed response
+int redstore_compress_stream_close(redhttp_request_t * request, FILE * stream)
+{
+  FILE *socket = redhttp_request_get_socket(request);
+  int err = 0;
+
+  if (stream && stream != socket && fclose(stream))
+    err = -1;
+  if (fflush(socket))
+    err = -1;
+
+  return err;
+}
+
+// Returns true if request bodies with this Content-Encoding can be read
+int redstore_decompress_supported(const char *encoding)
+{
+#if defined(HAVE_FOPENCOOKIE) || defined(HAVE_FUNOPEN)
+  return encoding && encoding_from_name(encoding) != ENCODING_NONE;
+#else
+  return 0;
+#endif
+}
+
+// Open a stream which reads the decompressed contents of a buffer
+FILE *redstore_decompress_open(const unsigned char *buffer, size_t length, const char *encoding)
+{
+  decompressor_t *decomp = malloc(sizeof(decompressor_t));
+  FILE *stream = NULL;
+
+  if (!decomp)
+    return NULL;
+
+  if (decompressor_init(decomp, encoding_from_name(encoding), buffer, length) == 0) {
+    stream = open_read_stream(decomp);
+    if (!stream)
+      decompressor_end(decomp);
+  }
+  if (!stream)
+    free(decomp);
+
+  return stream;
+}
+
+int redstore_compress_init(redhttp_server_t * server)
+{
+  compression_level = redstore_get_option_long("compression-level", DEFAULT_COMPRESSION_LEVEL);
+  compression_min_size =
+      redstore_get_option_long("compression-min-size", DEFAULT_COMPRESSION_MIN_SIZE);
+
+  if (compression_level < 0 || compression_level > 9) {
+    redstore_error("compression-level should be between 0 and 9.");
+    return -1;
+  }
+
+  if (compression_level && !encodings[0].name)
+    redstore_debug("Response compression is not supported by this build of RedStore.");
+
+  redhttp_server_set_response_filter(server, compress_filter, NULL);
+
+  return 0;
+}
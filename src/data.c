@@ -114,7 +114,8 @@ CLEANUP:
   return graph_node;
 }
 
-static redhttp_response_t *remove_all_statements(redhttp_request_t *request)
+static redhttp_response_t *remove_all_statements(redhttp_request_t *request,
+                                                 librdf_stream *unused_stream, librdf_node *unused_graph)
 {
   librdf_iterator *iterator = NULL;
   librdf_stream *stream = NULL;
@@ -123,7 +124,7 @@ static redhttp_response_t *remove_all_statements(redhttp_request_t *request)
   // FIXME: re-implement using librdf_model_remove_statements()
 
   // First:  delete all the named graphs
-  iterator = librdf_storage_get_contexts(storage);
+  iterator = redstore_store_get_contexts();
   if (!iterator) {
     return redstore_page_new_with_message(
       request, LIBRDF_LOG_ERROR, REDHTTP_INTERNAL_SERVER_ERROR, "Failed to get list of graphs."
@@ -137,7 +138,7 @@ static redhttp_response_t *remove_all_statements(redhttp_request_t *request)
       break;
     }
 
-    if (librdf_model_context_remove_statements(model, graph))
+    if (redstore_store_remove_graph(graph))
       err++;
 
     librdf_iterator_next(iterator);
@@ -145,7 +146,7 @@ static redhttp_response_t *remove_all_statements(redhttp_request_t *request)
   librdf_free_iterator(iterator);
 
 
-  // Second: delete the remaining triples
+  // Second: delete the remaining triples, which are all in the default graph's shard
   stream = librdf_model_as_stream(model);
   if (!stream) {
     return redstore_page_new_with_message(
@@ -161,7 +162,7 @@ static redhttp_response_t *remove_all_statements(redhttp_request_t *request)
       break;
     }
 
-    if (librdf_model_remove_statement(model, statement))
+    if (redstore_store_remove_statement(NULL, statement))
       err++;
 
     librdf_stream_next(stream);
@@ -179,6 +180,29 @@ static redhttp_response_t *remove_all_statements(redhttp_request_t *request)
   }
 }
 
+static redhttp_response_t *remove_graph(redhttp_request_t *request,
+                                        librdf_stream *unused, librdf_node *graph)
+{
+  // Check if the graph exists
+  if (!redstore_store_contains_graph(graph)) {
+    return redstore_page_new_with_message(
+      request, LIBRDF_LOG_INFO, REDHTTP_NOT_FOUND, "Graph not found."
+    );
+  }
+
+  if (redstore_store_remove_graph(graph)) {
+    return redstore_page_new_with_message(
+      request, LIBRDF_LOG_ERROR, REDHTTP_INTERNAL_SERVER_ERROR,
+      "Error while trying to delete graph"
+    );
+  } else {
+    return redstore_page_new_with_message(
+      request, LIBRDF_LOG_INFO, REDHTTP_OK,
+      "Successfully deleted graph."
+    );
+  }
+}
+
 static redhttp_response_t *post_to_new_graph(redhttp_request_t * request)
 {
   redhttp_response_t *response = NULL;
@@ -194,7 +218,7 @@ static redhttp_response_t *post_to_new_graph(redhttp_request_t * request)
       );
     }
 
-    if (!librdf_model_contains_context(model, graph_node)) {
+    if (!redstore_store_contains_graph(graph_node)) {
       break;
     } else {
       librdf_uri *graph_uri = librdf_node_get_uri(graph_node);
@@ -220,6 +244,32 @@ static redhttp_response_t *post_to_new_graph(redhttp_request_t * request)
 
 
 
+// Returns the number of triples that a GET of the request would send,
+// from the graph catalogue, or -1 if it is not known
+long redstore_data_count_triples(redhttp_request_t * request)
+{
+  redstore_graph_info_t *info = NULL;
+  librdf_node *graph_node = NULL;
+  long triples = -1;
+
+  if (!redstore_catalogue_is_ready())
+    return -1;
+
+  if (redhttp_request_argument_exists(request, "default"))
+    return redstore_catalogue_triples();
+
+  graph_node = get_graph_node(request);
+  if (!graph_node)
+    return -1;
+
+  info = redstore_catalogue_lookup(graph_node);
+  if (info)
+    triples = info->triples;
+  librdf_free_node(graph_node);
+
+  return triples;
+}
+
 redhttp_response_t *handle_data_head(redhttp_request_t * request, void *user_data)
 {
   int has_graph = redhttp_request_argument_exists(request, "graph");
@@ -244,6 +294,7 @@ redhttp_response_t *handle_data_head(redhttp_request_t * request, void *user_dat
     response = redhttp_response_new(REDHTTP_OK, NULL);
   } else {
     librdf_node *graph_node = get_graph_node(request);
+    redstore_graph_info_t *info = NULL;
 
     if (!graph_node) {
       return redstore_page_new_with_message(
@@ -251,8 +302,10 @@ redhttp_response_t *handle_data_head(redhttp_request_t * request, void *user_dat
       );
     }
 
-    if (librdf_model_contains_context(model, graph_node)) {
+    info = redstore_catalogue_lookup(graph_node);
+    if (info) {
       response = redhttp_response_new(REDHTTP_OK, NULL);
+      redhttp_response_add_time_header(response, "Last-Modified", info->modified);
     } else {
       response = redstore_page_new_with_message(
         request, LIBRDF_LOG_INFO, REDHTTP_NOT_FOUND, "Graph not found."
@@ -288,7 +341,7 @@ redhttp_response_t *handle_data_get(redhttp_request_t * request, void *user_data
   }
 
   if (has_default) {
-    stream = librdf_model_as_stream(model);
+    stream = redstore_store_as_stream();
     if (!stream) {
       response = redstore_page_new_with_message(
         request, LIBRDF_LOG_ERROR, REDHTTP_INTERNAL_SERVER_ERROR, "Failed to stream model."
@@ -306,7 +359,7 @@ redhttp_response_t *handle_data_get(redhttp_request_t * request, void *user_data
     }
 
     // Check if the graph exists
-    if (!librdf_model_contains_context(model, graph_node)) {
+    if (!redstore_store_contains_graph(graph_node)) {
       response = redstore_page_new_with_message(request,
         LIBRDF_LOG_INFO, REDHTTP_NOT_FOUND, "Graph not found."
       );
@@ -314,7 +367,7 @@ redhttp_response_t *handle_data_get(redhttp_request_t * request, void *user_data
     }
 
     // Stream the graph
-    stream = librdf_model_context_as_stream(model, graph_node);
+    stream = librdf_model_context_as_stream(redstore_graph_model(graph_node), graph_node);
     if (!stream) {
       response = redstore_page_new_with_message(
         request, LIBRDF_LOG_ERROR, REDHTTP_INTERNAL_SERVER_ERROR, "Failed to stream context."
@@ -429,7 +482,7 @@ redhttp_response_t *handle_data_delete(redhttp_request_t * request, void *user_d
   }
 
   if (has_default) {
-    response = remove_all_statements(request);
+    response = redstore_queue_write(request, NULL, remove_all_statements, NULL, 0, NULL, NULL);
   } else {
     librdf_node *graph_node = get_graph_node(request);
 
@@ -440,26 +493,7 @@ redhttp_response_t *handle_data_delete(redhttp_request_t * request, void *user_d
       );
     }
 
-    // Check if the graph exists
-    if (!librdf_model_contains_context(model, graph_node)) {
-      librdf_free_node(graph_node);
-      return redstore_page_new_with_message(
-        request, LIBRDF_LOG_INFO, REDHTTP_NOT_FOUND, "Graph not found."
-      );
-    }
-
-    if (librdf_model_context_remove_statements(model, graph_node)) {
-      response = redstore_page_new_with_message(
-        request, LIBRDF_LOG_ERROR, REDHTTP_INTERNAL_SERVER_ERROR,
-        "Error while trying to delete graph"
-      );
-    } else {
-      response = redstore_page_new_with_message(
-        request, LIBRDF_LOG_INFO, REDHTTP_OK,
-        "Successfully deleted graph."
-      );
-    }
-
+    response = redstore_queue_write(request, graph_node, remove_graph, NULL, 0, NULL, NULL);
     librdf_free_node(graph_node);
   }
 
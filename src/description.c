@@ -19,7 +19,6 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <assert.h>
 
 #include "redstore.h"
 
@@ -29,6 +28,23 @@ librdf_uri *format_ns_uri = NULL;
 librdf_uri *sd_ns_uri = NULL;
 librdf_uri *void_ns_uri = NULL;
 
+#define SD_CACHE_MAX_ENTRIES   (16)
+
+typedef struct sd_cache_entry_s {
+  char *format;
+  char *endpoint;
+  unsigned char *buffer;
+  size_t length;
+  struct sd_cache_entry_s *next;
+} sd_cache_entry_t;
+
+static librdf_storage *sd_static_storage = NULL;
+static librdf_model *sd_static_model = NULL;
+static librdf_node *sd_service_node = NULL;
+static sd_cache_entry_t *sd_cache = NULL;
+static int sd_cache_size = 0;
+static int sd_cache_triples = -1;
+
 static librdf_node *new_node_from_integer(librdf_world * world, int i)
 {
   librdf_uri *xsd_integer_uri = NULL;
@@ -87,30 +103,6 @@ CLEANUP:
 }
 
 
-static int context_count(librdf_storage * storage)
-{
-  librdf_iterator *iterator = NULL;
-  int count = 0;
-
-  assert(storage != NULL);
-
-  iterator = librdf_storage_get_contexts(storage);
-  if (!iterator) {
-    redstore_error("librdf_storage_get_contexts returned NULL");
-    return -1;
-  }
-
-  while (!librdf_iterator_end(iterator)) {
-    count++;
-    librdf_iterator_next(iterator);
-  }
-
-  librdf_free_iterator(iterator);
-
-  return count;
-}
-
-
 static int sd_add_format_descriptions(librdf_model *sd_model, librdf_node *service_node, description_proc_t desc_proc, const char *type)
 {
   librdf_node *format_node = NULL;
@@ -262,7 +254,7 @@ static int sd_add_query_languages(librdf_model *sd_model, librdf_node *service_n
 static int sd_add_dataset_description(librdf_model *sd_model, librdf_node *service_node)
 {
   librdf_node *dataset_node = NULL, *default_graph_node = NULL;
-  int triple_count = librdf_storage_size(storage);
+  int triple_count = redstore_store_size();
 
   dataset_node = librdf_new_node(world);
   if (!dataset_node) {
@@ -319,72 +311,212 @@ static int sd_add_dataset_description(librdf_model *sd_model, librdf_node *servi
   return 0;
 }
 
-static librdf_model * create_service_description(librdf_storage *sd_storage, const char * request_url)
+// Builds the parts of the service description that do not change while
+// the server is running; the endpoint and counts are added per format
+static int create_static_description(void)
 {
-  librdf_model *sd_model = NULL;
-  librdf_node *service_node = NULL;
   char *comment = NULL;
 
-  sd_model = librdf_new_model(world, sd_storage, NULL);
-  if (!sd_model) {
+  sd_static_storage = librdf_new_storage(world, NULL, NULL, NULL);
+  if (!sd_static_storage) {
+    redstore_error("Failed to create storage for service description.");
+    return 1;
+  }
+
+  sd_static_model = librdf_new_model(world, sd_static_storage, NULL);
+  if (!sd_static_model) {
     redstore_error("Failed to create model for service description.");
-    return NULL;
+    return 1;
   }
 
-  service_node = librdf_new_node(world);
-  if (!service_node) {
+  sd_service_node = librdf_new_node(world);
+  if (!sd_service_node) {
     redstore_error("Failed to create service description bnode - librdf_new_node returned NULL");
-    librdf_free_model(sd_model);
-    return NULL;
+    return 1;
   }
 
-  librdf_model_add(sd_model,
-                   librdf_new_node_from_node(service_node),
+  librdf_model_add(sd_static_model,
+                   librdf_new_node_from_node(sd_service_node),
                    librdf_new_node_from_node(LIBRDF_MS_type(world)),
                    librdf_new_node_from_uri_local_name(world, sd_ns_uri, (unsigned char *) "Service")
       );
 
-  sd_add_format_descriptions(sd_model, service_node, librdf_parser_get_description, "inputFormat");
-  sd_add_format_descriptions(sd_model, service_node, librdf_serializer_get_description, "resultFormat");
-  sd_add_format_descriptions(sd_model, service_node, librdf_query_results_formats_get_description, "resultFormat");
-  sd_add_query_languages(sd_model, service_node);
-  sd_add_dataset_description(sd_model, service_node);
+  sd_add_format_descriptions(sd_static_model, sd_service_node, librdf_parser_get_description, "inputFormat");
+  sd_add_format_descriptions(sd_static_model, sd_service_node, librdf_serializer_get_description, "resultFormat");
+  sd_add_format_descriptions(sd_static_model, sd_service_node, redstore_results_formats_get_description, "resultFormat");
+  sd_add_query_languages(sd_static_model, sd_service_node);
 
-  librdf_model_add(sd_model,
-                   librdf_new_node_from_node(service_node),
+  librdf_model_add(sd_static_model,
+                   librdf_new_node_from_node(sd_service_node),
                    librdf_new_node_from_node(LIBRDF_S_label(world)),
                    librdf_new_node_from_literal(world, (unsigned char *) storage_name, NULL, 0)
       );
 
   #define COMMENT_MAX_LEN   (128)
   comment = malloc(COMMENT_MAX_LEN);
+  if (!comment) {
+    redstore_error("Failed to allocate memory for service description comment.");
+    return 1;
+  }
   snprintf(comment, COMMENT_MAX_LEN, "RedStore %s endpoint using the '%s' storage module.",
            PACKAGE_VERSION, storage_type);
-  librdf_model_add(sd_model,
-                   librdf_new_node_from_node(service_node),
+  librdf_model_add(sd_static_model,
+                   librdf_new_node_from_node(sd_service_node),
                    librdf_new_node_from_node(LIBRDF_S_comment(world)),
                    librdf_new_node_from_literal(world, (unsigned char *) comment, NULL, 0)
       );
   free(comment);
 
-  librdf_model_add(sd_model,
-                   librdf_new_node_from_node(service_node),
-                   librdf_new_node_from_uri_local_name(world, sd_ns_uri, (unsigned char *) "endpoint"),
-                   sd_get_endpoint_node(request_url)
-      );
-
   // Redland's default graph is the union of all other graphs
-  librdf_model_add(sd_model,
-                   librdf_new_node_from_node(service_node),
+  librdf_model_add(sd_static_model,
+                   librdf_new_node_from_node(sd_service_node),
                    librdf_new_node_from_uri_local_name(world, sd_ns_uri, (unsigned char *) "feature"),
                    librdf_new_node_from_uri_local_name(world, sd_ns_uri, (unsigned char *) "UnionDefaultGraph")
       );
 
-  librdf_free_node(service_node);
+  return 0;
+}
+
+static void sd_cache_entry_free(sd_cache_entry_t * entry)
+{
+  if (entry->format)
+    free(entry->format);
+  if (entry->endpoint)
+    free(entry->endpoint);
+  if (entry->buffer)
+    librdf_free_memory(entry->buffer);
+  free(entry);
+}
+
+static void sd_cache_clear(void)
+{
+  while (sd_cache) {
+    sd_cache_entry_t *entry = sd_cache;
+    sd_cache = entry->next;
+    sd_cache_entry_free(entry);
+  }
+  sd_cache_size = 0;
+}
+
+// Returns the cached serialisation for a format and endpoint, moving it to
+// the front of the cache
+static sd_cache_entry_t *sd_cache_lookup(const char *format, const char *endpoint)
+{
+  sd_cache_entry_t **ptr;
+
+  for (ptr = &sd_cache; *ptr; ptr = &(*ptr)->next) {
+    sd_cache_entry_t *entry = *ptr;
+    if (strcmp(entry->format, format) == 0 && strcmp(entry->endpoint, endpoint) == 0) {
+      *ptr = entry->next;
+      entry->next = sd_cache;
+      sd_cache = entry;
+      return entry;
+    }
+  }
 
-  return sd_model;
+  return NULL;
 }
 
+static void sd_cache_insert(sd_cache_entry_t * entry)
+{
+  entry->next = sd_cache;
+  sd_cache = entry;
+  sd_cache_size++;
+
+  // The endpoint depends on the Host header, so don't let the cache grow forever
+  if (sd_cache_size > SD_CACHE_MAX_ENTRIES) {
+    sd_cache_entry_t *last = sd_cache;
+    while (last->next->next)
+      last = last->next;
+    sd_cache_entry_free(last->next);
+    last->next = NULL;
+    sd_cache_size--;
+  }
+}
+
+static sd_cache_entry_t *serialise_service_description(const char *format, librdf_node * endpoint_node)
+{
+  sd_cache_entry_t *entry = NULL, *result = NULL;
+  librdf_storage *sd_storage = NULL;
+  librdf_model *sd_model = NULL;
+  librdf_stream *static_stream = NULL;
+  librdf_serializer *serialiser = NULL;
+  const char *endpoint = (const char *) librdf_uri_as_string(librdf_node_get_uri(endpoint_node));
+
+  entry = calloc(1, sizeof(sd_cache_entry_t));
+  if (!entry) {
+    redstore_error("Failed to allocate memory for service description cache.");
+    goto CLEANUP;
+  }
+
+  entry->format = strdup(format);
+  entry->endpoint = strdup(endpoint);
+  if (!entry->format || !entry->endpoint) {
+    redstore_error("Failed to allocate memory for service description cache.");
+    goto CLEANUP;
+  }
+
+  sd_storage = librdf_new_storage(world, NULL, NULL, NULL);
+  if (!sd_storage) {
+    redstore_error("Failed to create temporary storage for service description.");
+    goto CLEANUP;
+  }
+
+  sd_model = librdf_new_model(world, sd_storage, NULL);
+  if (!sd_model) {
+    redstore_error("Failed to create model for service description.");
+    goto CLEANUP;
+  }
+
+  static_stream = librdf_model_as_stream(sd_static_model);
+  if (!static_stream || librdf_model_add_statements(sd_model, static_stream)) {
+    redstore_error("Failed to copy static service description.");
+    goto CLEANUP;
+  }
+
+  librdf_model_add(sd_model,
+                   librdf_new_node_from_node(sd_service_node),
+                   librdf_new_node_from_uri_local_name(world, sd_ns_uri, (unsigned char *) "endpoint"),
+                   librdf_new_node_from_node(endpoint_node)
+      );
+
+  sd_add_dataset_description(sd_model, sd_service_node);
+
+  serialiser = librdf_new_serializer(world, format, NULL, NULL);
+  if (!serialiser) {
+    redstore_error("Failed to create serialiser for service description.");
+    goto CLEANUP;
+  }
+
+  // Add the namespaces used by the service description
+  librdf_serializer_set_namespace(serialiser, librdf_get_concept_schema_namespace(world), "rdfs");
+  librdf_serializer_set_namespace(serialiser, sd_ns_uri, "sd");
+  librdf_serializer_set_namespace(serialiser, format_ns_uri, "format");
+  librdf_serializer_set_namespace(serialiser, void_ns_uri, "void");
+
+  entry->buffer = librdf_serializer_serialize_model_to_counted_string(serialiser, NULL, sd_model, &entry->length);
+  if (!entry->buffer || entry->length == 0) {
+    redstore_error("Failed to serialise service description.");
+    goto CLEANUP;
+  }
+
+  result = entry;
+  entry = NULL;
+
+CLEANUP:
+  if (serialiser)
+    librdf_free_serializer(serialiser);
+  if (static_stream)
+    librdf_free_stream(static_stream);
+  if (sd_model)
+    librdf_free_model(sd_model);
+  if (sd_storage)
+    librdf_free_storage(sd_storage);
+  if (entry)
+    sd_cache_entry_free(entry);
+
+  return result;
+}
 
 
 static void description_html_table(const char *title, description_proc_t desc_proc, redhttp_response_t * response)
@@ -453,6 +585,13 @@ static redhttp_response_t *handle_html_description(redhttp_request_t * request,
 {
 
   redhttp_response_t *response = redstore_page_new(REDHTTP_OK, "Service Description");
+  unsigned long oldest_version = 0;
+  redstore_lock_stats_t lock_stats;
+  unsigned long negotiate_hits = 0, negotiate_misses = 0;
+  unsigned long requests_refused = 0;
+  int requests_queued = 0;
+  int analytic_running = 0;
+  unsigned long timed_out = 0, headers_refused = 0, rate_limited = 0;
 
   redstore_page_append_string(response, "<h2>Store Information</h2>\n");
   redstore_page_append_string(response, "<table border=\"1\">\n");
@@ -460,18 +599,48 @@ static redhttp_response_t *handle_html_description(redhttp_request_t * request,
   redstore_page_append_strings(response, "<tr><th>Storage Type</th><td>", storage_type, "</td></tr>\n", NULL);
   redstore_page_append_strings(response, "<tr><th>Storage Options</th><td>", public_storage_options, "</td></tr>\n", NULL);
 
+  redstore_page_append_string(response, "<tr><th>Shard Count</th><td>");
+  redstore_page_append_decimal(response, redstore_shard_count());
+  redstore_page_append_string(response, "</td></tr>\n");
+
   redstore_page_append_string(response, "<tr><th>Triple Count</th><td>");
-  redstore_page_append_decimal(response, librdf_storage_size(storage));
+  redstore_page_append_decimal(response, redstore_store_size());
   redstore_page_append_string(response, "</td></tr>\n");
 
   redstore_page_append_string(response, "<tr><th>Named Graph Count</th><td>");
-  redstore_page_append_decimal(response, context_count(storage));
+  redstore_page_append_decimal(response, redstore_catalogue_count());
   redstore_page_append_string(response, "</td></tr>\n");
 
   redstore_page_append_string(response, "<tr><th>HTTP Request Count</th><td>");
   redstore_page_append_decimal(response, request_count);
   redstore_page_append_string(response, "</td></tr>\n");
 
+  redstore_admission_get_stats(&requests_queued, &requests_refused, &analytic_running);
+  redstore_page_append_string(response, "<tr><th>HTTP Requests Waiting</th><td>");
+  redstore_page_append_decimal(response, requests_queued);
+  redstore_page_append_string(response, "</td></tr>\n");
+
+  redstore_page_append_string(response, "<tr><th>HTTP Requests Refused</th><td>");
+  redstore_page_append_decimal(response, requests_refused);
+  redstore_page_append_string(response, "</td></tr>\n");
+
+  redstore_page_append_string(response, "<tr><th>Analytic Queries Running</th><td>");
+  redstore_page_append_decimal(response, analytic_running);
+  redstore_page_append_string(response, "</td></tr>\n");
+
+  redstore_admission_get_offenders(&timed_out, &headers_refused, &rate_limited);
+  redstore_page_append_string(response, "<tr><th>HTTP Connections Timed Out</th><td>");
+  redstore_page_append_decimal(response, timed_out);
+  redstore_page_append_string(response, "</td></tr>\n");
+
+  redstore_page_append_string(response, "<tr><th>HTTP Headers Too Large</th><td>");
+  redstore_page_append_decimal(response, headers_refused);
+  redstore_page_append_string(response, "</td></tr>\n");
+
+  redstore_page_append_string(response, "<tr><th>HTTP Requests Rate Limited</th><td>");
+  redstore_page_append_decimal(response, rate_limited);
+  redstore_page_append_string(response, "</td></tr>\n");
+
   redstore_page_append_string(response, "<tr><th>Successful Import Count</th><td>");
   redstore_page_append_decimal(response, import_count);
   redstore_page_append_string(response, "</td></tr>\n");
@@ -479,10 +648,56 @@ static redhttp_response_t *handle_html_description(redhttp_request_t * request,
   redstore_page_append_string(response, "<tr><th>SPARQL Query Count</th><td>");
   redstore_page_append_decimal(response, query_count);
   redstore_page_append_string(response, "</td></tr>\n");
+
+  redstore_page_append_string(response, "<tr><th>Store Version</th><td>");
+  redstore_page_append_decimal(response, store_version);
+  redstore_page_append_string(response, "</td></tr>\n");
+
+  redstore_page_append_string(response, "<tr><th>Forked Readers</th><td>");
+  redstore_page_append_decimal(response, redstore_children_oldest_version(&oldest_version));
+  redstore_page_append_string(response, "</td></tr>\n");
+
+  redstore_page_append_string(response, "<tr><th>Oldest Forked Reader Version</th><td>");
+  redstore_page_append_decimal(response, oldest_version);
+  redstore_page_append_string(response, "</td></tr>\n");
+
+  redstore_lock_get_stats(&lock_stats);
+  redstore_page_append_string(response, "<tr><th>Graph Locks Held</th><td>");
+  redstore_page_append_decimal(response, lock_stats.held);
+  redstore_page_append_string(response, "</td></tr>\n");
+
+  redstore_page_append_string(response, "<tr><th>Writes Waiting for Lock</th><td>");
+  redstore_page_append_decimal(response, lock_stats.waiting);
+  redstore_page_append_string(response, "</td></tr>\n");
+
+  redstore_page_append_string(response, "<tr><th>Lock Acquisitions</th><td>");
+  redstore_page_append_decimal(response, lock_stats.acquired);
+  redstore_page_append_string(response, "</td></tr>\n");
+
+  redstore_page_append_string(response, "<tr><th>Lock Waits</th><td>");
+  redstore_page_append_decimal(response, lock_stats.waited);
+  redstore_page_append_string(response, "</td></tr>\n");
+
+  redstore_page_append_string(response, "<tr><th>Total Lock Wait (ms)</th><td>");
+  redstore_page_append_decimal(response, lock_stats.total_wait_ms);
+  redstore_page_append_string(response, "</td></tr>\n");
+
+  redstore_page_append_string(response, "<tr><th>Longest Lock Wait (ms)</th><td>");
+  redstore_page_append_decimal(response, lock_stats.max_wait_ms);
+  redstore_page_append_string(response, "</td></tr>\n");
+
+  redstore_negotiate_get_stats(&negotiate_hits, &negotiate_misses);
+  redstore_page_append_string(response, "<tr><th>Negotiation Cache Hits</th><td>");
+  redstore_page_append_decimal(response, negotiate_hits);
+  redstore_page_append_string(response, "</td></tr>\n");
+
+  redstore_page_append_string(response, "<tr><th>Negotiation Cache Misses</th><td>");
+  redstore_page_append_decimal(response, negotiate_misses);
+  redstore_page_append_string(response, "</td></tr>\n");
   redstore_page_append_string(response, "</table>\n");
 
   description_html_table("Query Languages", librdf_query_language_get_description, response);
-  description_html_table("Query Result Formats", librdf_query_results_formats_get_description, response);
+  description_html_table("Query Result Formats", redstore_results_formats_get_description, response);
   description_html_table("Input RDF Formats", librdf_parser_get_description, response);
   description_html_table("Output RDF Formats", librdf_serializer_get_description, response);
 
@@ -500,49 +715,50 @@ redhttp_response_t *handle_description_get(redhttp_request_t * request, void *us
 {
   const raptor_syntax_description* desc = NULL;
   redhttp_response_t *response = NULL;
-  librdf_storage *sd_storage = NULL;
-  librdf_model *sd_model = NULL;
-  librdf_stream *sd_stream = NULL;
-
-  desc = redstore_negotiate_format(request, librdf_serializer_get_description, "text/html", NULL);
-  if (desc == NULL || strcmp("html", desc->names[0])==0) {
-    response = handle_html_description(request, user_data);
-  } else {
-    const char *request_url = redhttp_request_get_url(request);
-
-    sd_storage = librdf_new_storage(world, NULL, NULL, NULL);
-    if (!sd_storage) {
-      redstore_error("Failed to create temporary storage for service description.");
-      goto CLEANUP;
-    }
+  librdf_node *endpoint_node = NULL;
+  sd_cache_entry_t *entry = NULL;
+  const char *mime_type = NULL;
+  int triple_count;
+
+  desc = redstore_negotiate_format(request, librdf_serializer_get_description, "text/html", &mime_type);
+  if (desc == NULL || strcmp("html", desc->names[0])==0)
+    return handle_html_description(request, user_data);
+
+  // The only part of the description which changes is the triple count
+  triple_count = redstore_store_size();
+  if (triple_count != sd_cache_triples) {
+    sd_cache_clear();
+    sd_cache_triples = triple_count;
+  }
 
-    sd_model = create_service_description(sd_storage, request_url);
-    if (!sd_model) {
-      redstore_error("Failed to create model for service description.");
-      goto CLEANUP;
-    }
+  endpoint_node = sd_get_endpoint_node(redhttp_request_get_url(request));
+  if (!endpoint_node) {
+    return redstore_page_new_with_message(
+      request, LIBRDF_LOG_ERROR, REDHTTP_INTERNAL_SERVER_ERROR,
+      "Failed to create endpoint URI for service description."
+    );
+  }
 
-    sd_stream = librdf_model_as_stream(sd_model);
-    if (!sd_stream) {
-      redstore_error("Failed to create stream for service description.");
-      goto CLEANUP;
-    }
+  entry = sd_cache_lookup(desc->names[0],
+                          (const char *) librdf_uri_as_string(librdf_node_get_uri(endpoint_node)));
+  if (!entry) {
+    entry = serialise_service_description(desc->names[0], endpoint_node);
+    if (entry)
+      sd_cache_insert(entry);
+  }
+  librdf_free_node(endpoint_node);
 
-    response = format_graph_stream(request, sd_stream);
-    if (!response) {
-      redstore_error("Failed to create temporary storage for service description.");
-      goto CLEANUP;
-    }
+  if (!entry) {
+    return redstore_page_new_with_message(
+      request, LIBRDF_LOG_ERROR, REDHTTP_INTERNAL_SERVER_ERROR,
+      "Failed to serialise service description."
+    );
   }
 
-
-CLEANUP:
-  if (sd_stream)
-    librdf_free_stream(sd_stream);
-  if (sd_model)
-    librdf_free_model(sd_model);
-  if (sd_storage)
-    librdf_free_storage(sd_storage);
+  response = redhttp_response_new(REDHTTP_OK, NULL);
+  if (mime_type)
+    redhttp_response_add_header(response, "Content-Type", mime_type);
+  redhttp_response_copy_content(response, (const char *) entry->buffer, entry->length);
 
   return response;
 }
@@ -568,12 +784,24 @@ int description_init()
     return 1;
   }
 
+  if (create_static_description())
+    return 1;
+
   // Success
   return 0;
 }
 
 void description_free()
 {
+  sd_cache_clear();
+
+  if (sd_service_node)
+    librdf_free_node(sd_service_node);
+  if (sd_static_model)
+    librdf_free_model(sd_static_model);
+  if (sd_static_storage)
+    librdf_free_storage(sd_static_storage);
+
   if (format_ns_uri)
     librdf_free_uri(format_ns_uri);
 
@@ -0,0 +1,395 @@
+/*
+    RedStore - a lightweight RDF triplestore powered by Redland
+    Copyright (C) 2010-2011 Nicholas J Humfrey <njh@aelius.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/wait.h>
+
+#include "redstore.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#define DUMP_BUFFER_SIZE     (64 * 1024)
+
+
+typedef struct {
+  FILE *file;
+#ifdef HAVE_ZLIB
+  gzFile gz;
+#endif
+  redstore_buffer_t buffer;
+  int error;
+} dump_output_t;
+
+
+static void dump_flush(dump_output_t * output)
+{
+  if (output->buffer.length == 0 || output->error)
+    return;
+
+#ifdef HAVE_ZLIB
+  if (output->gz) {
+    if (gzwrite(output->gz, output->buffer.data, output->buffer.length) == 0)
+      output->error = 1;
+  } else
+#endif
+  if (fwrite(output->buffer.data, 1, output->buffer.length, output->file) !=
+        output->buffer.length) {
+    output->error = 1;
+  }
+
+  redstore_buffer_reset(&output->buffer);
+}
+
+// Write a stream of statements; if graph is set it is used as the
+// graph of every statement, otherwise the context of the stream is used.
+// When default_only is set, statements in a named graph are skipped.
+static long dump_write_stream(dump_output_t * output, librdf_stream * stream,
+                              librdf_node * graph, int default_only)
+{
+  long count = 0;
+
+  while (!librdf_stream_end(stream) && !output->error) {
+    librdf_statement *statement = librdf_stream_get_object(stream);
+    librdf_node *context = graph ? graph : librdf_stream_get_context2(stream);
+
+    if (!statement) {
+      redstore_error("librdf_stream_get_object returned NULL while dumping store");
+      return -1;
+    }
+
+    if (default_only && context) {
+      librdf_stream_next(stream);
+      continue;
+    }
+
+    if (redstore_ntriples_append_statement(&output->buffer, statement, context))
+      output->error = 1;
+
+    if (output->buffer.length >= DUMP_BUFFER_SIZE)
+      dump_flush(output);
+
+    count++;
+    librdf_stream_next(stream);
+  }
+
+  dump_flush(output);
+
+  return output->error ? -1 : count;
+}
+
+static int dump_output_open(dump_output_t * output, FILE * file, int compress)
+{
+  memset(output, 0, sizeof(dump_output_t));
+  output->file = file;
+
+#ifdef HAVE_ZLIB
+  if (compress) {
+    fflush(file);
+    output->gz = gzdopen(dup(fileno(file)), "wb");
+    if (!output->gz) {
+      redstore_error("Failed to create gzip stream for dump.");
+      return -1;
+    }
+  }
+#endif
+
+  return 0;
+}
+
+static void dump_output_close(dump_output_t * output)
+{
+#ifdef HAVE_ZLIB
+  if (output->gz && gzclose(output->gz) != Z_OK)
+    output->error = 1;
+  output->gz = NULL;
+#endif
+  redstore_buffer_free(&output->buffer);
+  fflush(output->file);
+}
+
+static int compare_graphs(const void *a, const void *b)
+{
+  librdf_uri *ua = librdf_node_get_uri(*(librdf_node * const *) a);
+  librdf_uri *ub = librdf_node_get_uri(*(librdf_node * const *) b);
+
+  return strcmp((const char *) librdf_uri_as_string(ua), (const char *) librdf_uri_as_string(ub));
+}
+
+// Get a sorted list of the named graphs, so that dumps are in a deterministic order
+static librdf_node **dump_list_graphs(size_t * count)
+{
+  librdf_iterator *iterator = NULL;
+  librdf_node **graphs = NULL;
+  size_t size = 0;
+
+  *count = 0;
+  iterator = redstore_store_get_contexts();
+  if (!iterator) {
+    redstore_error("Failed to get list of graphs.");
+    return NULL;
+  }
+
+  while (!librdf_iterator_end(iterator)) {
+    librdf_node *graph = (librdf_node *) librdf_iterator_get_object(iterator);
+    if (!graph) {
+      redstore_error("librdf_iterator_get_object returned NULL while dumping store");
+      break;
+    }
+
+    if (*count == size) {
+      librdf_node **new_graphs;
+      size = size ? size * 2 : 64;
+      new_graphs = realloc(graphs, size * sizeof(librdf_node *));
+      if (!new_graphs) {
+        redstore_error("Failed to allocate memory for list of graphs.");
+        break;
+      }
+      graphs = new_graphs;
+    }
+
+    graphs[(*count)++] = librdf_new_node_from_node(graph);
+    librdf_iterator_next(iterator);
+  }
+  librdf_free_iterator(iterator);
+
+  if (*count > 1)
+    qsort(graphs, *count, sizeof(librdf_node *), compare_graphs);
+
+  return graphs;
+}
+
+// Worker process: dump one part of the store into a temporary file and exit
+static void dump_part(FILE * file, librdf_node * graph, int compress)
+{
+  librdf_stream *stream = NULL;
+  dump_output_t output;
+  long count = -1;
+
+  if (dump_output_open(&output, file, compress) == 0) {
+    if (graph) {
+      stream = librdf_model_context_as_stream(redstore_graph_model(graph), graph);
+    } else {
+      stream = librdf_model_as_stream(model);
+    }
+
+    if (stream) {
+      count = dump_write_stream(&output, stream, graph, graph == NULL);
+      librdf_free_stream(stream);
+    }
+    dump_output_close(&output);
+  }
+
+  _exit(count < 0 || output.error ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+// Dump each graph in a separate worker process and concatenate the parts
+// in order. Compressed parts are separate gzip members, which is still
+// a valid gzip stream.
+static int dump_parts_parallel(FILE * socket, int compress)
+{
+  long max_workers = redstore_get_option_long("dump-workers", sysconf(_SC_NPROCESSORS_ONLN));
+  librdf_node **graphs = NULL;
+  size_t graph_count = 0, part_count, i;
+  size_t next_start = 0, next_write = 0;
+  FILE **files = NULL;
+  pid_t *pids = NULL;
+  int *done = NULL;
+  long running = 0;
+  int err = 0;
+
+  if (max_workers < 1)
+    max_workers = 1;
+
+  graphs = dump_list_graphs(&graph_count);
+
+  // Part 0 is the default graph; part N is named graph N-1
+  part_count = graph_count + 1;
+  files = calloc(part_count, sizeof(FILE *));
+  pids = calloc(part_count, sizeof(pid_t));
+  done = calloc(part_count, sizeof(int));
+  if (!files || !pids || !done) {
+    redstore_error("Failed to allocate memory for dump workers.");
+    err = -1;
+    goto CLEANUP;
+  }
+
+  while (next_write < part_count && !err) {
+    pid_t pid;
+    int status;
+
+    // Start workers, but don't get too far ahead of the writer
+    while (running < max_workers && next_start < part_count &&
+           next_start - next_write < (size_t) max_workers * 4) {
+      files[next_start] = tmpfile();
+      if (!files[next_start]) {
+        redstore_error("Failed to create temporary file for dump.");
+        err = -1;
+        break;
+      }
+
+      pid = fork();
+      if (pid < 0) {
+        redstore_error("Failed to fork dump worker.");
+        err = -1;
+        break;
+      } else if (pid == 0) {
+        dump_part(files[next_start], next_start ? graphs[next_start - 1] : NULL, compress);
+      }
+
+      pids[next_start++] = pid;
+      running++;
+    }
+
+    if (running == 0)
+      break;
+
+    // Wait for any worker to finish
+    pid = waitpid(-1, &status, 0);
+    if (pid < 0) {
+      if (errno == EINTR)
+        continue;
+      err = -1;
+      break;
+    }
+
+    for (i = next_write; i < next_start; i++) {
+      if (pids[i] == pid) {
+        done[i] = (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 1 : -1;
+        running--;
+        break;
+      }
+    }
+
+    // Copy the finished parts that are next in order
+    while (next_write < next_start && done[next_write]) {
+      if (done[next_write] < 0 || redstore_copy_file(files[next_write], socket)) {
+        redstore_error("Failed to dump part %lu of the store.", (unsigned long) next_write);
+        err = -1;
+        break;
+      }
+      fclose(files[next_write]);
+      files[next_write] = NULL;
+      next_write++;
+    }
+  }
+
+CLEANUP:
+  // Wait for any workers that are still running
+  while (running > 0 && waitpid(-1, NULL, 0) > 0)
+    running--;
+  for (i = 0; files && i < part_count; i++) {
+    if (files[i])
+      fclose(files[i]);
+  }
+  for (i = 0; i < graph_count; i++)
+    librdf_free_node(graphs[i]);
+  if (graphs)
+    free(graphs);
+  if (files)
+    free(files);
+  if (pids)
+    free(pids);
+  if (done)
+    free(done);
+
+  return err;
+}
+
+// Write out the response headers and every quad in the store
+static redhttp_response_t *dump_store(redhttp_request_t * request, int compress)
+{
+  FILE *socket = redhttp_request_get_socket(request);
+  redhttp_response_t *response = NULL;
+  int err;
+
+  response = redhttp_response_new(REDHTTP_OK, NULL);
+  redhttp_response_add_header(response, "Content-Type", "application/n-quads");
+  if (compress)
+    redhttp_response_add_header(response, "Content-Encoding", "gzip");
+  redhttp_response_send(response, request);
+  fflush(socket);
+
+  err = dump_parts_parallel(socket, compress);
+
+  if (err)
+    redstore_error("Failed to write dump to client.");
+  fflush(socket);
+
+  return response;
+}
+
+
+redhttp_response_t *handle_dump_get(redhttp_request_t * request, void *user_data)
+{
+  int compress = redhttp_request_argument_exists(request, "gzip");
+  redhttp_response_t *response = NULL;
+  pid_t pid;
+
+#ifndef HAVE_ZLIB
+  if (compress) {
+    return redstore_page_new_with_message(
+      request, LIBRDF_LOG_INFO, REDHTTP_NOT_IMPLEMENTED,
+      "Compressed dumps are not supported by this build of RedStore."
+    );
+  }
+#endif
+
+  // Only the server can write to a connection shared by several requests,
+  // and a dump is too long to write without holding up every other request
+  if (redhttp_request_is_multiplexed(request)) {
+    return redstore_page_new_with_message(
+      request, LIBRDF_LOG_INFO, REDHTTP_NOT_IMPLEMENTED,
+      "Dumps are not supported over HTTP/2; use HTTP/1.1."
+    );
+  }
+
+  // Only a forked copy of an in-memory store stays as it was when the dump
+  // started; other storage modules would be read while they are changed
+  if (!redstore_storage_is_in_memory()) {
+    return redstore_page_new_with_message(
+      request, LIBRDF_LOG_INFO, REDHTTP_NOT_IMPLEMENTED,
+      "Dumps are only supported with the memory storage module."
+    );
+  }
+
+  pid = redstore_fork_child();
+  if (pid < 0) {
+    response = redstore_page_new_with_message(
+      request, LIBRDF_LOG_WARN, REDHTTP_SERVICE_UNAVAILABLE,
+      "Failed to start dump; try again later."
+    );
+    redstore_add_retry_after(response);
+    return response;
+  } else if (pid == 0) {
+    // In the child: write out the point-in-time copy of the store
+    response = dump_store(request, compress);
+    _exit(EXIT_SUCCESS);
+  }
+
+  // The child process is now responsible for the connection
+  response = redhttp_response_new(REDHTTP_OK, NULL);
+  redhttp_response_set_headers_sent(response, 1);
+
+  return response;
+}
@@ -25,7 +25,7 @@
 
 redhttp_response_t *format_graph_stream(redhttp_request_t * request, librdf_stream * stream)
 {
-  FILE *socket = redhttp_request_get_socket(request);
+  FILE *socket = NULL;
   const raptor_syntax_description* desc = NULL;
   redhttp_response_t *response = NULL;
   librdf_serializer *serialiser = NULL;
@@ -40,6 +40,18 @@ redhttp_response_t *format_graph_stream(redhttp_request_t * request, librdf_stre
     goto CLEANUP;
   }
 
+  // Line based formats are written without a librdf serialiser
+  if (strcmp(desc->names[0], "ntriples") == 0 || strcmp(desc->names[0], "nquads") == 0) {
+    response = redhttp_response_new(REDHTTP_OK, NULL);
+    if (mime_type)
+      redhttp_response_add_header(response, "Content-Type", mime_type);
+    socket = redstore_compress_stream_open(request, response);
+
+    if (redstore_ntriples_write_stream(socket, stream, strcmp(desc->names[0], "nquads") == 0) < 0)
+      redstore_error("Failed to write graph");
+    goto CLEANUP;
+  }
+
   serialiser = librdf_new_serializer(world, desc->names[0], NULL, NULL);
   if (!serialiser) {
     response = redstore_page_new_with_message(
@@ -58,7 +70,7 @@ redhttp_response_t *format_graph_stream(redhttp_request_t * request, librdf_stre
   response = redhttp_response_new(REDHTTP_OK, NULL);
   if (mime_type)
     redhttp_response_add_header(response, "Content-Type", mime_type);
-  redhttp_response_send(response, request);
+  socket = redstore_compress_stream_open(request, response);
 
   if (librdf_serializer_serialize_stream_to_file_handle(serialiser, socket, NULL, stream)) {
     redstore_error("Failed to serialize graph");
@@ -66,6 +78,8 @@ redhttp_response_t *format_graph_stream(redhttp_request_t * request, librdf_stre
   }
 
 CLEANUP:
+  if (socket)
+    redstore_compress_stream_close(request, socket);
   if (serialiser)
     librdf_free_serializer(serialiser);
 
@@ -77,14 +91,16 @@ redhttp_response_t *format_bindings_query_result(redhttp_request_t * request,
                                                  librdf_query_results * results)
 {
   raptor_world *raptor = librdf_world_get_raptor(world);
-  FILE *socket = redhttp_request_get_socket(request);
+  FILE *socket = NULL;
   raptor_iostream *iostream = NULL;
   redhttp_response_t *response = NULL;
   librdf_query_results_formatter *formatter = NULL;
+  const redstore_results_writer_t *writer = NULL;
   const raptor_syntax_description* desc = NULL;
   const char* mime_type = NULL;
+  unsigned long count = 0;
 
-  desc = redstore_negotiate_format(request, librdf_query_results_formats_get_description, DEFAULT_RESULTS_FORMAT, &mime_type);
+  desc = redstore_negotiate_format(request, redstore_results_formats_get_description, DEFAULT_RESULTS_FORMAT, &mime_type);
   if (!desc) {
     response = redstore_page_new_with_message(
       request, LIBRDF_LOG_INFO, REDHTTP_NOT_ACCEPTABLE,
@@ -93,6 +109,21 @@ redhttp_response_t *format_bindings_query_result(redhttp_request_t * request,
     goto CLEANUP;
   }
 
+  // Use a native writer if there is one for the chosen format
+  writer = redstore_get_results_writer(desc->names[0], librdf_query_results_is_boolean(results));
+  if (writer) {
+    response = redhttp_response_new(REDHTTP_OK, NULL);
+    if (mime_type)
+      redhttp_response_add_header(response, "Content-Type", mime_type);
+    socket = redstore_compress_stream_open(request, response);
+
+    if (redstore_write_results(writer, socket, results, &count))
+      redstore_error("Failed to write query results");
+
+    redstore_debug("Query returned %lu results", count);
+    goto CLEANUP;
+  }
+
   formatter = librdf_new_query_results_formatter2(results, desc->names[0], NULL, NULL);
   if (!formatter) {
     response = redstore_page_new_with_message(
@@ -101,19 +132,17 @@ redhttp_response_t *format_bindings_query_result(redhttp_request_t * request,
     goto CLEANUP;
   }
 
-  iostream = raptor_new_iostream_to_file_handle(raptor, socket);
-  if (!iostream) {
-    response = redstore_page_new_with_message(
-      request, LIBRDF_LOG_ERROR, REDHTTP_INTERNAL_SERVER_ERROR,
-      "Failed to create raptor_iostream for results output."
-    );
-    goto CLEANUP;
-  }
   // Send back the response headers
   response = redhttp_response_new(REDHTTP_OK, NULL);
   if (mime_type)
     redhttp_response_add_header(response, "Content-Type", mime_type);
-  redhttp_response_send(response, request);
+  socket = redstore_compress_stream_open(request, response);
+
+  iostream = raptor_new_iostream_to_file_handle(raptor, socket);
+  if (!iostream) {
+    redstore_error("Failed to create raptor_iostream for results output.");
+    goto CLEANUP;
+  }
 
   // Stream results back to client
   if (librdf_query_results_formatter_write(iostream, formatter, results, NULL)) {
@@ -126,8 +155,58 @@ redhttp_response_t *format_bindings_query_result(redhttp_request_t * request,
 CLEANUP:
   if (iostream)
     raptor_free_iostream(iostream);
+  if (socket)
+    redstore_compress_stream_close(request, socket);
   if (formatter)
     librdf_free_query_results_formatter(formatter);
 
   return response;
 }
+
+
+// Write the rows from every shard as a single set of results. The merger
+// writes the rows, between the head and tail written here, so the format
+// must have a native writer.
+redhttp_response_t *format_bindings_query_results_merged(redhttp_request_t * request,
+                                                         librdf_query_results * results,
+                                                         redstore_results_merger merger,
+                                                         void *data)
+{
+  FILE *socket = NULL;
+  redhttp_response_t *response = NULL;
+  const redstore_results_writer_t *writer = NULL;
+  const raptor_syntax_description* desc = NULL;
+  const char* mime_type = NULL;
+  int err = 0;
+
+  desc = redstore_negotiate_format(request, redstore_results_formats_get_description, DEFAULT_RESULTS_FORMAT, &mime_type);
+  if (desc)
+    writer = redstore_get_results_writer(desc->names[0], 0);
+  if (!writer) {
+    response = redstore_page_new_with_message(
+      request, LIBRDF_LOG_INFO, REDHTTP_NOT_ACCEPTABLE,
+      "Results format not supported by a sharded store."
+    );
+    goto CLEANUP;
+  }
+
+  // Send back the response headers
+  response = redhttp_response_new(REDHTTP_OK, NULL);
+  if (mime_type)
+    redhttp_response_add_header(response, "Content-Type", mime_type);
+  socket = redstore_compress_stream_open(request, response);
+
+  err |= writer->head(socket, results);
+  if (!err)
+    err |= merger(socket, writer, results, data);
+  if (!err && writer->tail)
+    err |= writer->tail(socket, results);
+  if (err)
+    redstore_error("Failed to write query results");
+
+CLEANUP:
+  if (socket)
+    redstore_compress_stream_close(request, socket);
+
+  return response;
+}
@@ -18,12 +18,15 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "redstore.h"
 #include "redstore_config.h"
 
 #define REDSTORE_ID_LEN  (9)
 static unsigned long base_id = 0;
+static pid_t base_pid = 0;
 
 
 char* redstore_genid(void)
@@ -34,10 +37,14 @@ char* redstore_genid(void)
   int i=0, index=0;
   char *str = NULL;
 
-  // FIXME: this won't work if redstore starts using fork()
-  if (base_id == 0) {
+  // Re-seed in each process, so that forked children don't generate
+  // the same identifiers as their parent
+  if (base_id == 0 || base_pid != getpid()) {
+    base_pid = getpid();
 #ifdef HAVE_SRANDOMDEV
     srandomdev();
+#else
+    srandom(time(NULL) ^ ((unsigned long) base_pid << 16));
 #endif
     base_id = random();
   }
@@ -27,9 +27,12 @@ int exit_code = EXIT_SUCCESS;   // Exit code for when RedStore exits
 unsigned long query_count = 0;
 unsigned long import_count = 0;
 unsigned long request_count = 0;
+unsigned long store_version = 0;
 const char *storage_name = NULL;
 const char *storage_type = NULL;
 char *public_storage_options = NULL;
+const char *snapshot_filename = NULL;
+librdf_hash *server_options = NULL;
 
 librdf_world *world = NULL;
 librdf_model *model = NULL;
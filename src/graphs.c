@@ -39,42 +39,29 @@ static char* server_root_url(redhttp_request_t * request)
 }
 
 static redhttp_response_t *handle_html_graph_index(redhttp_request_t * request,
-                                                   librdf_iterator * iterator)
+                                                   redstore_graph_info_t ** graphs, int count)
 {
   redhttp_response_t *response = redstore_page_new(REDHTTP_OK, "Named Graphs");
   char *root_url = server_root_url(request);
+  int i;
 
   if (!root_url || !response)
     goto CLEANUP;
 
-  if (!librdf_iterator_end(iterator)) {
+  if (count > 0) {
     redstore_page_append_string(response, "<ul>\n");
 
-    while (!librdf_iterator_end(iterator)) {
-      librdf_uri *uri;
-      librdf_node *node;
-      char *uri_str, *escaped;
+    for (i = 0; i < count; i++) {
+      char *uri_str = graphs[i]->uri;
+      char *escaped;
 
-      node = (librdf_node *) librdf_iterator_get_object(iterator);
-      if (!node) {
-        redstore_error("librdf_iterator_get_next returned NULL");
-        break;
-      }
-
-      uri = librdf_node_get_uri(node);
-      if (!uri) {
-        redstore_error("Failed to get URI for context node");
-        break;
-      }
-
-      uri_str = (char*)librdf_uri_as_string(uri);
       if (strstr(uri_str, root_url)) {
         // Direct graph identification
         redstore_page_append_string(response, "<li><a href=\"");
         redstore_page_append_escaped(response, uri_str, 0);
         redstore_page_append_string(response, "\">");
         redstore_page_append_escaped(response, uri_str, 0);
-        redstore_page_append_string(response, "</a></li>\n");
+        redstore_page_append_string(response, "</a>");
       } else {
         // Indirect graph identification
         escaped = redhttp_url_escape(uri_str);
@@ -82,11 +69,13 @@ static redhttp_response_t *handle_html_graph_index(redhttp_request_t * request,
         redstore_page_append_escaped(response, escaped, 0);
         redstore_page_append_string(response, "\">");
         redstore_page_append_escaped(response, uri_str, 0);
-        redstore_page_append_string(response, "</a></li>\n");
+        redstore_page_append_string(response, "</a>");
         free(escaped);
       }
 
-      librdf_iterator_next(iterator);
+      redstore_page_append_string(response, " (");
+      redstore_page_append_decimal(response, graphs[i]->triples);
+      redstore_page_append_string(response, graphs[i]->triples == 1 ? " triple)</li>\n" : " triples)</li>\n");
     }
     redstore_page_append_string(response, "</ul>\n");
 
@@ -107,36 +96,21 @@ CLEANUP:
 }
 
 static redhttp_response_t *handle_text_graph_index(redhttp_request_t * request,
-                                                   librdf_iterator * iterator)
+                                                   redstore_graph_info_t ** graphs, int count)
 {
   redhttp_response_t *response = redhttp_response_new_with_type(REDHTTP_OK, NULL, "text/plain");
-  FILE *socket = redhttp_request_get_socket(request);
+  FILE *socket = NULL;
+  int i;
 
   if (!response)
     return NULL;
 
-  redhttp_response_send(response, request);
-
-  while (!librdf_iterator_end(iterator)) {
-    librdf_uri *uri;
-    librdf_node *node;
+  socket = redstore_compress_stream_open(request, response);
 
-    node = (librdf_node *) librdf_iterator_get_object(iterator);
-    if (!node) {
-      redstore_error("librdf_iterator_get_next returned NULL");
-      break;
-    }
-
-    uri = librdf_node_get_uri(node);
-    if (!uri) {
-      redstore_error("Failed to get URI for context node");
-      break;
-    }
+  for (i = 0; i < count; i++)
+    fprintf(socket, "%s\n", graphs[i]->uri);
 
-    fprintf(socket, "%s\n", librdf_uri_as_string(uri));
-
-    librdf_iterator_next(iterator);
-  }
+  redstore_compress_stream_close(request, socket);
 
   return response;
 }
@@ -146,19 +120,21 @@ redhttp_response_t *handle_graph_index(redhttp_request_t * request, void *user_d
 {
   char *format_str = redstore_negotiate_string(request, "text/plain,text/html,application/xhtml+xml", "text/plain");
   redhttp_response_t *response = NULL;
-  librdf_iterator *iterator = NULL;
+  redstore_graph_info_t **graphs = NULL;
+  int count = 0;
 
-  iterator = librdf_storage_get_contexts(storage);
-  if (!iterator) {
+  graphs = redstore_catalogue_list(&count);
+  if (!graphs) {
+    free(format_str);
     return redstore_page_new_with_message(
       request, LIBRDF_LOG_ERROR, REDHTTP_INTERNAL_SERVER_ERROR, "Failed to get list of graphs."
     );
   }
 
   if (redstore_is_text_format(format_str)) {
-    response = handle_text_graph_index(request, iterator);
+    response = handle_text_graph_index(request, graphs, count);
   } else if (redstore_is_html_format(format_str)) {
-    response = handle_html_graph_index(request, iterator);
+    response = handle_html_graph_index(request, graphs, count);
   } else {
     response = redstore_page_new_with_message(
       request, LIBRDF_LOG_INFO, REDHTTP_NOT_ACCEPTABLE, "No acceptable format supported."
@@ -166,7 +142,7 @@ redhttp_response_t *handle_graph_index(redhttp_request_t * request, void *user_d
   }
 
   free(format_str);
-  librdf_free_iterator(iterator);
+  free(graphs);
 
   return response;
 }
@@ -66,8 +66,10 @@ redhttp_response_t *handle_image_favicon(redhttp_request_t * request, void *user
     0x00, 0x00, 0xe0, 0x07, 0x00, 0x00,
   };
 
-  redhttp_response_t *response = redhttp_response_new_with_type(REDHTTP_OK, NULL, "image/x-icon");
-  redhttp_response_add_header(response, "Last-Modified", BUILD_TIME);
-  redhttp_response_set_content(response, (char *) const_data, sizeof(const_data), NULL);
-  return response;
+  static redstore_asset_t favicon;
+
+  if (!favicon.content)
+    redstore_asset_set(&favicon, "image/x-icon", (const char *) const_data, sizeof(const_data));
+
+  return redstore_asset_response(request, &favicon);
 }
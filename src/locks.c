@@ -0,0 +1,270 @@
+/*
+    RedStore - a lightweight RDF triplestore powered by Redland
+    Copyright (C) 2010-2011 Nicholas J Humfrey <njh@aelius.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Graph write locks
+
+  Each named graph has its own lock, kept in a table keyed by the graph
+  URI, so that writes to different graphs do not wait for each other.
+  Writes to the default graph, and operations on the whole store, take
+  the global lock instead, which excludes every graph lock.
+
+  Requests waiting for a lock are granted it in the order they asked
+  for it: each request takes a ticket, and a graph lock is not granted
+  ahead of an older request for the global lock, or the other way round.
+
+  The locks only decide the order of writes. Redland is not thread-safe,
+  so the changes themselves are still applied one at a time, by the
+  server process; what runs concurrently is the parsing of request
+  bodies in child processes (see writes.c). A lock is held from when it
+  is granted until the write has been parsed and applied.
+
+  The graph locks in use are kept in a hash table, so finding one takes
+  the same time however many graphs are being written to.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "redstore.h"
+
+#define LOCK_TABLE_SIZE   (256)
+
+
+typedef struct lock_waiter_s {
+  unsigned long ticket;
+  struct timeval queued;
+  redstore_lock_func func;
+  void *data;
+  struct lock_waiter_s *next;
+} lock_waiter_t;
+
+typedef struct lock_s {
+  char *key;
+  uint32_t hash;
+  int held;
+  lock_waiter_t *waiters;
+  struct lock_s *next;
+} lock_t;
+
+static lock_t global_lock = { NULL, 0, 0, NULL, NULL };
+static lock_t *graph_locks[LOCK_TABLE_SIZE];
+static int graph_locks_held = 0;
+static unsigned long next_ticket = 0;
+static redstore_lock_stats_t lock_stats;
+
+
+static const char *graph_key(librdf_node * graph)
+{
+  librdf_uri *uri = NULL;
+
+  if (graph)
+    uri = librdf_node_get_uri(graph);
+
+  return uri ? (const char *) librdf_uri_as_string(uri) : NULL;
+}
+
+static lock_t *find_lock(const char *key, int create)
+{
+  uint32_t hash;
+  lock_t *lock;
+
+  if (!key)
+    return &global_lock;
+
+  hash = redstore_hash_bytes((const unsigned char *) key, strlen(key));
+  for (lock = graph_locks[hash % LOCK_TABLE_SIZE]; lock; lock = lock->next) {
+    if (lock->hash == hash && strcmp(lock->key, key) == 0)
+      return lock;
+  }
+
+  if (!create)
+    return NULL;
+
+  lock = calloc(1, sizeof(lock_t));
+  if (!lock)
+    return NULL;
+  lock->key = strdup(key);
+  if (!lock->key) {
+    free(lock);
+    return NULL;
+  }
+
+  lock->hash = hash;
+  lock->next = graph_locks[hash % LOCK_TABLE_SIZE];
+  graph_locks[hash % LOCK_TABLE_SIZE] = lock;
+
+  return lock;
+}
+
+// Graph locks are only kept in the table while in use
+static void remove_unused_lock(lock_t * lock)
+{
+  lock_t **ptr;
+
+  if (lock == &global_lock || lock->held || lock->waiters)
+    return;
+
+  for (ptr = &graph_locks[lock->hash % LOCK_TABLE_SIZE]; *ptr; ptr = &(*ptr)->next) {
+    if (*ptr == lock) {
+      *ptr = lock->next;
+      free(lock->key);
+      free(lock);
+      return;
+    }
+  }
+}
+
+static int can_grant(lock_t * lock, unsigned long ticket)
+{
+  lock_t *other;
+  int i;
+
+  if (lock->held)
+    return 0;
+
+  if (lock != &global_lock) {
+    return !global_lock.held &&
+        (!global_lock.waiters || global_lock.waiters->ticket > ticket);
+  }
+
+  if (graph_locks_held)
+    return 0;
+
+  for (i = 0; i < LOCK_TABLE_SIZE; i++) {
+    for (other = graph_locks[i]; other; other = other->next) {
+      if (other->waiters && other->waiters->ticket < ticket)
+        return 0;
+    }
+  }
+
+  return 1;
+}
+
+static void mark_held(lock_t * lock, int held)
+{
+  lock->held = held;
+  if (lock != &global_lock)
+    graph_locks_held += held ? 1 : -1;
+}
+
+static void grant(lock_t * lock)
+{
+  lock_waiter_t *waiter = lock->waiters;
+  struct timeval now;
+  unsigned long wait_ms;
+
+  lock->waiters = waiter->next;
+  mark_held(lock, 1);
+  lock_stats.waiting--;
+  lock_stats.held++;
+
+  gettimeofday(&now, NULL);
+  wait_ms = (now.tv_sec - waiter->queued.tv_sec) * 1000 +
+      (now.tv_usec - waiter->queued.tv_usec) / 1000;
+  lock_stats.acquired++;
+  lock_stats.waited++;
+  lock_stats.total_wait_ms += wait_ms;
+  if (wait_ms > lock_stats.max_wait_ms)
+    lock_stats.max_wait_ms = wait_ms;
+
+  redstore_debug("Granted lock on %s after %lums.",
+                 lock->key ? lock->key : "the store", wait_ms);
+  waiter->func(waiter->data);
+  free(waiter);
+}
+
+static void grant_waiting(void)
+{
+  lock_t *lock;
+  int i;
+
+  if (global_lock.waiters && can_grant(&global_lock, global_lock.waiters->ticket))
+    grant(&global_lock);
+
+  for (i = 0; i < LOCK_TABLE_SIZE; i++) {
+    for (lock = graph_locks[i]; lock; lock = lock->next) {
+      if (lock->waiters && can_grant(lock, lock->waiters->ticket))
+        grant(lock);
+    }
+  }
+}
+
+
+// Returns 1 if the lock was granted straight away, 0 if the request has
+// been queued and func will be called when it is granted, or -1 on error
+int redstore_lock_acquire(librdf_node * graph, redstore_lock_func func, void *data)
+{
+  lock_t *lock = find_lock(graph_key(graph), 1);
+  lock_waiter_t *waiter, **tail;
+  unsigned long ticket = next_ticket++;
+
+  if (!lock) {
+    redstore_error("Failed to allocate memory for lock.");
+    return -1;
+  }
+
+  if (!lock->waiters && can_grant(lock, ticket)) {
+    mark_held(lock, 1);
+    lock_stats.held++;
+    lock_stats.acquired++;
+    return 1;
+  }
+
+  waiter = calloc(1, sizeof(lock_waiter_t));
+  if (!waiter) {
+    redstore_error("Failed to allocate memory for lock waiter.");
+    remove_unused_lock(lock);
+    return -1;
+  }
+  waiter->ticket = ticket;
+  waiter->func = func;
+  waiter->data = data;
+  gettimeofday(&waiter->queued, NULL);
+
+  for (tail = &lock->waiters; *tail; tail = &(*tail)->next);
+  *tail = waiter;
+  lock_stats.waiting++;
+
+  redstore_debug("Waiting for lock on %s.", lock->key ? lock->key : "the store");
+
+  return 0;
+}
+
+void redstore_lock_release(librdf_node * graph)
+{
+  lock_t *lock = find_lock(graph_key(graph), 0);
+
+  if (!lock || !lock->held) {
+    redstore_error("Attempted to release a lock that is not held.");
+    return;
+  }
+
+  mark_held(lock, 0);
+  lock_stats.held--;
+  remove_unused_lock(lock);
+
+  grant_waiting();
+}
+
+void redstore_lock_get_stats(redstore_lock_stats_t * stats)
+{
+  *stats = lock_stats;
+}
@@ -0,0 +1,414 @@
+/*
+    RedStore - a lightweight RDF triplestore powered by Redland
+    Copyright (C) 2010-2011 Nicholas J Humfrey <njh@aelius.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Content negotiation tables
+
+  For each list of syntax descriptions (serialisers, query results formats
+  and parsers) a hash table from MIME type to the descriptions offering it
+  is built once, so that choosing a format for an Accept header is a
+  lookup per Accept entry, rather than a scan of every MIME type of every
+  description.
+
+  Clients tend to send the same few Accept headers over and over again, so
+  the result of each negotiation is also kept in a small LRU cache, keyed
+  on the raw Accept header and what it was negotiated against.
+
+  The choice made is the same as comparing every pair in turn: the highest
+  product of the server and client q values wins, and a tie goes to the
+  description that comes first.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "redstore.h"
+
+#define TABLE_SLOT_COUNT    (128)
+#define MAX_TABLE_COUNT     (8)
+#define CACHE_SLOT_COUNT    (128)
+#define CACHE_SIZE          (64)
+
+
+typedef struct mime_entry_s {
+  const char *mime_type;
+  uint32_t hash;
+  int q;
+  unsigned int ordinal;
+  const raptor_syntax_description *desc;
+  struct mime_entry_s *next;
+} mime_entry_t;
+
+typedef struct {
+  description_proc_t desc_proc;
+  mime_entry_t *slots[TABLE_SLOT_COUNT];
+  mime_entry_t *first;
+  mime_entry_t *best;
+} mime_table_t;
+
+typedef struct cache_entry_s {
+  uint32_t hash;
+  char *accept;
+  mime_table_t *table;
+  char *supported;
+
+  const raptor_syntax_description *desc;
+  const char *mime_type;
+  char *chosen;
+
+  struct cache_entry_s *next_in_slot;
+  struct cache_entry_s *newer;
+  struct cache_entry_s *older;
+} cache_entry_t;
+
+
+static mime_table_t tables[MAX_TABLE_COUNT];
+static int table_count = 0;
+
+static cache_entry_t *cache_slots[CACHE_SLOT_COUNT];
+static cache_entry_t *cache_newest = NULL;
+static cache_entry_t *cache_oldest = NULL;
+static int cache_count = 0;
+static unsigned long cache_hits = 0;
+static unsigned long cache_misses = 0;
+
+
+static uint32_t hash_string(const char *str)
+{
+  return redstore_hash_bytes((const unsigned char *) str, strlen(str));
+}
+
+static void free_table(mime_table_t * table)
+{
+  unsigned int i;
+
+  for (i = 0; i < TABLE_SLOT_COUNT; i++) {
+    while (table->slots[i]) {
+      mime_entry_t *entry = table->slots[i];
+      table->slots[i] = entry->next;
+      free(entry);
+    }
+  }
+  table->desc_proc = NULL;
+  table->first = NULL;
+  table->best = NULL;
+}
+
+static mime_table_t *get_table(description_proc_t desc_proc)
+{
+  mime_table_t *table = NULL;
+  unsigned int d, m, ordinal = 0;
+  int i;
+
+  for (i = 0; i < table_count; i++) {
+    if (tables[i].desc_proc == desc_proc)
+      return &tables[i];
+  }
+
+  if (table_count >= MAX_TABLE_COUNT)
+    return NULL;
+
+  table = &tables[table_count];
+  memset(table, 0, sizeof(mime_table_t));
+  table->desc_proc = desc_proc;
+
+  for (d = 0; 1; d++) {
+    const raptor_syntax_description *desc = desc_proc(world, d);
+    if (!desc)
+      break;
+
+    for (m = 0; m < desc->mime_types_count; m++) {
+      mime_entry_t *entry, **tail;
+
+      entry = calloc(1, sizeof(mime_entry_t));
+      if (!entry) {
+        redstore_error("Failed to allocate memory for content negotiation table.");
+        free_table(table);
+        return NULL;
+      }
+
+      entry->mime_type = desc->mime_types[m].mime_type;
+      entry->hash = hash_string(entry->mime_type);
+      entry->q = desc->mime_types[m].q;
+      entry->ordinal = ordinal++;
+      entry->desc = desc;
+
+      // Keep each chain in description order
+      for (tail = &table->slots[entry->hash % TABLE_SLOT_COUNT]; *tail; tail = &(*tail)->next);
+      *tail = entry;
+
+      // The first of the highest quality formats is chosen for */*
+      if (!table->first)
+        table->first = entry;
+      if (!table->best || entry->q > table->best->q)
+        table->best = entry;
+    }
+  }
+
+  table_count++;
+
+  return table;
+}
+
+static void consider(mime_entry_t * entry, int accept_q, int *best_score, mime_entry_t ** best)
+{
+  int score = entry->q * accept_q;
+
+  if (score > *best_score || (score == *best_score && *best && entry->ordinal < (*best)->ordinal)) {
+    *best_score = score;
+    *best = entry;
+  }
+}
+
+static mime_entry_t *choose_from_table(mime_table_t * table, const char *accept_str)
+{
+  redhttp_negotiate_t *accept = redhttp_negotiate_parse(accept_str);
+  mime_entry_t *best = NULL;
+  int best_score = -1;
+  const char *accept_type = NULL;
+  int accept_q = 0;
+  int a;
+
+  if (!accept)
+    return NULL;
+
+  for (a = 0; redhttp_negotiate_get(&accept, a, &accept_type, &accept_q) == 0; a++) {
+    if (strcmp(accept_type, "*/*") == 0) {
+      // With q=0 every format scores the same, so the first one wins
+      mime_entry_t *any = accept_q ? table->best : table->first;
+      if (any)
+        consider(any, accept_q, &best_score, &best);
+    } else {
+      uint32_t hash = hash_string(accept_type);
+      mime_entry_t *entry;
+
+      for (entry = table->slots[hash % TABLE_SLOT_COUNT]; entry; entry = entry->next) {
+        if (entry->hash == hash && strcmp(entry->mime_type, accept_type) == 0)
+          consider(entry, accept_q, &best_score, &best);
+      }
+    }
+  }
+
+  redhttp_negotiate_free(&accept);
+
+  return best;
+}
+
+
+static void cache_unlink(cache_entry_t * entry)
+{
+  if (entry->newer)
+    entry->newer->older = entry->older;
+  else
+    cache_newest = entry->older;
+
+  if (entry->older)
+    entry->older->newer = entry->newer;
+  else
+    cache_oldest = entry->newer;
+
+  entry->newer = entry->older = NULL;
+}
+
+static void cache_push(cache_entry_t * entry)
+{
+  entry->older = cache_newest;
+  entry->newer = NULL;
+  if (cache_newest)
+    cache_newest->newer = entry;
+  cache_newest = entry;
+  if (!cache_oldest)
+    cache_oldest = entry;
+}
+
+static void cache_entry_free(cache_entry_t * entry)
+{
+  if (entry->accept)
+    free(entry->accept);
+  if (entry->supported)
+    free(entry->supported);
+  if (entry->chosen)
+    free(entry->chosen);
+  free(entry);
+}
+
+static void cache_evict_oldest(void)
+{
+  cache_entry_t *entry = cache_oldest;
+  cache_entry_t **ptr;
+
+  if (!entry)
+    return;
+
+  for (ptr = &cache_slots[entry->hash % CACHE_SLOT_COUNT]; *ptr; ptr = &(*ptr)->next_in_slot) {
+    if (*ptr == entry) {
+      *ptr = entry->next_in_slot;
+      break;
+    }
+  }
+
+  cache_unlink(entry);
+  cache_entry_free(entry);
+  cache_count--;
+}
+
+static cache_entry_t *cache_lookup(mime_table_t * table, const char *supported, const char *accept,
+                                   uint32_t hash)
+{
+  cache_entry_t *entry;
+
+  for (entry = cache_slots[hash % CACHE_SLOT_COUNT]; entry; entry = entry->next_in_slot) {
+    if (entry->hash != hash || entry->table != table || strcmp(entry->accept, accept) != 0)
+      continue;
+    if (supported && (!entry->supported || strcmp(entry->supported, supported) != 0))
+      continue;
+
+    cache_unlink(entry);
+    cache_push(entry);
+    cache_hits++;
+    return entry;
+  }
+
+  cache_misses++;
+  return NULL;
+}
+
+static cache_entry_t *cache_insert(mime_table_t * table, const char *supported, const char *accept,
+                                   uint32_t hash)
+{
+  cache_entry_t *entry = calloc(1, sizeof(cache_entry_t));
+
+  if (!entry)
+    return NULL;
+
+  entry->hash = hash;
+  entry->table = table;
+  entry->accept = strdup(accept);
+  if (supported)
+    entry->supported = strdup(supported);
+  if (!entry->accept || (supported && !entry->supported)) {
+    cache_entry_free(entry);
+    return NULL;
+  }
+
+  if (cache_count >= CACHE_SIZE)
+    cache_evict_oldest();
+
+  entry->next_in_slot = cache_slots[hash % CACHE_SLOT_COUNT];
+  cache_slots[hash % CACHE_SLOT_COUNT] = entry;
+  cache_push(entry);
+  cache_count++;
+
+  return entry;
+}
+
+
+int redstore_negotiate_init(void)
+{
+  if (!get_table(librdf_serializer_get_description) ||
+      !get_table(redstore_results_formats_get_description) ||
+      !get_table(librdf_parser_get_description)) {
+    redstore_error("Failed to build content negotiation tables.");
+    return -1;
+  }
+
+  return 0;
+}
+
+// Chooses the description which best matches an Accept header
+const raptor_syntax_description *redstore_negotiate_accept(description_proc_t desc_proc,
+                                                           const char *accept_str,
+                                                           const char **chosen_mime)
+{
+  mime_table_t *table = get_table(desc_proc);
+  uint32_t hash = hash_string(accept_str);
+  cache_entry_t *entry = NULL;
+  mime_entry_t *best = NULL;
+
+  if (!table)
+    return NULL;
+
+  entry = cache_lookup(table, NULL, accept_str, hash);
+  if (!entry) {
+    best = choose_from_table(table, accept_str);
+    entry = cache_insert(table, NULL, accept_str, hash);
+    if (!entry) {
+      if (best && chosen_mime)
+        *chosen_mime = best->mime_type;
+      return best ? best->desc : NULL;
+    }
+    if (best) {
+      entry->desc = best->desc;
+      entry->mime_type = best->mime_type;
+    }
+  }
+
+  if (entry->desc && chosen_mime)
+    *chosen_mime = entry->mime_type;
+
+  return entry->desc;
+}
+
+// Chooses the type in a list of supported types which best matches an
+// Accept header; returns a newly allocated string or NULL
+char *redstore_negotiate_accept_string(const char *supported_str, const char *accept_str)
+{
+  uint32_t hash = hash_string(accept_str);
+  cache_entry_t *entry = NULL;
+  char *chosen = NULL;
+
+  entry = cache_lookup(NULL, supported_str, accept_str, hash);
+  if (!entry) {
+    redhttp_negotiate_t *accept = redhttp_negotiate_parse(accept_str);
+    redhttp_negotiate_t *supported = redhttp_negotiate_parse(supported_str);
+    chosen = redhttp_negotiate_choose(&supported, &accept);
+    redhttp_negotiate_free(&accept);
+    redhttp_negotiate_free(&supported);
+
+    entry = cache_insert(NULL, supported_str, accept_str, hash);
+    if (!entry)
+      return chosen;
+    entry->chosen = chosen;
+  }
+
+  return entry->chosen ? strdup(entry->chosen) : NULL;
+}
+
+void redstore_negotiate_get_stats(unsigned long *hits, unsigned long *misses)
+{
+  if (hits)
+    *hits = cache_hits;
+  if (misses)
+    *misses = cache_misses;
+}
+
+void redstore_negotiate_free(void)
+{
+  int i;
+
+  while (cache_oldest)
+    cache_evict_oldest();
+
+  for (i = 0; i < table_count; i++)
+    free_table(&tables[i]);
+  table_count = 0;
+  cache_hits = 0;
+  cache_misses = 0;
+}
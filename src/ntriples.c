@@ -0,0 +1,204 @@
+/*
+    RedStore - a lightweight RDF triplestore powered by Redland
+    Copyright (C) 2010-2011 Nicholas J Humfrey <njh@aelius.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  N-Triples and N-Quads writer
+
+  Line based formats need no namespace handling or pretty printing, so
+  statements are formatted straight into a buffer, without creating a
+  librdf serialiser. This is used for dumps of the store and whenever
+  content negotiation picks N-Triples or N-Quads for graph output.
+
+  Terms are escaped as in RDF 1.1 N-Triples: UTF-8 is written as it is,
+  and only characters which are not allowed are escaped.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "redstore.h"
+
+#define OUTPUT_FLUSH_SIZE   (256 * 1024)
+#define OUTPUT_KEEP_SIZE    (4 * 1024 * 1024)
+
+
+static redstore_buffer_t output = { NULL, 0, 0 };
+static const char hex_digits[] = "0123456789ABCDEF";
+
+
+static int append_escaped(redstore_buffer_t * buffer, const unsigned char *str, size_t len,
+                          int is_uri)
+{
+  unsigned char *out;
+  size_t i;
+
+  // Reserve enough for every character to be escaped as \uXXXX
+  if (redstore_buffer_reserve(buffer, len * 6))
+    return -1;
+
+  out = &buffer->data[buffer->length];
+  for (i = 0; i < len; i++) {
+    unsigned char c = str[i];
+    char escape = 0;
+
+    if (!is_uri) {
+      switch (c) {
+      case '\\':
+        escape = '\\';
+        break;
+      case '"':
+        escape = '"';
+        break;
+      case '\n':
+        escape = 'n';
+        break;
+      case '\r':
+        escape = 'r';
+        break;
+      case '\t':
+        escape = 't';
+        break;
+      }
+    }
+
+    if (escape) {
+      *out++ = '\\';
+      *out++ = escape;
+    } else if (c < 0x20 || (is_uri && (c == ' ' || strchr("<>\"{}|^`\\", c)))) {
+      *out++ = '\\';
+      *out++ = 'u';
+      *out++ = '0';
+      *out++ = '0';
+      *out++ = hex_digits[c >> 4];
+      *out++ = hex_digits[c & 0x0F];
+    } else {
+      *out++ = c;
+    }
+  }
+  buffer->length = out - buffer->data;
+
+  return 0;
+}
+
+static int append_uri(redstore_buffer_t * buffer, librdf_uri * uri)
+{
+  size_t len;
+  const unsigned char *str = librdf_uri_as_counted_string(uri, &len);
+
+  return redstore_buffer_append_byte(buffer, '<') ||
+      append_escaped(buffer, str, len, 1) || redstore_buffer_append_byte(buffer, '>');
+}
+
+int redstore_ntriples_append_node(redstore_buffer_t * buffer, librdf_node * node)
+{
+  const unsigned char *str;
+  size_t len;
+  int err = 0;
+
+  if (librdf_node_is_resource(node)) {
+    err |= append_uri(buffer, librdf_node_get_uri(node));
+  } else if (librdf_node_is_blank(node)) {
+    str = librdf_node_get_counted_blank_identifier(node, &len);
+    err |= redstore_buffer_append(buffer, "_:", 2);
+    err |= redstore_buffer_append(buffer, str, len);
+  } else if (librdf_node_is_literal(node)) {
+    const char *lang = librdf_node_get_literal_value_language(node);
+    librdf_uri *datatype = librdf_node_get_literal_value_datatype_uri(node);
+
+    str = librdf_node_get_literal_value_as_counted_string(node, &len);
+    err |= redstore_buffer_append_byte(buffer, '"');
+    err |= append_escaped(buffer, str, len, 0);
+    err |= redstore_buffer_append_byte(buffer, '"');
+    if (datatype) {
+      err |= redstore_buffer_append(buffer, "^^", 2);
+      err |= append_uri(buffer, datatype);
+    } else if (lang && *lang) {
+      err |= redstore_buffer_append_byte(buffer, '@');
+      err |= redstore_buffer_append(buffer, lang, strlen(lang));
+    }
+  }
+
+  return err;
+}
+
+// Append a statement as a line of N-Triples, or N-Quads if graph is set
+int redstore_ntriples_append_statement(redstore_buffer_t * buffer, librdf_statement * statement,
+                                       librdf_node * graph)
+{
+  int err = 0;
+
+  err |= redstore_ntriples_append_node(buffer, librdf_statement_get_subject(statement));
+  err |= redstore_buffer_append_byte(buffer, ' ');
+  err |= redstore_ntriples_append_node(buffer, librdf_statement_get_predicate(statement));
+  err |= redstore_buffer_append_byte(buffer, ' ');
+  err |= redstore_ntriples_append_node(buffer, librdf_statement_get_object(statement));
+  if (graph) {
+    err |= redstore_buffer_append_byte(buffer, ' ');
+    err |= redstore_ntriples_append_node(buffer, graph);
+  }
+  err |= redstore_buffer_append(buffer, " .\n", 3);
+
+  return err;
+}
+
+// Write a stream to a file as N-Triples, or as N-Quads using the context
+// of each statement. Returns the number of statements written, or -1.
+long redstore_ntriples_write_stream(FILE * file, librdf_stream * stream, int quads)
+{
+  long count = 0;
+  int err = 0;
+
+  redstore_buffer_reset(&output);
+
+  while (!err && !librdf_stream_end(stream)) {
+    librdf_statement *statement = librdf_stream_get_object(stream);
+    if (!statement) {
+      redstore_error("librdf_stream_get_object returned NULL while writing N-Triples");
+      err = 1;
+      break;
+    }
+
+    err |= redstore_ntriples_append_statement(&output, statement,
+                                              quads ? librdf_stream_get_context2(stream) : NULL);
+
+    if (output.length >= OUTPUT_FLUSH_SIZE) {
+      if (fwrite(output.data, 1, output.length, file) != output.length)
+        err = 1;
+      redstore_buffer_reset(&output);
+    }
+
+    count++;
+    librdf_stream_next(stream);
+  }
+
+  if (!err && output.length && fwrite(output.data, 1, output.length, file) != output.length)
+    err = 1;
+  redstore_buffer_reset(&output);
+
+  // Don't hold on to the memory used by a huge literal
+  if (output.size > OUTPUT_KEEP_SIZE)
+    redstore_buffer_free(&output);
+
+  return err ? -1 : count;
+}
+
+void redstore_ntriples_free(void)
+{
+  redstore_buffer_free(&output);
+}
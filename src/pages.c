@@ -31,6 +31,14 @@ typedef struct redstore_page_s {
   raptor_iostream *iostream;
 } redstore_page_t;
 
+#define ASSET_CACHE_CONTROL   "public, max-age=3600"
+
+static redstore_asset_t home_page;
+static redstore_asset_t query_form_page;
+static redstore_asset_t insert_form_page;
+static redstore_asset_t delete_form_page;
+static redstore_asset_t load_form_page;
+
 redhttp_response_t *redstore_page_new(int code, const char *title)
 {
   raptor_world *raptor = librdf_world_get_raptor(world);
@@ -204,10 +212,9 @@ void redstore_page_end(redhttp_response_t * response)
   free(page);
 }
 
-redhttp_response_t *handle_page_home(redhttp_request_t * request, void *user_data)
+static redhttp_response_t *render_page_home(void)
 {
   redhttp_response_t *response = redstore_page_new(REDHTTP_OK, "RedStore");
-  redhttp_response_add_header(response, "Last-Modified", BUILD_TIME);
   redstore_page_append_string(response, "<ul>\n");
   redstore_page_append_string(response, "  <li><a href=\"/query\">Query Form</a></li>\n");
   redstore_page_append_string(response, "  <li><a href=\"/graphs\">List Named Graphs</a></li>\n");
@@ -226,15 +233,61 @@ redhttp_response_t *handle_page_home(redhttp_request_t * request, void *user_dat
   return response;
 }
 
-redhttp_response_t *handle_page_robots_txt(redhttp_request_t * request, void *user_data)
+void redstore_asset_set(redstore_asset_t * asset, const char *content_type, const char *content, size_t length)
 {
-  redhttp_response_t *response = redhttp_response_new_with_type(REDHTTP_OK, NULL, "text/plain");
-  static const char text[] = "User-agent: *\nDisallow: /\n";
+  asset->content_type = content_type;
+  asset->content = content;
+  asset->length = length;
+  asset->owned = 0;
+  snprintf(asset->etag, sizeof(asset->etag), "\"%08x\"",
+           (unsigned int) redstore_hash_bytes((const unsigned char *) content, length));
+}
+
+void redstore_asset_free(redstore_asset_t * asset)
+{
+  if (asset->owned && asset->content)
+    free((char *) asset->content);
+  memset(asset, 0, sizeof(redstore_asset_t));
+}
+
+// Sends a page or image that never changes while the server is running,
+// or 304 Not Modified if the client already has it
+redhttp_response_t *redstore_asset_response(redhttp_request_t * request, redstore_asset_t * asset)
+{
+  const char *if_none_match = redhttp_request_get_header(request, "If-None-Match");
+  redhttp_response_t *response = NULL;
+
+  if (!asset->content) {
+    return redstore_page_new_with_message(
+      request, LIBRDF_LOG_ERROR, REDHTTP_INTERNAL_SERVER_ERROR, "Page has not been rendered."
+    );
+  }
+
+  if (if_none_match && (strcmp(if_none_match, "*") == 0 || strstr(if_none_match, asset->etag))) {
+    response = redhttp_response_new(REDHTTP_NOT_MODIFIED, NULL);
+  } else {
+    response = redhttp_response_new_with_type(REDHTTP_OK, NULL, asset->content_type);
+    redhttp_response_set_content(response, (char *) asset->content, asset->length, NULL);
+  }
+
+  redhttp_response_add_header(response, "ETag", asset->etag);
+  redhttp_response_add_header(response, "Cache-Control", ASSET_CACHE_CONTROL);
   redhttp_response_add_header(response, "Last-Modified", BUILD_TIME);
-  redhttp_response_set_content(response, (char*)text, sizeof(text)-1, NULL);
+
   return response;
 }
 
+redhttp_response_t *handle_page_robots_txt(redhttp_request_t * request, void *user_data)
+{
+  static const char text[] = "User-agent: *\nDisallow: /\n";
+  static redstore_asset_t robots_txt;
+
+  if (!robots_txt.content)
+    redstore_asset_set(&robots_txt, "text/plain", text, sizeof(text)-1);
+
+  return redstore_asset_response(request, &robots_txt);
+}
+
 
 static void syntax_select_list(const char *field_name, const char *default_name,
                                description_proc_t desc_proc, redhttp_response_t * response)
@@ -266,12 +319,11 @@ static void syntax_select_list(const char *field_name, const char *default_name,
 
 
 
-redhttp_response_t *handle_page_query_form(redhttp_request_t * request, void *user_data)
+static redhttp_response_t *render_page_query_form(void)
 {
   redhttp_response_t *response = NULL;
 
   response = redstore_page_new(REDHTTP_OK, "Query Form");
-  redhttp_response_add_header(response, "Last-Modified", BUILD_TIME);
   redstore_page_append_string(response, "<form action=\"./query\" method=\"get\">\n");
   redstore_page_append_string(response, "<div><textarea name=\"query\" cols=\"80\" rows=\"18\">\n");
   redstore_page_append_string(response,
@@ -290,7 +342,7 @@ redhttp_response_t *handle_page_query_form(redhttp_request_t * request, void *us
   redstore_page_append_string(response, "<select name=\"format\">\n");
 
   redstore_page_append_string(response, "<optgroup label=\"Query Results Formats\">\n");
-  syntax_select_list(NULL, "html", librdf_query_results_formats_get_description, response);
+  syntax_select_list(NULL, "html", redstore_results_formats_get_description, response);
   redstore_page_append_string(response, "</optgroup>\n");
 
   redstore_page_append_string(response, "<optgroup label=\"RDF Formats\">\n");
@@ -308,13 +360,9 @@ redhttp_response_t *handle_page_query_form(redhttp_request_t * request, void *us
   return response;
 }
 
-redhttp_response_t *handle_page_update_form(redhttp_request_t * request, void *user_data)
+static redhttp_response_t *render_page_update_form(const char *title, const char *action)
 {
-  const char *title = (char *) user_data;
-  const char *action = redhttp_request_get_path(request);
-
   redhttp_response_t *response = redstore_page_new(REDHTTP_OK, title);
-  redhttp_response_add_header(response, "Last-Modified", BUILD_TIME);
   redstore_page_append_strings(response, "<form method=\"post\" action=\"", action, "\">\n", NULL);
   redstore_page_append_string(response,
                               "<div><textarea name=\"content\" cols=\"80\" rows=\"18\">\n");
@@ -336,10 +384,9 @@ redhttp_response_t *handle_page_update_form(redhttp_request_t * request, void *u
 }
 
 
-redhttp_response_t *handle_page_load_form(redhttp_request_t * request, void *user_data)
+static redhttp_response_t *render_page_load_form(void)
 {
   redhttp_response_t *response = redstore_page_new(REDHTTP_OK, "Load URI");
-  redhttp_response_add_header(response, "Last-Modified", BUILD_TIME);
   redstore_page_append_string(response, "<form method=\"post\" action=\"/load\"><div>\n"
                               "<label for=\"uri\">URI:</label> <input id=\"uri\" name=\"uri\" type=\"text\" size=\"40\" /><br />\n"
                               "<label for=\"graph\">Graph:</label> <input id=\"graph\" name=\"graph\" type=\"text\" size=\"40\" /> <i>(optional)</i><br />\n"
@@ -351,3 +398,77 @@ redhttp_response_t *handle_page_load_form(redhttp_request_t * request, void *use
 
   return response;
 }
+
+
+// Takes ownership of the content of a rendered page
+static int asset_from_page(redstore_asset_t * asset, redhttp_response_t * response)
+{
+  char *content;
+  int length;
+
+  if (!response)
+    return -1;
+
+  content = redhttp_response_get_content_buffer(response);
+  length = redhttp_response_get_content_length(response);
+  if (!content || length <= 0) {
+    redhttp_response_free(response);
+    return -1;
+  }
+
+  redhttp_response_set_content(response, content, length, NULL);
+  redhttp_response_free(response);
+
+  redstore_asset_set(asset, "text/html", content, length);
+  asset->owned = 1;
+
+  return 0;
+}
+
+int redstore_pages_init(void)
+{
+  if (asset_from_page(&home_page, render_page_home()) ||
+      asset_from_page(&query_form_page, render_page_query_form()) ||
+      asset_from_page(&insert_form_page, render_page_update_form("Insert Triples", "/insert")) ||
+      asset_from_page(&delete_form_page, render_page_update_form("Delete Triples", "/delete")) ||
+      asset_from_page(&load_form_page, render_page_load_form())) {
+    redstore_error("Failed to render static pages.");
+    return -1;
+  }
+
+  return 0;
+}
+
+void redstore_pages_free(void)
+{
+  redstore_asset_free(&home_page);
+  redstore_asset_free(&query_form_page);
+  redstore_asset_free(&insert_form_page);
+  redstore_asset_free(&delete_form_page);
+  redstore_asset_free(&load_form_page);
+}
+
+redhttp_response_t *handle_page_home(redhttp_request_t * request, void *user_data)
+{
+  return redstore_asset_response(request, &home_page);
+}
+
+redhttp_response_t *handle_page_query_form(redhttp_request_t * request, void *user_data)
+{
+  return redstore_asset_response(request, &query_form_page);
+}
+
+redhttp_response_t *handle_page_update_form(redhttp_request_t * request, void *user_data)
+{
+  const char *path = redhttp_request_get_path(request);
+
+  if (path && strcmp(path, "/delete") == 0)
+    return redstore_asset_response(request, &delete_form_page);
+  else
+    return redstore_asset_response(request, &insert_form_page);
+}
+
+redhttp_response_t *handle_page_load_form(redhttp_request_t * request, void *user_data)
+{
+  return redstore_asset_response(request, &load_form_page);
+}
@@ -19,21 +19,82 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
 
 #include "redstore.h"
 
-static redhttp_response_t *perform_query(redhttp_request_t * request, const char *query_string)
+#define DEFAULT_ANALYTIC_COST   (0)
+
+
+// How a query can be answered by a sharded store
+typedef enum {
+  SHARDED_QUERY_MERGE,          // run against every shard and concatenate the results
+  SHARDED_QUERY_ROUTE,          // run against the one shard that holds everything it needs
+  SHARDED_QUERY_COPY            // needs statements or results from several shards at once
+} sharded_query_kind_t;
+
+typedef struct {
+  const char *lang;
+  const char *query_string;
+} sharded_query_t;
+
+
+static int count_keyword(const char *str, const char *keyword)
+{
+  size_t len = strlen(keyword);
+  char prev = ' ';
+  int count = 0;
+
+  for (; *str; prev = *str, str++) {
+    if (isalnum((unsigned char) prev) || prev == '?' || prev == '$' || prev == ':')
+      continue;
+    if (strncasecmp(str, keyword, len) == 0 && !isalnum((unsigned char) str[len])) {
+      count++;
+      str += len - 1;
+    }
+  }
+
+  return count;
+}
+
+// Rough estimate of how expensive a query is to run, based on its text
+int redstore_estimate_query_cost(const char *query_string)
+{
+  const char *ptr;
+  int cost = 1;
+
+  // Each variable reference is likely to mean another join
+  for (ptr = query_string; *ptr; ptr++) {
+    if ((*ptr == '?' || *ptr == '$') && isalpha((unsigned char) ptr[1]))
+      cost++;
+  }
+
+  cost += 5 * count_keyword(query_string, "OPTIONAL");
+  cost += 5 * count_keyword(query_string, "UNION");
+  cost += 10 * count_keyword(query_string, "DISTINCT");
+  cost += 10 * count_keyword(query_string, "ORDER");
+  cost += 10 * count_keyword(query_string, "GROUP");
+  cost += 10 * count_keyword(query_string, "REGEX");
+
+  // Unbounded results have to be written out in full
+  if (count_keyword(query_string, "LIMIT") == 0)
+    cost += 20;
+
+  return cost;
+}
+
+
+static redhttp_response_t *execute_model_query(redhttp_request_t * request, librdf_model * target,
+                                               const char *lang, const char *query_string)
 {
   librdf_query *query = NULL;
   librdf_query_results *results = NULL;
   redhttp_response_t *response = NULL;
-  const char *lang = redhttp_request_get_argument(request, "lang");
-
-  if (lang == NULL)
-    lang = DEFAULT_QUERY_LANGUAGE;
-
-  redstore_debug("query_lang='%s'", lang);
-  redstore_debug("query_string='%s'", query_string);
 
   query = librdf_new_query(world, lang, NULL, (unsigned char *) query_string, NULL);
   if (!query) {
@@ -44,7 +105,7 @@ static redhttp_response_t *perform_query(redhttp_request_t * request, const char
     goto CLEANUP;
   }
 
-  results = librdf_model_query_execute(model, query);
+  results = librdf_model_query_execute(target, query);
   if (!results) {
     response = redstore_page_new_with_message(
       request, LIBRDF_LOG_INFO, REDHTTP_INTERNAL_SERVER_ERROR,
@@ -90,6 +151,529 @@ CLEANUP:
 }
 
 
+static int find_aggregate(void *user_data, rasqal_expression * expression)
+{
+  switch (expression->op) {
+  case RASQAL_EXPR_COUNT:
+  case RASQAL_EXPR_SUM:
+  case RASQAL_EXPR_AVG:
+  case RASQAL_EXPR_MIN:
+  case RASQAL_EXPR_MAX:
+  case RASQAL_EXPR_SAMPLE:
+  case RASQAL_EXPR_GROUP_CONCAT:
+    *(int *) user_data = 1;
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+static int has_aggregate(rasqal_query * query)
+{
+  raptor_sequence *variables = rasqal_query_get_bound_variable_sequence(query);
+  int found = 0;
+  int i;
+
+  for (i = 0; variables && i < raptor_sequence_size(variables) && !found; i++) {
+    rasqal_variable *variable = (rasqal_variable *) raptor_sequence_get_at(variables, i);
+    if (variable->expression)
+      rasqal_expression_visit(variable->expression, find_aggregate, &found);
+  }
+
+  return found;
+}
+
+static int sequence_size(raptor_sequence * sequence)
+{
+  return sequence ? raptor_sequence_size(sequence) : 0;
+}
+
+// Each shard only sees its own statements, so a query can only be split
+// between them if every solution comes from a single statement, and the
+// solutions from each shard can simply be concatenated. Otherwise, the
+// query is sent to a single shard if all of its triple patterns are in
+// the same named graph, or is run against a copy of the whole store.
+// The reason it can't be split is given for the log.
+static sharded_query_kind_t classify_sharded_query(const char *lang, const char *query_string,
+                                                   librdf_model ** target, const char **reason)
+{
+  rasqal_world *rasqal = librdf_world_get_rasqal(world);
+  rasqal_query *query = NULL;
+  rasqal_triple *triple = NULL;
+  raptor_uri *graph_uri = NULL;
+  sharded_query_kind_t kind = SHARDED_QUERY_COPY;
+  int same_graph = 1;
+  int i;
+
+  // librdf parses the query with rasqal too, so a query which can't be
+  // parsed here goes to one shard, to be reported in the usual way
+  *target = redstore_shard_model(0);
+  query = rasqal_new_query(rasqal, lang, NULL);
+  if (!query || rasqal_query_prepare(query, (const unsigned char *) query_string, NULL)) {
+    kind = SHARDED_QUERY_ROUTE;
+    goto CLEANUP;
+  }
+
+  for (i = 0; (triple = rasqal_query_get_triple(query, i)); i++) {
+    rasqal_literal *origin = triple->origin;
+
+    if (!origin || origin->type != RASQAL_LITERAL_URI) {
+      same_graph = 0;
+    } else if (!graph_uri) {
+      graph_uri = origin->value.uri;
+    } else if (!raptor_uri_equals(graph_uri, origin->value.uri)) {
+      same_graph = 0;
+    }
+  }
+
+  if (i == 0) {
+    kind = SHARDED_QUERY_ROUTE;
+    goto CLEANUP;
+  }
+
+  if (same_graph && graph_uri) {
+    librdf_node *graph = librdf_new_node_from_uri_string(world, raptor_uri_as_string(graph_uri));
+    if (graph) {
+      *target = redstore_graph_model(graph);
+      librdf_free_node(graph);
+      kind = SHARDED_QUERY_ROUTE;
+      goto CLEANUP;
+    }
+  }
+
+  if (i > 1) {
+    *reason = "The query joins triple patterns outside a single GRAPH <uri>.";
+  } else if (sequence_size(rasqal_query_get_order_conditions_sequence(query)) ||
+             rasqal_query_get_limit(query) >= 0 || rasqal_query_get_offset(query) >= 0) {
+    *reason = "The query uses ORDER BY, LIMIT or OFFSET outside a single GRAPH <uri>.";
+  } else if (rasqal_query_get_distinct(query) == 1) {
+    *reason = "The query uses DISTINCT outside a single GRAPH <uri>.";
+  } else if (sequence_size(rasqal_query_get_group_conditions_sequence(query)) ||
+             sequence_size(rasqal_query_get_having_conditions_sequence(query)) ||
+             has_aggregate(query)) {
+    *reason = "The query uses aggregates outside a single GRAPH <uri>.";
+  } else {
+    kind = SHARDED_QUERY_MERGE;
+  }
+
+CLEANUP:
+  if (query)
+    rasqal_free_query(query);
+
+  return kind;
+}
+
+// Write the rows of the results from one shard
+static int write_shard_rows(FILE * file, const redstore_results_writer_t * writer, int shard,
+                            sharded_query_t * sharded, unsigned long *count)
+{
+  librdf_query *query = NULL;
+  librdf_query_results *results = NULL;
+  int err = -1;
+
+  query = librdf_new_query(world, sharded->lang, NULL, (unsigned char *) sharded->query_string, NULL);
+  if (query)
+    results = librdf_model_query_execute(redstore_shard_model(shard), query);
+
+  if (results) {
+    err = writer->rows(file, results, count);
+    librdf_free_query_results(results);
+  } else {
+    redstore_error("Failed to run query against shard %d.", shard);
+  }
+  if (query)
+    librdf_free_query(query);
+
+  return err;
+}
+
+// Worker process: write the rows from one shard into a temporary file and exit
+static void shard_worker(FILE * file, const redstore_results_writer_t * writer, int shard,
+                         sharded_query_t * sharded)
+{
+  unsigned long count = 0;
+  int err = write_shard_rows(file, writer, shard, sharded, &count);
+
+  if (fflush(file))
+    err = -1;
+
+  _exit(err ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+// Write the rows from every shard, in order. With in-memory storage, the
+// other shards are each queried by a worker process while the rows from
+// the first shard are written here; otherwise they are queried in turn.
+static int merge_shard_rows(FILE * socket, const redstore_results_writer_t * writer,
+                            librdf_query_results * results, void *data)
+{
+  sharded_query_t *sharded = (sharded_query_t *) data;
+  int count = redstore_shard_count();
+  unsigned long rows = 0;
+  FILE **files = NULL;
+  pid_t *pids = NULL;
+  int i, err = 0;
+
+  files = calloc(count, sizeof(FILE *));
+  pids = calloc(count, sizeof(pid_t));
+  if (!files || !pids) {
+    redstore_error("Failed to allocate memory for shard workers.");
+    err = -1;
+    goto CLEANUP;
+  }
+
+  // Any shard without a worker is queried here instead
+  for (i = 1; i < count && redstore_storage_is_in_memory(); i++) {
+    files[i] = tmpfile();
+    if (!files[i])
+      break;
+
+    pids[i] = fork();
+    if (pids[i] < 0) {
+      pids[i] = 0;
+      break;
+    } else if (pids[i] == 0) {
+      shard_worker(files[i], writer, i, sharded);
+    }
+  }
+
+  err |= writer->rows(socket, results, &rows);
+
+  for (i = 1; i < count && !err; i++) {
+    if (pids[i]) {
+      pid_t pid;
+      int status;
+
+      do {
+        pid = waitpid(pids[i], &status, 0);
+      } while (pid < 0 && errno == EINTR);
+      pids[i] = 0;
+
+      if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        redstore_error("Shard worker %d failed.", i);
+        err = -1;
+        break;
+      }
+
+      // Join the rows on to those already written
+      if (fseek(files[i], 0, SEEK_END) == 0 && ftell(files[i]) > 0) {
+        if (rows && writer->separator)
+          fputs(writer->separator, socket);
+        err |= redstore_copy_file(files[i], socket);
+        rows++;
+      }
+    } else {
+      err |= write_shard_rows(socket, writer, i, sharded, &rows);
+    }
+  }
+
+CLEANUP:
+  // Stop any workers that are still running after an error
+  for (i = 1; pids && i < count; i++) {
+    if (pids[i]) {
+      kill(pids[i], SIGKILL);
+      waitpid(pids[i], NULL, 0);
+    }
+  }
+  for (i = 1; files && i < count; i++) {
+    if (files[i])
+      fclose(files[i]);
+  }
+  if (files)
+    free(files);
+  if (pids)
+    free(pids);
+
+  return err;
+}
+
+// Copy every statement in every shard into a temporary in-memory model,
+// which a query can be run against as if the store weren't sharded
+static librdf_model *new_union_model(librdf_storage ** storage)
+{
+  librdf_model *union_model = NULL;
+  librdf_stream *stream = NULL;
+  int err = 0;
+
+  *storage = librdf_new_storage(world, "memory", NULL, "contexts='yes'");
+  if (*storage)
+    union_model = librdf_new_model(world, *storage, NULL);
+  if (union_model)
+    stream = redstore_store_as_stream();
+  if (!stream) {
+    err = 1;
+    goto CLEANUP;
+  }
+
+  for (; !err && !librdf_stream_end(stream); librdf_stream_next(stream)) {
+    librdf_statement *statement = librdf_stream_get_object(stream);
+    librdf_node *graph = librdf_stream_get_context2(stream);
+
+    if (graph) {
+      err = librdf_model_context_add_statement(union_model, graph, statement);
+    } else {
+      err = librdf_model_add_statement(union_model, statement);
+    }
+  }
+
+CLEANUP:
+  if (stream)
+    librdf_free_stream(stream);
+  if (err) {
+    redstore_error("Failed to copy the shards of the store into memory.");
+    if (union_model)
+      librdf_free_model(union_model);
+    if (*storage)
+      librdf_free_storage(*storage);
+    *storage = NULL;
+    return NULL;
+  }
+
+  return union_model;
+}
+
+// Run a query which can't be split between the shards against a copy of
+// the whole store; this takes time and memory in proportion to the size
+// of the store, but gives the same answer as an unsharded store
+static redhttp_response_t *execute_union_query(redhttp_request_t * request, const char *lang,
+                                               const char *query_string)
+{
+  librdf_storage *union_storage = NULL;
+  librdf_model *union_model = new_union_model(&union_storage);
+  redhttp_response_t *response = NULL;
+
+  if (!union_model) {
+    return redstore_page_new_with_message(
+      request, LIBRDF_LOG_ERROR, REDHTTP_INTERNAL_SERVER_ERROR,
+      "Failed to copy the store to answer the query."
+    );
+  }
+
+  response = execute_model_query(request, union_model, lang, query_string);
+  librdf_free_model(union_model);
+  librdf_free_storage(union_storage);
+
+  return response;
+}
+
+// Run the query against a sharded store. Queries whose solutions can be
+// found in each shard separately are run against every shard and the
+// results merged; queries which only use a single named graph are run
+// against the shard which holds it; and any other query is run against
+// a copy of the whole store.
+static redhttp_response_t *execute_sharded_query(redhttp_request_t * request, const char *lang,
+                                                 const char *query_string)
+{
+  sharded_query_t sharded = { lang, query_string };
+  int count = redstore_shard_count();
+  librdf_model *target = NULL;
+  librdf_query **queries = NULL;
+  librdf_query_results **results = NULL;
+  librdf_stream **streams = NULL;
+  librdf_stream *stream = NULL;
+  redhttp_response_t *response = NULL;
+  const char *reason = NULL;
+  int i;
+
+  switch (classify_sharded_query(lang, query_string, &target, &reason)) {
+  case SHARDED_QUERY_ROUTE:
+    return execute_model_query(request, target, lang, query_string);
+  case SHARDED_QUERY_COPY:
+    redstore_debug("%s Copying the store to run the query.", reason);
+    return execute_union_query(request, lang, query_string);
+  default:
+    break;
+  }
+
+  queries = calloc(count, sizeof(librdf_query *));
+  results = calloc(count, sizeof(librdf_query_results *));
+  if (!queries || !results) {
+    response = redstore_page_new_with_message(
+      request, LIBRDF_LOG_ERROR, REDHTTP_INTERNAL_SERVER_ERROR,
+      "Failed to allocate memory for query."
+    );
+    goto CLEANUP;
+  }
+
+  // The rows of a bindings query are written by merge_shard_rows(), so the
+  // other shards are only queried here for other types of results
+  for (i = 0; i < count; i++) {
+    if (i == 1 && librdf_query_results_is_bindings(results[0]))
+      break;
+
+    queries[i] = librdf_new_query(world, lang, NULL, (unsigned char *) query_string, NULL);
+    if (!queries[i]) {
+      response = redstore_page_new_with_message(
+        request, LIBRDF_LOG_ERROR, REDHTTP_INTERNAL_SERVER_ERROR,
+        "There was an error while creating the query."
+      );
+      goto CLEANUP;
+    }
+
+    results[i] = librdf_model_query_execute(redstore_shard_model(i), queries[i]);
+    if (!results[i]) {
+      response = redstore_page_new_with_message(
+        request, LIBRDF_LOG_INFO, REDHTTP_INTERNAL_SERVER_ERROR,
+        "There was an error while executing the query."
+      );
+      goto CLEANUP;
+    }
+  }
+
+  query_count++;
+
+  if (librdf_query_results_is_bindings(results[0])) {
+    response = format_bindings_query_results_merged(request, results[0], merge_shard_rows, &sharded);
+  } else if (librdf_query_results_is_boolean(results[0])) {
+    // The answer is true if it is true for any of the shards
+    librdf_query_results *answer = results[0];
+    for (i = 0; i < count; i++) {
+      if (librdf_query_results_get_boolean(results[i]) > 0) {
+        answer = results[i];
+        break;
+      }
+    }
+    response = format_bindings_query_result(request, answer);
+  } else if (librdf_query_results_is_graph(results[0])) {
+    streams = calloc(count, sizeof(librdf_stream *));
+    if (streams) {
+      for (i = 0; i < count; i++) {
+        streams[i] = librdf_query_results_as_stream(results[i]);
+        if (!streams[i])
+          break;
+      }
+
+      if (i == count) {
+        stream = redstore_new_union_stream(streams, count);
+      } else {
+        while (--i >= 0)
+          librdf_free_stream(streams[i]);
+      }
+    }
+
+    if (stream) {
+      response = format_graph_stream(request, stream);
+    } else {
+      response = redstore_page_new_with_message(
+        request, LIBRDF_LOG_DEBUG, REDHTTP_INTERNAL_SERVER_ERROR, "Failed to get query results graph."
+      );
+    }
+  } else {
+    response = redstore_page_new_with_message(
+      request, LIBRDF_LOG_INFO, REDHTTP_NOT_IMPLEMENTED,
+      "Results type is not supported for a sharded store."
+    );
+  }
+
+CLEANUP:
+  if (stream)
+    librdf_free_stream(stream);
+  if (streams)
+    free(streams);
+  for (i = 0; results && i < count; i++) {
+    if (results[i])
+      librdf_free_query_results(results[i]);
+  }
+  for (i = 0; queries && i < count; i++) {
+    if (queries[i])
+      librdf_free_query(queries[i]);
+  }
+  if (results)
+    free(results);
+  if (queries)
+    free(queries);
+
+  return response;
+}
+
+static redhttp_response_t *execute_query(redhttp_request_t * request, const char *query_string)
+{
+  const char *lang = redhttp_request_get_argument(request, "lang");
+
+  if (lang == NULL)
+    lang = DEFAULT_QUERY_LANGUAGE;
+
+  redstore_debug("query_lang='%s'", lang);
+  redstore_debug("query_string='%s'", query_string);
+
+  if (redstore_shard_count() > 1)
+    return execute_sharded_query(request, lang, query_string);
+
+  return execute_model_query(request, model, lang, query_string);
+}
+
+int redstore_is_analytic_query(redhttp_request_t * request, const char *query_string)
+{
+  const char *analytic = redhttp_request_get_argument(request, "analytic");
+  long analytic_cost = redstore_get_option_long("analytic-cost", DEFAULT_ANALYTIC_COST);
+
+  if (analytic)
+    return strcmp(analytic, "1") == 0 || strcmp(analytic, "true") == 0;
+
+  if (analytic_cost > 0) {
+    int cost = redstore_estimate_query_cost(query_string);
+    redstore_debug("Estimated query cost: %d", cost);
+    return cost >= analytic_cost;
+  }
+
+  return 0;
+}
+
+static redhttp_response_t *too_many_analytic_queries(redhttp_request_t * request)
+{
+  redhttp_response_t *response = redstore_page_new_with_message(
+    request, LIBRDF_LOG_WARN, REDHTTP_SERVICE_UNAVAILABLE,
+    "Too many analytic queries running; try again later."
+  );
+
+  redstore_add_retry_after(response);
+  return response;
+}
+
+static redhttp_response_t *perform_query(redhttp_request_t * request, const char *query_string)
+{
+  redhttp_response_t *response = NULL;
+  pid_t pid;
+
+  if (!redstore_is_analytic_query(request, query_string))
+    return execute_query(request, query_string);
+
+  // Analytic queries share a fixed number of slots between all the
+  // processes, so that some are left for interactive requests
+  if (redstore_admission_acquire_analytic()) {
+    return too_many_analytic_queries(request);
+  }
+
+  // Only in-memory stores can safely be shared with a child process, and
+  // only the server can write to a connection shared by several requests
+  if (!redstore_storage_is_in_memory() || redhttp_request_is_multiplexed(request)) {
+    response = execute_query(request, query_string);
+    redstore_admission_release_analytic();
+    return response;
+  }
+
+  pid = redstore_fork_child();
+  if (pid < 0) {
+    redstore_admission_release_analytic();
+    return too_many_analytic_queries(request);
+  } else if (pid == 0) {
+    // In the child: run the query against the copy-on-write snapshot
+    response = execute_query(request, query_string);
+    if (!redhttp_response_get_headers_sent(response))
+      redhttp_response_send(response, request);
+    fflush(redhttp_request_get_socket(request));
+    _exit(redhttp_response_get_status_code(response) == REDHTTP_OK ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+
+  redstore_debug("Running analytic query in child process %d.", (int) pid);
+  redstore_children_hold_analytic(pid);
+  query_count++;
+
+  // The child process is now responsible for the connection
+  response = redhttp_response_new(REDHTTP_OK, NULL);
+  redhttp_response_set_headers_sent(response, 1);
+
+  return response;
+}
 
 
 redhttp_response_t *handle_query(redhttp_request_t * request, void *user_data)
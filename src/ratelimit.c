@@ -0,0 +1,255 @@
+/*
+    RedStore - a lightweight RDF triplestore powered by Redland
+    Copyright (C) 2010-2011 Nicholas J Humfrey <njh@aelius.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Rate limiting
+
+  Each client - an address, or an API key - has a token bucket for each
+  budget (queries and writes). A bucket holds up to its burst of tokens,
+  and is refilled at its rate, in requests per minute; each request takes
+  a token, and a request that finds the bucket empty is refused. So a
+  client can send a burst of requests at once, but no more than the rate
+  over a longer time.
+
+  The buckets are kept in a fixed-size hash table in shared memory,
+  created before the workers are forked, so that a client is limited
+  across all of the processes. Each entry has its own spinlock, held only
+  while its tokens are counted. A client is looked for in a short run of
+  entries after its hash; if it isn't there, it takes the first empty
+  entry, or else the one which has been idle longest, so the table never
+  grows. A new client in an empty entry starts with a full bucket, but
+  one that takes over an entry inherits its tokens, refilled for the time
+  it was idle - so a client can't earn a fresh burst by forcing its own
+  entry out with a stream of new keys.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "redstore.h"
+
+// Number of entries searched for each client
+#define RATELIMIT_PROBES     (8)
+
+// Bytes of each key kept to tell clients with the same hash apart
+#define RATELIMIT_KEY_SIZE   (64)
+
+// Tokens are counted in 1/60000ths, so a rate per minute refills a whole
+// number of them each millisecond
+#define TOKEN                (60000)
+
+typedef struct {
+  int lock;
+  uint32_t hash;
+  char key[RATELIMIT_KEY_SIZE];
+  int64_t updated;
+  int64_t tokens[RATELIMIT_BUDGETS];
+} bucket_t;
+
+typedef struct {
+  unsigned long refused;
+  int size;
+  bucket_t buckets[];
+} bucket_table_t;
+
+static bucket_table_t *table = NULL;
+static size_t table_bytes = 0;
+static long rates[RATELIMIT_BUDGETS];
+static long bursts[RATELIMIT_BUDGETS];
+
+
+static int64_t now_ms(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void bucket_lock(bucket_t * bucket)
+{
+  while (__atomic_exchange_n(&bucket->lock, 1, __ATOMIC_ACQUIRE))
+    sched_yield();
+}
+
+static void bucket_unlock(bucket_t * bucket)
+{
+  __atomic_store_n(&bucket->lock, 0, __ATOMIC_RELEASE);
+}
+
+static void bucket_claim(bucket_t * bucket, uint32_t hash, const char *key)
+{
+  bucket->hash = hash;
+  strncpy(bucket->key, key, RATELIMIT_KEY_SIZE - 1);
+  bucket->key[RATELIMIT_KEY_SIZE - 1] = '\0';
+}
+
+static void bucket_refill(bucket_t * bucket, int64_t now)
+{
+  int64_t elapsed = now - bucket->updated;
+  int i;
+
+  if (elapsed <= 0)
+    return;
+
+  for (i = 0; i < RATELIMIT_BUDGETS; i++) {
+    int64_t full = (int64_t) bursts[i] * TOKEN;
+
+    if (rates[i] <= 0)
+      continue;
+    if (elapsed >= (full - bucket->tokens[i]) / rates[i] + 1) {
+      bucket->tokens[i] = full;
+    } else {
+      bucket->tokens[i] += elapsed * rates[i];
+    }
+  }
+  bucket->updated = now;
+}
+
+
+// Returns the locked bucket for a client, taking over an entry if the
+// client doesn't have one
+static bucket_t *bucket_find(const char *key, int64_t now)
+{
+  uint32_t hash = redstore_hash_bytes((const unsigned char *) key, strlen(key));
+  int mask = table->size - 1;
+  bucket_t *oldest = NULL;
+  int i;
+
+  for (i = 0; i < RATELIMIT_PROBES; i++) {
+    bucket_t *bucket = &table->buckets[(hash + i) & mask];
+
+    bucket_lock(bucket);
+    if (bucket->key[0] == '\0') {
+      int j;
+
+      bucket_claim(bucket, hash, key);
+      bucket->updated = now;
+      for (j = 0; j < RATELIMIT_BUDGETS; j++)
+        bucket->tokens[j] = (int64_t) bursts[j] * TOKEN;
+      return bucket;
+    }
+    if (bucket->hash == hash && strncmp(bucket->key, key, RATELIMIT_KEY_SIZE - 1) == 0)
+      return bucket;
+    if (!oldest || bucket->updated < oldest->updated)
+      oldest = bucket;
+    bucket_unlock(bucket);
+  }
+
+  // The new client keeps the tokens the old one had left
+  bucket_lock(oldest);
+  bucket_refill(oldest, now);
+  bucket_claim(oldest, hash, key);
+  return oldest;
+}
+
+
+// Create the table of buckets for this many clients (rounded up to a
+// power of two); must be called before the workers are forked
+int redstore_ratelimit_init(long clients)
+{
+  int size = RATELIMIT_PROBES;
+
+  if (table)
+    redstore_ratelimit_free();
+
+  while (size < clients && size < (1 << 24))
+    size <<= 1;
+
+  table_bytes = sizeof(bucket_table_t) + (size_t) size * sizeof(bucket_t);
+  table = mmap(NULL, table_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+  if (table == MAP_FAILED) {
+    redstore_error("Failed to allocate shared memory: %s", strerror(errno));
+    table = NULL;
+    return -1;
+  }
+
+  // Anonymous mappings start zeroed, so every entry is empty
+  table->size = size;
+  return 0;
+}
+
+// Set the rate, in requests per minute, and the burst of a budget; a rate
+// of 0 means no limit
+void redstore_ratelimit_set_budget(int budget, long rate, long burst)
+{
+  rates[budget] = rate;
+  bursts[budget] = burst > 0 ? burst : 1;
+}
+
+int redstore_ratelimit_is_enabled(void)
+{
+  int i;
+
+  if (!table)
+    return 0;
+
+  for (i = 0; i < RATELIMIT_BUDGETS; i++) {
+    if (rates[i] > 0)
+      return 1;
+  }
+
+  return 0;
+}
+
+// Take a token from a client's bucket for a budget; returns -1, and the
+// number of seconds until there will be a token, if it is empty
+int redstore_ratelimit_take(const char *key, int budget, long *retry_after)
+{
+  int64_t now, wait;
+  bucket_t *bucket;
+
+  if (!table || rates[budget] <= 0 || !key || !key[0])
+    return 0;
+
+  now = now_ms();
+  bucket = bucket_find(key, now);
+  bucket_refill(bucket, now);
+
+  if (bucket->tokens[budget] >= TOKEN) {
+    bucket->tokens[budget] -= TOKEN;
+    bucket_unlock(bucket);
+    return 0;
+  }
+
+  wait = (TOKEN - bucket->tokens[budget] + rates[budget] - 1) / rates[budget];
+  bucket_unlock(bucket);
+
+  __atomic_fetch_add(&table->refused, 1, __ATOMIC_RELAXED);
+  if (retry_after)
+    *retry_after = (wait + 999) / 1000;
+  return -1;
+}
+
+// Returns the number of requests refused so far, by all the processes
+unsigned long redstore_ratelimit_refused(void)
+{
+  return table ? __atomic_load_n(&table->refused, __ATOMIC_RELAXED) : 0;
+}
+
+void redstore_ratelimit_free(void)
+{
+  if (table) {
+    munmap(table, table_bytes);
+    table = NULL;
+  }
+}
@@ -0,0 +1,302 @@
+/*
+    RedHTTP - a lightweight HTTP server library
+    Copyright (C) 2010-2011 Nicholas J Humfrey <njh@aelius.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Compare the select() and io_uring backends of the server.
+
+  For each backend, a server is forked on the loopback interface, and
+  a number of clients make small GET requests to it, each on a new
+  connection, until the total has been made. The request rate, and the
+  CPU time used by the server for each request, are printed.
+
+  To count the system calls made by each backend, run it under
+  strace -c -f, with one backend at a time.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "redhttp.h"
+
+
+#define DEFAULT_REQUESTS      (20000)
+#define DEFAULT_CONCURRENCY   (16)
+#define MAX_CONCURRENCY       (1000)
+
+static const char request_line[] = "GET / HTTP/1.0\r\n\r\n";
+
+static long served = 0;
+
+// The CPU time of earlier benchmarks is included in RUSAGE_CHILDREN
+static double children_cpu = 0.0;
+
+
+static void print_help(char *pname)
+{
+  fprintf(stderr, "%s [options]\n"
+          " -n <count>   number of requests (default %d)\n"
+          " -c <count>   number of concurrent clients (default %d)\n"
+          " -b <name>    backend to benchmark: select, io_uring or both (default both)\n"
+          " -h           help\n", pname, DEFAULT_REQUESTS, DEFAULT_CONCURRENCY);
+}
+
+static redhttp_response_t *handle_homepage(redhttp_request_t * request, void *user_data)
+{
+  redhttp_response_t *response = redhttp_response_new_with_type(REDHTTP_OK, NULL, "text/plain");
+  static const char page[] = "Hello World\n";
+
+  redhttp_response_set_content(response, (char *) page, sizeof(page) - 1, NULL);
+  served++;
+
+  return response;
+}
+
+// Find a free port on the loopback interface for the server
+static int find_port(struct sockaddr_in *addr)
+{
+  socklen_t addr_len = sizeof(*addr);
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_addr.s_addr = inet_addr("127.0.0.1");
+  if (sock < 0 || bind(sock, (struct sockaddr *) addr, sizeof(*addr)) ||
+      getsockname(sock, (struct sockaddr *) addr, &addr_len)) {
+    perror("failed to find a free port");
+    return -1;
+  }
+  close(sock);
+
+  return 0;
+}
+
+static void run_server(struct sockaddr_in *addr, int use_io_uring, long requests)
+{
+  redhttp_server_t *server = redhttp_server_new();
+  char port[NI_MAXSERV];
+
+  snprintf(port, sizeof(port), "%d", ntohs(addr->sin_port));
+  redhttp_server_add_handler(server, "GET", "/", handle_homepage, NULL);
+  redhttp_server_set_backlog_size(server, MAX_CONCURRENCY);
+  redhttp_server_set_idle_timeout(server, 100);
+  if (use_io_uring && redhttp_server_set_io_uring(server, 1)) {
+    fprintf(stderr, "io_uring is not supported by the kernel\n");
+    exit(EXIT_FAILURE);
+  }
+  if (redhttp_server_listen(server, "127.0.0.1", port, PF_INET)) {
+    fprintf(stderr, "Failed to create HTTP server socket.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  while (served < requests)
+    redhttp_server_run(server);
+
+  redhttp_server_free(server);
+  exit(EXIT_SUCCESS);
+}
+
+// Start a request on a new non-blocking connection
+static int client_connect(struct sockaddr_in *addr)
+{
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+
+  if (sock < 0)
+    return -1;
+  fcntl(sock, F_SETFL, O_NONBLOCK);
+  if (connect(sock, (struct sockaddr *) addr, sizeof(*addr)) && errno != EINPROGRESS) {
+    close(sock);
+    return -1;
+  }
+
+  return sock;
+}
+
+// Make the requests from concurrent clients; returns the number answered
+static long run_clients(struct sockaddr_in *addr, long requests, int concurrency)
+{
+  struct pollfd fds[MAX_CONCURRENCY];
+  long started = 0, answered = 0;
+  char buffer[BUFSIZ];
+  int i;
+
+  for (i = 0; i < concurrency; i++) {
+    fds[i].fd = -1;
+    if (started < requests && (fds[i].fd = client_connect(addr)) >= 0)
+      started++;
+    fds[i].events = POLLOUT;
+  }
+
+  while (answered < started) {
+    if (poll(fds, concurrency, 5000) <= 0) {
+      fprintf(stderr, "Timed out waiting for the server.\n");
+      break;
+    }
+
+    for (i = 0; i < concurrency; i++) {
+      if (fds[i].fd < 0 || !fds[i].revents)
+        continue;
+
+      if (fds[i].events == POLLOUT) {
+        // Connected: send the request, and wait for the response
+        if (write(fds[i].fd, request_line, sizeof(request_line) - 1) < 0) {
+          perror("failed to send request");
+          return answered;
+        }
+        fds[i].events = POLLIN;
+      } else {
+        ssize_t len = read(fds[i].fd, buffer, sizeof(buffer));
+        if (len > 0 || (len < 0 && errno == EAGAIN))
+          continue;
+
+        // The server closed the connection after the response
+        close(fds[i].fd);
+        fds[i].fd = -1;
+        answered++;
+        if (started < requests && (fds[i].fd = client_connect(addr)) >= 0) {
+          fds[i].events = POLLOUT;
+          started++;
+        }
+      }
+    }
+  }
+
+  return answered;
+}
+
+static double timeval_seconds(struct timeval *tv)
+{
+  return tv->tv_sec + tv->tv_usec / 1000000.0;
+}
+
+static int benchmark(const char *name, int use_io_uring, long requests, int concurrency)
+{
+  struct sockaddr_in addr;
+  struct timeval start, end;
+  struct rusage usage;
+  double elapsed, cpu;
+  char buffer[BUFSIZ];
+  long answered;
+  pid_t pid;
+  int status, sock, tries;
+
+  if (find_port(&addr))
+    return -1;
+
+  // Don't let the server inherit what is waiting to be printed
+  fflush(stdout);
+  pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return -1;
+  } else if (pid == 0) {
+    run_server(&addr, use_io_uring, requests);
+  }
+
+  // Wait for the server to start listening; the probe is the first request
+  for (tries = 0; tries < 100; tries++) {
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+      if (write(sock, request_line, sizeof(request_line) - 1) < 0) {
+        perror("failed to send request");
+      }
+      while (read(sock, buffer, sizeof(buffer)) > 0);
+      close(sock);
+      break;
+    }
+    close(sock);
+    usleep(10000);
+  }
+
+  gettimeofday(&start, NULL);
+  answered = run_clients(&addr, requests - 1, concurrency);
+  gettimeofday(&end, NULL);
+
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+    fprintf(stderr, "%s: server failed\n", name);
+    return -1;
+  }
+  getrusage(RUSAGE_CHILDREN, &usage);
+
+  cpu = timeval_seconds(&usage.ru_utime) + timeval_seconds(&usage.ru_stime) - children_cpu;
+  children_cpu += cpu;
+  elapsed = timeval_seconds(&end) - timeval_seconds(&start);
+
+  printf("%-10s %8ld requests %10.0f requests/sec %8.1f us server CPU/request\n",
+         name, answered, answered / elapsed, cpu * 1000000.0 / (answered + 1));
+
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  long requests = DEFAULT_REQUESTS;
+  int concurrency = DEFAULT_CONCURRENCY;
+  const char *backend = "both";
+  int opt, result = 0;
+
+  while ((opt = getopt(argc, argv, "n:c:b:h")) != -1) {
+    switch (opt) {
+    case 'n':
+      requests = atol(optarg);
+      break;
+    case 'c':
+      concurrency = atoi(optarg);
+      break;
+    case 'b':
+      backend = optarg;
+      break;
+    default:
+      print_help(argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (requests < 2 || concurrency < 1 || concurrency > MAX_CONCURRENCY) {
+    print_help(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  if (strcmp(backend, "select") == 0 || strcmp(backend, "both") == 0)
+    result |= benchmark("select", 0, requests, concurrency);
+
+  if (strcmp(backend, "io_uring") == 0 || strcmp(backend, "both") == 0) {
+    if (!redhttp_io_uring_is_supported()) {
+      fprintf(stderr, "io_uring backend was not built\n");
+      result = -1;
+    } else {
+      result |= benchmark("io_uring", 1, requests, concurrency);
+    }
+  }
+
+  return result ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,624 @@
+/*
+    RedHTTP - a lightweight HTTP server library
+    Copyright (C) 2010-2011 Nicholas J Humfrey <njh@aelius.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Connection deadlines
+
+  Requests are read through a blocking stdio stream, so a client which
+  connects and then sends nothing, or sends its headers a byte at a time,
+  would hold up the whole server while it was read.
+
+  If a header timeout has been set, a new connection is not read until
+  its request has arrived. Until then it is watched, and each time more
+  arrives, the start of it is peeked at, without reading it, to see if
+  the headers are complete. If they give a Content-Length, and the body
+  would fit in the same peek, the body is waited for too, with the body
+  timeout. Once it is all there, the connection is handled as before,
+  and the reads don't block.
+
+  The deadlines of the waiting connections are kept in a timer wheel: a
+  ring of slots, each for one tick of time, holding the connections whose
+  deadline falls in a tick which maps to it. Each run of the server
+  steps through the slots for the ticks that have passed, and closes the
+  connections in them whose deadline has passed; the others have a
+  deadline a whole turn of the wheel or more away. Adding and removing a
+  connection takes constant time, however many are waiting.
+
+  Larger bodies are read by the handlers themselves, and responses are
+  written by them, through the stdio stream of the connection. Socket
+  timeouts alone would let a client that sends or reads a byte at a time
+  hold a connection for ever, so where stdio streams can be given their
+  own functions, the stream of the connection waits for the socket with
+  poll(), against absolute deadlines: the rest of the header timeout
+  while the headers are read (when they were too large to peek at), the
+  body timeout from when the request is handled while the body is read,
+  and the write timeout from the first write while the response is
+  written. When a deadline passes, the read or write fails, and the
+  connection is closed. The socket timeouts are still set, for anything
+  that uses the socket directly.
+*/
+
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "redstore_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <assert.h>
+#include <limits.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#include "redhttp_private.h"
+#include "redhttp.h"
+
+// Milliseconds in each tick of the wheel
+#define WHEEL_TICK            (100)
+
+// Bytes of the request peeked at, if there is no limit on the header size
+#define DEFAULT_PEEK_SIZE     (16384)
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL (0)
+#endif
+
+#if defined(HAVE_FOPENCOOKIE) || defined(HAVE_FUNOPEN)
+#define DEADLINE_STREAMS
+#endif
+
+// The stdio stream of a connection, read and written against deadlines
+struct redhttp_deadline_stream_s {
+  redhttp_server_t *server;
+  int fd;
+
+  // Milliseconds on the monotonic clock, or 0 for no deadline
+  long read_deadline;
+  long write_deadline;
+
+  int timed_out;
+};
+
+
+static long now_tick(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long) ts.tv_sec * (1000 / WHEEL_TICK) + ts.tv_nsec / (WHEEL_TICK * 1000000L);
+}
+
+static long now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000L;
+}
+
+static void wheel_insert(redhttp_server_t * server, struct redhttp_pending_s *pending,
+                         int timeout)
+{
+  struct redhttp_pending_s **slot;
+
+  // Round up, so the connection gets at least the whole timeout
+  pending->deadline = now_tick() + (timeout + WHEEL_TICK - 1) / WHEEL_TICK;
+  slot = &server->wheel[pending->deadline % REDHTTP_WHEEL_SLOTS];
+
+  pending->prev = NULL;
+  pending->next = *slot;
+  if (*slot)
+    (*slot)->prev = pending;
+  *slot = pending;
+}
+
+static void wheel_remove(redhttp_server_t * server, struct redhttp_pending_s *pending)
+{
+  if (pending->prev) {
+    pending->prev->next = pending->next;
+  } else {
+    server->wheel[pending->deadline % REDHTTP_WHEEL_SLOTS] = pending->next;
+  }
+  if (pending->next)
+    pending->next->prev = pending->prev;
+}
+
+// Stop waiting for a connection, and close it unless it is being handled
+static void pending_free(redhttp_server_t * server, struct redhttp_pending_s *pending,
+                         int close_socket)
+{
+  wheel_remove(server, pending);
+  redhttp_server_remove_watch(server, pending->fd);
+  if (close_socket)
+    close(pending->fd);
+  server->pending_count--;
+  free(pending);
+}
+
+// Find the value of the Content-Length header in a header block
+static long find_content_length(const char *headers, const char *end)
+{
+  const char *ptr;
+
+  for (ptr = memchr(headers, '\n', end - headers); ptr; ptr = memchr(ptr, '\n', end - ptr)) {
+    ptr++;
+    if (end - ptr > 15 && strncasecmp(ptr, "Content-Length:", 15) == 0)
+      return strtol(ptr + 15, NULL, 10);
+  }
+
+  return -1;
+}
+
+// Peek at the request; returns 1 once it can be read without waiting, or
+// if it is too large and should be refused, 0 if more is needed, or -1
+// if the connection has been closed
+static int pending_check(redhttp_server_t * server, struct redhttp_pending_s *pending)
+{
+  size_t size = server->max_header_size > 0 ? server->max_header_size : DEFAULT_PEEK_SIZE;
+  char *end = NULL, *ptr, *first_line;
+  int lines = 0;
+  ssize_t len;
+  long content_length;
+
+  if (!server->peek_buffer) {
+    server->peek_buffer = malloc(size + 1);
+    if (!server->peek_buffer)
+      return 1;
+  }
+
+  do {
+    len = recv(pending->fd, server->peek_buffer, size, MSG_PEEK | MSG_DONTWAIT);
+  } while (len < 0 && errno == EINTR);
+
+  if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return 0;
+  if (len <= 0)
+    return -1;
+  server->peek_buffer[len] = '\0';
+
+  // Waiting for the body, which has a known length
+  if (pending->expected)
+    return (size_t) len >= pending->expected;
+
+  // HTTP/0.9 requests are a single line, without a version
+  first_line = memchr(server->peek_buffer, '\n', len);
+  if (first_line) {
+    *first_line = '\0';
+    if (!strstr(server->peek_buffer, " HTTP/") && !strstr(server->peek_buffer, " http/"))
+      return 1;
+    *first_line = '\n';
+  }
+
+  // Count the header lines, up to the blank line that ends them
+  for (ptr = server->peek_buffer; (ptr = memchr(ptr, '\n', len - (ptr - server->peek_buffer)));) {
+    ptr++;
+    lines++;
+    if (*ptr == '\n' || (ptr[0] == '\r' && ptr[1] == '\n')) {
+      end = ptr + (*ptr == '\n' ? 1 : 2);
+      break;
+    }
+  }
+
+  // Too many headers, or too long; reading them refuses the request
+  if (server->max_header_count > 0 && lines > server->max_header_count + 1)
+    return 1;
+  if (!end)
+    return (size_t) len >= size;
+
+  // Wait for a short body too, so that it can be read without blocking
+  content_length = find_content_length(server->peek_buffer, end);
+  if (content_length > 0 && content_length <= (long) (size - (end - server->peek_buffer)) &&
+      server->body_timeout > 0) {
+    pending->expected = (end - server->peek_buffer) + content_length;
+    if ((size_t) len >= pending->expected)
+      return 1;
+
+    wheel_remove(server, pending);
+    wheel_insert(server, pending, server->body_timeout);
+    return 0;
+  }
+
+  return 1;
+}
+
+static void pending_readable(int fd, void *user_data)
+{
+  struct redhttp_pending_s *pending = (struct redhttp_pending_s *) user_data;
+  redhttp_server_t *server = pending->server;
+  struct sockaddr_storage ss;
+  socklen_t ss_len = pending->ss_len;
+  int preface = pending->preface;
+  int result = pending_check(server, pending);
+  long header_wait;
+
+  if (result == 0)
+    return;
+  if (result < 0) {
+    // The client went away before sending its request
+    pending_free(server, pending, 1);
+    return;
+  }
+
+  // Headers too large to peek at are read within the rest of the timeout
+  header_wait = (pending->deadline - now_tick()) * WHEEL_TICK;
+  if (header_wait < 1)
+    header_wait = 1;
+
+  memcpy(&ss, &pending->ss, ss_len);
+  pending_free(server, pending, 0);
+  redhttp_server_start_connection(server, fd, (struct sockaddr *) &ss, ss_len, preface,
+                                  (int) header_wait);
+}
+
+// Wait for the request on a new connection to arrive before it is read;
+// returns 1 if the connection is waiting, or 0 to handle it now
+int redhttp_deadline_wait(redhttp_server_t * server, int socket, struct sockaddr *sa,
+                          size_t sa_len, int preface)
+{
+  struct redhttp_pending_s *pending;
+  int result;
+
+  if (server->header_timeout <= 0 || sa_len > sizeof(pending->ss))
+    return 0;
+
+  pending = calloc(1, sizeof(struct redhttp_pending_s));
+  if (!pending)
+    return 0;
+  pending->server = server;
+  pending->fd = socket;
+  pending->preface = preface;
+  memcpy(&pending->ss, sa, sa_len);
+  pending->ss_len = sa_len;
+  wheel_insert(server, pending, server->header_timeout);
+
+  // The request has often arrived already
+  result = pending_check(server, pending);
+  if (result != 0 || redhttp_server_add_watch(server, socket, pending_readable, pending)) {
+    wheel_remove(server, pending);
+    free(pending);
+    if (result < 0) {
+      close(socket);
+      return 1;
+    }
+    return 0;
+  }
+
+  server->pending_count++;
+  return 1;
+}
+
+// Close the waiting connections whose deadline has passed
+void redhttp_deadline_expire(redhttp_server_t * server)
+{
+  long now = now_tick();
+  long tick = server->wheel_tick;
+  int steps = 0;
+
+  if (server->pending_count == 0) {
+    server->wheel_tick = now;
+    return;
+  }
+
+  while (tick < now && steps < REDHTTP_WHEEL_SLOTS) {
+    struct redhttp_pending_s *pending, *next;
+
+    tick++;
+    steps++;
+    for (pending = server->wheel[tick % REDHTTP_WHEEL_SLOTS]; pending; pending = next) {
+      next = pending->next;
+      if (pending->deadline <= now) {
+        server->timed_out++;
+        pending_free(server, pending, 1);
+      }
+    }
+  }
+
+  server->wheel_tick = now;
+}
+
+// Returns the milliseconds until the wheel next needs to be stepped, or -1
+int redhttp_deadline_wait_time(redhttp_server_t * server)
+{
+  return server->pending_count > 0 ? WHEEL_TICK : -1;
+}
+
+// Apply the body and write timeouts to a connection that is being read
+void redhttp_deadline_set_socket_timeouts(redhttp_server_t * server, int socket)
+{
+  struct timeval tv;
+
+  if (server->body_timeout > 0) {
+    tv.tv_sec = server->body_timeout / 1000;
+    tv.tv_usec = (server->body_timeout % 1000) * 1000;
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  }
+
+  if (server->write_timeout > 0) {
+    tv.tv_sec = server->write_timeout / 1000;
+    tv.tv_usec = (server->write_timeout % 1000) * 1000;
+    setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  }
+}
+
+#ifdef DEADLINE_STREAMS
+// Wait for the socket to be ready, until the deadline; returns 0 when it
+// is ready, or -1 if the deadline has passed
+static int stream_wait(struct redhttp_deadline_stream_s *stream, short events, long deadline)
+{
+  struct pollfd pfd;
+  long remaining;
+  int result;
+
+  pfd.fd = stream->fd;
+  pfd.events = events;
+  do {
+    remaining = deadline - now_ms();
+    if (remaining <= 0) {
+      if (!stream->timed_out)
+        stream->server->timed_out++;
+      stream->timed_out = 1;
+      errno = ETIMEDOUT;
+      return -1;
+    }
+    result = poll(&pfd, 1, remaining > INT_MAX ? INT_MAX : (int) remaining);
+  } while (result == 0 || (result < 0 && errno == EINTR));
+
+  return result < 0 ? -1 : 0;
+}
+
+static ssize_t stream_read(void *cookie, char *data, size_t length)
+{
+  struct redhttp_deadline_stream_s *stream = (struct redhttp_deadline_stream_s *) cookie;
+  ssize_t len;
+
+  for (;;) {
+    if (stream->read_deadline && stream_wait(stream, POLLIN, stream->read_deadline))
+      return -1;
+    len = recv(stream->fd, data, length, stream->read_deadline ? MSG_DONTWAIT : 0);
+    if (len >= 0 || !(errno == EINTR || (stream->read_deadline && errno == EAGAIN)))
+      return len;
+  }
+}
+
+// Returns the number of bytes written, which is short if there was an
+// error or the deadline passed
+static size_t stream_write(void *cookie, const char *data, size_t length)
+{
+  struct redhttp_deadline_stream_s *stream = (struct redhttp_deadline_stream_s *) cookie;
+  size_t written = 0;
+  ssize_t len;
+
+  if (!stream->write_deadline && stream->server->write_timeout > 0)
+    stream->write_deadline = now_ms() + stream->server->write_timeout;
+
+  while (written < length) {
+    if (stream->write_deadline && stream_wait(stream, POLLOUT, stream->write_deadline))
+      break;
+    len = send(stream->fd, data + written, length - written,
+               MSG_NOSIGNAL | (stream->write_deadline ? MSG_DONTWAIT : 0));
+    if (len < 0) {
+      if (errno == EINTR || (stream->write_deadline && errno == EAGAIN))
+        continue;
+      break;
+    }
+    written += len;
+  }
+
+  return written;
+}
+
+static int stream_close(void *cookie)
+{
+  struct redhttp_deadline_stream_s *stream = (struct redhttp_deadline_stream_s *) cookie;
+  int result = close(stream->fd);
+
+  free(stream);
+  return result;
+}
+#endif
+
+#ifdef HAVE_FOPENCOOKIE
+static ssize_t cookie_write(void *cookie, const char *data, size_t length)
+{
+  return stream_write(cookie, data, length);
+}
+
+static FILE *open_stream(struct redhttp_deadline_stream_s *stream, const char *mode)
+{
+  cookie_io_functions_t functions = { stream_read, cookie_write, NULL, stream_close };
+  return fopencookie(stream, mode, functions);
+}
+#elif defined(HAVE_FUNOPEN)
+static int funopen_read(void *cookie, char *data, int length)
+{
+  return stream_read(cookie, data, length);
+}
+
+static int funopen_write(void *cookie, const char *data, int length)
+{
+  int written = stream_write(cookie, data, length);
+  return written > 0 ? written : -1;
+}
+
+static FILE *open_stream(struct redhttp_deadline_stream_s *stream, const char *mode)
+{
+  return funopen(stream, funopen_read, funopen_write, NULL, stream_close);
+}
+#endif
+
+// Open the stdio stream of a connection for its request, which takes
+// ownership of the socket; the headers are read within header_wait
+// milliseconds, or without a deadline if it is 0
+int redhttp_deadline_open(redhttp_request_t * request, int socket, const char *mode,
+                          int header_wait)
+{
+#ifdef DEADLINE_STREAMS
+  struct redhttp_deadline_stream_s *stream = calloc(1, sizeof(struct redhttp_deadline_stream_s));
+  FILE *file = NULL;
+
+  if (stream) {
+    stream->server = request->server;
+    stream->fd = socket;
+    if (header_wait > 0)
+      stream->read_deadline = now_ms() + header_wait;
+    file = open_stream(stream, mode);
+    if (!file) {
+      free(stream);
+      return -1;
+    }
+  }
+
+  request->socket = file;
+  request->deadline = stream;
+#else
+  request->socket = fdopen(socket, mode);
+#endif
+
+  if (!request->socket)
+    return -1;
+  request->socket_fd = socket;
+
+  return 0;
+}
+
+// Give the handler of a request the body timeout to read its body
+void redhttp_deadline_start_body(redhttp_request_t * request)
+{
+  struct redhttp_deadline_stream_s *stream = request->deadline;
+
+  if (stream)
+    stream->read_deadline = stream->server->body_timeout > 0 ?
+        now_ms() + stream->server->body_timeout : 0;
+}
+
+// Close every waiting connection, when the server is freed or in a forked
+// child; their watches are left alone, as a child shares them with its
+// parent when using io_uring, so the server must not be run again
+void redhttp_deadline_free_all(redhttp_server_t * server)
+{
+  int i;
+
+  for (i = 0; i < REDHTTP_WHEEL_SLOTS; i++) {
+    while (server->wheel[i]) {
+      struct redhttp_pending_s *pending = server->wheel[i];
+      server->wheel[i] = pending->next;
+      close(pending->fd);
+      free(pending);
+    }
+  }
+  server->pending_count = 0;
+
+  if (server->peek_buffer)
+    free(server->peek_buffer);
+  server->peek_buffer = NULL;
+}
+
+// Set the milliseconds a new connection has to send the headers of its
+// request; 0 to read the request straight away, without a deadline
+void redhttp_server_set_header_timeout(redhttp_server_t * server, int milliseconds)
+{
+  assert(server != NULL);
+
+  server->header_timeout = milliseconds;
+}
+
+int redhttp_server_get_header_timeout(redhttp_server_t * server)
+{
+  return server->header_timeout;
+}
+
+// Set the milliseconds the body of a request may take to arrive, after
+// its headers, or after the handler starts to read it; 0 for no limit
+void redhttp_server_set_body_timeout(redhttp_server_t * server, int milliseconds)
+{
+  assert(server != NULL);
+
+  server->body_timeout = milliseconds;
+}
+
+int redhttp_server_get_body_timeout(redhttp_server_t * server)
+{
+  return server->body_timeout;
+}
+
+// Set the milliseconds the client has to read the response, from when
+// the first of it is written; 0 for no limit
+void redhttp_server_set_write_timeout(redhttp_server_t * server, int milliseconds)
+{
+  assert(server != NULL);
+
+  server->write_timeout = milliseconds;
+}
+
+int redhttp_server_get_write_timeout(redhttp_server_t * server)
+{
+  return server->write_timeout;
+}
+
+// Set the largest number of bytes allowed in the request line and
+// headers; 0 for no limit
+void redhttp_server_set_max_header_size(redhttp_server_t * server, int size)
+{
+  assert(server != NULL);
+
+  server->max_header_size = size;
+  if (server->peek_buffer)
+    free(server->peek_buffer);
+  server->peek_buffer = NULL;
+}
+
+int redhttp_server_get_max_header_size(redhttp_server_t * server)
+{
+  return server->max_header_size;
+}
+
+// Set the largest number of headers allowed in a request; 0 for no limit
+void redhttp_server_set_max_header_count(redhttp_server_t * server, int count)
+{
+  assert(server != NULL);
+
+  server->max_header_count = count;
+}
+
+int redhttp_server_get_max_header_count(redhttp_server_t * server)
+{
+  return server->max_header_count;
+}
+
+// Returns the number of connections closed because a deadline passed
+unsigned long redhttp_server_get_timed_out(redhttp_server_t * server)
+{
+  return server->timed_out;
+}
+
+// Returns the number of requests refused because their headers were
+// too large, or too many
+unsigned long redhttp_server_get_headers_refused(redhttp_server_t * server)
+{
+  return server->headers_refused;
+}
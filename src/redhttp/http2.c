@@ -0,0 +1,985 @@
+/*
+    RedHTTP - a lightweight HTTP server library
+    Copyright (C) 2010-2011 Nicholas J Humfrey <njh@aelius.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Cleartext HTTP/2 (h2c)
+
+  Clients may start a connection with the HTTP/2 preface (prior
+  knowledge), or send an HTTP/1.1 request with "Upgrade: h2c", which is
+  answered with 101 Switching Protocols and then served as stream 1.
+  Framing, HPACK and flow control are done by libnghttp2.
+
+  Once it has been set up, the connection is a watch on the server: each
+  time the socket is readable, the frames are given to nghttp2, and every
+  stream whose request is complete is dispatched to the handlers, one at
+  a time. Each stream is an ordinary request, whose socket is a stdio
+  stream: reading it returns the request body, and what is written to it
+  is queued and sent as DATA frames. The response headers are sent as a
+  HEADERS frame by redhttp_response_send(), and closing the stream (by
+  freeing the request) ends it, so deferred requests work as they do for
+  HTTP/1.0.
+
+  A handler which writes more than fits in the flow control window waits
+  for the client to open the window, reading frames from the connection
+  meanwhile. Requests on other streams which arrive while it waits are
+  dispatched when it returns, or by the next redhttp_server_run() if it
+  was finishing a deferred request.
+*/
+
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "redstore_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "redhttp_private.h"
+#include "redhttp.h"
+
+#if defined(HAVE_NGHTTP2) && (defined(HAVE_FOPENCOOKIE) || defined(HAVE_FUNOPEN))
+#define REDHTTP_HTTP2
+#endif
+
+#ifdef REDHTTP_HTTP2
+#include <nghttp2/nghttp2.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL (0)
+#endif
+
+#define HTTP2_PREFACE           "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_READ_SIZE         (16 * 1024)
+#define HTTP2_OUTPUT_LIMIT      (64 * 1024)
+#define HTTP2_WINDOW_SIZE       (1024 * 1024)
+#define HTTP2_MAX_HEADERS       (64)
+
+
+typedef struct redhttp_http2_connection_s http2_connection_t;
+
+struct redhttp_http2_stream_s {
+  int32_t id;
+  http2_connection_t *conn;
+  redhttp_request_t *request;
+
+  // The request body
+  char *input;
+  size_t input_length;
+  size_t input_size;
+  size_t input_pos;
+
+  // Response body waiting to be sent as DATA frames
+  char *output;
+  size_t output_length;
+  size_t output_size;
+  size_t output_pos;
+
+  int ready;                    // the request is complete, and waiting to be dispatched
+  int dispatched;               // the request has been given to the handlers
+  int headers_sent;             // the response HEADERS frame has been submitted
+  int finished;                 // the response has been written in full
+  int closed;                   // nghttp2 has closed the stream
+  int busy;                     // in a call which uses the stream
+
+  struct redhttp_http2_stream_s *next;
+  struct redhttp_http2_stream_s *next_ready;
+};
+
+typedef struct redhttp_http2_stream_s http2_stream_t;
+
+struct redhttp_http2_connection_s {
+  redhttp_server_t *server;
+  nghttp2_session *session;
+  int fd;
+
+  char remote_addr[NI_MAXHOST];
+  char remote_port[NI_MAXSERV];
+  char server_addr[NI_MAXHOST];
+  char server_port[NI_MAXSERV];
+
+  http2_stream_t *streams;
+  http2_stream_t *ready_first;
+  http2_stream_t *ready_last;
+  int stream_count;
+
+  int closed;
+  int busy;
+
+  struct redhttp_http2_connection_s *next;
+};
+
+
+static int connection_flush(http2_connection_t * conn);
+static void connection_close(http2_connection_t * conn);
+
+
+static void connection_release(http2_connection_t * conn)
+{
+  http2_connection_t **ptr;
+
+  if (!conn->closed || conn->stream_count > 0 || conn->busy > 0)
+    return;
+
+  for (ptr = &conn->server->http2_connections; *ptr; ptr = &(*ptr)->next) {
+    if (*ptr == conn) {
+      *ptr = conn->next;
+      break;
+    }
+  }
+  free(conn);
+}
+
+static http2_stream_t *stream_new(http2_connection_t * conn, int32_t id,
+                                  redhttp_request_t * request)
+{
+  http2_stream_t *stream = calloc(1, sizeof(http2_stream_t));
+  if (!stream)
+    return NULL;
+
+  if (!request) {
+    request = redhttp_request_new();
+    if (!request) {
+      free(stream);
+      return NULL;
+    }
+  }
+
+  request->server = conn->server;
+  request->stream = stream;
+  strcpy(request->remote_addr, conn->remote_addr);
+  strcpy(request->remote_port, conn->remote_port);
+  strcpy(request->server_addr, conn->server_addr);
+  strcpy(request->server_port, conn->server_port);
+  redhttp_request_set_version(request, "2.0");
+
+  stream->id = id;
+  stream->conn = conn;
+  stream->request = request;
+  stream->next = conn->streams;
+  conn->streams = stream;
+  conn->stream_count++;
+
+  return stream;
+}
+
+// Free a stream, once nothing else refers to it
+static void stream_release(http2_stream_t * stream)
+{
+  http2_connection_t *conn = stream->conn;
+  http2_stream_t **ptr;
+
+  if (stream->busy || stream->ready || !stream->closed)
+    return;
+  if (stream->dispatched && !stream->finished)
+    return;
+
+  for (ptr = &conn->streams; *ptr; ptr = &(*ptr)->next) {
+    if (*ptr == stream) {
+      *ptr = stream->next;
+      break;
+    }
+  }
+
+  // A request which was never dispatched still belongs to the stream
+  if (stream->request) {
+    stream->request->stream = NULL;
+    redhttp_request_free(stream->request);
+  }
+  free(stream->input);
+  free(stream->output);
+  free(stream);
+
+  conn->stream_count--;
+  connection_release(conn);
+}
+
+static int buffer_append(char **buffer, size_t * length, size_t * size, const void *data,
+                         size_t data_length)
+{
+  if (*length + data_length > *size) {
+    size_t new_size = *size ? *size : 4096;
+    char *new_buffer;
+
+    while (new_size < *length + data_length)
+      new_size *= 2;
+    new_buffer = realloc(*buffer, new_size);
+    if (!new_buffer)
+      return -1;
+    *buffer = new_buffer;
+    *size = new_size;
+  }
+
+  memcpy(*buffer + *length, data, data_length);
+  *length += data_length;
+
+  return 0;
+}
+
+
+static int write_fully(int fd, const uint8_t * data, size_t length)
+{
+  while (length > 0) {
+    ssize_t written = send(fd, data, length, MSG_NOSIGNAL);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    data += written;
+    length -= written;
+  }
+
+  return 0;
+}
+
+// Send all the frames which nghttp2 has ready
+static int connection_flush(http2_connection_t * conn)
+{
+  while (!conn->closed) {
+    const uint8_t *data = NULL;
+    ssize_t length = nghttp2_session_mem_send(conn->session, &data);
+
+    if (length == 0)
+      return 0;
+    if (length < 0 || write_fully(conn->fd, data, length)) {
+      connection_close(conn);
+      break;
+    }
+  }
+
+  return -1;
+}
+
+// Read from the socket and pass what arrives to nghttp2; blocks until
+// there is something to read
+static int connection_receive(http2_connection_t * conn)
+{
+  uint8_t buffer[HTTP2_READ_SIZE];
+  ssize_t got;
+
+  if (conn->closed)
+    return -1;
+
+  do {
+    got = read(conn->fd, buffer, sizeof(buffer));
+  } while (got < 0 && errno == EINTR);
+
+  if (got <= 0 || nghttp2_session_mem_recv(conn->session, buffer, got) < 0) {
+    connection_close(conn);
+    return -1;
+  }
+
+  return 0;
+}
+
+static void connection_close(http2_connection_t * conn)
+{
+  http2_stream_t *stream, *next;
+
+  if (conn->closed)
+    return;
+
+  conn->closed = 1;
+  conn->busy++;
+  redhttp_server_remove_watch(conn->server, conn->fd);
+  close(conn->fd);
+  nghttp2_session_del(conn->session);
+  conn->session = NULL;
+
+  // Streams still being answered are freed when they finish
+  for (stream = conn->ready_first; stream; stream = stream->next_ready)
+    stream->ready = 0;
+  conn->ready_first = conn->ready_last = NULL;
+  for (stream = conn->streams; stream; stream = next) {
+    next = stream->next;
+    stream->closed = 1;
+    stream_release(stream);
+  }
+
+  conn->busy--;
+  connection_release(conn);
+}
+
+
+static int stream_read(void *cookie, char *data, size_t length)
+{
+  http2_stream_t *stream = (http2_stream_t *) cookie;
+  size_t available = stream->input_length - stream->input_pos;
+
+  if (length > available)
+    length = available;
+  memcpy(data, stream->input + stream->input_pos, length);
+  stream->input_pos += length;
+
+  return length;
+}
+
+static int stream_write(void *cookie, const char *data, size_t length)
+{
+  http2_stream_t *stream = (http2_stream_t *) cookie;
+  http2_connection_t *conn = stream->conn;
+  int result = length;
+
+  if (stream->closed || !stream->headers_sent)
+    return -1;
+  if (buffer_append(&stream->output, &stream->output_length, &stream->output_size, data, length))
+    return -1;
+
+  stream->busy++;
+  conn->busy++;
+
+  // Wait for the client to open the window, if too much is queued
+  while (stream->output_length - stream->output_pos > HTTP2_OUTPUT_LIMIT) {
+    if (stream->closed || conn->closed) {
+      result = -1;
+      break;
+    }
+    nghttp2_session_resume_data(conn->session, stream->id);
+    connection_flush(conn);
+    if (stream->output_length - stream->output_pos > HTTP2_OUTPUT_LIMIT)
+      connection_receive(conn);
+  }
+
+  conn->busy--;
+  stream->busy--;
+
+  return result;
+}
+
+static int stream_close(void *cookie)
+{
+  http2_stream_t *stream = (http2_stream_t *) cookie;
+  http2_connection_t *conn = stream->conn;
+
+  stream->finished = 1;
+  stream->request = NULL;
+
+  if (!stream->closed) {
+    if (!stream->headers_sent) {
+      nghttp2_submit_rst_stream(conn->session, NGHTTP2_FLAG_NONE, stream->id,
+                                NGHTTP2_INTERNAL_ERROR);
+    } else {
+      nghttp2_session_resume_data(conn->session, stream->id);
+    }
+    conn->busy++;
+    stream->busy++;
+    connection_flush(conn);
+    stream->busy--;
+    conn->busy--;
+  }
+
+  stream_release(stream);
+
+  return 0;
+}
+
+#ifdef HAVE_FOPENCOOKIE
+static ssize_t cookie_read(void *cookie, char *data, size_t length)
+{
+  return stream_read(cookie, data, length);
+}
+
+static ssize_t cookie_write(void *cookie, const char *data, size_t length)
+{
+  int written = stream_write(cookie, data, length);
+  return written < 0 ? 0 : written;
+}
+
+static FILE *open_stream(http2_stream_t * stream)
+{
+  cookie_io_functions_t functions = { cookie_read, cookie_write, NULL, stream_close };
+  return fopencookie(stream, "r+", functions);
+}
+#else
+static int funopen_read(void *cookie, char *data, int length)
+{
+  return stream_read(cookie, data, length);
+}
+
+static int funopen_write(void *cookie, const char *data, int length)
+{
+  return stream_write(cookie, data, length);
+}
+
+static FILE *open_stream(http2_stream_t * stream)
+{
+  return funopen(stream, funopen_read, funopen_write, NULL, stream_close);
+}
+#endif
+
+
+static ssize_t data_source_read(nghttp2_session * session, int32_t stream_id, uint8_t * buf,
+                                size_t length, uint32_t * data_flags,
+                                nghttp2_data_source * source, void *user_data)
+{
+  http2_stream_t *stream = (http2_stream_t *) source->ptr;
+  size_t available = stream->output_length - stream->output_pos;
+
+  if (length > available)
+    length = available;
+  if (length)
+    memcpy(buf, stream->output + stream->output_pos, length);
+  stream->output_pos += length;
+
+  if (stream->output_pos == stream->output_length) {
+    stream->output_pos = stream->output_length = 0;
+    if (stream->finished) {
+      *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+    } else if (length == 0) {
+      return NGHTTP2_ERR_DEFERRED;
+    }
+  }
+
+  return length;
+}
+
+// Headers which only apply to an HTTP/1 connection
+static int is_connection_header(const char *key)
+{
+  return redhttp_strcasecmp(key, "Connection") == 0 ||
+      redhttp_strcasecmp(key, "Keep-Alive") == 0 ||
+      redhttp_strcasecmp(key, "Proxy-Connection") == 0 ||
+      redhttp_strcasecmp(key, "Transfer-Encoding") == 0 ||
+      redhttp_strcasecmp(key, "Upgrade") == 0;
+}
+
+static char *lowercase_dup(const char *str)
+{
+  char *lower = redhttp_strdup(str);
+  char *ptr;
+
+  for (ptr = lower; ptr && *ptr; ptr++)
+    *ptr = tolower(*ptr);
+
+  return lower;
+}
+
+// Send the response status and headers as a HEADERS frame
+void redhttp_http2_send_headers(redhttp_request_t * request, redhttp_response_t * response)
+{
+  http2_stream_t *stream = request->stream;
+  http2_connection_t *conn = stream->conn;
+  nghttp2_nv nva[HTTP2_MAX_HEADERS];
+  nghttp2_data_provider provider;
+  char status[8];
+  redhttp_header_t *it;
+  size_t count = 0, i;
+
+  if (stream->closed || stream->headers_sent)
+    return;
+
+  snprintf(status, sizeof(status), "%d", response->status_code);
+  nva[0].name = (uint8_t *) ":status";
+  nva[0].namelen = 7;
+  nva[0].value = (uint8_t *) status;
+  nva[0].valuelen = strlen(status);
+  nva[0].flags = NGHTTP2_NV_FLAG_NONE;
+  count++;
+
+  for (it = response->headers; it && count < HTTP2_MAX_HEADERS; it = it->next) {
+    if (is_connection_header(it->key))
+      continue;
+    nva[count].name = (uint8_t *) lowercase_dup(it->key);
+    nva[count].namelen = nva[count].name ? strlen((char *) nva[count].name) : 0;
+    nva[count].value = (uint8_t *) it->value;
+    nva[count].valuelen = it->value ? strlen(it->value) : 0;
+    nva[count].flags = NGHTTP2_NV_FLAG_NONE;
+    count++;
+  }
+
+  provider.source.ptr = stream;
+  provider.read_callback = data_source_read;
+  if (nghttp2_submit_response(conn->session, stream->id, nva, count, &provider) == 0)
+    stream->headers_sent = 1;
+
+  for (i = 1; i < count; i++)
+    free(nva[i].name);
+}
+
+
+static int on_begin_headers(nghttp2_session * session, const nghttp2_frame * frame,
+                            void *user_data)
+{
+  http2_connection_t *conn = (http2_connection_t *) user_data;
+  http2_stream_t *stream;
+
+  if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST)
+    return 0;
+
+  stream = stream_new(conn, frame->hd.stream_id, NULL);
+  if (!stream)
+    return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+  nghttp2_session_set_stream_user_data(session, frame->hd.stream_id, stream);
+
+  return 0;
+}
+
+static int on_header(nghttp2_session * session, const nghttp2_frame * frame,
+                     const uint8_t * name, size_t namelen, const uint8_t * value,
+                     size_t valuelen, uint8_t flags, void *user_data)
+{
+  http2_stream_t *stream = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+  redhttp_request_t *request;
+  const char *key = (const char *) name;
+  char *str;
+
+  if (!stream || frame->hd.type != NGHTTP2_HEADERS)
+    return 0;
+
+  // nghttp2 checks that names are lowercase and have no NULs
+  str = redhttp_strndup((const char *) value, valuelen);
+  if (!str)
+    return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+
+  request = stream->request;
+  if (strcmp(key, ":method") == 0) {
+    redhttp_request_set_method(request, str);
+  } else if (strcmp(key, ":path") == 0) {
+    redhttp_request_set_path_and_query(request, str);
+  } else if (strcmp(key, ":authority") == 0) {
+    redhttp_request_add_header(request, "Host", str);
+  } else if (key[0] != ':') {
+    redhttp_request_add_header(request, key, str);
+  }
+  free(str);
+
+  return 0;
+}
+
+static int on_data_chunk_recv(nghttp2_session * session, uint8_t flags, int32_t stream_id,
+                              const uint8_t * data, size_t len, void *user_data)
+{
+  http2_stream_t *stream = nghttp2_session_get_stream_user_data(session, stream_id);
+
+  if (!stream || stream->dispatched)
+    return 0;
+
+  if (buffer_append(&stream->input, &stream->input_length, &stream->input_size, data, len)) {
+    nghttp2_submit_rst_stream(session, NGHTTP2_FLAG_NONE, stream_id, NGHTTP2_INTERNAL_ERROR);
+  }
+
+  return 0;
+}
+
+static void stream_ready(http2_stream_t * stream)
+{
+  http2_connection_t *conn = stream->conn;
+
+  stream->ready = 1;
+  stream->next_ready = NULL;
+  if (conn->ready_last) {
+    conn->ready_last->next_ready = stream;
+  } else {
+    conn->ready_first = stream;
+  }
+  conn->ready_last = stream;
+}
+
+static int on_frame_recv(nghttp2_session * session, const nghttp2_frame * frame,
+                         void *user_data)
+{
+  http2_stream_t *stream;
+
+  if (frame->hd.type != NGHTTP2_HEADERS && frame->hd.type != NGHTTP2_DATA)
+    return 0;
+  if (!(frame->hd.flags & NGHTTP2_FLAG_END_STREAM))
+    return 0;
+
+  stream = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+  if (stream && !stream->ready && !stream->dispatched)
+    stream_ready(stream);
+
+  return 0;
+}
+
+static int on_stream_close(nghttp2_session * session, int32_t stream_id, uint32_t error_code,
+                           void *user_data)
+{
+  http2_stream_t *stream = nghttp2_session_get_stream_user_data(session, stream_id);
+
+  if (stream) {
+    nghttp2_session_set_stream_user_data(session, stream_id, NULL);
+    stream->closed = 1;
+    stream_release(stream);
+  }
+
+  return 0;
+}
+
+
+// Answer a request which has arrived in full
+static void stream_dispatch(http2_stream_t * stream)
+{
+  redhttp_request_t *request = stream->request;
+  redhttp_response_t *response = NULL;
+  char length_str[32];
+
+  stream->dispatched = 1;
+  request->socket = open_stream(stream);
+  if (!request->socket) {
+    // Freeing the stream frees the request
+    nghttp2_submit_rst_stream(stream->conn->session, NGHTTP2_FLAG_NONE, stream->id,
+                              NGHTTP2_INTERNAL_ERROR);
+    stream->dispatched = 0;
+    return;
+  }
+  stream->request = NULL;
+
+  // The length of the body is known now that it has all arrived
+  if (stream->input_length && !redhttp_request_get_header(request, "Content-Length")) {
+    snprintf(length_str, sizeof(length_str), "%lu", (unsigned long) stream->input_length);
+    redhttp_request_add_header(request, "Content-Length", length_str);
+  }
+
+  if (!request->method || !request->path) {
+    response = redhttp_response_new_error_page(REDHTTP_BAD_REQUEST, NULL);
+  } else if (redhttp_request_read_content(request)) {
+    response = redhttp_response_new_error_page(REDHTTP_BAD_REQUEST, NULL);
+  }
+
+  redhttp_server_respond(stream->conn->server, request, response);
+}
+
+static void connection_dispatch(http2_connection_t * conn)
+{
+  while (!conn->closed && conn->ready_first) {
+    http2_stream_t *stream = conn->ready_first;
+
+    conn->ready_first = stream->next_ready;
+    if (!conn->ready_first)
+      conn->ready_last = NULL;
+    stream->ready = 0;
+
+    if (stream->closed) {
+      stream_release(stream);
+      continue;
+    }
+
+    stream->busy++;
+    stream_dispatch(stream);
+    stream->busy--;
+    stream_release(stream);
+  }
+}
+
+static void connection_readable(int fd, void *user_data)
+{
+  http2_connection_t *conn = (http2_connection_t *) user_data;
+
+  conn->busy++;
+  if (connection_receive(conn) == 0) {
+    connection_dispatch(conn);
+    connection_flush(conn);
+    if (!conn->closed && !nghttp2_session_want_read(conn->session) &&
+        !nghttp2_session_want_write(conn->session))
+      connection_close(conn);
+  }
+  conn->busy--;
+  connection_release(conn);
+}
+
+
+// Decode base64url, as used by the HTTP2-Settings header
+static size_t base64url_decode(const char *str, uint8_t * out, size_t out_size)
+{
+  static const char alphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+  unsigned long bits = 0;
+  size_t length = 0;
+  int bit_count = 0;
+
+  for (; *str && *str != '='; str++) {
+    const char *pos = strchr(alphabet, *str);
+    if (!pos)
+      return 0;
+    bits = (bits << 6) | (pos - alphabet);
+    bit_count += 6;
+    if (bit_count >= 8) {
+      bit_count -= 8;
+      if (length >= out_size)
+        return 0;
+      out[length++] = (bits >> bit_count) & 0xFF;
+    }
+  }
+
+  return length;
+}
+
+static http2_connection_t *connection_new(redhttp_request_t * request, int fd)
+{
+  http2_connection_t *conn = calloc(1, sizeof(http2_connection_t));
+  nghttp2_session_callbacks *callbacks = NULL;
+
+  if (!conn)
+    return NULL;
+
+  conn->server = request->server;
+  conn->fd = fd;
+  strcpy(conn->remote_addr, request->remote_addr);
+  strcpy(conn->remote_port, request->remote_port);
+  strcpy(conn->server_addr, request->server_addr);
+  strcpy(conn->server_port, request->server_port);
+
+  if (nghttp2_session_callbacks_new(&callbacks)) {
+    free(conn);
+    return NULL;
+  }
+  nghttp2_session_callbacks_set_on_begin_headers_callback(callbacks, on_begin_headers);
+  nghttp2_session_callbacks_set_on_header_callback(callbacks, on_header);
+  nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks, on_data_chunk_recv);
+  nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, on_frame_recv);
+  nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, on_stream_close);
+
+  if (nghttp2_session_server_new(&conn->session, callbacks, conn)) {
+    nghttp2_session_callbacks_del(callbacks);
+    free(conn);
+    return NULL;
+  }
+  nghttp2_session_callbacks_del(callbacks);
+
+  conn->next = conn->server->http2_connections;
+  conn->server->http2_connections = conn;
+
+  return conn;
+}
+
+// Returns true if the client has started the connection with the
+// HTTP/2 preface, without reading anything from the socket
+int redhttp_http2_check_preface(int socket)
+{
+  char buffer[4];
+  ssize_t got;
+
+  do {
+    got = recv(socket, buffer, sizeof(buffer), MSG_PEEK | MSG_WAITALL);
+  } while (got < 0 && errno == EINTR);
+
+  return got == sizeof(buffer) && memcmp(buffer, HTTP2_PREFACE, sizeof(buffer)) == 0;
+}
+
+// Returns true if an HTTP/1.1 request asks to upgrade to h2c; requests
+// with a body are answered using HTTP/1.0
+int redhttp_http2_check_upgrade(redhttp_request_t * request)
+{
+  const char *upgrade = redhttp_request_get_header(request, "Upgrade");
+  const char *content_length = redhttp_request_get_header(request, "Content-Length");
+
+  if (!upgrade || !redhttp_request_get_header(request, "HTTP2-Settings"))
+    return 0;
+  if (!request->version || strcmp(request->version, "1.1") != 0)
+    return 0;
+  if (content_length && atoi(content_length) != 0)
+    return 0;
+
+  // Upgrade is a list of protocols, in order of preference
+  while (*upgrade) {
+    size_t len;
+
+    while (*upgrade == ' ' || *upgrade == ',')
+      upgrade++;
+    len = strcspn(upgrade, " ,");
+    if (len == 3 && strncmp(upgrade, "h2c", 3) == 0)
+      return 1;
+    upgrade += len;
+  }
+
+  return 0;
+}
+
+// Take over the connection of a request, and serve HTTP/2 on it. If
+// upgrade is set, the request is answered as stream 1, otherwise it was
+// only used to accept the connection and is freed.
+int redhttp_http2_start(redhttp_request_t * request, int upgrade)
+{
+  redhttp_server_t *server = request->server;
+  http2_connection_t *conn = NULL;
+  http2_stream_t *stream = NULL;
+  nghttp2_settings_entry settings[2];
+  uint8_t upgrade_settings[256];
+  size_t upgrade_settings_length = 0;
+  int fd;
+
+  if (upgrade) {
+    upgrade_settings_length =
+        base64url_decode(redhttp_request_get_header(request, "HTTP2-Settings"),
+                         upgrade_settings, sizeof(upgrade_settings));
+    fputs("HTTP/1.1 101 Switching Protocols\r\n"
+          "Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n", request->socket);
+  }
+
+  // The client sends nothing more until it has had the 101 response, so
+  // nothing is left in the buffer of the stdio stream
+  fflush(request->socket);
+  fd = dup(request->socket_fd);
+  fclose(request->socket);
+  request->socket = NULL;
+  if (fd < 0) {
+    redhttp_request_free(request);
+    return -1;
+  }
+
+  conn = connection_new(request, fd);
+  if (!conn) {
+    close(fd);
+    redhttp_request_free(request);
+    return -1;
+  }
+
+  settings[0].settings_id = NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS;
+  settings[0].value = server->http2_max_streams;
+  settings[1].settings_id = NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE;
+  settings[1].value = HTTP2_WINDOW_SIZE;
+  nghttp2_submit_settings(conn->session, NGHTTP2_FLAG_NONE, settings, 2);
+
+  if (upgrade) {
+    stream = stream_new(conn, 1, request);
+    if (!stream ||
+        nghttp2_session_upgrade2(conn->session, upgrade_settings, upgrade_settings_length,
+                                 strcmp(request->method, "HEAD") == 0, stream)) {
+      if (stream)
+        stream->closed = 1;
+      else
+        redhttp_request_free(request);
+      connection_close(conn);
+      return -1;
+    }
+    stream_ready(stream);
+  } else {
+    redhttp_request_free(request);
+  }
+
+  if (redhttp_server_add_watch(server, fd, connection_readable, conn)) {
+    connection_close(conn);
+    return -1;
+  }
+
+  conn->busy++;
+  connection_dispatch(conn);
+  connection_flush(conn);
+  conn->busy--;
+  connection_release(conn);
+
+  return 0;
+}
+
+// Returns true if there are requests waiting to be dispatched
+int redhttp_http2_pending(redhttp_server_t * server)
+{
+  http2_connection_t *conn;
+
+  for (conn = server->http2_connections; conn; conn = conn->next) {
+    if (!conn->busy && conn->ready_first)
+      return 1;
+  }
+
+  return 0;
+}
+
+// Dispatch requests which arrived while another stream was being answered
+void redhttp_http2_dispatch_pending(redhttp_server_t * server)
+{
+  http2_connection_t *conn;
+  int found;
+
+  // Answering a request may close other connections, so start again
+  // from the beginning of the list each time
+  do {
+    found = 0;
+    for (conn = server->http2_connections; conn; conn = conn->next) {
+      if (!conn->busy && conn->ready_first) {
+        found = 1;
+        break;
+      }
+    }
+    if (found) {
+      conn->busy++;
+      connection_dispatch(conn);
+      connection_flush(conn);
+      conn->busy--;
+      connection_release(conn);
+    }
+  } while (found);
+}
+
+// Close all the connections, when the server is freed
+void redhttp_http2_close_all(redhttp_server_t * server)
+{
+  http2_connection_t *conn, *next;
+
+  for (conn = server->http2_connections; conn; conn = next) {
+    next = conn->next;
+    connection_close(conn);
+  }
+}
+
+#else
+
+// HTTP/2 is not supported by this build
+int redhttp_http2_check_preface(int socket)
+{
+  return 0;
+}
+
+int redhttp_http2_check_upgrade(redhttp_request_t * request)
+{
+  return 0;
+}
+
+int redhttp_http2_start(redhttp_request_t * request, int upgrade)
+{
+  redhttp_request_free(request);
+  return -1;
+}
+
+void redhttp_http2_send_headers(redhttp_request_t * request, redhttp_response_t * response)
+{
+}
+
+int redhttp_http2_pending(redhttp_server_t * server)
+{
+  return 0;
+}
+
+void redhttp_http2_dispatch_pending(redhttp_server_t * server)
+{
+}
+
+void redhttp_http2_close_all(redhttp_server_t * server)
+{
+}
+
+#endif
+
+// Returns true if HTTP/2 connections can be served by this build
+int redhttp_http2_is_supported(void)
+{
+#ifdef REDHTTP_HTTP2
+  return 1;
+#else
+  return 0;
+#endif
+}
@@ -96,7 +96,7 @@ redhttp_negotiate_t *redhttp_negotiate_parse(const char *str)
           const char *p;
           // Scan for q= parameter
           // FIXME: this could be improved
-          for (p = params; p < (ptr - 3); p++) {
+          for (p = params; p + 2 < ptr; p++) {
             if (p[0] == 'q' && p[1] == '=') {
               const char * nptr = &p[2];
               char * endptr = NULL;
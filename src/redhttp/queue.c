@@ -0,0 +1,290 @@
+/*
+    RedHTTP - a lightweight HTTP server library
+    Copyright (C) 2010-2011 Nicholas J Humfrey <njh@aelius.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Request queues
+
+  Without them, connections the server has not got round to wait in the
+  kernel's listen backlog, where the server can't tell how many there are
+  and the clients can't tell why nothing is happening.
+
+  If a classifier has been set, each request that has been read is put on
+  one of the server's queues instead of being dispatched straight away;
+  the classifier chooses which one. Each time the server is run, it
+  accepts and reads every connection that is waiting, and then dispatches
+  one queued request. So the queues, rather than the backlog, hold
+  the requests that are waiting.
+
+  Each queue can have a limit on its length. A request that would go over
+  it is answered straight away with 503 Service Unavailable, and a
+  Retry-After header, so the requests that have been queued are answered
+  in bounded time and the others find out quickly that they should come
+  back later.
+
+  The queues are dispatched by weighted round-robin: among the queues
+  with requests waiting, each gets a share of the dispatches in
+  proportion to its weight, in the order the requests arrived within
+  each queue. A queue of cheap requests with a large weight is not held
+  up behind a long queue of expensive ones, and an expensive queue with a
+  small weight still gets its turn.
+
+  The server can also be given a gate, which is asked before a request
+  is dispatched from a queue, and can keep a queue closed while, for
+  example, all the processes which run expensive requests are busy. The
+  requests on a closed queue wait, up to its limit, and the gate is asked
+  again a few times a second.
+
+  Requests on HTTP/2 connections are not queued; they are limited by the
+  number of streams allowed on each connection.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "redhttp_private.h"
+#include "redhttp.h"
+
+// Milliseconds between asking the gate again about a closed queue
+#define QUEUE_GATE_INTERVAL   (50)
+
+
+// Queue a request that has been read; returns 1 if it was queued, or
+// has been refused, or 0 if it should be dispatched now
+int redhttp_queue_add(redhttp_server_t * server, redhttp_request_t * request)
+{
+  struct redhttp_queue_s *queue;
+  int index;
+
+  if (!server->classify)
+    return 0;
+
+  index = server->classify(request, server->classify_data);
+  if (index < 0 || index >= REDHTTP_MAX_QUEUES)
+    return 0;
+
+  queue = &server->queues[index];
+  if (queue->limit > 0 && queue->length >= queue->limit) {
+    redhttp_response_t *response = redhttp_response_new_error_page(
+      REDHTTP_SERVICE_UNAVAILABLE, "Too many requests are waiting; please try again later."
+    );
+
+    if (response && server->retry_after > 0) {
+      char value[16];
+      snprintf(value, sizeof(value), "%d", server->retry_after);
+      redhttp_response_add_header(response, "Retry-After", value);
+    }
+
+    queue->rejected++;
+    redhttp_server_respond(server, request, response);
+    return 1;
+  }
+
+  request->queued_seq = ++server->queued_seq;
+  request->queue_next = NULL;
+  if (queue->last) {
+    queue->last->queue_next = request;
+  } else {
+    queue->first = request;
+  }
+  queue->last = request;
+  queue->length++;
+
+  return 1;
+}
+
+static int queue_is_open(redhttp_server_t * server, int index)
+{
+  if (!server->queues[index].first)
+    return 0;
+
+  return !server->gate || server->gate(index, server->gate_data);
+}
+
+// Returns the milliseconds the server should wait, at most, before
+// dispatching again: 0 if there are queued requests to dispatch, a short
+// interval if they are waiting for their queue to be opened, or -1
+int redhttp_queue_wait(redhttp_server_t * server)
+{
+  int i, wait = -1;
+
+  for (i = 0; i < REDHTTP_MAX_QUEUES; i++) {
+    if (queue_is_open(server, i))
+      return 0;
+    if (server->queues[i].first)
+      wait = QUEUE_GATE_INTERVAL;
+  }
+
+  return wait;
+}
+
+// Dispatch a request from the open queue whose turn it is: each queue
+// earns credit in proportion to its weight, and the one with the most
+// pays for its dispatch with the weights of all of them
+void redhttp_queue_dispatch(redhttp_server_t * server)
+{
+  struct redhttp_queue_s *chosen = NULL;
+  redhttp_request_t *request;
+  long total = 0;
+  int i;
+
+  for (i = 0; i < REDHTTP_MAX_QUEUES; i++) {
+    struct redhttp_queue_s *queue = &server->queues[i];
+
+    if (!queue_is_open(server, i))
+      continue;
+
+    queue->credit += queue->weight;
+    total += queue->weight;
+    if (!chosen || queue->credit > chosen->credit ||
+        (queue->credit == chosen->credit && queue->first->queued_seq < chosen->first->queued_seq))
+      chosen = queue;
+  }
+
+  if (!chosen)
+    return;
+
+  chosen->credit -= total;
+  request = chosen->first;
+  chosen->first = request->queue_next;
+  if (!chosen->first)
+    chosen->last = NULL;
+  chosen->length--;
+  request->queue_next = NULL;
+
+  // Credit is only earned while waiting, so an idle queue can't save up
+  if (!chosen->first)
+    chosen->credit = 0;
+
+  redhttp_server_respond(server, request, NULL);
+}
+
+// Close the connections of the queued requests, when the server is freed
+void redhttp_queue_free_all(redhttp_server_t * server)
+{
+  int i;
+
+  for (i = 0; i < REDHTTP_MAX_QUEUES; i++) {
+    struct redhttp_queue_s *queue = &server->queues[i];
+
+    while (queue->first) {
+      redhttp_request_t *request = queue->first;
+      queue->first = request->queue_next;
+      redhttp_request_free(request);
+    }
+    queue->last = NULL;
+    queue->length = 0;
+  }
+}
+
+// In a forked child process, close its copies of the connections of the
+// queued requests, and of those waiting for their requests, so that the
+// parent's responses to them are not held open until the child exits
+void redhttp_server_release_queued(redhttp_server_t * server)
+{
+  assert(server != NULL);
+
+  redhttp_queue_free_all(server);
+  redhttp_deadline_free_all(server);
+}
+
+// Set the function which chooses the queue for each request; it returns
+// the number of the queue, or -1 to dispatch the request straight away
+void redhttp_server_set_classifier(redhttp_server_t * server, redhttp_classify_func func,
+                                   void *user_data)
+{
+  assert(server != NULL);
+
+  server->classify = func;
+  server->classify_data = user_data;
+}
+
+// Set the most requests that may wait on a queue; 0 for no limit
+void redhttp_server_set_queue_limit(redhttp_server_t * server, int queue, int limit)
+{
+  assert(server != NULL);
+  assert(queue >= 0 && queue < REDHTTP_MAX_QUEUES);
+
+  server->queues[queue].limit = limit;
+}
+
+int redhttp_server_get_queue_limit(redhttp_server_t * server, int queue)
+{
+  assert(queue >= 0 && queue < REDHTTP_MAX_QUEUES);
+
+  return server->queues[queue].limit;
+}
+
+int redhttp_server_get_queue_length(redhttp_server_t * server, int queue)
+{
+  assert(queue >= 0 && queue < REDHTTP_MAX_QUEUES);
+
+  return server->queues[queue].length;
+}
+
+// Returns the number of requests refused because the queue was full
+unsigned long redhttp_server_get_queue_rejected(redhttp_server_t * server, int queue)
+{
+  assert(queue >= 0 && queue < REDHTTP_MAX_QUEUES);
+
+  return server->queues[queue].rejected;
+}
+
+// Set the share of the dispatches that a queue gets, relative to the
+// weights of the other queues with requests waiting
+void redhttp_server_set_queue_weight(redhttp_server_t * server, int queue, int weight)
+{
+  assert(server != NULL);
+  assert(queue >= 0 && queue < REDHTTP_MAX_QUEUES);
+  assert(weight > 0);
+
+  server->queues[queue].weight = weight;
+}
+
+int redhttp_server_get_queue_weight(redhttp_server_t * server, int queue)
+{
+  assert(queue >= 0 && queue < REDHTTP_MAX_QUEUES);
+
+  return server->queues[queue].weight;
+}
+
+// Set the function asked before a request is dispatched from a queue; it
+// returns 0 to keep the requests on that queue waiting
+void redhttp_server_set_queue_gate(redhttp_server_t * server, redhttp_gate_func func,
+                                   void *user_data)
+{
+  assert(server != NULL);
+
+  server->gate = func;
+  server->gate_data = user_data;
+}
+
+// Set the number of seconds, sent in Retry-After, that a refused client
+// should wait before trying again; 0 to leave it out
+void redhttp_server_set_retry_after(redhttp_server_t * server, int seconds)
+{
+  assert(server != NULL);
+
+  server->retry_after = seconds;
+}
+
+int redhttp_server_get_retry_after(redhttp_server_t * server)
+{
+  return server->retry_after;
+}
@@ -28,6 +28,8 @@
 #define _REDHTTP_H_
 
 #define DEFAUT_HTTP_SERVER_BACKLOG_SIZE  (16)
+#define DEFAULT_HTTP2_MAX_STREAMS        (100)
+#define REDHTTP_MAX_QUEUES               (8)
 
 enum redhttp_status_code {
   REDHTTP_OK = 200,
@@ -39,6 +41,7 @@ enum redhttp_status_code {
   REDHTTP_MOVED_TEMPORARILY = 302,
   REDHTTP_SEE_OTHER = 303,
   REDHTTP_NOT_MODIFIED = 304,
+  REDHTTP_TEMPORARY_REDIRECT = 307,
 
   REDHTTP_BAD_REQUEST = 400,
   REDHTTP_UNAUTHORIZED = 401,
@@ -46,6 +49,9 @@ enum redhttp_status_code {
   REDHTTP_NOT_FOUND = 404,
   REDHTTP_METHOD_NOT_ALLOWED = 405,
   REDHTTP_NOT_ACCEPTABLE = 406,
+  REDHTTP_UNSUPPORTED_MEDIA_TYPE = 415,
+  REDHTTP_TOO_MANY_REQUESTS = 429,
+  REDHTTP_REQUEST_HEADER_FIELDS_TOO_LARGE = 431,
 
   REDHTTP_INTERNAL_SERVER_ERROR = 500,
   REDHTTP_NOT_IMPLEMENTED = 501,
@@ -62,6 +68,13 @@ typedef struct redhttp_server_s redhttp_server_t;
 typedef struct redhttp_negotiate_s redhttp_negotiate_t;
 
 typedef redhttp_response_t *(*redhttp_handler_func) (redhttp_request_t * request, void *user_data);
+typedef void (*redhttp_watch_func) (int fd, void *user_data);
+typedef void (*redhttp_filter_func) (redhttp_request_t * request, redhttp_response_t * response,
+                                     void *user_data);
+typedef int (*redhttp_connection_func) (int socket, struct sockaddr * sa, size_t sa_len,
+                                        void *user_data);
+typedef int (*redhttp_classify_func) (redhttp_request_t * request, void *user_data);
+typedef int (*redhttp_gate_func) (int queue, void *user_data);
 
 
 void redhttp_headers_print(redhttp_header_t ** first, FILE * socket);
@@ -110,11 +123,18 @@ const char *redhttp_request_get_server_port(redhttp_request_t * request);
 void redhttp_request_set_socket(redhttp_request_t * request, FILE * socket);
 FILE *redhttp_request_get_socket(redhttp_request_t * request);
 void redhttp_request_set_socket(redhttp_request_t * request, FILE * socket);
+void redhttp_request_set_deferred(redhttp_request_t * request, int deferred);
+int redhttp_request_get_deferred(redhttp_request_t * request);
 char *redhttp_request_get_content_buffer(redhttp_request_t * request);
 size_t redhttp_request_get_content_length(redhttp_request_t * request);
 int redhttp_request_read_status_line(redhttp_request_t * request);
 int redhttp_request_read(redhttp_request_t * request);
+int redhttp_request_read_content(redhttp_request_t * request);
+int redhttp_request_is_multiplexed(redhttp_request_t * request);
+void redhttp_request_set_admitted(redhttp_request_t * request, int admitted);
+int redhttp_request_get_admitted(redhttp_request_t * request);
 void redhttp_request_free(redhttp_request_t * request);
+void redhttp_request_finish(redhttp_request_t * request, redhttp_response_t * response);
 
 
 const char* redhttp_response_status_message_for_code(int code);
@@ -142,6 +162,8 @@ char *redhttp_response_get_content_buffer(redhttp_response_t * response);
 int redhttp_response_get_content_length(redhttp_response_t * response);
 void *redhttp_response_get_user_data(redhttp_response_t * response);
 void redhttp_response_set_user_data(redhttp_response_t * response, void *user_data);
+void redhttp_response_set_headers_sent(redhttp_response_t * response, int headers_sent);
+int redhttp_response_get_headers_sent(redhttp_response_t * response);
 void redhttp_response_free(redhttp_response_t * response);
 
 redhttp_server_t *redhttp_server_new(void);
@@ -158,6 +180,50 @@ void redhttp_server_set_signature(redhttp_server_t * server, const char *signatu
 const char *redhttp_server_get_signature(redhttp_server_t * server);
 void redhttp_server_set_backlog_size(redhttp_server_t * server, int backlog_size);
 int redhttp_server_get_backlog_size(redhttp_server_t * server);
+void redhttp_server_set_idle_timeout(redhttp_server_t * server, int milliseconds);
+int redhttp_server_get_idle_timeout(redhttp_server_t * server);
+int redhttp_server_add_watch(redhttp_server_t * server, int fd, redhttp_watch_func func,
+                             void *user_data);
+int redhttp_server_add_write_watch(redhttp_server_t * server, int fd, redhttp_watch_func func,
+                                   void *user_data);
+void redhttp_server_remove_watch(redhttp_server_t * server, int fd);
+void redhttp_server_set_response_filter(redhttp_server_t * server, redhttp_filter_func func,
+                                        void *user_data);
+void redhttp_server_set_connection_filter(redhttp_server_t * server,
+                                          redhttp_connection_func func, void *user_data);
+int redhttp_server_set_reuse_port(redhttp_server_t * server, int reuse_port);
+int redhttp_server_get_reuse_port(redhttp_server_t * server);
+void redhttp_server_set_classifier(redhttp_server_t * server, redhttp_classify_func func,
+                                   void *user_data);
+void redhttp_server_set_queue_limit(redhttp_server_t * server, int queue, int limit);
+int redhttp_server_get_queue_limit(redhttp_server_t * server, int queue);
+int redhttp_server_get_queue_length(redhttp_server_t * server, int queue);
+unsigned long redhttp_server_get_queue_rejected(redhttp_server_t * server, int queue);
+void redhttp_server_set_queue_weight(redhttp_server_t * server, int queue, int weight);
+int redhttp_server_get_queue_weight(redhttp_server_t * server, int queue);
+void redhttp_server_set_queue_gate(redhttp_server_t * server, redhttp_gate_func func,
+                                   void *user_data);
+void redhttp_server_release_queued(redhttp_server_t * server);
+void redhttp_server_set_retry_after(redhttp_server_t * server, int seconds);
+int redhttp_server_get_retry_after(redhttp_server_t * server);
+void redhttp_server_set_header_timeout(redhttp_server_t * server, int milliseconds);
+int redhttp_server_get_header_timeout(redhttp_server_t * server);
+void redhttp_server_set_body_timeout(redhttp_server_t * server, int milliseconds);
+int redhttp_server_get_body_timeout(redhttp_server_t * server);
+void redhttp_server_set_write_timeout(redhttp_server_t * server, int milliseconds);
+int redhttp_server_get_write_timeout(redhttp_server_t * server);
+void redhttp_server_set_max_header_size(redhttp_server_t * server, int size);
+int redhttp_server_get_max_header_size(redhttp_server_t * server);
+void redhttp_server_set_max_header_count(redhttp_server_t * server, int count);
+int redhttp_server_get_max_header_count(redhttp_server_t * server);
+unsigned long redhttp_server_get_timed_out(redhttp_server_t * server);
+unsigned long redhttp_server_get_headers_refused(redhttp_server_t * server);
+void redhttp_server_set_http2_max_streams(redhttp_server_t * server, int max_streams);
+int redhttp_server_get_http2_max_streams(redhttp_server_t * server);
+int redhttp_http2_is_supported(void);
+int redhttp_server_set_io_uring(redhttp_server_t * server, int enabled);
+int redhttp_server_get_io_uring(redhttp_server_t * server);
+int redhttp_io_uring_is_supported(void);
 void redhttp_server_free(redhttp_server_t * server);
 
 int redhttp_negotiate_compare_types(const char *server_type, const char *client_type);
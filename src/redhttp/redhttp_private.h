@@ -37,6 +37,11 @@
 #define NI_MAXSERV (32)
 #endif
 
+// Also defined in redhttp.h, which is included after this file
+#ifndef REDHTTP_MAX_QUEUES
+#define REDHTTP_MAX_QUEUES               (8)
+#endif
+
 
 struct redhttp_header_s {
   char *key;
@@ -50,6 +55,7 @@ struct redhttp_request_s {
   struct redhttp_server_s *server;
 
   FILE *socket;
+  int socket_fd;
   char remote_addr[NI_MAXHOST];
   char remote_port[NI_MAXSERV];
 
@@ -60,7 +66,6 @@ struct redhttp_request_s {
   char *method;
   char *path_and_query;
   char *version;
-  void *user_data;
 
   char *url;
   char *path;
@@ -71,6 +76,22 @@ struct redhttp_request_s {
   size_t content_length;
 
   struct redhttp_type_q_s *accept;
+
+  int deferred;
+  int admitted;
+
+  // Bytes of the request line and headers read so far
+  size_t header_size;
+
+  // Set while the request is waiting on one of the server's queues
+  unsigned long queued_seq;
+  struct redhttp_request_s *queue_next;
+
+  // Set when the request is a stream of an HTTP/2 connection
+  struct redhttp_http2_stream_s *stream;
+
+  // Set when the socket is read and written with deadlines
+  struct redhttp_deadline_stream_s *deadline;
 };
 
 struct redhttp_response_s {
@@ -101,15 +122,98 @@ struct redhttp_negotiate_s {
   struct redhttp_negotiate_s *next;
 };
 
+struct redhttp_watch_s {
+  int fd;
+  int writable;                 // wait for the fd to be writable, not readable
+  void (*func) (int fd, void *user_data);
+  void *user_data;
+  struct redhttp_watch_s *next;
+
+  // The queued poll, when using io_uring
+  struct redhttp_uring_op_s *uring_op;
+};
+
+struct redhttp_queue_s {
+  struct redhttp_request_s *first;
+  struct redhttp_request_s *last;
+  int length;
+  int limit;
+  unsigned long rejected;
+
+  // Share of the dispatches, for weighted round-robin between the queues
+  int weight;
+  long credit;
+};
+
+// A new connection, waiting for its request to arrive
+struct redhttp_pending_s {
+  struct redhttp_server_s *server;
+  int fd;
+  int preface;
+  struct sockaddr_storage ss;
+  socklen_t ss_len;
+
+  // The tick of the wheel by which the request must arrive
+  long deadline;
+
+  // The length of the headers and body, once the headers have arrived
+  size_t expected;
+
+  struct redhttp_pending_s *prev;
+  struct redhttp_pending_s *next;
+};
+
+#define REDHTTP_WHEEL_SLOTS  (128)
+
 struct redhttp_server_s {
   int sockets[FD_SETSIZE];
   int socket_count;
   int socket_max;
 
   int backlog_size;
+  int idle_timeout;
   char *signature;
 
   struct redhttp_handler_s *handlers;
+  struct redhttp_watch_s *watches;
+
+  void (*response_filter) (struct redhttp_request_s * request,
+                           struct redhttp_response_s * response, void *user_data);
+  void *response_filter_data;
+
+  int (*connection_filter) (int socket, struct sockaddr * sa, size_t sa_len, void *user_data);
+  void *connection_filter_data;
+
+  // Set to let several processes listen on the same port
+  int reuse_port;
+
+  int http2_max_streams;
+  struct redhttp_http2_connection_s *http2_connections;
+
+  // Set when connections are accepted using io_uring rather than select()
+  struct redhttp_uring_s *uring;
+
+  // Requests which have been read, waiting to be dispatched
+  int (*classify) (struct redhttp_request_s * request, void *user_data);
+  void *classify_data;
+  int (*gate) (int queue, void *user_data);
+  void *gate_data;
+  struct redhttp_queue_s queues[REDHTTP_MAX_QUEUES];
+  unsigned long queued_seq;
+  int retry_after;
+
+  // Deadlines and limits for reading requests, and writing responses
+  int header_timeout;
+  int body_timeout;
+  int write_timeout;
+  int max_header_size;
+  int max_header_count;
+  struct redhttp_pending_s *wheel[REDHTTP_WHEEL_SLOTS];
+  long wheel_tick;
+  int pending_count;
+  char *peek_buffer;
+  unsigned long timed_out;
+  unsigned long headers_refused;
 };
 
 static inline char* redhttp_strndup(const char* str1, size_t str1_len)
@@ -151,5 +255,45 @@ static inline int redhttp_strcasecmp(const char *s1, const char *s2)
 }
 
 
+// Used between the HTTP/1.0 and HTTP/2 parts of the server
+void redhttp_server_respond(struct redhttp_server_s *server, struct redhttp_request_s *request,
+                            struct redhttp_response_s *response);
+int redhttp_http2_check_preface(int socket);
+int redhttp_http2_check_upgrade(struct redhttp_request_s *request);
+int redhttp_http2_start(struct redhttp_request_s *request, int upgrade);
+void redhttp_http2_send_headers(struct redhttp_request_s *request,
+                                struct redhttp_response_s *response);
+int redhttp_http2_pending(struct redhttp_server_s *server);
+void redhttp_http2_dispatch_pending(struct redhttp_server_s *server);
+void redhttp_http2_close_all(struct redhttp_server_s *server);
+
+// Used between the server and its request queues
+int redhttp_queue_add(struct redhttp_server_s *server, struct redhttp_request_s *request);
+int redhttp_queue_wait(struct redhttp_server_s *server);
+void redhttp_queue_dispatch(struct redhttp_server_s *server);
+void redhttp_queue_free_all(struct redhttp_server_s *server);
+
+// Used between the server and the deadlines of its connections
+int redhttp_server_start_connection(struct redhttp_server_s *server, int socket,
+                                    struct sockaddr *sa, size_t sa_len, int preface,
+                                    int header_wait);
+int redhttp_deadline_wait(struct redhttp_server_s *server, int socket, struct sockaddr *sa,
+                          size_t sa_len, int preface);
+void redhttp_deadline_expire(struct redhttp_server_s *server);
+int redhttp_deadline_wait_time(struct redhttp_server_s *server);
+void redhttp_deadline_set_socket_timeouts(struct redhttp_server_s *server, int socket);
+int redhttp_deadline_open(struct redhttp_request_s *request, int socket, const char *mode,
+                          int header_wait);
+void redhttp_deadline_start_body(struct redhttp_request_s *request);
+void redhttp_deadline_free_all(struct redhttp_server_s *server);
+
+// Used between the server and its io_uring backend
+int redhttp_server_handle_connection(struct redhttp_server_s *server, int socket,
+                                     struct sockaddr *sa, size_t sa_len, int preface);
+struct redhttp_uring_s *redhttp_uring_new(void);
+void redhttp_uring_run(struct redhttp_server_s *server);
+void redhttp_uring_remove_watch(struct redhttp_server_s *server, struct redhttp_watch_s *watch);
+void redhttp_uring_free(struct redhttp_server_s *server);
+
 
 #endif
@@ -38,6 +38,7 @@ redhttp_request_t *redhttp_request_new(void)
     perror("failed to allocate memory for redhttp_request_t");
     return NULL;
   }
+  request->socket_fd = -1;
 
   return request;
 }
@@ -56,6 +57,16 @@ redhttp_request_t *redhttp_request_new_with_args(const char *method,
   return request;
 }
 
+// Returns true if the request line and headers have gone over the size
+// allowed by the server
+static int header_too_large(redhttp_request_t * request)
+{
+  redhttp_server_t *server = request->server;
+
+  return server && server->max_header_size > 0 &&
+    request->header_size > (size_t) server->max_header_size;
+}
+
 char *redhttp_request_read_line(redhttp_request_t * request)
 {
   char *buffer = calloc(1, BUFSIZ);
@@ -88,6 +99,11 @@ char *redhttp_request_read_line(redhttp_request_t * request)
     }
 
     buffer_count++;
+    request->header_size++;
+    if (header_too_large(request)) {
+      free(buffer);
+      return NULL;
+    }
 
     // Expand buffer ?
     if (buffer_count > (buffer_size - 1)) {
@@ -406,6 +422,8 @@ const char *redhttp_request_get_server_port(redhttp_request_t * request)
 void redhttp_request_set_socket(redhttp_request_t * request, FILE * socket)
 {
   request->socket = socket;
+  request->socket_fd = socket ? fileno(socket) : -1;
+  request->deadline = NULL;
 }
 
 FILE *redhttp_request_get_socket(redhttp_request_t * request)
@@ -413,6 +431,36 @@ FILE *redhttp_request_get_socket(redhttp_request_t * request)
   return request->socket;
 }
 
+void redhttp_request_set_deferred(redhttp_request_t * request, int deferred)
+{
+  request->deferred = deferred;
+}
+
+int redhttp_request_get_deferred(redhttp_request_t * request)
+{
+  return request->deferred;
+}
+
+// Returns true if the request shares its connection with other requests,
+// as a stream of an HTTP/2 connection. The response to such a request can
+// only be written by the server process itself.
+int redhttp_request_is_multiplexed(redhttp_request_t * request)
+{
+  return request->stream != NULL;
+}
+
+// Marks a request as already accepted by admission control, so that it
+// isn't counted again when it is dispatched
+void redhttp_request_set_admitted(redhttp_request_t * request, int admitted)
+{
+  request->admitted = admitted;
+}
+
+int redhttp_request_get_admitted(redhttp_request_t * request)
+{
+  return request->admitted;
+}
+
 char *redhttp_request_get_content_buffer(redhttp_request_t * request)
 {
   return request->content_buffer;
@@ -423,6 +471,30 @@ size_t redhttp_request_get_content_length(redhttp_request_t * request)
   return request->content_length;
 }
 
+// Count a request refused because of its headers
+static int refuse_headers(redhttp_request_t * request)
+{
+  int fd = dup(request->socket_fd);
+  FILE *in = request->socket;
+  struct redhttp_deadline_stream_s *in_deadline = request->deadline;
+
+  request->server->headers_refused++;
+
+  // The rest of the headers are left unread, so the response is written
+  // through a new stream; writing to the one they were read from would
+  // try to seek back over them, which fails on a socket
+  if (fd >= 0 && redhttp_deadline_open(request, fd, "w", 0) == 0) {
+    fclose(in);
+  } else {
+    if (fd >= 0)
+      close(fd);
+    request->socket = in;
+    request->deadline = in_deadline;
+  }
+
+  return REDHTTP_REQUEST_HEADER_FIELDS_TOO_LARGE;
+}
+
 int redhttp_request_read_status_line(redhttp_request_t * request)
 {
   char *line, *ptr;
@@ -437,7 +509,7 @@ int redhttp_request_read_status_line(redhttp_request_t * request)
     // FAIL!
     if (line)
       free(line);
-    return REDHTTP_BAD_REQUEST;
+    return header_too_large(request) ? refuse_headers(request) : REDHTTP_BAD_REQUEST;
   }
   // Skip whitespace at the start
   for (ptr = line; isspace(*ptr); ptr++)
@@ -494,6 +566,9 @@ int redhttp_request_read(redhttp_request_t * request)
     return result;
 
   if (request->version && strncmp(request->version, "0.9", 3) != 0) {
+    redhttp_server_t *server = request->server;
+    int count = 0;
+
     // Read in the headers
     while (!feof(request->socket)) {
       char *line = redhttp_request_read_line(request);
@@ -502,31 +577,51 @@ int redhttp_request_read(redhttp_request_t * request)
           free(line);
         break;
       }
+      if (server && server->max_header_count > 0 && ++count > server->max_header_count) {
+        free(line);
+        return refuse_headers(request);
+      }
       redhttp_headers_parse_line(&request->headers, line);
       free(line);
     }
+    if (header_too_large(request))
+      return refuse_headers(request);
+    // The headers didn't arrive in time
+    if (ferror(request->socket))
+      return REDHTTP_BAD_REQUEST;
+
+    redhttp_deadline_start_body(request);
+    result = redhttp_request_read_content(request);
+  }
+
+  return result;
+}
 
-    // Read in PUT/POST content
-    if (strncmp(request->method, "POST", 4) == 0) {
-      const char *content_type = redhttp_headers_get(&request->headers, "Content-Type");
-      const char *content_length = redhttp_headers_get(&request->headers, "Content-Length");
-      int bytes_read = 0;
-
-      if (content_type == NULL || content_length == NULL) {
-        return REDHTTP_BAD_REQUEST;
-      } else if (strncmp(content_type, "application/x-www-form-urlencoded", 33) == 0) {
-        request->content_length = atoi(content_length);
-        // FIXME: set maximum POST size
-        request->content_buffer = calloc(1, request->content_length + 1);
-        if (request->content_buffer) {
-          bytes_read = fread(request->content_buffer, 1, request->content_length, request->socket);
-          if (bytes_read != request->content_length) {
-            perror("failed to read request");
-            // FIXME: better response?
-            return REDHTTP_BAD_REQUEST;
-          } else {
-            redhttp_request_parse_arguments(request, request->content_buffer);
-          }
+// Read the body of a form POST, and parse the arguments in it; other
+// bodies are left for the handler to read from the socket
+int redhttp_request_read_content(redhttp_request_t * request)
+{
+  assert(request != NULL);
+
+  if (strncmp(request->method, "POST", 4) == 0) {
+    const char *content_type = redhttp_headers_get(&request->headers, "Content-Type");
+    const char *content_length = redhttp_headers_get(&request->headers, "Content-Length");
+    int bytes_read = 0;
+
+    if (content_type == NULL || content_length == NULL) {
+      return REDHTTP_BAD_REQUEST;
+    } else if (strncmp(content_type, "application/x-www-form-urlencoded", 33) == 0) {
+      request->content_length = atoi(content_length);
+      // FIXME: set maximum POST size
+      request->content_buffer = calloc(1, request->content_length + 1);
+      if (request->content_buffer) {
+        bytes_read = fread(request->content_buffer, 1, request->content_length, request->socket);
+        if (bytes_read != request->content_length) {
+          perror("failed to read request");
+          // FIXME: better response?
+          return REDHTTP_BAD_REQUEST;
+        } else {
+          redhttp_request_parse_arguments(request, request->content_buffer);
         }
       }
     }
@@ -566,3 +661,23 @@ void redhttp_request_free(redhttp_request_t * request)
 
   free(request);
 }
+
+// Send the response to a deferred request, and free both of them
+void redhttp_request_finish(redhttp_request_t * request, redhttp_response_t * response)
+{
+  assert(request != NULL);
+  assert(response != NULL);
+
+  if (request->socket) {
+    redhttp_response_send(response, request);
+    fflush(request->socket);
+
+    // Child processes may hold copies of the socket, so signal the
+    // end of the response explicitly rather than relying on close
+    if (!request->stream)
+      shutdown(request->socket_fd, SHUT_WR);
+  }
+
+  redhttp_response_free(response);
+  redhttp_request_free(request);
+}
@@ -43,12 +43,16 @@ static struct redhttp_message_s {
   REDHTTP_MOVED_TEMPORARILY, "Moved Temporarily"}, {
   REDHTTP_SEE_OTHER, "See Other"}, {
   REDHTTP_NOT_MODIFIED, "Not Modified"}, {
+  REDHTTP_TEMPORARY_REDIRECT, "Temporary Redirect"}, {
   REDHTTP_BAD_REQUEST, "Bad Request"}, {
   REDHTTP_UNAUTHORIZED, "Unauthorized"}, {
   REDHTTP_FORBIDDEN, "Forbidden"}, {
   REDHTTP_NOT_FOUND, "Not Found"}, {
   REDHTTP_METHOD_NOT_ALLOWED, "Method Not Allowed"}, {
   REDHTTP_NOT_ACCEPTABLE, "Not Acceptable"}, {
+  REDHTTP_UNSUPPORTED_MEDIA_TYPE, "Unsupported Media Type"}, {
+  REDHTTP_TOO_MANY_REQUESTS, "Too Many Requests"}, {
+  REDHTTP_REQUEST_HEADER_FIELDS_TOO_LARGE, "Request Header Fields Too Large"}, {
   REDHTTP_INTERNAL_SERVER_ERROR, "Internal Server Error"}, {
   REDHTTP_NOT_IMPLEMENTED, "Not Implemented"}, {
   REDHTTP_BAD_GATEWAY, "Bad Gateway"}, {
@@ -218,7 +222,7 @@ void redhttp_response_copy_content(redhttp_response_t * response,
   assert(content != NULL);
   assert(length > 0);
 
-  new_buf = realloc(response->content_buffer, length+1);
+  new_buf = malloc(length+1);
   if (new_buf) {
     memcpy(new_buf, content, length);
     new_buf[length] = '\0';
@@ -232,6 +236,11 @@ void redhttp_response_set_content(redhttp_response_t * response, char *content,
   assert(content != NULL);
   assert(length > 0);
 
+  // Free any content which is being replaced
+  if (response->content_buffer && response->content_buffer != content &&
+      response->content_free_callback)
+    response->content_free_callback(response->content_buffer);
+
   response->content_buffer = content;
   response->content_length = length;
   response->content_free_callback = content_free_callback;
@@ -243,6 +252,9 @@ void redhttp_response_send(redhttp_response_t * response, redhttp_request_t * re
   assert(response != NULL);
 
   if (!response->headers_sent) {
+    if (request->server && request->server->response_filter)
+      request->server->response_filter(request, response, request->server->response_filter_data);
+
     // Add a content-length header, if content length has been defined
     if (response->content_length >= 0) {
       char length_str[32] = "";
@@ -251,7 +263,8 @@ void redhttp_response_send(redhttp_response_t * response, redhttp_request_t * re
     }
 
     redhttp_response_add_time_header(response, "Date", time(NULL));
-    redhttp_response_add_header(response, "Connection", "Close");
+    if (!request->stream)
+      redhttp_response_add_header(response, "Connection", "Close");
 
     if (request->server) {
       const char *signature = redhttp_server_get_signature(request->server);
@@ -259,7 +272,9 @@ void redhttp_response_send(redhttp_response_t * response, redhttp_request_t * re
         redhttp_response_add_header(response, "Server", signature);
     }
 
-    if (request->version && strncmp(request->version, "0.9", 3) != 0) {
+    if (request->stream) {
+      redhttp_http2_send_headers(request, response);
+    } else if (request->version && strncmp(request->version, "0.9", 3) != 0) {
       fprintf(request->socket, "HTTP/1.0 %d %s\r\n",
               response->status_code, response->status_message);
       redhttp_response_print_headers(response, request->socket);
@@ -274,6 +289,9 @@ void redhttp_response_send(redhttp_response_t * response, redhttp_request_t * re
     assert(response->content_length > 0);
     written = fwrite(response->content_buffer, 1, response->content_length, request->socket);
     if (written != response->content_length) {
+      // The client stopped reading, and the write timeout passed
+      if (request->server && (errno == EAGAIN || errno == EWOULDBLOCK))
+        request->server->timed_out++;
       perror("failed to write response to client");
     }
   }
@@ -332,6 +350,16 @@ void redhttp_response_set_user_data(redhttp_response_t * response, void *user_da
   response->user_data = user_data;
 }
 
+void redhttp_response_set_headers_sent(redhttp_response_t * response, int headers_sent)
+{
+  response->headers_sent = headers_sent;
+}
+
+int redhttp_response_get_headers_sent(redhttp_response_t * response)
+{
+  return response->headers_sent;
+}
+
 void redhttp_response_free(redhttp_response_t * response)
 {
   assert(response != NULL);
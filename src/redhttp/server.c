@@ -25,6 +25,7 @@
 #include <assert.h>
 
 #include <errno.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 
@@ -49,6 +50,27 @@ redhttp_server_t *redhttp_server_new(void)
     }
     server->signature = NULL;
     server->backlog_size = DEFAUT_HTTP_SERVER_BACKLOG_SIZE;
+    server->idle_timeout = 0;
+    server->watches = NULL;
+    server->response_filter = NULL;
+    server->connection_filter = NULL;
+    server->reuse_port = 0;
+    server->http2_max_streams = redhttp_http2_is_supported() ? DEFAULT_HTTP2_MAX_STREAMS : 0;
+    server->http2_connections = NULL;
+    server->uring = NULL;
+    server->classify = NULL;
+    server->gate = NULL;
+    for (i = 0; i < REDHTTP_MAX_QUEUES; i++) {
+      server->queues[i].weight = 1;
+    }
+    server->retry_after = 0;
+    server->header_timeout = 0;
+    server->body_timeout = 0;
+    server->write_timeout = 0;
+    server->max_header_size = 0;
+    server->max_header_count = 0;
+    server->pending_count = 0;
+    server->peek_buffer = NULL;
   }
 
   return server;
@@ -95,6 +117,17 @@ int redhttp_server_listen(redhttp_server_t * server, const char *host,
       if (server->socket_count < 1)
         fprintf(stderr, "setsockopt(SO_REUSEADDR) failed: %s\n", strerror(errno));
     }
+#ifdef SO_REUSEPORT
+    // Let the kernel share out connections between processes listening
+    // on the same port
+    if (server->reuse_port &&
+        setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &true, sizeof(true)) < 0) {
+      if (server->socket_count < 1)
+        fprintf(stderr, "setsockopt(SO_REUSEPORT) failed: %s\n", strerror(errno));
+      close(sock);
+      continue;
+    }
+#endif
     // Bind the socket
     if (bind(sock, (struct sockaddr *) res->ai_addr, res->ai_addrlen) < 0) {
       if (server->socket_count < 1)
@@ -152,42 +185,130 @@ void redhttp_server_add_handler(redhttp_server_t * server, const char *method,
   }
 }
 
+// Free the watches that have been removed
+static void sweep_watches(redhttp_server_t * server)
+{
+  struct redhttp_watch_s **ptr = &server->watches;
+
+  while (*ptr) {
+    struct redhttp_watch_s *watch = *ptr;
+    if (watch->fd < 0) {
+      *ptr = watch->next;
+      free(watch);
+    } else {
+      ptr = &watch->next;
+    }
+  }
+}
+
+// Returns true if a connection is waiting to be accepted
+static int socket_readable(int fd)
+{
+  struct pollfd pfd;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+
+  return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN);
+}
+
 void redhttp_server_run(redhttp_server_t * server)
 {
+  struct redhttp_watch_s *watch;
   struct sockaddr_storage ss;
   struct sockaddr *sa = (struct sockaddr *) &ss;
   socklen_t len = sizeof(ss);
   int nfds = server->socket_max + 1;
-  fd_set rfd;
-  int i, m;
+  struct timeval tv, *timeout = NULL;
+  fd_set rfd, wfd;
+  int i, m, wait;
 
   assert(server != NULL);
 
   FD_ZERO(&rfd);
+  FD_ZERO(&wfd);
   for (i = 0; i < server->socket_count; i++) {
     FD_SET(server->sockets[i], &rfd);
   }
 
-  m = select(nfds, &rfd, NULL, NULL, NULL);
+  sweep_watches(server);
+  redhttp_deadline_expire(server);
+  if (server->uring) {
+    redhttp_uring_run(server);
+    return;
+  }
+
+  for (watch = server->watches; watch; watch = watch->next) {
+    FD_SET(watch->fd, watch->writable ? &wfd : &rfd);
+    if (watch->fd >= nfds)
+      nfds = watch->fd + 1;
+  }
+
+  // Return to the caller periodically, if an idle timeout is set
+  if (server->idle_timeout > 0) {
+    tv.tv_sec = server->idle_timeout / 1000;
+    tv.tv_usec = (server->idle_timeout % 1000) * 1000;
+    timeout = &tv;
+  }
+  // Don't wait if there are requests to answer, and not for long if
+  // queued requests are waiting for their queue to be opened
+  wait = redhttp_http2_pending(server) ? 0 : redhttp_queue_wait(server);
+  // Wake up to close the connections whose deadlines have passed
+  if (redhttp_deadline_wait_time(server) >= 0 &&
+      (wait < 0 || redhttp_deadline_wait_time(server) < wait))
+    wait = redhttp_deadline_wait_time(server);
+  if (wait >= 0 && (!timeout || wait < server->idle_timeout)) {
+    tv.tv_sec = wait / 1000;
+    tv.tv_usec = (wait % 1000) * 1000;
+    timeout = &tv;
+  }
+
+  m = select(nfds, &rfd, &wfd, NULL, timeout);
   if (m < 0) {
     if (errno == EINTR)
       return;
     perror("select");
     exit(EXIT_FAILURE);
+  } else if (m == 0) {
+    redhttp_http2_dispatch_pending(server);
+    redhttp_queue_dispatch(server);
+    return;
   }
 
   for (i = 0; i < server->socket_count; i++) {
-    if (FD_ISSET(server->sockets[i], &rfd)) {
-      int cs = accept(server->sockets[i], sa, &len);
+    int accepted = 0;
+
+    // When requests are queued, take every connection that is waiting,
+    // so that the queues rather than the listen backlog hold them
+    while (FD_ISSET(server->sockets[i], &rfd) || (server->classify &&
+           accepted < server->backlog_size && socket_readable(server->sockets[i]))) {
+      int cs;
+
+      FD_CLR(server->sockets[i], &rfd);
+      len = sizeof(ss);
+      cs = accept(server->sockets[i], sa, &len);
       if (cs < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == ECONNABORTED)
+          break;
         perror("accept");
         exit(EXIT_FAILURE);
-      } else {
-        redhttp_server_handle_request(server, cs, sa, len);
-        close(cs);
       }
+
+      // The request takes ownership of the socket
+      redhttp_server_handle_request(server, cs, sa, len);
+      accepted++;
     }
   }
+
+  // Watches removed by a callback are marked, and freed on the next run
+  for (watch = server->watches; watch; watch = watch->next) {
+    if (watch->fd >= 0 && FD_ISSET(watch->fd, watch->writable ? &wfd : &rfd))
+      watch->func(watch->fd, watch->user_data);
+  }
+
+  redhttp_http2_dispatch_pending(server);
+  redhttp_queue_dispatch(server);
 }
 
 static int match_route(redhttp_handler_t * handler, redhttp_request_t * request)
@@ -241,17 +362,56 @@ static int get_server_addr(redhttp_request_t * request, int socket)
 int redhttp_server_handle_request(redhttp_server_t * server, int socket,
                                   struct sockaddr *sa, size_t sa_len)
 {
-  redhttp_request_t *request = NULL;
-  redhttp_response_t *response = NULL;
+  return redhttp_server_handle_connection(server, socket, sa, sa_len, -1);
+}
 
+// Handle a request on a new connection; preface is 1 or 0 if it is
+// already known whether the connection starts with the HTTP/2 preface,
+// or -1 to look for it
+int redhttp_server_handle_connection(redhttp_server_t * server, int socket,
+                                     struct sockaddr *sa, size_t sa_len, int preface)
+{
   assert(server != NULL);
   assert(socket >= 0);
 
+  // With a header timeout, the connection is only read once its request
+  // has arrived, so that reading it doesn't block
+  if (redhttp_deadline_wait(server, socket, sa, sa_len, preface))
+    return 0;
+
+  return redhttp_server_start_connection(server, socket, sa, sa_len, preface,
+                                         server->header_timeout);
+}
+
+// Read the request on a new connection, and dispatch or queue it; the
+// headers are read within header_wait milliseconds, if it isn't 0
+int redhttp_server_start_connection(redhttp_server_t * server, int socket,
+                                    struct sockaddr *sa, size_t sa_len, int preface,
+                                    int header_wait)
+{
+  redhttp_request_t *request = NULL;
+  redhttp_response_t *response = NULL;
+  int result;
+
+  redhttp_deadline_set_socket_timeouts(server, socket);
+
+  // The connection filter may take over the connection before it is read
+  if (server->connection_filter &&
+      server->connection_filter(socket, sa, sa_len, server->connection_filter_data))
+    return 0;
+
   request = redhttp_request_new();
-  if (!request)
+  if (!request) {
+    close(socket);
     return -1;
+  }
   request->server = server;
-  request->socket = fdopen(socket, "r+");;
+  if (redhttp_deadline_open(request, socket, "r+", header_wait)) {
+    perror("could not open client socket");
+    close(socket);
+    redhttp_request_free(request);
+    return -1;
+  }
   if (getnameinfo(sa, sa_len,
                   request->remote_addr, sizeof(request->remote_addr),
                   request->remote_port, sizeof(request->remote_port),
@@ -267,22 +427,48 @@ int redhttp_server_handle_request(redhttp_server_t * server, int socket,
     return -1;
   }
 
-  if (redhttp_request_read(request)) {
-    // Invalid request
-    response = redhttp_response_new_error_page(REDHTTP_BAD_REQUEST, NULL);
+  // Clients which know that the server speaks HTTP/2 start with its preface
+  if (server->http2_max_streams > 0 &&
+      (preface < 0 ? redhttp_http2_check_preface(socket) : preface))
+    return redhttp_http2_start(request, 0);
+
+  result = redhttp_request_read(request);
+  if (result) {
+    // Invalid request, or one with too many headers
+    if (result != REDHTTP_REQUEST_HEADER_FIELDS_TOO_LARGE)
+      result = REDHTTP_BAD_REQUEST;
+    response = redhttp_response_new_error_page(result, NULL);
+  } else if (server->http2_max_streams > 0 && redhttp_http2_check_upgrade(request)) {
+    return redhttp_http2_start(request, 1);
+  } else if (redhttp_queue_add(server, request)) {
+    // Dispatched later by redhttp_server_run(), or already refused
+    return 0;
   }
-  // Dispatch the request
-  if (!response)
+
+  redhttp_server_respond(server, request, response);
+
+  // Success
+  return 0;
+}
+
+// Dispatch a request, unless there is already a response to it, and send
+// the response
+void redhttp_server_respond(redhttp_server_t * server, redhttp_request_t * request,
+                            redhttp_response_t * response)
+{
+  // Dispatch the request, which may go on to read its body
+  if (!response) {
+    redhttp_deadline_start_body(request);
     response = redhttp_server_dispatch_request(server, request);
+  }
 
   // Send response
   redhttp_response_send(response, request);
-
-  redhttp_request_free(request);
   redhttp_response_free(response);
 
-  // Success
-  return 0;
+  // A deferred request is finished later, by redhttp_request_finish()
+  if (!request->deferred)
+    redhttp_request_free(request);
 }
 
 
@@ -430,6 +616,82 @@ const char *redhttp_server_get_signature(redhttp_server_t * server)
   return server->signature;
 }
 
+// Set a function which is given each response just before its headers
+// are sent, so that it can change the headers or content
+void redhttp_server_set_response_filter(redhttp_server_t * server, redhttp_filter_func func,
+                                        void *user_data)
+{
+  assert(server != NULL);
+
+  server->response_filter = func;
+  server->response_filter_data = user_data;
+}
+
+// Set a function which is given each new connection, before anything has
+// been read from it; if it returns non-zero, it has taken the socket
+void redhttp_server_set_connection_filter(redhttp_server_t * server,
+                                          redhttp_connection_func func, void *user_data)
+{
+  assert(server != NULL);
+
+  server->connection_filter = func;
+  server->connection_filter_data = user_data;
+}
+
+// Set SO_REUSEPORT on the sockets opened by redhttp_server_listen(), so that
+// each of several processes can listen on the same port; returns -1 if it
+// isn't supported
+int redhttp_server_set_reuse_port(redhttp_server_t * server, int reuse_port)
+{
+  assert(server != NULL);
+
+#ifdef SO_REUSEPORT
+  server->reuse_port = reuse_port;
+  return 0;
+#else
+  return reuse_port ? -1 : 0;
+#endif
+}
+
+int redhttp_server_get_reuse_port(redhttp_server_t * server)
+{
+  return server->reuse_port;
+}
+
+// Set the number of concurrent streams allowed on each HTTP/2 connection;
+// 0 disables HTTP/2
+void redhttp_server_set_http2_max_streams(redhttp_server_t * server, int max_streams)
+{
+  server->http2_max_streams = redhttp_http2_is_supported() ? max_streams : 0;
+}
+
+int redhttp_server_get_http2_max_streams(redhttp_server_t * server)
+{
+  return server->http2_max_streams;
+}
+
+// Accept connections and poll watches using io_uring instead of select();
+// returns -1, and carries on using select(), if the kernel doesn't support it
+int redhttp_server_set_io_uring(redhttp_server_t * server, int enabled)
+{
+  assert(server != NULL);
+
+  if (enabled && !server->uring) {
+    server->uring = redhttp_uring_new();
+    if (!server->uring)
+      return -1;
+  } else if (!enabled && server->uring) {
+    redhttp_uring_free(server);
+  }
+
+  return 0;
+}
+
+int redhttp_server_get_io_uring(redhttp_server_t * server)
+{
+  return server->uring != NULL;
+}
+
 void redhttp_server_set_backlog_size(redhttp_server_t * server, int backlog_size)
 {
   server->backlog_size = backlog_size;
@@ -440,13 +702,83 @@ int redhttp_server_get_backlog_size(redhttp_server_t * server)
   return server->backlog_size;
 }
 
+void redhttp_server_set_idle_timeout(redhttp_server_t * server, int milliseconds)
+{
+  server->idle_timeout = milliseconds;
+}
+
+int redhttp_server_get_idle_timeout(redhttp_server_t * server)
+{
+  return server->idle_timeout;
+}
+
+static int add_watch(redhttp_server_t * server, int fd, int writable, redhttp_watch_func func,
+                     void *user_data)
+{
+  struct redhttp_watch_s *watch = NULL;
+
+  assert(server != NULL);
+  assert(func != NULL);
+
+  if (fd < 0 || fd >= FD_SETSIZE)
+    return -1;
+
+  watch = calloc(1, sizeof(struct redhttp_watch_s));
+  if (!watch)
+    return -1;
+
+  watch->fd = fd;
+  watch->writable = writable;
+  watch->func = func;
+  watch->user_data = user_data;
+  watch->next = server->watches;
+  server->watches = watch;
+
+  return 0;
+}
+
+// Call the function whenever the fd is readable
+int redhttp_server_add_watch(redhttp_server_t * server, int fd, redhttp_watch_func func,
+                             void *user_data)
+{
+  return add_watch(server, fd, 0, func, user_data);
+}
+
+// Call the function whenever the fd is writable
+int redhttp_server_add_write_watch(redhttp_server_t * server, int fd, redhttp_watch_func func,
+                                   void *user_data)
+{
+  return add_watch(server, fd, 1, func, user_data);
+}
+
+void redhttp_server_remove_watch(redhttp_server_t * server, int fd)
+{
+  struct redhttp_watch_s *watch;
+
+  assert(server != NULL);
+
+  for (watch = server->watches; watch; watch = watch->next) {
+    if (watch->fd == fd) {
+      watch->fd = -1;
+      if (server->uring)
+        redhttp_uring_remove_watch(server, watch);
+    }
+  }
+}
+
 void redhttp_server_free(redhttp_server_t * server)
 {
+  struct redhttp_watch_s *watch, *next_watch;
   redhttp_handler_t *it, *next;
   int i;
 
   assert(server != NULL);
 
+  redhttp_http2_close_all(server);
+  redhttp_queue_free_all(server);
+  redhttp_deadline_free_all(server);
+  redhttp_uring_free(server);
+
   for (i = 0; i < server->socket_count; i++) {
     close(server->sockets[i]);
   }
@@ -458,6 +790,11 @@ void redhttp_server_free(redhttp_server_t * server)
     free(it);
   }
 
+  for (watch = server->watches; watch; watch = next_watch) {
+    next_watch = watch->next;
+    free(watch);
+  }
+
   if (server->signature)
     free(server->signature);
 
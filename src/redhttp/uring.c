@@ -0,0 +1,592 @@
+/*
+    RedHTTP - a lightweight HTTP server library
+    Copyright (C) 2010-2011 Nicholas J Humfrey <njh@aelius.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  io_uring network backend
+
+  An alternative to the select() loop in redhttp_server_run(), for Linux
+  5.11 or later. Instead of waiting for the listening sockets to become
+  readable and then calling accept(), several accepts are kept queued on
+  each of them, and the kernel completes it with the new connection and the
+  address of the client. Each new connection then has a peeking recv
+  queued, so it is only handed to redhttp_server_handle_request() once
+  the client has sent something, and the first bytes tell whether it is
+  the HTTP/2 preface without another recv() to find out. Watches are
+  one-shot polls, queued again after their callback has run. If the
+  server has a header timeout, new connections are handed over straight
+  away instead, to wait for their requests with a deadline.
+
+  All the queued operations are submitted, and their completions waited
+  for, with a single io_uring_enter() each time the server is run, so the
+  system calls to wait for, accept and peek each connection are replaced
+  by a share of that one call, however many connections arrive together.
+
+  The request and response are still read and written through the stdio
+  stream of the request, because handlers, and the child processes they
+  fork, write to it directly. So only the accept, and the peek when there
+  is no header timeout, move onto the ring; the reads and writes that
+  make up most of the system calls for a request don't. bench_redhttpd
+  measures no gain from this over select() - it is slightly slower on
+  small requests - so the backend stays off unless asked for.
+
+  The rings are set up with the raw system calls, so that liburing is not
+  needed. If the kernel does not support io_uring (or it is blocked),
+  redhttp_server_set_io_uring() fails and the server keeps using select().
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "redstore_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <assert.h>
+
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "redhttp_private.h"
+#include "redhttp.h"
+
+#if defined(HAVE_IO_URING) && defined(__linux__)
+#define REDHTTP_IO_URING
+#endif
+
+#ifdef REDHTTP_IO_URING
+#include <stdint.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES          (256)
+
+// Accepts queued on each listening socket, so that a burst of connections
+// can be accepted by one io_uring_enter()
+#define URING_ACCEPTS          (16)
+
+// Enough of the start of a connection to recognise the HTTP/2 preface
+#define URING_PEEK_SIZE        (4)
+
+enum uring_op_type {
+  URING_ACCEPT,
+  URING_RECV,
+  URING_POLL
+};
+
+// An operation queued on the ring; its address is the user_data of the
+// submission, so that the completion can be matched up with it
+typedef struct redhttp_uring_op_s {
+  enum uring_op_type type;
+  int fd;
+  int armed;
+
+  // For polls: the watch, or NULL once it has been removed
+  struct redhttp_watch_s *watch;
+
+  // For accepts and peeks: the address of the client
+  struct sockaddr_storage ss;
+  socklen_t ss_len;
+  char peek[URING_PEEK_SIZE];
+
+  struct redhttp_uring_op_s *prev;
+  struct redhttp_uring_op_s *next;
+} uring_op_t;
+
+struct redhttp_uring_s {
+  int fd;
+
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned to_submit;
+
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+
+  // Number of listening sockets which have accepts queued
+  int accepting;
+
+  // Every operation, so that they can be freed with the ring
+  uring_op_t *ops;
+};
+
+
+static int uring_setup(unsigned entries, struct io_uring_params *params)
+{
+  return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(struct redhttp_uring_s *ring, unsigned min_complete,
+                       struct __kernel_timespec *ts)
+{
+  struct io_uring_getevents_arg arg;
+  unsigned flags = IORING_ENTER_EXT_ARG;
+  int submitted;
+
+  memset(&arg, 0, sizeof(arg));
+  arg.ts = (uintptr_t) ts;
+  if (min_complete)
+    flags |= IORING_ENTER_GETEVENTS;
+
+  submitted = (int) syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, min_complete,
+                            flags, &arg, sizeof(arg));
+  if (submitted > 0)
+    ring->to_submit -= submitted;
+
+  return submitted;
+}
+
+// Get the next free submission entry, submitting those already queued if
+// the ring is full
+static struct io_uring_sqe *uring_get_sqe(struct redhttp_uring_s *ring)
+{
+  unsigned tail = *ring->sq_tail;
+  unsigned index;
+  struct io_uring_sqe *sqe;
+
+  if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) > *ring->sq_mask) {
+    if (uring_enter(ring, 0, NULL) < 0)
+      return NULL;
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) > *ring->sq_mask)
+      return NULL;
+  }
+
+  // The kernel only reads the entry when io_uring_enter() is called, so it
+  // can be filled in after the tail has moved
+  index = tail & *ring->sq_mask;
+  sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->to_submit++;
+
+  return sqe;
+}
+
+static uring_op_t *uring_op_new(struct redhttp_uring_s *ring, enum uring_op_type type, int fd)
+{
+  uring_op_t *op = calloc(1, sizeof(uring_op_t));
+
+  if (!op)
+    return NULL;
+
+  op->type = type;
+  op->fd = fd;
+  op->next = ring->ops;
+  if (ring->ops)
+    ring->ops->prev = op;
+  ring->ops = op;
+
+  return op;
+}
+
+static void uring_op_free(struct redhttp_uring_s *ring, uring_op_t * op)
+{
+  if (op->prev)
+    op->prev->next = op->next;
+  else
+    ring->ops = op->next;
+  if (op->next)
+    op->next->prev = op->prev;
+  free(op);
+}
+
+static int uring_op_submit(struct redhttp_uring_s *ring, uring_op_t * op)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  unsigned events;
+
+  if (!sqe)
+    return -1;
+
+  sqe->fd = op->fd;
+  sqe->user_data = (uintptr_t) op;
+
+  switch (op->type) {
+  case URING_ACCEPT:
+    op->ss_len = sizeof(op->ss);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->addr = (uintptr_t) & op->ss;
+    sqe->addr2 = (uintptr_t) & op->ss_len;
+    break;
+  case URING_RECV:
+    sqe->opcode = IORING_OP_RECV;
+    sqe->addr = (uintptr_t) op->peek;
+    sqe->len = sizeof(op->peek);
+    sqe->msg_flags = MSG_PEEK;
+    break;
+  case URING_POLL:
+    sqe->opcode = IORING_OP_POLL_ADD;
+    events = op->watch && op->watch->writable ? POLLOUT : POLLIN;
+#ifdef WORDS_BIGENDIAN
+    // The kernel expects the halves of the poll mask swapped
+    sqe->poll32_events = events << 16;
+#else
+    sqe->poll32_events = events;
+#endif
+    break;
+  }
+
+  op->armed = 1;
+  return 0;
+}
+
+static void uring_accepted(redhttp_server_t * server, uring_op_t * op, int res)
+{
+  struct redhttp_uring_s *ring = server->uring;
+  uring_op_t *peek;
+
+  if (res < 0) {
+    if (res == -EINTR || res == -EAGAIN || res == -ECONNABORTED) {
+      uring_op_submit(ring, op);
+      return;
+    }
+    errno = -res;
+    perror("accept");
+    exit(EXIT_FAILURE);
+  }
+
+  // With a header timeout, the connection waits for its request with a
+  // deadline, polled like a watch
+  if (server->header_timeout > 0) {
+    redhttp_server_handle_connection(server, res, (struct sockaddr *) &op->ss, op->ss_len, -1);
+    uring_op_submit(ring, op);
+    return;
+  }
+
+  // Wait for the request before handling the connection
+  peek = uring_op_new(ring, URING_RECV, res);
+  if (!peek) {
+    close(res);
+  } else {
+    memcpy(&peek->ss, &op->ss, op->ss_len);
+    peek->ss_len = op->ss_len;
+    if (uring_op_submit(ring, peek)) {
+      close(res);
+      uring_op_free(ring, peek);
+    }
+  }
+
+  uring_op_submit(ring, op);
+}
+
+static void uring_received(redhttp_server_t * server, uring_op_t * op, int res)
+{
+  struct sockaddr_storage ss;
+  socklen_t ss_len = op->ss_len;
+  int socket = op->fd;
+  int preface = -1;
+
+  // The client closed the connection without sending anything
+  if (res <= 0) {
+    close(socket);
+    uring_op_free(server->uring, op);
+    return;
+  }
+
+  if (res == URING_PEEK_SIZE)
+    preface = (memcmp(op->peek, "PRI ", URING_PEEK_SIZE) == 0);
+  memcpy(&ss, &op->ss, ss_len);
+  uring_op_free(server->uring, op);
+
+  // The request takes ownership of the socket
+  redhttp_server_handle_connection(server, socket, (struct sockaddr *) &ss, ss_len, preface);
+}
+
+static void uring_polled(redhttp_server_t * server, uring_op_t * op, int res)
+{
+  struct redhttp_watch_s *watch = op->watch;
+
+  // The watch was removed while the poll was queued
+  if (!watch) {
+    uring_op_free(server->uring, op);
+    return;
+  }
+  // The poll is queued again by the next run, if the watch remains
+  if (res != -ECANCELED && watch->fd >= 0)
+    watch->func(watch->fd, watch->user_data);
+}
+
+struct redhttp_uring_s *redhttp_uring_new(void)
+{
+  struct redhttp_uring_s *ring = NULL;
+  struct io_uring_params params;
+
+  ring = calloc(1, sizeof(struct redhttp_uring_s));
+  if (!ring)
+    return NULL;
+
+  memset(&params, 0, sizeof(params));
+  ring->fd = uring_setup(URING_ENTRIES, &params);
+  if (ring->fd < 0) {
+    free(ring);
+    return NULL;
+  }
+  // Timeouts are passed to io_uring_enter(), and completions are never
+  // dropped, since Linux 5.11
+  if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP))
+    goto fail;
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) {
+    ring->sq_ring = NULL;
+    goto fail;
+  }
+
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  if (ring->cq_ring == MAP_FAILED) {
+    ring->cq_ring = NULL;
+    goto fail;
+  }
+
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    goto fail;
+  }
+
+  ring->sq_head = (unsigned *) ((char *) ring->sq_ring + params.sq_off.head);
+  ring->sq_tail = (unsigned *) ((char *) ring->sq_ring + params.sq_off.tail);
+  ring->sq_mask = (unsigned *) ((char *) ring->sq_ring + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) ((char *) ring->sq_ring + params.sq_off.array);
+  ring->cq_head = (unsigned *) ((char *) ring->cq_ring + params.cq_off.head);
+  ring->cq_tail = (unsigned *) ((char *) ring->cq_ring + params.cq_off.tail);
+  ring->cq_mask = (unsigned *) ((char *) ring->cq_ring + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ring + params.cq_off.cqes);
+
+  return ring;
+
+fail:
+  if (ring->sqes)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring)
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  if (ring->sq_ring)
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->fd);
+  free(ring);
+  return NULL;
+}
+
+void redhttp_uring_run(redhttp_server_t * server)
+{
+  struct redhttp_uring_s *ring = server->uring;
+  struct redhttp_watch_s *watch;
+  struct __kernel_timespec ts, *timeout = NULL;
+  unsigned min_complete = 1;
+  unsigned head;
+  int i, wait;
+
+  // Queue accepts on any sockets added since the last run
+  for (i = ring->accepting; i < server->socket_count; i++) {
+    int j;
+    for (j = 0; j < URING_ACCEPTS; j++) {
+      uring_op_t *op = uring_op_new(ring, URING_ACCEPT, server->sockets[i]);
+      if (!op || uring_op_submit(ring, op)) {
+        perror("failed to queue accept");
+        exit(EXIT_FAILURE);
+      }
+    }
+    ring->accepting++;
+  }
+
+  // Queue a poll for each watch that doesn't have one
+  for (watch = server->watches; watch; watch = watch->next) {
+    if (watch->fd < 0)
+      continue;
+    if (!watch->uring_op) {
+      watch->uring_op = uring_op_new(ring, URING_POLL, watch->fd);
+      if (!watch->uring_op)
+        continue;
+      watch->uring_op->watch = watch;
+    }
+    if (!watch->uring_op->armed)
+      uring_op_submit(ring, watch->uring_op);
+  }
+
+  // Return to the caller periodically, if an idle timeout is set
+  if (server->idle_timeout > 0) {
+    ts.tv_sec = server->idle_timeout / 1000;
+    ts.tv_nsec = (server->idle_timeout % 1000) * 1000000L;
+    timeout = &ts;
+  }
+  // Don't wait if there are requests to answer, and not for long if
+  // queued requests are waiting for their queue to be opened
+  wait = redhttp_http2_pending(server) ? 0 : redhttp_queue_wait(server);
+  // Wake up to close the connections whose deadlines have passed
+  if (redhttp_deadline_wait_time(server) >= 0 &&
+      (wait < 0 || redhttp_deadline_wait_time(server) < wait))
+    wait = redhttp_deadline_wait_time(server);
+  if (wait == 0) {
+    min_complete = 0;
+  } else if (wait > 0 && (!timeout || wait < server->idle_timeout)) {
+    ts.tv_sec = wait / 1000;
+    ts.tv_nsec = (wait % 1000) * 1000000L;
+    timeout = &ts;
+  }
+
+  if (uring_enter(ring, min_complete, timeout) < 0) {
+    if (errno == EINTR)
+      return;
+    if (errno != ETIME && errno != EBUSY && errno != EAGAIN) {
+      perror("io_uring_enter");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // Handle the completions; each entry is released before its handler is
+  // called, since handling a request can queue more operations
+  head = *ring->cq_head;
+  while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    uring_op_t *op = (uring_op_t *) (uintptr_t) cqe->user_data;
+    int res = cqe->res;
+
+    head++;
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    // Cancellations have no operation of their own
+    if (!op)
+      continue;
+
+    op->armed = 0;
+    switch (op->type) {
+    case URING_ACCEPT:
+      uring_accepted(server, op, res);
+      break;
+    case URING_RECV:
+      uring_received(server, op, res);
+      break;
+    case URING_POLL:
+      uring_polled(server, op, res);
+      break;
+    }
+  }
+
+  redhttp_http2_dispatch_pending(server);
+  redhttp_queue_dispatch(server);
+}
+
+// Stop polling a watch which has been removed; it is freed by the next
+// run, so it must not be referred to by the queued poll
+void redhttp_uring_remove_watch(redhttp_server_t * server, struct redhttp_watch_s *watch)
+{
+  struct redhttp_uring_s *ring = server->uring;
+  uring_op_t *op = watch->uring_op;
+
+  if (!op)
+    return;
+  watch->uring_op = NULL;
+
+  if (op->armed) {
+    // Freed when the cancelled poll completes
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    op->watch = NULL;
+    if (sqe) {
+      sqe->opcode = IORING_OP_POLL_REMOVE;
+      sqe->addr = (uintptr_t) op;
+      sqe->user_data = 0;
+    }
+  } else {
+    uring_op_free(ring, op);
+  }
+}
+
+void redhttp_uring_free(redhttp_server_t * server)
+{
+  struct redhttp_uring_s *ring = server->uring;
+  struct redhttp_watch_s *watch;
+  uring_op_t *op, *next;
+
+  if (!ring)
+    return;
+
+  // Closing the ring cancels everything that is queued on it
+  munmap(ring->sqes, ring->sqes_size);
+  munmap(ring->cq_ring, ring->cq_ring_size);
+  munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->fd);
+
+  for (watch = server->watches; watch; watch = watch->next)
+    watch->uring_op = NULL;
+
+  for (op = ring->ops; op; op = next) {
+    next = op->next;
+    // Connections which were waiting for their request
+    if (op->type == URING_RECV)
+      close(op->fd);
+    free(op);
+  }
+
+  free(ring);
+  server->uring = NULL;
+}
+
+#else
+
+// io_uring is not supported by this build
+struct redhttp_uring_s *redhttp_uring_new(void)
+{
+  return NULL;
+}
+
+void redhttp_uring_run(redhttp_server_t * server)
+{
+}
+
+void redhttp_uring_remove_watch(redhttp_server_t * server, struct redhttp_watch_s *watch)
+{
+}
+
+void redhttp_uring_free(redhttp_server_t * server)
+{
+}
+
+#endif
+
+// Returns true if this build has the io_uring backend; whether the kernel
+// supports it is only known when redhttp_server_set_io_uring() is called
+int redhttp_io_uring_is_supported(void)
+{
+#ifdef REDHTTP_IO_URING
+  return 1;
+#else
+  return 0;
+#endif
+}
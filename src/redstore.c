@@ -151,8 +151,10 @@ static redhttp_response_t *handle_not_found(redhttp_request_t * request, void *u
   );
 }
 
-static int redstore_load_input_file(librdf_model* model, const char* filename, const char* format)
+static int redstore_load_input_file(const char* filename, const char* format)
 {
+  librdf_parser *parser = NULL;
+  librdf_stream *stream = NULL;
   librdf_uri *uri = NULL;
   int result = 0;
 
@@ -165,17 +167,51 @@ static int redstore_load_input_file(librdf_model* model, const char* filename, c
 
     redstore_info("Loading: %s", (char*)librdf_uri_as_string(uri));
     redstore_debug("Input format: %s", format);
-    result = librdf_model_load(model, uri, format, NULL, NULL);
+    if (redstore_shard_count() <= 1) {
+      result = librdf_model_load(model, uri, format, NULL, NULL);
+    } else {
+      // Send each quad to the shard that owns its graph
+      parser = librdf_new_parser(world, format, NULL, NULL);
+      if (parser)
+        stream = librdf_parser_parse_as_stream(parser, uri, NULL);
+      if (!stream) {
+        result = -1;
+      }
+
+      while (stream && !librdf_stream_end(stream)) {
+        librdf_statement *statement = librdf_stream_get_object(stream);
+        librdf_node *graph = librdf_stream_get_context2(stream);
+
+        if (!statement) {
+          result = -1;
+          break;
+        }
+
+        if (graph) {
+          result = librdf_model_context_add_statement(redstore_graph_model(graph), graph, statement);
+        } else {
+          result = librdf_model_add_statement(model, statement);
+        }
+        if (result)
+          break;
+
+        librdf_stream_next(stream);
+      }
+    }
   }
 
+  if (stream)
+    librdf_free_stream(stream);
+  if (parser)
+    librdf_free_parser(parser);
   if (uri)
     librdf_free_uri(uri);
 
   return result;
 }
 
-static librdf_storage *redstore_setup_storage(const char *name, const char *type,
-                                              const char *options, int new)
+librdf_storage *redstore_setup_storage(const char *name, const char *type,
+                                       const char *options, int new)
 {
   librdf_storage *storage = NULL;
   librdf_hash *hash = NULL;
@@ -196,11 +232,14 @@ static librdf_storage *redstore_setup_storage(const char *name, const char *type
   redstore_info("Storage name: %s", name);
   redstore_info("Storage type: %s", type);
 
-  public_storage_options = librdf_hash_to_string(hash, key_filter);
-  if (public_storage_options) {
-    redstore_info("Storage options: %s", public_storage_options);
-  } else {
-    redstore_warn("Failed to convert storage options hash into a string.");
+  // Every shard uses the same options, so only record them once
+  if (!public_storage_options) {
+    public_storage_options = librdf_hash_to_string(hash, key_filter);
+    if (public_storage_options) {
+      redstore_info("Storage options: %s", public_storage_options);
+    } else {
+      redstore_warn("Failed to convert storage options hash into a string.");
+    }
   }
 
   storage = librdf_new_storage_with_options(world, type, name, hash);
@@ -226,6 +265,8 @@ static redhttp_server_t *redstore_setup_http_server()
   redhttp_server_add_handler(server, NULL, NULL, request_counter, &request_count);
   redhttp_server_add_handler(server, NULL, NULL, request_log, NULL);
   redhttp_server_add_handler(server, NULL, NULL, reset_error_buffer, NULL);
+  redhttp_server_add_handler(server, NULL, NULL, handle_rate_limit, NULL);
+  redhttp_server_add_handler(server, NULL, NULL, handle_replica_write, NULL);
   redhttp_server_add_handler(server, "GET", "/query", handle_query, NULL);
   redhttp_server_add_handler(server, "GET", "/sparql", handle_sparql, NULL);
   redhttp_server_add_handler(server, "GET", "/sparql/", handle_sparql, NULL);
@@ -248,6 +289,9 @@ static redhttp_server_t *redstore_setup_http_server()
   redhttp_server_add_handler(server, "GET", "/description", handle_description_get, NULL);
   redhttp_server_add_handler(server, "GET", "/favicon.ico", handle_image_favicon, NULL);
   redhttp_server_add_handler(server, "GET", "/robots.txt", handle_page_robots_txt, NULL);
+  redhttp_server_add_handler(server, "GET", "/dump", handle_dump_get, NULL);
+  if (snapshot_filename)
+    redhttp_server_add_handler(server, "POST", "/snapshot", handle_snapshot_post, NULL);
   redhttp_server_add_handler(server, "GET", NULL, remove_trailing_slash, NULL);
   redhttp_server_add_handler(server, NULL, NULL, handle_not_found, NULL);
 
@@ -282,6 +326,9 @@ static void usage()
       break;
     printf("      %-12s   %s\n", desc->names[0], desc->label);
   }
+  printf("   -S <filename>   Snapshot file to load at startup and write at shutdown\n");
+  printf("   -W <filename>   Write-ahead log file (requires -S)\n");
+  printf("   -o <options>    Server options\n");
   printf("   -v              Enable verbose mode\n");
   printf("   -q              Enable quiet mode\n");
   exit(1);
@@ -295,6 +342,8 @@ int main(int argc, char *argv[])
   const char *storage_options = NULL;
   const char *input_filename = NULL;
   const char *input_format = NULL;
+  const char *wal_filename = NULL;
+  const char *server_options_str = NULL;
   int storage_new = 0;
   int opt = -1;
 
@@ -312,7 +361,7 @@ int main(int argc, char *argv[])
   librdf_world_set_logger(world, NULL, redland_log_handler);
 
   // Parse Switches
-  while ((opt = getopt(argc, argv, "p:b:s:t:nf:F:vqh")) != -1) {
+  while ((opt = getopt(argc, argv, "p:b:s:t:nf:F:S:W:o:vqh")) != -1) {
     switch (opt) {
     case 'p':
       port = optarg;
@@ -335,6 +384,15 @@ int main(int argc, char *argv[])
     case 'F':
       input_format = optarg;
       break;
+    case 'S':
+      snapshot_filename = optarg;
+      break;
+    case 'W':
+      wal_filename = optarg;
+      break;
+    case 'o':
+      server_options_str = optarg;
+      break;
     case 'v':
       verbose = 1;
       break;
@@ -361,6 +419,11 @@ int main(int argc, char *argv[])
     usage();
   }
 
+  if (wal_filename && !snapshot_filename) {
+    redstore_error("A snapshot file (-S) is required when using a write-ahead log.");
+    usage();
+  }
+
   if (!verbose) {
     rasqal_world* rasqal = librdf_world_get_rasqal(world);
     // Lower warning level to only get more serious warnings
@@ -375,10 +438,21 @@ int main(int argc, char *argv[])
     storage_options = DEFAULT_STORAGE_OPTIONS;
   }
 
+  // Parse server options
+  server_options = librdf_new_hash_from_string(world, NULL, server_options_str);
+  if (!server_options) {
+    redstore_fatal("Failed to parse server options.");
+    goto cleanup;
+  }
+
   // Setup signal handlers
   signal(SIGTERM, termination_handler);
   signal(SIGINT, termination_handler);
   signal(SIGHUP, termination_handler);
+  if (redstore_children_init()) {
+    redstore_fatal("Failed to initialise child process handling.");
+    goto cleanup;
+  }
 
   // Create HTTP server
   server = redstore_setup_http_server();
@@ -399,35 +473,135 @@ int main(int argc, char *argv[])
     redstore_fatal("Failed to create librdf model for storage.");
     goto cleanup;
   }
+  // Open the other shards of the store
+  if (redstore_shards_init(storage_name, storage_type, storage_options, storage_new)) {
+    redstore_fatal("Failed to open shards of the store.");
+    goto cleanup;
+  }
+  // Load snapshot; the write-ahead log and input file belong on top of it,
+  // so a store that already contains data can't be started from one
+  if (snapshot_filename && access(snapshot_filename, F_OK) == 0) {
+    if (redstore_store_size() > 0) {
+      redstore_fatal("Store is not empty, refusing to load snapshot on top of it: %s",
+                     snapshot_filename);
+      goto cleanup;
+    } else if (redstore_snapshot_load(snapshot_filename)) {
+      redstore_fatal("Failed to load snapshot.");
+      goto cleanup;
+    }
+  }
+  // Replay any changes made since the snapshot was written
+  if (wal_filename) {
+    if (redstore_wal_open(wal_filename)) {
+      redstore_fatal("Failed to open write-ahead log.");
+      goto cleanup;
+    }
+    redhttp_server_set_idle_timeout(server, redstore_wal_get_sync_interval());
+  }
   // Load startup input file
-  if (redstore_load_input_file(model, input_filename, input_format)) {
+  if (redstore_load_input_file(input_filename, input_format)) {
     redstore_fatal("Failed to load input file.");
     goto cleanup;
   }
+  // Start replicating from a primary and/or publishing to replicas
+  if (redstore_replication_init(server)) {
+    redstore_fatal("Failed to initialise replication.");
+    goto cleanup;
+  }
+  // Count the triples in each graph
+  if (redstore_catalogue_init()) {
+    redstore_fatal("Failed to build graph catalogue.");
+    goto cleanup;
+  }
+  // Queue writes to the store behind per-graph locks
+  if (redstore_writes_init(server)) {
+    redstore_fatal("Failed to initialise write queue.");
+    goto cleanup;
+  }
   // Create service description
   if (description_init()) {
     redstore_fatal("Failed to initialise Service Description.");
     goto cleanup;
   }
-  // Start listening for connections
-  redstore_info("Starting HTTP server on port %s", port);
-  if (redhttp_server_listen(server, address, port, PF_UNSPEC)) {
-    redstore_fatal("Failed to create HTTP server socket.");
+  // Build the content negotiation tables
+  if (redstore_negotiate_init()) {
+    redstore_fatal("Failed to build content negotiation tables.");
+    goto cleanup;
+  }
+  // Render the pages which don't change
+  if (redstore_pages_init()) {
+    redstore_fatal("Failed to render static pages.");
+    goto cleanup;
+  }
+  // Compress responses for clients that accept it
+  if (redstore_compress_init(server)) {
+    redstore_fatal("Failed to initialise response compression.");
     goto cleanup;
   }
+  // Serve HTTP/2 to clients that ask for it
+  redhttp_server_set_http2_max_streams(
+    server, redstore_get_option_long("http2-max-streams", DEFAULT_HTTP2_MAX_STREAMS)
+  );
+  if (redhttp_server_get_http2_max_streams(server) < 0) {
+    redstore_fatal("http2-max-streams should not be negative.");
+    goto cleanup;
+  }
+  // Queue requests, and refuse them once too many are waiting
+  if (redstore_admission_init(server)) {
+    redstore_fatal("Failed to set up request queues.");
+    goto cleanup;
+  }
+  // Fork the worker processes, which listen for connections themselves
+  if (redstore_workers_init(server, address, port)) {
+    redstore_fatal("Failed to start worker processes.");
+    goto cleanup;
+  }
+  // Accept connections using io_uring, if asked to and the kernel allows
+  if (redstore_get_option_long("io-uring", 0) && redhttp_server_set_io_uring(server, 1))
+    redstore_warn("io_uring is not available, using select() instead.");
+  // Start listening for connections
+  if (!redstore_is_worker() && redstore_workers_count() == 0) {
+    redstore_info("Starting HTTP server on port %s", port);
+    if (redhttp_server_listen(server, address, port, PF_UNSPEC)) {
+      redstore_fatal("Failed to create HTTP server socket.");
+      goto cleanup;
+    }
+  }
 
   while (running) {
     redhttp_server_run(server);
+    redstore_writes_run();
+    redstore_replication_flush();
+    redstore_reap_children();
+    redstore_wal_tick();
   }
 
+  // Write snapshot of the store before exiting
+  if (snapshot_filename) {
+    if (redstore_checkpoint())
+      exit_code = EXIT_FAILURE;
+  }
 
 cleanup:
+  redstore_writes_free();
+  redstore_workers_free();
+  redstore_children_free();
+  redstore_replication_free();
   description_free();
+  redstore_pages_free();
+  redstore_negotiate_free();
+  redstore_results_free();
+  redstore_ntriples_free();
+  redstore_wal_close();
 
   // Free up memory used by the error buffer
   reset_error_buffer(NULL, NULL);
 
   // Clean up librdf
+  if (server_options)
+    librdf_free_hash(server_options);
+  redstore_catalogue_free();
+  redstore_shards_free();
   if (model)
     librdf_free_model(model);
   if (storage)
@@ -22,6 +22,7 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <time.h>
 
 #include <redland.h>
 #include "redhttp/redhttp.h"
@@ -41,6 +42,17 @@
 #define DEFAULT_GRAPH_FORMAT    "rdfxml"
 #define DEFAULT_PARSE_FORMAT    "ntriples"
 #define DEFAULT_RESULTS_FORMAT  "xml"
+#define RESULTS_BINARY_MIME_TYPE "application/x-redstore-results"
+
+// Write-ahead log operations
+#define WAL_OP_ADD              (1)
+#define WAL_OP_REMOVE           (2)
+#define WAL_OP_CLEAR_GRAPH      (3)
+
+// Rate limit budgets
+#define RATELIMIT_QUERIES       (0)
+#define RATELIMIT_WRITES        (1)
+#define RATELIMIT_BUDGETS       (2)
 
 
 // ------- Logging ---------
@@ -74,6 +86,7 @@ extern int exit_code;
 extern unsigned long query_count;
 extern unsigned long import_count;
 extern unsigned long request_count;
+extern unsigned long store_version;
 extern const char *storage_name;
 extern const char *storage_type;
 extern char *public_storage_options;
@@ -81,6 +94,8 @@ extern librdf_world *world;
 extern librdf_storage *storage;
 extern librdf_model *model;
 extern raptor_stringbuffer *error_buffer;
+extern const char *snapshot_filename;
+extern librdf_hash *server_options;
 
 extern librdf_uri *format_ns_uri;
 extern librdf_uri *sd_ns_uri;
@@ -95,6 +110,55 @@ typedef redhttp_response_t *(*redstore_stream_processor) (redhttp_request_t * re
 
 typedef const raptor_syntax_description* (*description_proc_t) (librdf_world *world, unsigned int c);
 
+typedef void (*redstore_lock_func) (void *data);
+
+
+// ------- Types ---------
+
+typedef struct redstore_buffer_s {
+  unsigned char *data;
+  size_t length;
+  size_t size;
+} redstore_buffer_t;
+
+typedef struct redstore_graph_info_s {
+  char *uri;
+  uint32_t hash;
+  unsigned long triples;
+  unsigned long bytes;
+  time_t modified;
+  struct redstore_graph_info_s *next;
+} redstore_graph_info_t;
+
+typedef struct redstore_asset_s {
+  const char *content_type;
+  const char *content;
+  size_t length;
+  int owned;
+  char etag[16];
+} redstore_asset_t;
+
+typedef struct redstore_results_writer_s {
+  int (*head) (FILE * socket, librdf_query_results * results);
+  int (*rows) (FILE * socket, librdf_query_results * results, unsigned long *count);
+  int (*tail) (FILE * socket, librdf_query_results * results);
+  const char *separator;
+} redstore_results_writer_t;
+
+// Writes the rows of the results for each shard, starting with the given
+// results for the first shard
+typedef int (*redstore_results_merger) (FILE * socket, const redstore_results_writer_t * writer,
+                                        librdf_query_results * results, void *data);
+
+typedef struct redstore_lock_stats_s {
+  unsigned long acquired;
+  unsigned long waited;
+  unsigned long total_wait_ms;
+  unsigned long max_wait_ms;
+  int held;
+  int waiting;
+} redstore_lock_stats_t;
+
 
 // ------- Prototypes -------
 
@@ -106,9 +170,13 @@ redhttp_response_t *handle_page_home(redhttp_request_t * request, void *user_dat
 redhttp_response_t *handle_page_query_form(redhttp_request_t * request, void *user_data);
 redhttp_response_t *handle_page_update_form(redhttp_request_t * request, void *user_data);
 redhttp_response_t *handle_page_load_form(redhttp_request_t * request, void *user_data);
+int redstore_pages_init(void);
+void redstore_pages_free(void);
 
 redhttp_response_t *handle_query(redhttp_request_t * request, void *user_data);
 redhttp_response_t *handle_sparql(redhttp_request_t * request, void *user_data);
+int redstore_estimate_query_cost(const char *query_string);
+int redstore_is_analytic_query(redhttp_request_t * request, const char *query_string);
 redhttp_response_t *handle_page_robots_txt(redhttp_request_t * request, void *user_data);
 
 redhttp_response_t *redstore_page_new(int code, const char *title);
@@ -119,6 +187,9 @@ int redstore_page_append_strings(redhttp_response_t * response, ...);
 int redstore_page_append_string_buffer(redhttp_response_t * response, raptor_stringbuffer *buffer, int escape);
 int redstore_page_append_escaped(redhttp_response_t * response, const char *str, char quote);
 void redstore_page_end(redhttp_response_t * response);
+void redstore_asset_set(redstore_asset_t * asset, const char *content_type, const char *content, size_t length);
+void redstore_asset_free(redstore_asset_t * asset);
+redhttp_response_t *redstore_asset_response(redhttp_request_t * request, redstore_asset_t * asset);
 
 void page_append_html_header(redhttp_response_t * response, const char *title);
 void page_append_html_footer(redhttp_response_t * response);
@@ -130,6 +201,7 @@ redhttp_response_t *handle_data_get(redhttp_request_t * request, void *user_data
 redhttp_response_t *handle_data_put(redhttp_request_t * request, void *user_data);
 redhttp_response_t *handle_data_post(redhttp_request_t * request, void *user_data);
 redhttp_response_t *handle_data_delete(redhttp_request_t * request, void *user_data);
+long redstore_data_count_triples(redhttp_request_t * request);
 
 
 redhttp_response_t *load_stream_into_new_graph(redhttp_request_t * request, librdf_stream * stream,
@@ -140,9 +212,13 @@ redhttp_response_t *clear_and_load_stream_into_graph(redhttp_request_t * request
                                                      librdf_stream * stream, librdf_node * graph);
 redhttp_response_t *delete_stream_from_graph(redhttp_request_t * request, librdf_stream * stream,
                                              librdf_node * graph);
+redhttp_response_t *process_data_from_buffer(redhttp_request_t * request, const unsigned char *buffer,
+                                             size_t content_length, const char *parser_name,
+                                             const char *encoding, librdf_node *graph_node,
+                                             redstore_stream_processor stream_proc);
 redhttp_response_t *parse_data_from_buffer(redhttp_request_t * request, unsigned char *buffer,
                                            size_t content_length, const char *parser_name,
-                                           librdf_node *graph_node,
+                                           const char *encoding, librdf_node *graph_node,
                                            redstore_stream_processor stream_proc);
 redhttp_response_t *parse_data_from_request_body(redhttp_request_t * request,
                                                  librdf_node *graph_node,
@@ -154,8 +230,25 @@ redhttp_response_t *handle_delete_post(redhttp_request_t * request, void *user_d
 redhttp_response_t *format_bindings_query_result(redhttp_request_t * request,
                                                  librdf_query_results * results);
 
+redhttp_response_t *format_bindings_query_results_merged(redhttp_request_t * request,
+                                                         librdf_query_results * results,
+                                                         redstore_results_merger merger,
+                                                         void *data);
+
 redhttp_response_t *format_graph_stream(redhttp_request_t * request, librdf_stream * stream);
 
+const redstore_results_writer_t *redstore_get_results_writer(const char *format_name, int boolean);
+int redstore_write_results(const redstore_results_writer_t * writer, FILE * socket,
+                           librdf_query_results * results, unsigned long *count);
+const raptor_syntax_description *redstore_results_formats_get_description(librdf_world * rdf_world,
+                                                                          unsigned int counter);
+int redstore_ntriples_append_node(redstore_buffer_t * buffer, librdf_node * node);
+int redstore_ntriples_append_statement(redstore_buffer_t * buffer, librdf_statement * statement,
+                                       librdf_node * graph);
+long redstore_ntriples_write_stream(FILE * file, librdf_stream * stream, int quads);
+void redstore_ntriples_free(void);
+void redstore_results_free(void);
+
 redhttp_response_t *handle_image_favicon(redhttp_request_t * request, void *user_data);
 
 void redstore_log(librdf_log_level level, const char *format, ...);
@@ -166,8 +259,150 @@ char *redstore_negotiate_string(redhttp_request_t * request, const char* support
 int redstore_is_html_format(const char *str);
 int redstore_is_text_format(const char *str);
 int redstore_is_nquads_format(const char *str);
+int redstore_is_write_request(const char *method, const char *path);
 
 char* redstore_genid(void);
+long redstore_get_option_long(const char *key, long default_value);
+char *redstore_get_option_string(const char *key);
+int redstore_copy_file(FILE * from, FILE * to);
+
+int redstore_buffer_reserve(redstore_buffer_t * buffer, size_t length);
+int redstore_buffer_append(redstore_buffer_t * buffer, const void *data, size_t length);
+int redstore_buffer_append_byte(redstore_buffer_t * buffer, unsigned char byte);
+int redstore_buffer_append_varint(redstore_buffer_t * buffer, uint64_t value);
+int redstore_buffer_append_uint32(redstore_buffer_t * buffer, uint32_t value);
+void redstore_buffer_reset(redstore_buffer_t * buffer);
+void redstore_buffer_free(redstore_buffer_t * buffer);
+void redstore_put_uint32(unsigned char *ptr, uint32_t value);
+void redstore_put_uint64(unsigned char *ptr, uint64_t value);
+uint32_t redstore_get_uint32(const unsigned char *ptr);
+uint64_t redstore_get_uint64(const unsigned char *ptr);
+uint32_t redstore_hash_bytes(const unsigned char *data, size_t length);
+int redstore_encode_node(redstore_buffer_t * buffer, librdf_node * node);
+const unsigned char *redstore_decode_varint(const unsigned char *ptr, const unsigned char *end, uint64_t * value);
+const unsigned char *redstore_decode_node(const unsigned char *ptr, const unsigned char *end, librdf_node ** node);
+int redstore_encode_change(redstore_buffer_t * buffer, int op, uint64_t sequence,
+                           librdf_node * graph, librdf_statement * statement);
+const unsigned char *redstore_decode_change(const unsigned char *ptr, const unsigned char *end,
+                                            int *op, uint64_t * sequence,
+                                            librdf_node ** graph, librdf_statement ** statement);
+
+int redstore_snapshot_write_fd(int fd);
+int redstore_snapshot_write(const char *filename);
+int redstore_snapshot_load_fd(int fd, const char *filename);
+int redstore_snapshot_load(const char *filename);
+redhttp_response_t *handle_snapshot_post(redhttp_request_t * request, void *user_data);
+
+int redstore_store_add_statement(librdf_node * graph, librdf_statement * statement);
+int redstore_store_add_statements(librdf_node * graph, librdf_stream * stream);
+int redstore_store_remove_statement(librdf_node * graph, librdf_statement * statement);
+int redstore_store_remove_graph(librdf_node * graph);
+
+int redstore_wal_open(const char *filename);
+int redstore_wal_append(int op, librdf_node * graph, librdf_statement * statement);
+int redstore_wal_cancel(void);
+int redstore_wal_is_open(void);
+int redstore_wal_get_sync_interval(void);
+void redstore_wal_tick(void);
+void redstore_wal_detach(void);
+void redstore_wal_reaped(pid_t pid, int status);
+void redstore_wal_close(void);
+int redstore_checkpoint(void);
+
+int redstore_children_init(void);
+int redstore_storage_is_in_memory(void);
+pid_t redstore_fork_child(void);
+void redstore_children_hold_analytic(pid_t pid);
+void redstore_reap_children(void);
+int redstore_children_count(void);
+int redstore_children_max(void);
+int redstore_children_oldest_version(unsigned long *version);
+void redstore_children_free(void);
+
+int redstore_admission_init(redhttp_server_t * server);
+void redstore_admission_forked(void);
+int redstore_admission_acquire_analytic(void);
+void redstore_admission_release_analytic(void);
+void redstore_add_retry_after(redhttp_response_t * response);
+void redstore_admission_get_stats(int *queued, unsigned long *refused, int *analytic);
+void redstore_admission_get_offenders(unsigned long *timed_out, unsigned long *headers_refused,
+                                      unsigned long *rate_limited);
+redhttp_response_t *handle_rate_limit(redhttp_request_t * request, void *user_data);
+
+int redstore_ratelimit_init(long clients);
+void redstore_ratelimit_set_budget(int budget, long rate, long burst);
+int redstore_ratelimit_is_enabled(void);
+int redstore_ratelimit_take(const char *key, int budget, long *retry_after);
+unsigned long redstore_ratelimit_refused(void);
+void redstore_ratelimit_free(void);
+
+int redstore_workers_init(redhttp_server_t * server, const char *address, const char *port);
+int redstore_is_worker(void);
+int redstore_workers_count(void);
+int redstore_workers_reaped(pid_t pid, int status);
+void redstore_workers_free(void);
+
+redhttp_response_t *handle_dump_get(redhttp_request_t * request, void *user_data);
+
+librdf_storage *redstore_setup_storage(const char *name, const char *type,
+                                       const char *options, int new);
+int redstore_shards_init(const char *name, const char *type, const char *options, int new);
+int redstore_shard_count(void);
+librdf_model *redstore_shard_model(int shard);
+int redstore_graph_shard(librdf_node * graph);
+librdf_model *redstore_graph_model(librdf_node * graph);
+librdf_iterator *redstore_store_get_contexts(void);
+librdf_stream *redstore_new_union_stream(librdf_stream ** streams, int count);
+librdf_stream *redstore_store_as_stream(void);
+int redstore_store_size(void);
+int redstore_store_contains_graph(librdf_node * graph);
+void redstore_shards_free(void);
+
+int redstore_replication_init(redhttp_server_t * server);
+int redstore_is_replica(void);
+void redstore_replication_publish(int op, librdf_node * graph, librdf_statement * statement);
+void redstore_replication_flush(void);
+int redstore_replication_add_replica(int fd);
+int redstore_replication_follow(int fd);
+redhttp_response_t *handle_replica_write(redhttp_request_t * request, void *user_data);
+void redstore_replication_free(void);
+
+int redstore_catalogue_init(void);
+int redstore_catalogue_is_ready(void);
+void redstore_catalogue_add(librdf_node * graph, librdf_statement * statement);
+void redstore_catalogue_remove(librdf_node * graph, librdf_statement * statement);
+void redstore_catalogue_clear(librdf_node * graph);
+redstore_graph_info_t *redstore_catalogue_lookup(librdf_node * graph);
+int redstore_catalogue_count(void);
+long redstore_catalogue_triples(void);
+redstore_graph_info_t **redstore_catalogue_list(int *count);
+void redstore_catalogue_free(void);
+
+int redstore_lock_acquire(librdf_node * graph, redstore_lock_func func, void *data);
+void redstore_lock_release(librdf_node * graph);
+void redstore_lock_get_stats(redstore_lock_stats_t * stats);
+
+int redstore_writes_init(redhttp_server_t * server);
+redhttp_response_t *redstore_queue_write(redhttp_request_t * request, librdf_node * graph,
+                                         redstore_stream_processor stream_proc,
+                                         const unsigned char *buffer, size_t length,
+                                         const char *parser_name, const char *encoding);
+void redstore_writes_run(void);
+void redstore_writes_free(void);
+
+int redstore_negotiate_init(void);
+const raptor_syntax_description *redstore_negotiate_accept(description_proc_t desc_proc,
+                                                           const char *accept_str,
+                                                           const char **chosen_mime);
+char *redstore_negotiate_accept_string(const char *supported_str, const char *accept_str);
+void redstore_negotiate_get_stats(unsigned long *hits, unsigned long *misses);
+void redstore_negotiate_free(void);
+
+int redstore_compress_init(redhttp_server_t * server);
+FILE *redstore_compress_stream_open(redhttp_request_t * request, redhttp_response_t * response);
+int redstore_compress_stream_close(redhttp_request_t * request, FILE * stream);
+int redstore_decompress_supported(const char *encoding);
+FILE *redstore_decompress_open(const unsigned char *buffer, size_t length, const char *encoding);
 
 
 #endif
@@ -0,0 +1,941 @@
+/*
+    RedStore - a lightweight RDF triplestore powered by Redland
+    Copyright (C) 2010-2011 Nicholas J Humfrey <njh@aelius.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Primary / replica replication
+
+  A primary publishes every change made through store.c to its replicas
+  over a TCP or Unix domain socket. A replica that connects is first sent
+  a snapshot of the store (see snapshot.c) and then each change, in the
+  order they were made. After the magic string, the stream is made of
+  frames:
+
+    type        1 byte, 'S' for a snapshot or 'C' for a change
+    length      uint64, length of the payload
+    payload     snapshot: the store version (uint64), then the snapshot
+                change: see redstore_encode_change()
+
+  The snapshot is written and sent by a forked child process, from its
+  copy-on-write copy of the store, so that a slow replica doesn't hold up
+  the primary; the changes made meanwhile are kept until the child has
+  finished, and then sent after it. Other storage modules would be read
+  by the child while the primary changes them, so only a primary with
+  an in-memory store can listen for replicas.
+
+  Changes are queued while a request is being handled and sent to the
+  replicas when it has finished. They are sent without waiting: whatever
+  a replica's socket won't take yet is kept in its outbound buffer, and
+  sent when the socket is writable again, so a slow replica doesn't hold
+  up the primary. A replica that falls so far behind that its buffer
+  would pass 64MB is dropped. Replicas apply the changes through
+  store.c, so they can keep their own write-ahead log and have replicas
+  of their own. Writes made over HTTP are redirected to the primary.
+
+  Worker processes (see workers.c) are replicas of the process that
+  forked them, on a socket pair. They start with a copy of the store, so
+  they are not sent a snapshot.
+
+  There is no authentication: anything that can connect to the socket
+  is sent a copy of the whole store. So when only a port is given, the
+  primary listens on the loopback interface.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+
+#include "redstore.h"
+
+#define REPLICATION_MAGIC          "RSREPL\r\n"
+#define REPLICATION_MAGIC_SIZE     (8)
+#define FRAME_HEADER_SIZE          (9)
+#define FRAME_SNAPSHOT             'S'
+#define FRAME_CHANGE               'C'
+#define MAX_CHANGE_SIZE            (64 * 1024 * 1024)
+#define PENDING_FLUSH_SIZE         (64 * 1024)
+#define RECEIVE_SIZE               (64 * 1024)
+#define MAX_BACKLOG_SIZE           (64 * 1024 * 1024)
+
+#define DEFAULT_MAX_REPLICAS       (16)
+#define DEFAULT_REPLICA_TIMEOUT    (10000)
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL (0)
+#endif
+
+
+// A replica that is up to date, apart from the changes still to be sent
+typedef struct {
+  int fd;
+  redstore_buffer_t outbound;   // changes the socket hasn't taken yet
+  int watched;                  // waiting for the socket to be writable
+} replica_t;
+
+// A replica that is being sent a snapshot by a child process
+typedef struct {
+  int fd;
+  int done_fd;                  // pipe from the child, which writes its result
+  redstore_buffer_t backlog;    // changes made since the snapshot
+} syncing_replica_t;
+
+
+static redhttp_server_t *replication_server = NULL;
+
+// Primary
+static int listen_fd = -1;
+static char *listen_path = NULL;
+static replica_t *replicas = NULL;
+static int replica_count = 0;
+static syncing_replica_t *syncing = NULL;
+static int syncing_count = 0;
+static int worker_replicas = 0;
+static long max_replicas = DEFAULT_MAX_REPLICAS;
+static long replica_timeout = DEFAULT_REPLICA_TIMEOUT;
+static redstore_buffer_t pending = { NULL, 0, 0 };
+
+// Replica
+static int primary_fd = -1;
+static char *primary_url = NULL;
+static redstore_buffer_t incoming = { NULL, 0, 0 };
+
+
+static int send_fully(int fd, const void *data, size_t length)
+{
+  const unsigned char *ptr = data;
+
+  while (length > 0) {
+    ssize_t sent = send(fd, ptr, length, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    ptr += sent;
+    length -= sent;
+  }
+
+  return 0;
+}
+
+static int read_fully(int fd, void *data, size_t length)
+{
+  unsigned char *ptr = data;
+
+  while (length > 0) {
+    ssize_t got = read(fd, ptr, length);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      return -1;
+    ptr += got;
+    length -= got;
+  }
+
+  return 0;
+}
+
+// Open a socket for an address that is either a path to a Unix domain
+// socket, or a host and port for TCP. For listening, the host is optional.
+static int open_socket(const char *address, int do_listen)
+{
+  struct addrinfo hints, *res = NULL, *ai;
+  char *host = NULL, *port = NULL, *colon;
+  int fd = -1, err;
+  int on = 1;
+
+  if (address[0] == '/') {
+    struct sockaddr_un sun;
+
+    if (strlen(address) >= sizeof(sun.sun_path)) {
+      redstore_error("Replication socket path is too long: %s", address);
+      return -1;
+    }
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, address);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+      return -1;
+
+    if (do_listen) {
+      unlink(address);
+      err = bind(fd, (struct sockaddr *) &sun, sizeof(sun));
+    } else {
+      err = connect(fd, (struct sockaddr *) &sun, sizeof(sun));
+    }
+
+    if (err) {
+      close(fd);
+      return -1;
+    }
+
+    return fd;
+  }
+
+  host = calloc(1, strlen(address) + 1);
+  if (!host)
+    return -1;
+  strcpy(host, address);
+
+  colon = strrchr(host, ':');
+  if (colon) {
+    *colon = '\0';
+    port = colon + 1;
+  } else if (do_listen) {
+    port = host;
+    host = NULL;
+  } else {
+    redstore_error("Replication address must be a path or host:port: %s", address);
+    free(host);
+    return -1;
+  }
+
+  // Without a host, getaddrinfo() gives the loopback addresses
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = PF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  err = getaddrinfo(host && *host ? host : NULL, port, &hints, &res);
+  if (err) {
+    redstore_error("Failed to resolve replication address '%s': %s", address, gai_strerror(err));
+    goto CLEANUP;
+  }
+
+  for (ai = res; ai; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0)
+      continue;
+
+    if (do_listen) {
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+      err = bind(fd, ai->ai_addr, ai->ai_addrlen);
+    } else {
+      err = connect(fd, ai->ai_addr, ai->ai_addrlen);
+    }
+
+    if (err == 0)
+      break;
+
+    close(fd);
+    fd = -1;
+  }
+
+CLEANUP:
+  if (res)
+    freeaddrinfo(res);
+  if (host)
+    free(host);
+  else if (port)
+    free(port);
+
+  return fd;
+}
+
+static void put_frame_header(unsigned char *ptr, char type, uint64_t length)
+{
+  ptr[0] = type;
+  redstore_put_uint64(&ptr[1], length);
+}
+
+static void replica_close(int i)
+{
+  if (replicas[i].watched)
+    redhttp_server_remove_watch(replication_server, replicas[i].fd);
+  close(replicas[i].fd);
+  redstore_buffer_free(&replicas[i].outbound);
+  replicas[i] = replicas[--replica_count];
+}
+
+static void replica_drop(int i)
+{
+  redstore_warn("Dropping replica connection %d.", replicas[i].fd);
+  replica_close(i);
+}
+
+static void replica_writable(int fd, void *user_data);
+
+// Send as much of the outbound buffer as the socket will take without
+// waiting, and watch for it to become writable if any is left
+static int replica_send(replica_t * replica)
+{
+  redstore_buffer_t *outbound = &replica->outbound;
+  size_t offset = 0;
+
+  while (offset < outbound->length) {
+    ssize_t sent = send(replica->fd, outbound->data + offset, outbound->length - offset,
+                        MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      return -1;
+    }
+    offset += sent;
+  }
+
+  if (offset > 0) {
+    memmove(outbound->data, outbound->data + offset, outbound->length - offset);
+    outbound->length -= offset;
+  }
+
+  if (outbound->length > 0 && !replica->watched) {
+    if (redhttp_server_add_write_watch(replication_server, replica->fd, replica_writable, NULL))
+      return -1;
+    replica->watched = 1;
+  } else if (outbound->length == 0 && replica->watched) {
+    redhttp_server_remove_watch(replication_server, replica->fd);
+    replica->watched = 0;
+  }
+
+  return 0;
+}
+
+// Add changes to the outbound buffer of a replica, and start sending them
+static int replica_queue(replica_t * replica, const void *data, size_t length)
+{
+  if (replica->outbound.length + length > MAX_BACKLOG_SIZE) {
+    redstore_warn("Replica connection %d has fallen too far behind.", replica->fd);
+    return -1;
+  }
+
+  if (redstore_buffer_append(&replica->outbound, data, length))
+    return -1;
+
+  return replica_send(replica);
+}
+
+// A replica's socket can take more of its outbound buffer
+static void replica_writable(int fd, void *user_data)
+{
+  int i;
+
+  for (i = 0; i < replica_count; i++) {
+    if (replicas[i].fd == fd) {
+      if (replica_send(&replicas[i]))
+        replica_drop(i);
+      return;
+    }
+  }
+}
+
+// Send a snapshot of the store, as a single frame
+static int replica_send_snapshot(int fd)
+{
+  unsigned char header[FRAME_HEADER_SIZE + 8];
+  unsigned char buffer[RECEIVE_SIZE];
+  FILE *file = tmpfile();
+  struct stat st;
+  ssize_t len;
+  int err = -1;
+
+  if (!file) {
+    redstore_error("Failed to create temporary file for replica snapshot.");
+    return -1;
+  }
+
+  if (redstore_snapshot_write_fd(fileno(file)) || fstat(fileno(file), &st) ||
+      lseek(fileno(file), 0, SEEK_SET) < 0)
+    goto CLEANUP;
+
+  put_frame_header(header, FRAME_SNAPSHOT, 8 + (uint64_t) st.st_size);
+  redstore_put_uint64(&header[FRAME_HEADER_SIZE], store_version);
+  if (send_fully(fd, REPLICATION_MAGIC, REPLICATION_MAGIC_SIZE) ||
+      send_fully(fd, header, sizeof(header)))
+    goto CLEANUP;
+
+  while ((len = read(fileno(file), buffer, sizeof(buffer))) > 0) {
+    if (send_fully(fd, buffer, len))
+      goto CLEANUP;
+  }
+
+  if (len == 0)
+    err = 0;
+
+CLEANUP:
+  fclose(file);
+  return err;
+}
+
+static void syncing_remove(int i, int keep)
+{
+  redhttp_server_remove_watch(replication_server, syncing[i].done_fd);
+  close(syncing[i].done_fd);
+  if (!keep)
+    close(syncing[i].fd);
+  redstore_buffer_free(&syncing[i].backlog);
+  syncing[i] = syncing[--syncing_count];
+}
+
+// The child sending a snapshot has finished: send the changes made since
+// and start sending the replica changes with the others
+static void replication_synced(int fd, void *user_data)
+{
+  replica_t *replica;
+  char result = '0';
+  ssize_t got;
+  int i;
+
+  for (i = 0; i < syncing_count; i++) {
+    if (syncing[i].done_fd == fd)
+      break;
+  }
+  if (i == syncing_count)
+    return;
+
+  do {
+    got = read(fd, &result, 1);
+  } while (got < 0 && errno == EINTR);
+
+  if (got != 1 || result != '1') {
+    redstore_error("Failed to send snapshot to replica.");
+    syncing_remove(i, 0);
+    return;
+  }
+
+  // The changes made since the snapshot are the replica's first to send
+  replica = &replicas[replica_count++];
+  memset(replica, 0, sizeof(replica_t));
+  replica->fd = syncing[i].fd;
+  replica->outbound = syncing[i].backlog;
+  memset(&syncing[i].backlog, 0, sizeof(redstore_buffer_t));
+  syncing_remove(i, 1);
+
+  if (replica_send(replica)) {
+    redstore_error("Failed to send changes to replica.");
+    replica_drop(replica_count - 1);
+    return;
+  }
+
+  redstore_info("Replica is now up to date at store version %lu.", store_version);
+}
+
+// Child process: send the snapshot and report the result on the pipe
+static void replica_sync_child(int replica_fd, int done_fd)
+{
+  int err;
+  int i;
+
+  // The other replicas belong to the parent
+  for (i = 0; i < replica_count; i++)
+    close(replicas[i].fd);
+  for (i = 0; i < syncing_count; i++) {
+    close(syncing[i].fd);
+    close(syncing[i].done_fd);
+  }
+
+  err = replica_send_snapshot(replica_fd);
+
+  if (write(done_fd, err ? "0" : "1", 1) != 1)
+    err = -1;
+  _exit(err ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+static void replication_accept(int fd, void *user_data)
+{
+  struct timeval tv;
+  int replica_fd;
+  int pipe_fds[2];
+  pid_t pid;
+
+  replica_fd = accept(fd, NULL, NULL);
+  if (replica_fd < 0) {
+    if (errno != EINTR && errno != EAGAIN)
+      redstore_error("Failed to accept replica connection: %s", strerror(errno));
+    return;
+  }
+
+  if (replica_count + syncing_count - worker_replicas >= max_replicas) {
+    redstore_warn("Too many replicas connected (%d).", replica_count + syncing_count - worker_replicas);
+    close(replica_fd);
+    return;
+  }
+
+  // Don't let a stuck replica hold up the child sending its snapshot for ever
+  tv.tv_sec = replica_timeout / 1000;
+  tv.tv_usec = (replica_timeout % 1000) * 1000;
+  setsockopt(replica_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+  // The snapshot includes the queued changes, so send them to the others first
+  redstore_replication_flush();
+
+  if (pipe(pipe_fds)) {
+    redstore_error("Failed to create pipe for replica snapshot: %s", strerror(errno));
+    close(replica_fd);
+    return;
+  }
+
+  pid = redstore_fork_child();
+  if (pid < 0) {
+    redstore_error("Failed to start sending snapshot to replica.");
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    close(replica_fd);
+    return;
+  } else if (pid == 0) {
+    close(pipe_fds[0]);
+    replica_sync_child(replica_fd, pipe_fds[1]);
+  }
+
+  close(pipe_fds[1]);
+  syncing[syncing_count].fd = replica_fd;
+  syncing[syncing_count].done_fd = pipe_fds[0];
+  memset(&syncing[syncing_count].backlog, 0, sizeof(redstore_buffer_t));
+  syncing_count++;
+
+  if (redhttp_server_add_watch(replication_server, pipe_fds[0], replication_synced, NULL)) {
+    syncing_remove(syncing_count - 1, 0);
+    return;
+  }
+
+  redstore_info("Sending snapshot at store version %lu to replica in child process %d.",
+                store_version, (int) pid);
+}
+
+static int replication_listen(const char *address)
+{
+  if (!redstore_storage_is_in_memory()) {
+    redstore_error("Replicas can only be sent snapshots of an in-memory store.");
+    return -1;
+  }
+
+  max_replicas = redstore_get_option_long("max-replicas", DEFAULT_MAX_REPLICAS);
+  replica_timeout = redstore_get_option_long("replica-timeout", DEFAULT_REPLICA_TIMEOUT);
+
+  replicas = calloc(max_replicas > 0 ? max_replicas : 1, sizeof(replica_t));
+  syncing = calloc(max_replicas > 0 ? max_replicas : 1, sizeof(syncing_replica_t));
+  if (!replicas || !syncing) {
+    redstore_error("Failed to allocate memory for replica table.");
+    return -1;
+  }
+
+  listen_fd = open_socket(address, 1);
+  if (listen_fd < 0 || listen(listen_fd, max_replicas > 0 ? max_replicas : 1)) {
+    redstore_error("Failed to listen for replicas on '%s': %s", address, strerror(errno));
+    return -1;
+  }
+
+  if (address[0] == '/') {
+    listen_path = calloc(1, strlen(address) + 1);
+    if (listen_path)
+      strcpy(listen_path, address);
+  }
+
+  if (redhttp_server_add_watch(replication_server, listen_fd, replication_accept, NULL))
+    return -1;
+
+  // A replica going away should not kill the primary
+  signal(SIGPIPE, SIG_IGN);
+
+  redstore_info("Publishing changes to replicas on: %s", address);
+  return 0;
+}
+
+// Apply one change received from the primary
+static int replication_apply(const unsigned char *ptr, const unsigned char *end)
+{
+  librdf_statement *statement = NULL;
+  librdf_node *graph = NULL;
+  uint64_t sequence = 0;
+  int op, err = -1;
+
+  if (!redstore_decode_change(ptr, end, &op, &sequence, &graph, &statement))
+    return -1;
+
+  switch (op) {
+  case WAL_OP_ADD:
+    err = redstore_store_add_statement(graph, statement);
+    break;
+  case WAL_OP_REMOVE:
+    err = redstore_store_remove_statement(graph, statement);
+    break;
+  case WAL_OP_CLEAR_GRAPH:
+    if (graph)
+      err = redstore_store_remove_graph(graph);
+    break;
+  default:
+    redstore_error("Unknown operation received from primary: %d", op);
+  }
+
+  // Stay at the same version as the primary
+  store_version = sequence;
+
+  if (statement)
+    librdf_free_statement(statement);
+  if (graph)
+    librdf_free_node(graph);
+
+  return err;
+}
+
+static void replication_lost(const char *reason)
+{
+  redstore_error("Lost connection to primary: %s", reason);
+  redhttp_server_remove_watch(replication_server, primary_fd);
+  close(primary_fd);
+  primary_fd = -1;
+
+  // The replica is now out of date, so stop and let it be restarted
+  exit_code = EXIT_FAILURE;
+  running = 0;
+}
+
+static void replication_receive(int fd, void *user_data)
+{
+  size_t offset = 0;
+  ssize_t got;
+
+  if (redstore_buffer_reserve(&incoming, RECEIVE_SIZE)) {
+    replication_lost("out of memory");
+    return;
+  }
+
+  got = read(fd, incoming.data + incoming.length, RECEIVE_SIZE);
+  if (got < 0) {
+    if (errno != EINTR && errno != EAGAIN)
+      replication_lost(strerror(errno));
+    return;
+  } else if (got == 0) {
+    replication_lost("connection closed");
+    return;
+  }
+  incoming.length += got;
+
+  // Apply each of the complete frames
+  while (incoming.length - offset >= FRAME_HEADER_SIZE) {
+    const unsigned char *frame = incoming.data + offset;
+    uint64_t length = redstore_get_uint64(&frame[1]);
+
+    if (frame[0] != FRAME_CHANGE || length > MAX_CHANGE_SIZE) {
+      replication_lost("invalid frame");
+      return;
+    }
+    if (incoming.length - offset - FRAME_HEADER_SIZE < length)
+      break;
+
+    // A change that can't be applied leaves the replica out of step with
+    // the primary, and every later change would be applied to the wrong store
+    if (replication_apply(&frame[FRAME_HEADER_SIZE], &frame[FRAME_HEADER_SIZE + length])) {
+      redstore_error("Failed to apply change %lu from primary.", store_version);
+      replication_lost("replica is out of step");
+      return;
+    }
+
+    offset += FRAME_HEADER_SIZE + length;
+  }
+
+  if (offset > 0) {
+    memmove(incoming.data, incoming.data + offset, incoming.length - offset);
+    incoming.length -= offset;
+  }
+}
+
+// Connect to the primary and load the snapshot that it sends
+static int replication_bootstrap(const char *address)
+{
+  unsigned char header[REPLICATION_MAGIC_SIZE + FRAME_HEADER_SIZE + 8];
+  unsigned char buffer[RECEIVE_SIZE];
+  uint64_t length, version;
+  FILE *file = NULL;
+  int err = -1;
+
+  if (redstore_store_size() > 0) {
+    redstore_error("A replica must start with an empty store.");
+    return -1;
+  }
+
+  primary_fd = open_socket(address, 0);
+  if (primary_fd < 0) {
+    redstore_error("Failed to connect to primary '%s': %s", address, strerror(errno));
+    return -1;
+  }
+
+  if (read_fully(primary_fd, header, sizeof(header)) ||
+      memcmp(header, REPLICATION_MAGIC, REPLICATION_MAGIC_SIZE) != 0 ||
+      header[REPLICATION_MAGIC_SIZE] != FRAME_SNAPSHOT) {
+    redstore_error("Did not receive a snapshot from primary.");
+    return -1;
+  }
+
+  length = redstore_get_uint64(&header[REPLICATION_MAGIC_SIZE + 1]);
+  version = redstore_get_uint64(&header[REPLICATION_MAGIC_SIZE + FRAME_HEADER_SIZE]);
+  if (length < 8) {
+    redstore_error("Invalid snapshot received from primary.");
+    return -1;
+  }
+  length -= 8;
+
+  // Keep a copy of the snapshot, so that it can be mapped into memory
+  file = tmpfile();
+  if (!file) {
+    redstore_error("Failed to create temporary file for snapshot from primary.");
+    return -1;
+  }
+
+  while (length > 0) {
+    size_t len = length < sizeof(buffer) ? length : sizeof(buffer);
+    if (read_fully(primary_fd, buffer, len) || fwrite(buffer, 1, len, file) != len) {
+      redstore_error("Failed to receive snapshot from primary.");
+      goto CLEANUP;
+    }
+    length -= len;
+  }
+  fflush(file);
+
+  if (redstore_snapshot_load_fd(fileno(file), "primary"))
+    goto CLEANUP;
+
+  store_version = version;
+  redstore_info("Replicating from %s, starting at store version %lu.", address, store_version);
+
+  fcntl(primary_fd, F_SETFL, fcntl(primary_fd, F_GETFL) | O_NONBLOCK);
+  err = redhttp_server_add_watch(replication_server, primary_fd, replication_receive, NULL);
+
+CLEANUP:
+  fclose(file);
+  return err;
+}
+
+
+int redstore_replication_init(redhttp_server_t * server)
+{
+  char *listen_address = redstore_get_option_string("replication-listen");
+  char *primary_address = redstore_get_option_string("replicate-from");
+  int err = 0;
+
+  replication_server = server;
+  primary_url = redstore_get_option_string("primary-url");
+
+  if (primary_address) {
+    err = replication_bootstrap(primary_address);
+    free(primary_address);
+  }
+
+  if (listen_address) {
+    if (!err)
+      err = replication_listen(listen_address);
+    free(listen_address);
+  }
+
+  return err;
+}
+
+int redstore_is_replica(void)
+{
+  return primary_fd >= 0;
+}
+
+// Publish changes to a worker process; it was forked with a copy of the store
+int redstore_replication_add_replica(int fd)
+{
+  replica_t *table = realloc(replicas, (replica_count + max_replicas + 1) * sizeof(replica_t));
+
+  if (!table) {
+    redstore_error("Failed to allocate memory for replica table.");
+    return -1;
+  }
+
+  // A worker going away should not kill the primary
+  signal(SIGPIPE, SIG_IGN);
+
+  replicas = table;
+  memset(&replicas[replica_count], 0, sizeof(replica_t));
+  replicas[replica_count++].fd = fd;
+  worker_replicas++;
+  return 0;
+}
+
+// Become a replica of the process that forked this one, using its socket
+// pair
+int redstore_replication_follow(int fd)
+{
+  // The replicas and the listening socket belong to the primary
+  while (replica_count > 0)
+    replica_close(0);
+  worker_replicas = 0;
+  while (syncing_count > 0)
+    syncing_remove(0, 0);
+  redstore_buffer_reset(&pending);
+
+  if (listen_fd >= 0) {
+    redhttp_server_remove_watch(replication_server, listen_fd);
+    close(listen_fd);
+    listen_fd = -1;
+  }
+  if (listen_path) {
+    free(listen_path);
+    listen_path = NULL;
+  }
+
+  if (primary_fd >= 0) {
+    redhttp_server_remove_watch(replication_server, primary_fd);
+    close(primary_fd);
+  }
+  redstore_buffer_reset(&incoming);
+
+  primary_fd = fd;
+  fcntl(primary_fd, F_SETFL, fcntl(primary_fd, F_GETFL) | O_NONBLOCK);
+  return redhttp_server_add_watch(replication_server, primary_fd, replication_receive, NULL);
+}
+
+// Queue a change to be sent to the replicas
+void redstore_replication_publish(int op, librdf_node * graph, librdf_statement * statement)
+{
+  size_t start = pending.length;
+
+  if (replica_count == 0 && syncing_count == 0)
+    return;
+
+  if (redstore_buffer_reserve(&pending, FRAME_HEADER_SIZE))
+    return;
+  pending.length += FRAME_HEADER_SIZE;
+
+  if (redstore_encode_change(&pending, op, store_version, graph, statement)) {
+    pending.length = start;
+    return;
+  }
+  put_frame_header(&pending.data[start], FRAME_CHANGE, pending.length - start - FRAME_HEADER_SIZE);
+
+  if (pending.length >= PENDING_FLUSH_SIZE)
+    redstore_replication_flush();
+}
+
+// Send the queued changes to the replicas
+void redstore_replication_flush(void)
+{
+  int i;
+
+  if (pending.length == 0)
+    return;
+
+  for (i = 0; i < replica_count; i++) {
+    if (replica_queue(&replicas[i], pending.data, pending.length))
+      replica_drop(i--);
+  }
+
+  // Replicas still being sent a snapshot get the changes afterwards
+  for (i = 0; i < syncing_count; i++) {
+    if (syncing[i].backlog.length + pending.length > MAX_BACKLOG_SIZE ||
+        redstore_buffer_append(&syncing[i].backlog, pending.data, pending.length)) {
+      redstore_warn("Dropping replica connection %d, which fell too far behind.", syncing[i].fd);
+      syncing_remove(i--, 0);
+    }
+  }
+
+  redstore_buffer_reset(&pending);
+}
+
+// Replicas are read-only: send anything that might change the store to the primary
+redhttp_response_t *handle_replica_write(redhttp_request_t * request, void *user_data)
+{
+  const char *method = redhttp_request_get_method(request);
+  const char *path = redhttp_request_get_path(request);
+  redhttp_response_t *response = NULL;
+  char *url = NULL;
+
+  if (!redstore_is_replica() || !redstore_is_write_request(method, path))
+    return NULL;
+
+  // Workers pass HTTP/1.x writes to the writer before they are read, so
+  // they only get one if the writer couldn't take it
+  if (redstore_is_worker() && redhttp_request_is_multiplexed(request)) {
+    return redstore_page_new_with_message(
+      request, LIBRDF_LOG_INFO, REDHTTP_FORBIDDEN,
+      "Changes to this server must be made using HTTP/1.x."
+    );
+  } else if (redstore_is_worker()) {
+    response = redstore_page_new_with_message(
+      request, LIBRDF_LOG_WARN, REDHTTP_SERVICE_UNAVAILABLE,
+      "The server is too busy to make changes; try again later."
+    );
+    redstore_add_retry_after(response);
+    return response;
+  }
+
+  if (!primary_url) {
+    return redstore_page_new_with_message(
+      request, LIBRDF_LOG_INFO, REDHTTP_FORBIDDEN, "This server is a read-only replica."
+    );
+  }
+
+  url = calloc(1, strlen(primary_url) + strlen(redhttp_request_get_path_and_query(request)) + 1);
+  if (!url) {
+    return redstore_page_new_with_message(
+      request, LIBRDF_LOG_ERROR, REDHTTP_INTERNAL_SERVER_ERROR, "Failed to allocate memory."
+    );
+  }
+
+  // Strip any trailing slash, as the path starts with one
+  strcpy(url, primary_url);
+  if (*url && url[strlen(url) - 1] == '/')
+    url[strlen(url) - 1] = '\0';
+  strcat(url, redhttp_request_get_path_and_query(request));
+
+  response = redhttp_response_new_redirect(url, REDHTTP_TEMPORARY_REDIRECT);
+  free(url);
+
+  return response;
+}
+
+void redstore_replication_free(void)
+{
+  redstore_replication_flush();
+  while (replica_count > 0)
+    replica_close(0);
+  while (syncing_count > 0)
+    syncing_remove(0, 0);
+
+  if (replicas)
+    free(replicas);
+  replicas = NULL;
+  if (syncing)
+    free(syncing);
+  syncing = NULL;
+
+  if (listen_fd >= 0)
+    close(listen_fd);
+  listen_fd = -1;
+  if (listen_path) {
+    unlink(listen_path);
+    free(listen_path);
+    listen_path = NULL;
+  }
+
+  if (primary_fd >= 0)
+    close(primary_fd);
+  primary_fd = -1;
+
+  if (primary_url)
+    free(primary_url);
+  primary_url = NULL;
+
+  redstore_buffer_free(&pending);
+  redstore_buffer_free(&incoming);
+}
@@ -0,0 +1,941 @@
+/*
+    RedStore - a lightweight RDF triplestore powered by Redland
+    Copyright (C) 2010-2011 Nicholas J Humfrey <njh@aelius.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Native query results writers
+
+  The SPARQL XML, JSON, CSV and TSV results formats are simple enough to
+  write directly, without going through a librdf results formatter and a
+  raptor iostream for every term. Each row is escaped straight into one
+  output buffer, which is written to the socket whenever it gets large,
+  and is kept between responses so that it does not have to grow again.
+
+  Each writer is split into a head, the rows and a tail, so that the rows
+  of several sets of results for the same query - one from each shard -
+  can be written into a single document. Rows written separately (by
+  worker processes) are joined with the writer's separator, if it has one.
+
+  Which format to use is still decided by the usual negotiation, against
+  the librdf query results formats plus the formats which only exist here
+  (see redstore_results_formats_get_description()), and
+  redstore_get_results_writer() returns NULL for any format that should
+  be written by librdf.
+
+  The binary results format is for bulk machine clients. All integers are
+  unsigned LEB128 varints and terms use the same encoding as the write
+  ahead log (see redstore_encode_node()):
+
+    "RSR1"                      magic
+    byte                        0 for bindings, 1 for a boolean result
+    byte                        the boolean result (boolean results only)
+    varint, names               variable count and counted variable names
+    blocks                      (bindings only)
+
+  Each block is:
+
+    varint                      number of rows, 0 at the end of the results
+    byte                        1 if the term dictionary starts again empty,
+                                as it always does for the first block of
+                                each shard's rows
+    varint, terms               number of terms new to the dictionary, then
+                                each term, numbered on from 1 in order
+    varint[rows] per variable   the rows one column at a time, giving the
+                                number of each term, or 0 if it is unbound
+
+  so each distinct term is only sent once, until the dictionary gets large
+  enough to start again.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "redstore.h"
+
+#define OUTPUT_FLUSH_SIZE   (256 * 1024)
+#define OUTPUT_KEEP_SIZE    (4 * 1024 * 1024)
+
+#define BINARY_MAGIC              "RSR1"
+#define BINARY_BLOCK_ROWS         (1024)
+#define BINARY_DICTIONARY_SLOTS   (4096)
+#define BINARY_DICTIONARY_MAX     (1024 * 1024)
+
+
+typedef struct dictionary_term_s {
+  uint32_t hash;
+  uint64_t id;
+  size_t length;
+  struct dictionary_term_s *next;
+  unsigned char data[1];
+} dictionary_term_t;
+
+typedef struct {
+  dictionary_term_t **slots;
+  unsigned int slot_count;
+  uint64_t count;
+} dictionary_t;
+
+
+static redstore_buffer_t output = { NULL, 0, 0 };
+static const char hex_digits[] = "0123456789ABCDEF";
+
+static const char *binary_names[] = { "binary", NULL };
+static const raptor_type_q binary_mime_types[] = {
+  { RESULTS_BINARY_MIME_TYPE, sizeof(RESULTS_BINARY_MIME_TYPE) - 1, 10 }
+};
+static const raptor_syntax_description binary_description = {
+  binary_names, 1, "RedStore Binary Query Results", binary_mime_types, 1, NULL, 0, 0
+};
+static int librdf_results_format_count = -1;
+
+
+static int output_flush(FILE * socket)
+{
+  size_t written = 0;
+
+  if (output.length)
+    written = fwrite(output.data, 1, output.length, socket);
+
+  if (written != output.length) {
+    redstore_buffer_reset(&output);
+    return -1;
+  }
+
+  redstore_buffer_reset(&output);
+  return 0;
+}
+
+static int output_finish(FILE * socket, int err)
+{
+  if (!err)
+    err = output_flush(socket);
+  redstore_buffer_reset(&output);
+
+  // Don't hold on to the memory used by a huge literal
+  if (output.size > OUTPUT_KEEP_SIZE)
+    redstore_buffer_free(&output);
+
+  return err;
+}
+
+static int append_string(const char *str)
+{
+  return redstore_buffer_append(&output, str, strlen(str));
+}
+
+static int append_json_escaped(const unsigned char *str, size_t len)
+{
+  unsigned char *out;
+  size_t i;
+
+  if (redstore_buffer_reserve(&output, len * 6))
+    return -1;
+
+  out = &output.data[output.length];
+  for (i = 0; i < len; i++) {
+    unsigned char c = str[i];
+    switch (c) {
+    case '"':
+      *out++ = '\\';
+      *out++ = '"';
+      break;
+    case '\\':
+      *out++ = '\\';
+      *out++ = '\\';
+      break;
+    case '\n':
+      *out++ = '\\';
+      *out++ = 'n';
+      break;
+    case '\r':
+      *out++ = '\\';
+      *out++ = 'r';
+      break;
+    case '\t':
+      *out++ = '\\';
+      *out++ = 't';
+      break;
+    default:
+      if (c < 0x20) {
+        *out++ = '\\';
+        *out++ = 'u';
+        *out++ = '0';
+        *out++ = '0';
+        *out++ = hex_digits[c >> 4];
+        *out++ = hex_digits[c & 0x0F];
+      } else {
+        *out++ = c;
+      }
+    }
+  }
+  output.length = out - output.data;
+
+  return 0;
+}
+
+static int append_xml_escaped(const unsigned char *str, size_t len)
+{
+  unsigned char *out;
+  size_t i;
+
+  if (redstore_buffer_reserve(&output, len * 6))
+    return -1;
+
+  out = &output.data[output.length];
+  for (i = 0; i < len; i++) {
+    switch (str[i]) {
+    case '&':
+      memcpy(out, "&amp;", 5);
+      out += 5;
+      break;
+    case '<':
+      memcpy(out, "&lt;", 4);
+      out += 4;
+      break;
+    case '>':
+      memcpy(out, "&gt;", 4);
+      out += 4;
+      break;
+    case '"':
+      memcpy(out, "&quot;", 6);
+      out += 6;
+      break;
+    default:
+      *out++ = str[i];
+    }
+  }
+  output.length = out - output.data;
+
+  return 0;
+}
+
+static int append_csv_field(const unsigned char *str, size_t len)
+{
+  unsigned char *out;
+  size_t i;
+
+  // Only quote the field if it needs it
+  for (i = 0; i < len; i++) {
+    if (str[i] == '"' || str[i] == ',' || str[i] == '\r' || str[i] == '\n')
+      break;
+  }
+  if (i == len)
+    return redstore_buffer_append(&output, str, len);
+
+  if (redstore_buffer_reserve(&output, len * 2 + 2))
+    return -1;
+
+  out = &output.data[output.length];
+  *out++ = '"';
+  for (i = 0; i < len; i++) {
+    if (str[i] == '"')
+      *out++ = '"';
+    *out++ = str[i];
+  }
+  *out++ = '"';
+  output.length = out - output.data;
+
+  return 0;
+}
+
+static int append_tsv_escaped(const unsigned char *str, size_t len)
+{
+  unsigned char *out;
+  size_t i;
+
+  if (redstore_buffer_reserve(&output, len * 2))
+    return -1;
+
+  out = &output.data[output.length];
+  for (i = 0; i < len; i++) {
+    switch (str[i]) {
+    case '\t':
+      *out++ = '\\';
+      *out++ = 't';
+      break;
+    case '\n':
+      *out++ = '\\';
+      *out++ = 'n';
+      break;
+    case '\r':
+      *out++ = '\\';
+      *out++ = 'r';
+      break;
+    case '"':
+      *out++ = '\\';
+      *out++ = '"';
+      break;
+    case '\\':
+      *out++ = '\\';
+      *out++ = '\\';
+      break;
+    default:
+      *out++ = str[i];
+    }
+  }
+  output.length = out - output.data;
+
+  return 0;
+}
+
+
+static int append_xml_term(librdf_node * node)
+{
+  const unsigned char *str;
+  size_t len;
+  int err = 0;
+
+  if (librdf_node_is_resource(node)) {
+    str = librdf_uri_as_counted_string(librdf_node_get_uri(node), &len);
+    err |= append_string("<uri>");
+    err |= append_xml_escaped(str, len);
+    err |= append_string("</uri>");
+  } else if (librdf_node_is_blank(node)) {
+    str = librdf_node_get_counted_blank_identifier(node, &len);
+    err |= append_string("<bnode>");
+    err |= append_xml_escaped(str, len);
+    err |= append_string("</bnode>");
+  } else if (librdf_node_is_literal(node)) {
+    const char *lang = librdf_node_get_literal_value_language(node);
+    librdf_uri *datatype = librdf_node_get_literal_value_datatype_uri(node);
+
+    err |= append_string("<literal");
+    if (datatype) {
+      str = librdf_uri_as_counted_string(datatype, &len);
+      err |= append_string(" datatype=\"");
+      err |= append_xml_escaped(str, len);
+      err |= append_string("\"");
+    } else if (lang && *lang) {
+      err |= append_string(" xml:lang=\"");
+      err |= append_xml_escaped((const unsigned char *) lang, strlen(lang));
+      err |= append_string("\"");
+    }
+    err |= append_string(">");
+    str = librdf_node_get_literal_value_as_counted_string(node, &len);
+    err |= append_xml_escaped(str, len);
+    err |= append_string("</literal>");
+  }
+
+  return err;
+}
+
+static int append_json_term(librdf_node * node)
+{
+  const unsigned char *str;
+  size_t len;
+  int err = 0;
+
+  if (librdf_node_is_resource(node)) {
+    str = librdf_uri_as_counted_string(librdf_node_get_uri(node), &len);
+    err |= append_string("{\"type\":\"uri\",\"value\":\"");
+    err |= append_json_escaped(str, len);
+    err |= append_string("\"}");
+  } else if (librdf_node_is_blank(node)) {
+    str = librdf_node_get_counted_blank_identifier(node, &len);
+    err |= append_string("{\"type\":\"bnode\",\"value\":\"");
+    err |= append_json_escaped(str, len);
+    err |= append_string("\"}");
+  } else if (librdf_node_is_literal(node)) {
+    const char *lang = librdf_node_get_literal_value_language(node);
+    librdf_uri *datatype = librdf_node_get_literal_value_datatype_uri(node);
+
+    str = librdf_node_get_literal_value_as_counted_string(node, &len);
+    err |= append_string("{\"type\":\"literal\",\"value\":\"");
+    err |= append_json_escaped(str, len);
+    err |= append_string("\"");
+    if (datatype) {
+      str = librdf_uri_as_counted_string(datatype, &len);
+      err |= append_string(",\"datatype\":\"");
+      err |= append_json_escaped(str, len);
+      err |= append_string("\"");
+    } else if (lang && *lang) {
+      err |= append_string(",\"xml:lang\":\"");
+      err |= append_json_escaped((const unsigned char *) lang, strlen(lang));
+      err |= append_string("\"");
+    }
+    err |= append_string("}");
+  } else {
+    err |= append_string("null");
+  }
+
+  return err;
+}
+
+static int append_csv_term(librdf_node * node)
+{
+  const unsigned char *str;
+  size_t len;
+
+  // CSV loses the type of each term, leaving just its value
+  if (librdf_node_is_resource(node)) {
+    str = librdf_uri_as_counted_string(librdf_node_get_uri(node), &len);
+    return append_csv_field(str, len);
+  } else if (librdf_node_is_blank(node)) {
+    str = librdf_node_get_counted_blank_identifier(node, &len);
+    return append_string("_:") || append_csv_field(str, len);
+  } else if (librdf_node_is_literal(node)) {
+    str = librdf_node_get_literal_value_as_counted_string(node, &len);
+    return append_csv_field(str, len);
+  }
+
+  return 0;
+}
+
+static int append_tsv_term(librdf_node * node)
+{
+  const unsigned char *str;
+  size_t len;
+  int err = 0;
+
+  // TSV terms are written in the same way as in Turtle
+  if (librdf_node_is_resource(node)) {
+    str = librdf_uri_as_counted_string(librdf_node_get_uri(node), &len);
+    err |= redstore_buffer_append_byte(&output, '<');
+    err |= redstore_buffer_append(&output, str, len);
+    err |= redstore_buffer_append_byte(&output, '>');
+  } else if (librdf_node_is_blank(node)) {
+    str = librdf_node_get_counted_blank_identifier(node, &len);
+    err |= append_string("_:");
+    err |= redstore_buffer_append(&output, str, len);
+  } else if (librdf_node_is_literal(node)) {
+    const char *lang = librdf_node_get_literal_value_language(node);
+    librdf_uri *datatype = librdf_node_get_literal_value_datatype_uri(node);
+
+    str = librdf_node_get_literal_value_as_counted_string(node, &len);
+    err |= redstore_buffer_append_byte(&output, '"');
+    err |= append_tsv_escaped(str, len);
+    err |= redstore_buffer_append_byte(&output, '"');
+    if (datatype) {
+      str = librdf_uri_as_counted_string(datatype, &len);
+      err |= append_string("^^<");
+      err |= redstore_buffer_append(&output, str, len);
+      err |= redstore_buffer_append_byte(&output, '>');
+    } else if (lang && *lang) {
+      err |= redstore_buffer_append_byte(&output, '@');
+      err |= append_string(lang);
+    }
+  }
+
+  return err;
+}
+
+
+static int write_json_head(FILE * socket, librdf_query_results * results)
+{
+  int bindings_count, b;
+  int err = 0;
+
+  redstore_buffer_reset(&output);
+
+  if (librdf_query_results_is_boolean(results)) {
+    // Laid out in the same way as the librdf formatter
+    err |= append_string("{\n  \"head\": {},\n  \"boolean\" : ");
+    err |= append_string(librdf_query_results_get_boolean(results) > 0 ? "true" : "false");
+    err |= append_string("\n}\n");
+    return output_finish(socket, err);
+  }
+
+  err |= append_string("{\"head\":{\"vars\":[");
+  bindings_count = librdf_query_results_get_bindings_count(results);
+  for (b = 0; b < bindings_count; b++) {
+    const char *name = librdf_query_results_get_binding_name(results, b);
+    err |= append_string(b ? ",\"" : "\"");
+    err |= append_json_escaped((const unsigned char *) name, strlen(name));
+    err |= append_string("\"");
+  }
+  err |= append_string("]},\n\"results\":{\"bindings\":[\n");
+
+  return output_finish(socket, err);
+}
+
+static int write_json_rows(FILE * socket, librdf_query_results * results, unsigned long *count)
+{
+  int bindings_count, b;
+  int err = 0;
+
+  if (librdf_query_results_is_boolean(results))
+    return 0;
+
+  redstore_buffer_reset(&output);
+  bindings_count = librdf_query_results_get_bindings_count(results);
+
+  while (!err && !librdf_query_results_finished(results)) {
+    int first = 1;
+
+    err |= append_string((*count)++ ? ",\n{" : "{");
+    for (b = 0; b < bindings_count; b++) {
+      librdf_node *node = librdf_query_results_get_binding_value(results, b);
+      if (node) {
+        const char *name = librdf_query_results_get_binding_name(results, b);
+        err |= append_string(first ? "\"" : ",\"");
+        err |= append_json_escaped((const unsigned char *) name, strlen(name));
+        err |= append_string("\":");
+        err |= append_json_term(node);
+        librdf_free_node(node);
+        first = 0;
+      }
+    }
+    err |= append_string("}");
+
+    if (output.length >= OUTPUT_FLUSH_SIZE)
+      err |= output_flush(socket);
+
+    if (librdf_query_results_next(results))
+      break;
+  }
+
+  return output_finish(socket, err);
+}
+
+static int write_json_tail(FILE * socket, librdf_query_results * results)
+{
+  if (librdf_query_results_is_boolean(results))
+    return 0;
+
+  redstore_buffer_reset(&output);
+  return output_finish(socket, append_string("\n]}}\n"));
+}
+
+static int write_separated_head(FILE * socket, librdf_query_results * results, int tabs)
+{
+  int bindings_count, b;
+  int err = 0;
+
+  redstore_buffer_reset(&output);
+
+  bindings_count = librdf_query_results_get_bindings_count(results);
+  for (b = 0; b < bindings_count; b++) {
+    const char *name = librdf_query_results_get_binding_name(results, b);
+    if (b)
+      err |= redstore_buffer_append_byte(&output, tabs ? '\t' : ',');
+    if (tabs) {
+      err |= redstore_buffer_append_byte(&output, '?');
+      err |= append_string(name);
+    } else {
+      err |= append_csv_field((const unsigned char *) name, strlen(name));
+    }
+  }
+  err |= append_string(tabs ? "\n" : "\r\n");
+
+  return output_finish(socket, err);
+}
+
+static int write_separated_rows(FILE * socket, librdf_query_results * results,
+                                unsigned long *count, int tabs)
+{
+  int bindings_count, b;
+  int err = 0;
+
+  redstore_buffer_reset(&output);
+  bindings_count = librdf_query_results_get_bindings_count(results);
+
+  while (!err && !librdf_query_results_finished(results)) {
+    for (b = 0; b < bindings_count; b++) {
+      librdf_node *node = librdf_query_results_get_binding_value(results, b);
+      if (b)
+        err |= redstore_buffer_append_byte(&output, tabs ? '\t' : ',');
+      if (node) {
+        err |= tabs ? append_tsv_term(node) : append_csv_term(node);
+        librdf_free_node(node);
+      }
+    }
+    err |= append_string(tabs ? "\n" : "\r\n");
+    (*count)++;
+
+    if (output.length >= OUTPUT_FLUSH_SIZE)
+      err |= output_flush(socket);
+
+    if (librdf_query_results_next(results))
+      break;
+  }
+
+  return output_finish(socket, err);
+}
+
+static int write_csv_head(FILE * socket, librdf_query_results * results)
+{
+  return write_separated_head(socket, results, 0);
+}
+
+static int write_csv_rows(FILE * socket, librdf_query_results * results, unsigned long *count)
+{
+  return write_separated_rows(socket, results, count, 0);
+}
+
+static int write_tsv_head(FILE * socket, librdf_query_results * results)
+{
+  return write_separated_head(socket, results, 1);
+}
+
+static int write_tsv_rows(FILE * socket, librdf_query_results * results, unsigned long *count)
+{
+  return write_separated_rows(socket, results, count, 1);
+}
+
+static int write_xml_head(FILE * socket, librdf_query_results * results)
+{
+  int bindings_count, b;
+  int err = 0;
+
+  redstore_buffer_reset(&output);
+
+  // Laid out in the same way as the librdf formatter
+  err |= append_string("<?xml version=\"1.0\" encoding=\"utf-8\"?>\n");
+  err |= append_string("<sparql xmlns=\"http://www.w3.org/2005/sparql-results#\">\n");
+  err |= append_string("  <head>\n");
+
+  if (librdf_query_results_is_boolean(results)) {
+    err |= append_string("  </head>\n  <boolean>");
+    err |= append_string(librdf_query_results_get_boolean(results) > 0 ? "true" : "false");
+    err |= append_string("</boolean>\n</sparql>\n");
+    return output_finish(socket, err);
+  }
+
+  bindings_count = librdf_query_results_get_bindings_count(results);
+  for (b = 0; b < bindings_count; b++) {
+    const char *name = librdf_query_results_get_binding_name(results, b);
+    err |= append_string("    <variable name=\"");
+    err |= append_xml_escaped((const unsigned char *) name, strlen(name));
+    err |= append_string("\"/>\n");
+  }
+  err |= append_string("  </head>\n  <results>\n");
+
+  return output_finish(socket, err);
+}
+
+static int write_xml_rows(FILE * socket, librdf_query_results * results, unsigned long *count)
+{
+  int bindings_count, b;
+  int err = 0;
+
+  if (librdf_query_results_is_boolean(results))
+    return 0;
+
+  redstore_buffer_reset(&output);
+  bindings_count = librdf_query_results_get_bindings_count(results);
+
+  while (!err && !librdf_query_results_finished(results)) {
+    err |= append_string("    <result>\n");
+    for (b = 0; b < bindings_count; b++) {
+      librdf_node *node = librdf_query_results_get_binding_value(results, b);
+      if (node) {
+        const char *name = librdf_query_results_get_binding_name(results, b);
+        err |= append_string("      <binding name=\"");
+        err |= append_xml_escaped((const unsigned char *) name, strlen(name));
+        err |= append_string("\">");
+        err |= append_xml_term(node);
+        err |= append_string("</binding>\n");
+        librdf_free_node(node);
+      }
+    }
+    err |= append_string("    </result>\n");
+    (*count)++;
+
+    if (output.length >= OUTPUT_FLUSH_SIZE)
+      err |= output_flush(socket);
+
+    if (librdf_query_results_next(results))
+      break;
+  }
+
+  return output_finish(socket, err);
+}
+
+static int write_xml_tail(FILE * socket, librdf_query_results * results)
+{
+  if (librdf_query_results_is_boolean(results))
+    return 0;
+
+  redstore_buffer_reset(&output);
+  return output_finish(socket, append_string("  </results>\n</sparql>\n"));
+}
+
+
+static void dictionary_clear(dictionary_t * dict)
+{
+  unsigned int i;
+
+  for (i = 0; i < dict->slot_count; i++) {
+    while (dict->slots[i]) {
+      dictionary_term_t *term = dict->slots[i];
+      dict->slots[i] = term->next;
+      free(term);
+    }
+  }
+  dict->count = 0;
+}
+
+// Returns the number of an encoded term, adding it to the dictionary
+// if it is new, in which case *added is set
+static uint64_t dictionary_add(dictionary_t * dict, const unsigned char *data, size_t length,
+                               int *added)
+{
+  uint32_t hash = redstore_hash_bytes(data, length);
+  dictionary_term_t *term;
+
+  *added = 0;
+  for (term = dict->slots[hash % dict->slot_count]; term; term = term->next) {
+    if (term->hash == hash && term->length == length && memcmp(term->data, data, length) == 0)
+      return term->id;
+  }
+
+  term = malloc(sizeof(dictionary_term_t) + length);
+  if (!term)
+    return 0;
+
+  term->hash = hash;
+  term->id = ++dict->count;
+  term->length = length;
+  memcpy(term->data, data, length);
+  term->next = dict->slots[hash % dict->slot_count];
+  dict->slots[hash % dict->slot_count] = term;
+  *added = 1;
+
+  return term->id;
+}
+
+static int append_binary_block(uint64_t * ids, int rows, int columns, int reset,
+                               redstore_buffer_t * new_terms, uint64_t new_count)
+{
+  int err = 0;
+  int r, c;
+
+  err |= redstore_buffer_append_varint(&output, rows);
+  err |= redstore_buffer_append_byte(&output, reset ? 1 : 0);
+  err |= redstore_buffer_append_varint(&output, new_count);
+  err |= redstore_buffer_append(&output, new_terms->data, new_terms->length);
+
+  for (c = 0; c < columns; c++) {
+    for (r = 0; r < rows; r++)
+      err |= redstore_buffer_append_varint(&output, ids[r * columns + c]);
+  }
+
+  return err;
+}
+
+static int write_binary_head(FILE * socket, librdf_query_results * results)
+{
+  int bindings_count, b;
+  int err = 0;
+
+  redstore_buffer_reset(&output);
+  err |= redstore_buffer_append(&output, BINARY_MAGIC, 4);
+
+  if (librdf_query_results_is_boolean(results)) {
+    err |= redstore_buffer_append_byte(&output, 1);
+    err |= redstore_buffer_append_byte(&output, librdf_query_results_get_boolean(results) > 0);
+    err |= redstore_buffer_append_varint(&output, 0);
+    return output_finish(socket, err);
+  }
+
+  err |= redstore_buffer_append_byte(&output, 0);
+  bindings_count = librdf_query_results_get_bindings_count(results);
+  err |= redstore_buffer_append_varint(&output, bindings_count);
+  for (b = 0; b < bindings_count; b++) {
+    const char *name = librdf_query_results_get_binding_name(results, b);
+    err |= redstore_buffer_append_varint(&output, strlen(name));
+    err |= append_string(name);
+  }
+
+  return output_finish(socket, err);
+}
+
+static int write_binary_rows(FILE * socket, librdf_query_results * results, unsigned long *count)
+{
+  redstore_buffer_t term = { NULL, 0, 0 };
+  redstore_buffer_t new_terms = { NULL, 0, 0 };
+  dictionary_t dict = { NULL, 0, 0 };
+  uint64_t *ids = NULL, new_count = 0;
+  int bindings_count, b, rows = 0;
+  // The rows may follow others written with a different dictionary
+  int reset = 1;
+  int err = 0;
+
+  if (librdf_query_results_is_boolean(results))
+    return 0;
+
+  redstore_buffer_reset(&output);
+  bindings_count = librdf_query_results_get_bindings_count(results);
+
+  dict.slot_count = BINARY_DICTIONARY_SLOTS;
+  dict.slots = calloc(dict.slot_count, sizeof(dictionary_term_t *));
+  ids = calloc(BINARY_BLOCK_ROWS * (bindings_count ? bindings_count : 1), sizeof(uint64_t));
+  if (!dict.slots || !ids) {
+    redstore_error("Failed to allocate memory for binary query results.");
+    err = 1;
+  }
+
+  while (!err && !librdf_query_results_finished(results)) {
+    // Start the dictionary again before it gets too big
+    if (rows == 0 && dict.count >= BINARY_DICTIONARY_MAX) {
+      dictionary_clear(&dict);
+      reset = 1;
+    }
+
+    for (b = 0; b < bindings_count; b++) {
+      librdf_node *node = librdf_query_results_get_binding_value(results, b);
+      uint64_t id = 0;
+
+      if (node) {
+        int added = 0;
+
+        redstore_buffer_reset(&term);
+        err |= redstore_encode_node(&term, node);
+        librdf_free_node(node);
+        if (err)
+          break;
+
+        id = dictionary_add(&dict, term.data, term.length, &added);
+        if (!id) {
+          redstore_error("Failed to allocate memory for binary query results.");
+          err = 1;
+          break;
+        }
+        if (added) {
+          err |= redstore_buffer_append(&new_terms, term.data, term.length);
+          new_count++;
+        }
+      }
+      ids[rows * bindings_count + b] = id;
+    }
+    (*count)++;
+
+    if (++rows == BINARY_BLOCK_ROWS) {
+      err |= append_binary_block(ids, rows, bindings_count, reset, &new_terms, new_count);
+      redstore_buffer_reset(&new_terms);
+      new_count = 0;
+      rows = 0;
+      reset = 0;
+
+      if (output.length >= OUTPUT_FLUSH_SIZE)
+        err |= output_flush(socket);
+    }
+
+    if (librdf_query_results_next(results))
+      break;
+  }
+
+  if (!err && rows)
+    err |= append_binary_block(ids, rows, bindings_count, reset, &new_terms, new_count);
+
+  if (dict.slots) {
+    dictionary_clear(&dict);
+    free(dict.slots);
+  }
+  if (ids)
+    free(ids);
+  redstore_buffer_free(&term);
+  redstore_buffer_free(&new_terms);
+
+  return output_finish(socket, err);
+}
+
+static int write_binary_tail(FILE * socket, librdf_query_results * results)
+{
+  if (librdf_query_results_is_boolean(results))
+    return 0;
+
+  redstore_buffer_reset(&output);
+  return output_finish(socket, redstore_buffer_append_varint(&output, 0));
+}
+
+
+static const redstore_results_writer_t json_writer = {
+  write_json_head, write_json_rows, write_json_tail, ",\n"
+};
+static const redstore_results_writer_t csv_writer = {
+  write_csv_head, write_csv_rows, NULL, NULL
+};
+static const redstore_results_writer_t tsv_writer = {
+  write_tsv_head, write_tsv_rows, NULL, NULL
+};
+static const redstore_results_writer_t xml_writer = {
+  write_xml_head, write_xml_rows, write_xml_tail, NULL
+};
+static const redstore_results_writer_t binary_writer = {
+  write_binary_head, write_binary_rows, write_binary_tail, NULL
+};
+
+
+// Returns the native writer for a query results format, or NULL if
+// librdf should be used instead
+const redstore_results_writer_t *redstore_get_results_writer(const char *format_name, int boolean)
+{
+  if (!format_name)
+    return NULL;
+
+  if (strcmp(format_name, "xml") == 0)
+    return &xml_writer;
+  if (strcmp(format_name, "json") == 0)
+    return &json_writer;
+  if (strcmp(format_name, "binary") == 0)
+    return &binary_writer;
+
+  // There is no standard way to write a boolean result as CSV or TSV
+  if (boolean)
+    return NULL;
+
+  if (strcmp(format_name, "csv") == 0)
+    return &csv_writer;
+  if (strcmp(format_name, "tsv") == 0)
+    return &tsv_writer;
+
+  return NULL;
+}
+
+// Write a whole set of results with a native writer, adding the number
+// of rows written to *count
+int redstore_write_results(const redstore_results_writer_t * writer, FILE * socket,
+                           librdf_query_results * results, unsigned long *count)
+{
+  int err = 0;
+
+  err |= writer->head(socket, results);
+  if (!err)
+    err |= writer->rows(socket, results, count);
+  if (!err && writer->tail)
+    err |= writer->tail(socket, results);
+
+  return err;
+}
+
+
+// The librdf query results formats, followed by those that are only
+// written by RedStore
+const raptor_syntax_description *redstore_results_formats_get_description(librdf_world * rdf_world,
+                                                                          unsigned int counter)
+{
+  if (librdf_results_format_count < 0) {
+    librdf_results_format_count = 0;
+    while (librdf_query_results_formats_get_description(rdf_world, librdf_results_format_count))
+      librdf_results_format_count++;
+  }
+
+  if (counter < (unsigned int) librdf_results_format_count)
+    return librdf_query_results_formats_get_description(rdf_world, counter);
+  if (counter == (unsigned int) librdf_results_format_count)
+    return &binary_description;
+
+  return NULL;
+}
+
+void redstore_results_free(void)
+{
+  redstore_buffer_free(&output);
+}
@@ -0,0 +1,391 @@
+/*
+    RedStore - a lightweight RDF triplestore powered by Redland
+    Copyright (C) 2010-2011 Nicholas J Humfrey <njh@aelius.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  The store can be split across several storage instances (shards), each
+  with its own files, environment and locks. Every named graph lives in
+  exactly one shard, chosen by hashing the graph URI. The default graph
+  always lives in shard 0, which is the storage named on the command line.
+
+  Operations on a single graph go straight to the owning shard. Operations
+  on the whole store (listing graphs, streaming every statement) walk the
+  shards in turn and present the results as a single iterator or stream.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "redstore.h"
+
+#define DEFAULT_SHARD_COUNT   (1)
+#define MAX_SHARD_COUNT       (256)
+
+
+static librdf_storage **shard_storages = NULL;
+static librdf_model **shard_models = NULL;
+static int shard_count = 1;
+
+
+// Iterator or stream that walks through a list of others in turn
+typedef struct {
+  void **parts;
+  int count;
+  int current;
+  int is_stream;
+} union_context_t;
+
+
+static int union_part_end(union_context_t * context, int i)
+{
+  if (context->is_stream) {
+    return librdf_stream_end((librdf_stream *) context->parts[i]);
+  } else {
+    return librdf_iterator_end((librdf_iterator *) context->parts[i]);
+  }
+}
+
+// Move on to the next part that still has something in it
+static void union_skip_finished(union_context_t * context)
+{
+  while (context->current < context->count && union_part_end(context, context->current))
+    context->current++;
+}
+
+static int union_is_end(void *data)
+{
+  union_context_t *context = (union_context_t *) data;
+  return context->current >= context->count;
+}
+
+static int union_next(void *data)
+{
+  union_context_t *context = (union_context_t *) data;
+
+  if (context->current >= context->count)
+    return 1;
+
+  if (context->is_stream) {
+    librdf_stream_next((librdf_stream *) context->parts[context->current]);
+  } else {
+    librdf_iterator_next((librdf_iterator *) context->parts[context->current]);
+  }
+  union_skip_finished(context);
+
+  return context->current >= context->count;
+}
+
+static void *union_stream_get(void *data, int flags)
+{
+  union_context_t *context = (union_context_t *) data;
+  librdf_stream *stream;
+
+  if (context->current >= context->count)
+    return NULL;
+
+  stream = (librdf_stream *) context->parts[context->current];
+  if (flags == LIBRDF_STREAM_GET_METHOD_GET_CONTEXT)
+    return librdf_stream_get_context2(stream);
+
+  return librdf_stream_get_object(stream);
+}
+
+static void *union_iterator_get(void *data, int flags)
+{
+  union_context_t *context = (union_context_t *) data;
+  librdf_iterator *iterator;
+
+  if (context->current >= context->count)
+    return NULL;
+
+  iterator = (librdf_iterator *) context->parts[context->current];
+  switch (flags) {
+  case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
+    return librdf_iterator_get_object(iterator);
+  case LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT:
+    return librdf_iterator_get_context(iterator);
+  case LIBRDF_ITERATOR_GET_METHOD_GET_KEY:
+    return librdf_iterator_get_key(iterator);
+  case LIBRDF_ITERATOR_GET_METHOD_GET_VALUE:
+    return librdf_iterator_get_value(iterator);
+  }
+
+  return NULL;
+}
+
+static void union_free_parts(void **parts, int count, int is_stream)
+{
+  int i;
+
+  for (i = 0; i < count; i++) {
+    if (!parts[i])
+      continue;
+    if (is_stream) {
+      librdf_free_stream((librdf_stream *) parts[i]);
+    } else {
+      librdf_free_iterator((librdf_iterator *) parts[i]);
+    }
+  }
+  free(parts);
+}
+
+static void union_finished(void *data)
+{
+  union_context_t *context = (union_context_t *) data;
+
+  union_free_parts(context->parts, context->count, context->is_stream);
+  free(context);
+}
+
+static union_context_t *union_context_new(void **parts, int count, int is_stream)
+{
+  union_context_t *context = calloc(1, sizeof(union_context_t));
+
+  if (!context) {
+    union_free_parts(parts, count, is_stream);
+    return NULL;
+  }
+
+  context->parts = parts;
+  context->count = count;
+  context->is_stream = is_stream;
+  union_skip_finished(context);
+
+  return context;
+}
+
+
+int redstore_shards_init(const char *name, const char *type, const char *options, int new)
+{
+  long count = redstore_get_option_long("shards", DEFAULT_SHARD_COUNT);
+  char *shard_name = NULL;
+  int i;
+
+  if (count < 1 || count > MAX_SHARD_COUNT) {
+    redstore_error("The number of shards must be between 1 and %d.", MAX_SHARD_COUNT);
+    return -1;
+  }
+
+  shard_storages = calloc(count, sizeof(librdf_storage *));
+  shard_models = calloc(count, sizeof(librdf_model *));
+  shard_name = malloc(strlen(name) + 16);
+  if (!shard_storages || !shard_models || !shard_name) {
+    redstore_error("Failed to allocate memory for shards.");
+    free(shard_name);
+    return -1;
+  }
+
+  // Shard 0 is the storage that has already been opened
+  shard_storages[0] = storage;
+  shard_models[0] = model;
+  shard_count = 1;
+
+  for (i = 1; i < count; i++) {
+    sprintf(shard_name, "%s-shard%d", name, i);
+    shard_storages[i] = redstore_setup_storage(shard_name, type, options, new);
+    if (!shard_storages[i]) {
+      redstore_error("Failed to open storage for shard %d.", i);
+      free(shard_name);
+      return -1;
+    }
+    shard_count++;
+
+    shard_models[i] = librdf_new_model(world, shard_storages[i], NULL);
+    if (!shard_models[i]) {
+      redstore_error("Failed to create model for shard %d.", i);
+      free(shard_name);
+      return -1;
+    }
+  }
+
+  if (shard_count > 1)
+    redstore_info("Store is split across %d shards.", shard_count);
+
+  free(shard_name);
+  return 0;
+}
+
+int redstore_shard_count(void)
+{
+  return shard_count;
+}
+
+librdf_model *redstore_shard_model(int shard)
+{
+  if (!shard_models || shard <= 0 || shard >= shard_count)
+    return model;
+
+  return shard_models[shard];
+}
+
+int redstore_graph_shard(librdf_node * graph)
+{
+  const unsigned char *str;
+  librdf_uri *uri;
+  size_t len;
+
+  if (!graph || shard_count <= 1)
+    return 0;
+
+  uri = librdf_node_get_uri(graph);
+  if (!uri)
+    return 0;
+
+  str = librdf_uri_as_counted_string(uri, &len);
+  return (int) (redstore_hash_bytes(str, len) % (uint32_t) shard_count);
+}
+
+librdf_model *redstore_graph_model(librdf_node * graph)
+{
+  return redstore_shard_model(redstore_graph_shard(graph));
+}
+
+// Get the list of named graphs from every shard
+librdf_iterator *redstore_store_get_contexts(void)
+{
+  union_context_t *context = NULL;
+  void **parts = NULL;
+  int i;
+
+  if (shard_count <= 1)
+    return librdf_storage_get_contexts(storage);
+
+  parts = calloc(shard_count, sizeof(void *));
+  if (!parts)
+    return NULL;
+
+  for (i = 0; i < shard_count; i++) {
+    parts[i] = librdf_storage_get_contexts(shard_storages[i]);
+    if (!parts[i]) {
+      redstore_error("Failed to get list of graphs for shard %d.", i);
+      union_free_parts(parts, shard_count, 0);
+      return NULL;
+    }
+  }
+
+  context = union_context_new(parts, shard_count, 0);
+  if (!context)
+    return NULL;
+
+  return librdf_new_iterator(world, context, union_is_end, union_next,
+                             union_iterator_get, union_finished);
+}
+
+// Concatenate a list of streams; takes ownership of the streams
+librdf_stream *redstore_new_union_stream(librdf_stream ** streams, int count)
+{
+  union_context_t *context = NULL;
+  void **parts = NULL;
+  int i;
+
+  parts = calloc(count, sizeof(void *));
+  if (!parts) {
+    for (i = 0; i < count; i++)
+      librdf_free_stream(streams[i]);
+    return NULL;
+  }
+
+  for (i = 0; i < count; i++)
+    parts[i] = streams[i];
+
+  context = union_context_new(parts, count, 1);
+  if (!context)
+    return NULL;
+
+  return librdf_new_stream(world, context, union_is_end, union_next,
+                           union_stream_get, union_finished);
+}
+
+// Stream every statement in every shard
+librdf_stream *redstore_store_as_stream(void)
+{
+  librdf_stream **streams = NULL;
+  librdf_stream *stream = NULL;
+  int i;
+
+  if (shard_count <= 1)
+    return librdf_model_as_stream(model);
+
+  streams = calloc(shard_count, sizeof(librdf_stream *));
+  if (!streams)
+    return NULL;
+
+  for (i = 0; i < shard_count; i++) {
+    streams[i] = librdf_model_as_stream(shard_models[i]);
+    if (!streams[i]) {
+      redstore_error("Failed to stream shard %d.", i);
+      while (--i >= 0)
+        librdf_free_stream(streams[i]);
+      free(streams);
+      return NULL;
+    }
+  }
+
+  stream = redstore_new_union_stream(streams, shard_count);
+  free(streams);
+
+  return stream;
+}
+
+int redstore_store_size(void)
+{
+  int size = 0;
+  int i;
+
+  if (redstore_catalogue_is_ready() && redstore_catalogue_triples() >= 0)
+    return (int) redstore_catalogue_triples();
+
+  for (i = 0; i < shard_count; i++) {
+    int shard_size = librdf_model_size(redstore_shard_model(i));
+    if (shard_size < 0)
+      return -1;
+    size += shard_size;
+  }
+
+  return size;
+}
+
+int redstore_store_contains_graph(librdf_node * graph)
+{
+  if (redstore_catalogue_is_ready())
+    return redstore_catalogue_lookup(graph) != NULL;
+
+  return librdf_model_contains_context(redstore_graph_model(graph), graph);
+}
+
+void redstore_shards_free(void)
+{
+  int i;
+
+  // Shard 0 is freed along with the global model and storage
+  for (i = 1; i < shard_count; i++) {
+    if (shard_models[i])
+      librdf_free_model(shard_models[i]);
+    if (shard_storages[i])
+      librdf_free_storage(shard_storages[i]);
+  }
+
+  if (shard_models)
+    free(shard_models);
+  if (shard_storages)
+    free(shard_storages);
+  shard_models = NULL;
+  shard_storages = NULL;
+  shard_count = 1;
+}
@@ -0,0 +1,547 @@
+/*
+    RedStore - a lightweight RDF triplestore powered by Redland
+    Copyright (C) 2010-2011 Nicholas J Humfrey <njh@aelius.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Binary store snapshots
+
+  A snapshot is a term dictionary followed by a sorted quad index:
+
+    header      64 bytes, all integers little-endian
+                  magic             "RSSNAP\r\n"
+                  version           uint32
+                  flags             uint32 (reserved, 0)
+                  term_count        uint64
+                  quad_count        uint64
+                  dictionary_offset uint64
+                  dictionary_length uint64
+                  index_offset      uint64
+                  reserved          uint64
+    dictionary  term_count encoded nodes (see codec.c), term N is the Nth entry
+    index       quad_count x { graph, subject, predicate, object } as uint32
+                term identifiers, sorted in that order. Graph 0 is the
+                default graph.
+
+  Snapshots are written to a temporary file and renamed into place, so a
+  crash while writing never damages the previous snapshot; the directory
+  is synced after the rename so that the new name survives a crash too.
+
+  Loading maps the file and adds each quad to the storage, decoding each
+  term only once. Queries are answered by the storage, not from the
+  mapped file, so loading still takes time in proportion to the size of
+  the store - it just avoids parsing RDF syntax. Serving queries from the
+  mapping would need a storage module of its own, registered with
+  librdf_storage_register_factory(), with an overlay for changes; the
+  workers, dumps and replicas all rely on the memory storage module
+  instead.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "redstore.h"
+
+#define SNAPSHOT_MAGIC         "RSSNAP\r\n"
+#define SNAPSHOT_VERSION       (1)
+#define SNAPSHOT_HEADER_SIZE   (64)
+#define SNAPSHOT_QUAD_SIZE     (16)
+
+
+typedef struct {
+  uint32_t graph;
+  uint32_t subject;
+  uint32_t predicate;
+  uint32_t object;
+} snapshot_quad_t;
+
+typedef struct {
+  uint32_t hash;
+  uint32_t id;
+  size_t offset;
+  size_t length;
+} dictionary_slot_t;
+
+typedef struct {
+  redstore_buffer_t terms;
+  redstore_buffer_t scratch;
+  dictionary_slot_t *slots;
+  size_t slot_count;
+  uint32_t term_count;
+} dictionary_t;
+
+
+static int dictionary_grow(dictionary_t * dict)
+{
+  size_t new_count = dict->slot_count ? dict->slot_count * 2 : 4096;
+  dictionary_slot_t *new_slots = calloc(new_count, sizeof(dictionary_slot_t));
+  size_t i;
+
+  if (!new_slots) {
+    redstore_error("Failed to allocate memory for snapshot dictionary.");
+    return -1;
+  }
+
+  for (i = 0; i < dict->slot_count; i++) {
+    dictionary_slot_t *slot = &dict->slots[i];
+    if (slot->id) {
+      size_t s = slot->hash & (new_count - 1);
+      while (new_slots[s].id)
+        s = (s + 1) & (new_count - 1);
+      new_slots[s] = *slot;
+    }
+  }
+
+  if (dict->slots)
+    free(dict->slots);
+  dict->slots = new_slots;
+  dict->slot_count = new_count;
+
+  return 0;
+}
+
+// Returns the identifier for a node, adding it to the dictionary if it is new
+static uint32_t dictionary_lookup(dictionary_t * dict, librdf_node * node)
+{
+  dictionary_slot_t *slot;
+  uint32_t hash;
+  size_t s;
+
+  if (!node)
+    return 0;
+
+  redstore_buffer_reset(&dict->scratch);
+  if (redstore_encode_node(&dict->scratch, node))
+    return 0;
+
+  // Keep the load factor under 75%
+  if ((dict->term_count + 1) * 4 >= dict->slot_count * 3) {
+    if (dictionary_grow(dict))
+      return 0;
+  }
+
+  hash = redstore_hash_bytes(dict->scratch.data, dict->scratch.length);
+  for (s = hash & (dict->slot_count - 1); dict->slots[s].id; s = (s + 1) & (dict->slot_count - 1)) {
+    slot = &dict->slots[s];
+    if (slot->hash == hash && slot->length == dict->scratch.length &&
+        memcmp(&dict->terms.data[slot->offset], dict->scratch.data, slot->length) == 0)
+      return slot->id;
+  }
+
+  slot = &dict->slots[s];
+  slot->hash = hash;
+  slot->offset = dict->terms.length;
+  slot->length = dict->scratch.length;
+  if (redstore_buffer_append(&dict->terms, dict->scratch.data, dict->scratch.length))
+    return 0;
+  slot->id = ++dict->term_count;
+
+  return slot->id;
+}
+
+static void dictionary_free(dictionary_t * dict)
+{
+  redstore_buffer_free(&dict->terms);
+  redstore_buffer_free(&dict->scratch);
+  if (dict->slots)
+    free(dict->slots);
+}
+
+static int compare_quads(const void *a, const void *b)
+{
+  const snapshot_quad_t *qa = a;
+  const snapshot_quad_t *qb = b;
+
+  if (qa->graph != qb->graph)
+    return qa->graph < qb->graph ? -1 : 1;
+  if (qa->subject != qb->subject)
+    return qa->subject < qb->subject ? -1 : 1;
+  if (qa->predicate != qb->predicate)
+    return qa->predicate < qb->predicate ? -1 : 1;
+  if (qa->object != qb->object)
+    return qa->object < qb->object ? -1 : 1;
+  return 0;
+}
+
+static int write_fully(int fd, const unsigned char *data, size_t length)
+{
+  while (length > 0) {
+    ssize_t written = write(fd, data, length);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    data += written;
+    length -= written;
+  }
+
+  return 0;
+}
+
+
+// Write a snapshot of the whole store to a file descriptor
+int redstore_snapshot_write_fd(int fd)
+{
+  unsigned char header[SNAPSHOT_HEADER_SIZE];
+  dictionary_t dict;
+  redstore_buffer_t index;
+  snapshot_quad_t *quads = NULL;
+  size_t quad_count = 0, quad_size = 0, i;
+  librdf_stream *stream = NULL;
+  int result = -1;
+
+  memset(&dict, 0, sizeof(dict));
+  memset(&index, 0, sizeof(index));
+
+  stream = redstore_store_as_stream();
+  if (!stream) {
+    redstore_error("Failed to stream store while writing snapshot.");
+    goto CLEANUP;
+  }
+
+  // Build the dictionary and the unsorted quad list
+  while (!librdf_stream_end(stream)) {
+    librdf_statement *statement = librdf_stream_get_object(stream);
+    librdf_node *context = librdf_stream_get_context2(stream);
+    snapshot_quad_t *quad;
+
+    if (!statement) {
+      redstore_error("librdf_stream_get_object returned NULL while writing snapshot");
+      goto CLEANUP;
+    }
+
+    if (quad_count == quad_size) {
+      snapshot_quad_t *new_quads;
+      quad_size = quad_size ? quad_size * 2 : 65536;
+      new_quads = realloc(quads, quad_size * sizeof(snapshot_quad_t));
+      if (!new_quads) {
+        redstore_error("Failed to allocate memory for snapshot quads.");
+        goto CLEANUP;
+      }
+      quads = new_quads;
+    }
+
+    quad = &quads[quad_count++];
+    quad->graph = dictionary_lookup(&dict, context);
+    quad->subject = dictionary_lookup(&dict, librdf_statement_get_subject(statement));
+    quad->predicate = dictionary_lookup(&dict, librdf_statement_get_predicate(statement));
+    quad->object = dictionary_lookup(&dict, librdf_statement_get_object(statement));
+    if (!quad->subject || !quad->predicate || !quad->object || (context && !quad->graph)) {
+      redstore_error("Failed to add statement to snapshot dictionary.");
+      goto CLEANUP;
+    }
+
+    librdf_stream_next(stream);
+  }
+
+  if (quad_count)
+    qsort(quads, quad_count, sizeof(snapshot_quad_t), compare_quads);
+
+  if (redstore_buffer_reserve(&index, quad_count * SNAPSHOT_QUAD_SIZE))
+    goto CLEANUP;
+  for (i = 0; i < quad_count; i++) {
+    redstore_buffer_append_uint32(&index, quads[i].graph);
+    redstore_buffer_append_uint32(&index, quads[i].subject);
+    redstore_buffer_append_uint32(&index, quads[i].predicate);
+    redstore_buffer_append_uint32(&index, quads[i].object);
+  }
+
+  memset(header, 0, sizeof(header));
+  memcpy(header, SNAPSHOT_MAGIC, 8);
+  redstore_put_uint32(&header[8], SNAPSHOT_VERSION);
+  redstore_put_uint64(&header[16], dict.term_count);
+  redstore_put_uint64(&header[24], quad_count);
+  redstore_put_uint64(&header[32], SNAPSHOT_HEADER_SIZE);
+  redstore_put_uint64(&header[40], dict.terms.length);
+  redstore_put_uint64(&header[48], SNAPSHOT_HEADER_SIZE + dict.terms.length);
+
+  if (write_fully(fd, header, sizeof(header)) ||
+      write_fully(fd, dict.terms.data, dict.terms.length) ||
+      write_fully(fd, index.data, index.length)) {
+    redstore_error("Failed to write snapshot: %s", strerror(errno));
+    goto CLEANUP;
+  }
+
+  redstore_info("Wrote snapshot of %lu quads and %lu terms.",
+                 (unsigned long) quad_count, (unsigned long) dict.term_count);
+  result = 0;
+
+CLEANUP:
+  if (stream)
+    librdf_free_stream(stream);
+  if (quads)
+    free(quads);
+  redstore_buffer_free(&index);
+  dictionary_free(&dict);
+
+  return result;
+}
+
+// Sync the directory holding a file, so that a rename into it is durable
+static int sync_directory(const char *filename)
+{
+  const char *slash = strrchr(filename, '/');
+  size_t len = 1;
+  char *dirname = NULL;
+  int fd, result = -1;
+
+  // The root directory keeps its slash
+  if (slash && slash > filename)
+    len = slash - filename;
+
+  dirname = calloc(1, len + 1);
+  if (!dirname) {
+    redstore_error("Failed to allocate memory for snapshot directory name.");
+    return -1;
+  }
+  memcpy(dirname, slash ? filename : ".", len);
+
+  fd = open(dirname, O_RDONLY);
+  if (fd < 0) {
+    redstore_error("Failed to open snapshot directory '%s': %s", dirname, strerror(errno));
+  } else {
+    if (fsync(fd)) {
+      redstore_error("Failed to sync snapshot directory '%s': %s", dirname, strerror(errno));
+    } else {
+      result = 0;
+    }
+    close(fd);
+  }
+
+  free(dirname);
+  return result;
+}
+
+int redstore_snapshot_write(const char *filename)
+{
+  char *tmp_filename = NULL;
+  size_t tmp_len;
+  int fd = -1;
+  int result = -1;
+
+  tmp_len = strlen(filename) + 5;
+  tmp_filename = malloc(tmp_len);
+  if (!tmp_filename) {
+    redstore_error("Failed to allocate memory for snapshot filename.");
+    goto CLEANUP;
+  }
+  snprintf(tmp_filename, tmp_len, "%s.tmp", filename);
+
+  fd = open(tmp_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    redstore_error("Failed to open snapshot file '%s': %s", tmp_filename, strerror(errno));
+    goto CLEANUP;
+  }
+
+  if (redstore_snapshot_write_fd(fd))
+    goto CLEANUP;
+
+  if (fsync(fd)) {
+    redstore_error("Failed to write snapshot file '%s': %s", tmp_filename, strerror(errno));
+    goto CLEANUP;
+  }
+
+  if (close(fd)) {
+    fd = -1;
+    redstore_error("Failed to close snapshot file '%s': %s", tmp_filename, strerror(errno));
+    goto CLEANUP;
+  }
+  fd = -1;
+
+  if (rename(tmp_filename, filename)) {
+    redstore_error("Failed to rename snapshot file into place: %s", strerror(errno));
+    goto CLEANUP;
+  }
+
+  if (sync_directory(filename))
+    goto CLEANUP;
+
+  redstore_debug("Snapshot file: %s", filename);
+  result = 0;
+
+CLEANUP:
+  if (fd >= 0) {
+    close(fd);
+    unlink(tmp_filename);
+  }
+  if (tmp_filename)
+    free(tmp_filename);
+
+  return result;
+}
+
+
+// Load a snapshot from a file descriptor; the name is used in messages
+int redstore_snapshot_load_fd(int fd, const char *filename)
+{
+  const unsigned char *map = NULL, *ptr, *end;
+  uint64_t term_count, quad_count, dict_offset, dict_length, index_offset, i;
+  librdf_node **terms = NULL;
+  librdf_model *target = model;
+  uint32_t target_graph = 0;
+  struct stat st;
+  size_t map_len = 0;
+  int result = -1;
+
+  if (fstat(fd, &st) || st.st_size < SNAPSHOT_HEADER_SIZE) {
+    redstore_error("Snapshot file is too short: %s", filename);
+    goto CLEANUP;
+  }
+
+  map_len = st.st_size;
+  map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    map = NULL;
+    redstore_error("Failed to mmap snapshot file '%s': %s", filename, strerror(errno));
+    goto CLEANUP;
+  }
+#ifdef MADV_SEQUENTIAL
+  madvise((void *) map, map_len, MADV_SEQUENTIAL);
+#endif
+
+  if (memcmp(map, SNAPSHOT_MAGIC, 8) != 0 || redstore_get_uint32(&map[8]) != SNAPSHOT_VERSION) {
+    redstore_error("Not a RedStore snapshot (or unsupported version): %s", filename);
+    goto CLEANUP;
+  }
+
+  term_count = redstore_get_uint64(&map[16]);
+  quad_count = redstore_get_uint64(&map[24]);
+  dict_offset = redstore_get_uint64(&map[32]);
+  dict_length = redstore_get_uint64(&map[40]);
+  index_offset = redstore_get_uint64(&map[48]);
+
+  // Each term takes at least one byte of the dictionary
+  if (dict_offset > map_len || dict_length > map_len - dict_offset ||
+      index_offset > map_len || quad_count > (map_len - index_offset) / SNAPSHOT_QUAD_SIZE ||
+      term_count > UINT32_MAX || term_count > dict_length) {
+    redstore_error("Snapshot file is truncated or corrupt: %s", filename);
+    goto CLEANUP;
+  }
+
+  redstore_info("Loading snapshot of %lu quads and %lu terms from: %s",
+                (unsigned long) quad_count, (unsigned long) term_count, filename);
+
+  // Decode each term once; the quads then share the nodes
+  terms = calloc(term_count + 1, sizeof(librdf_node *));
+  if (!terms) {
+    redstore_error("Failed to allocate memory for snapshot terms.");
+    goto CLEANUP;
+  }
+
+  ptr = &map[dict_offset];
+  end = ptr + dict_length;
+  for (i = 1; i <= term_count; i++) {
+    ptr = redstore_decode_node(ptr, end, &terms[i]);
+    if (!ptr || !terms[i]) {
+      redstore_error("Failed to decode term %lu of snapshot.", (unsigned long) i);
+      goto CLEANUP;
+    }
+  }
+
+  ptr = &map[index_offset];
+  for (i = 0; i < quad_count; i++, ptr += SNAPSHOT_QUAD_SIZE) {
+    uint32_t g = redstore_get_uint32(ptr);
+    uint32_t s = redstore_get_uint32(ptr + 4);
+    uint32_t p = redstore_get_uint32(ptr + 8);
+    uint32_t o = redstore_get_uint32(ptr + 12);
+    librdf_statement *statement;
+    int err;
+
+    if (g > term_count || !s || s > term_count || !p || p > term_count || !o || o > term_count) {
+      redstore_error("Invalid term identifier in quad %lu of snapshot.", (unsigned long) i);
+      goto CLEANUP;
+    }
+
+    statement = librdf_new_statement_from_nodes(world,
+                                                librdf_new_node_from_node(terms[s]),
+                                                librdf_new_node_from_node(terms[p]),
+                                                librdf_new_node_from_node(terms[o]));
+    if (!statement) {
+      redstore_error("Failed to create statement while loading snapshot.");
+      goto CLEANUP;
+    }
+
+    // The quads are sorted by graph, so only look up the shard when it changes
+    if (g != target_graph) {
+      target = redstore_graph_model(g ? terms[g] : NULL);
+      target_graph = g;
+    }
+
+    if (g) {
+      err = librdf_model_context_add_statement(target, terms[g], statement);
+    } else {
+      err = librdf_model_add_statement(target, statement);
+    }
+    librdf_free_statement(statement);
+
+    if (err) {
+      redstore_error("Failed to add statement while loading snapshot.");
+      goto CLEANUP;
+    }
+  }
+
+  result = 0;
+
+CLEANUP:
+  if (terms) {
+    for (i = 0; i <= term_count; i++) {
+      if (terms[i])
+        librdf_free_node(terms[i]);
+    }
+    free(terms);
+  }
+  if (map)
+    munmap((void *) map, map_len);
+
+  return result;
+}
+
+int redstore_snapshot_load(const char *filename)
+{
+  int fd = open(filename, O_RDONLY);
+  int result;
+
+  if (fd < 0) {
+    redstore_error("Failed to open snapshot file '%s': %s", filename, strerror(errno));
+    return -1;
+  }
+
+  result = redstore_snapshot_load_fd(fd, filename);
+  close(fd);
+
+  return result;
+}
+
+
+redhttp_response_t *handle_snapshot_post(redhttp_request_t * request, void *user_data)
+{
+  if (redstore_checkpoint()) {
+    return redstore_page_new_with_message(
+      request, LIBRDF_LOG_ERROR, REDHTTP_INTERNAL_SERVER_ERROR, "Failed to write snapshot."
+    );
+  } else {
+    return redstore_page_new_with_message(
+      request, LIBRDF_LOG_INFO, REDHTTP_OK, "Successfully wrote snapshot to: %s", snapshot_filename
+    );
+  }
+}
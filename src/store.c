@@ -0,0 +1,179 @@
+/*
+    RedStore - a lightweight RDF triplestore powered by Redland
+    Copyright (C) 2010-2011 Nicholas J Humfrey <njh@aelius.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  All changes made to the store by the HTTP handlers go through these
+  functions, so that they can be recorded in the write-ahead log and
+  sent to the shard that owns the graph (see shards.c).
+
+  Each change is logged before it is made, and only once it has been made
+  is it published to any replicas (see replication.c) and counted in the
+  graph catalogue (see catalogue.c). If the change fails, its log record
+  is cancelled.
+
+  The storage modules report success for adding a statement that is
+  already there, or removing one that isn't, so each statement is looked
+  up first; only changes which actually alter the store are counted,
+  logged and published.
+
+  Each change also adds one to the store version, which is only a count
+  of the changes: it numbers the changes sent to replicas, and is shown
+  in the service description. It doesn't give readers a snapshot; only
+  a reader forked from an in-memory store (see children.c) is isolated
+  from later changes, by having a copy of the store.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "redstore.h"
+
+
+// Returns 1 if the graph holds the statement; without a graph, only a
+// statement in the default graph counts, not the same triple in a named
+// graph
+static int store_contains(librdf_model * model, librdf_node * graph, librdf_statement * statement)
+{
+  librdf_stream *stream;
+  int found = 0;
+
+  if (graph) {
+    stream = librdf_model_find_statements_in_context(model, statement, graph);
+  } else {
+    stream = librdf_model_find_statements(model, statement);
+  }
+  if (!stream)
+    return 0;
+
+  while (!librdf_stream_end(stream)) {
+    if (graph || !librdf_stream_get_context2(stream)) {
+      found = 1;
+      break;
+    }
+    librdf_stream_next(stream);
+  }
+  librdf_free_stream(stream);
+
+  return found;
+}
+
+int redstore_store_add_statement(librdf_node * graph, librdf_statement * statement)
+{
+  librdf_model *target = redstore_graph_model(graph);
+  int err;
+
+  if (store_contains(target, graph, statement))
+    return 0;
+
+  if (redstore_wal_append(WAL_OP_ADD, graph, statement)) {
+    redstore_wal_cancel();
+    return -1;
+  }
+
+  if (graph) {
+    err = librdf_model_context_add_statement(target, graph, statement);
+  } else {
+    err = librdf_model_add_statement(target, statement);
+  }
+
+  if (err) {
+    redstore_wal_cancel();
+    return err;
+  }
+
+  store_version++;
+  redstore_catalogue_add(graph, statement);
+  redstore_replication_publish(WAL_OP_ADD, graph, statement);
+  return 0;
+}
+
+int redstore_store_add_statements(librdf_node * graph, librdf_stream * stream)
+{
+  int err = 0;
+
+  while (!librdf_stream_end(stream)) {
+    librdf_statement *statement = librdf_stream_get_object(stream);
+    if (!statement) {
+      redstore_error("librdf_stream_get_object returned NULL in redstore_store_add_statements()");
+      return -1;
+    }
+
+    if (redstore_store_add_statement(graph, statement))
+      err++;
+
+    librdf_stream_next(stream);
+  }
+
+  return err;
+}
+
+int redstore_store_remove_statement(librdf_node * graph, librdf_statement * statement)
+{
+  librdf_model *target = redstore_graph_model(graph);
+  int err;
+
+  if (!store_contains(target, graph, statement))
+    return 0;
+
+  if (redstore_wal_append(WAL_OP_REMOVE, graph, statement)) {
+    redstore_wal_cancel();
+    return -1;
+  }
+
+  if (graph) {
+    err = librdf_model_context_remove_statement(target, graph, statement);
+  } else {
+    err = librdf_model_remove_statement(target, statement);
+  }
+
+  if (err) {
+    redstore_wal_cancel();
+    return err;
+  }
+
+  store_version++;
+  redstore_catalogue_remove(graph, statement);
+  redstore_replication_publish(WAL_OP_REMOVE, graph, statement);
+  return 0;
+}
+
+int redstore_store_remove_graph(librdf_node * graph)
+{
+  librdf_model *target = redstore_graph_model(graph);
+  int err;
+
+  if (!librdf_model_contains_context(target, graph))
+    return 0;
+
+  if (redstore_wal_append(WAL_OP_CLEAR_GRAPH, graph, NULL)) {
+    redstore_wal_cancel();
+    return -1;
+  }
+
+  err = librdf_model_context_remove_statements(target, graph);
+  if (err) {
+    redstore_wal_cancel();
+    return err;
+  }
+
+  store_version++;
+  redstore_catalogue_clear(graph);
+  redstore_replication_publish(WAL_OP_CLEAR_GRAPH, graph, NULL);
+  return 0;
+}
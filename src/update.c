@@ -22,6 +22,9 @@
 
 #include "redstore.h"
 
+// Amount of decompressed data used to guess the format of compressed data
+#define GUESS_BUFFER_SIZE   (4 * 1024)
+
 
 redhttp_response_t *load_stream_into_new_graph(redhttp_request_t * request, librdf_stream * stream,
                                            librdf_node * graph_node)
@@ -30,7 +33,7 @@ redhttp_response_t *load_stream_into_new_graph(redhttp_request_t * request, libr
   librdf_uri *graph_uri = librdf_node_get_uri(graph_node);
   const char *graph_str = (const char *) librdf_uri_as_string(graph_uri);
 
-  if (librdf_model_context_add_statements(model, graph_node, stream)) {
+  if (redstore_store_add_statements(graph_node, stream)) {
     return redstore_page_new_with_message(
       request, LIBRDF_LOG_ERROR, REDHTTP_INTERNAL_SERVER_ERROR,
       "Failed to add triples to graph."
@@ -58,7 +61,7 @@ redhttp_response_t *load_stream_into_graph(redhttp_request_t * request, librdf_s
 {
   const char *graph_str = NULL;
 
-  if (librdf_model_context_add_statements(model, graph, stream)) {
+  if (redstore_store_add_statements(graph, stream)) {
     return redstore_page_new_with_message(
       request, LIBRDF_LOG_ERROR, REDHTTP_INTERNAL_SERVER_ERROR, "Failed to add triples to graph."
     );
@@ -87,7 +90,7 @@ redhttp_response_t *clear_and_load_stream_into_graph(redhttp_request_t * request
                                                      librdf_stream * stream, librdf_node * graph)
 {
   if (graph) {
-    librdf_model_context_remove_statements(model, graph);
+    redstore_store_remove_graph(graph);
   }
 
   return load_stream_into_graph(request, stream, graph);
@@ -100,7 +103,7 @@ redhttp_response_t *delete_stream_from_graph(redhttp_request_t * request, librdf
 
   while (!librdf_stream_end(stream)) {
     librdf_statement *statement = librdf_stream_get_object(stream);
-    if (librdf_model_context_remove_statement(model, graph, statement) == 0)
+    if (redstore_store_remove_statement(graph, statement) == 0)
       count++;
     librdf_stream_next(stream);
   }
@@ -120,10 +123,12 @@ redhttp_response_t *delete_stream_from_graph(redhttp_request_t * request, librdf
   }
 }
 
-redhttp_response_t *parse_data_from_buffer(redhttp_request_t * request, unsigned char *buffer,
-                                           size_t content_length, const char *parser_name,
-                                           librdf_node *graph_node,
-                                           redstore_stream_processor stream_proc)
+// Parse data and pass it to stream_proc. If the data is compressed, it is
+// decompressed as the parser reads it.
+redhttp_response_t *process_data_from_buffer(redhttp_request_t * request, const unsigned char *buffer,
+                                             size_t content_length, const char *parser_name,
+                                             const char *encoding, librdf_node *graph_node,
+                                             redstore_stream_processor stream_proc)
 {
   const char *base_uri_str = redhttp_request_get_argument(request, "base-uri");
   redhttp_response_t *response = NULL;
@@ -162,7 +167,21 @@ redhttp_response_t *parse_data_from_buffer(redhttp_request_t * request, unsigned
     goto CLEANUP;
   }
 
-  stream = librdf_parser_parse_counted_string_as_stream(parser, buffer, content_length, base_uri);
+  if (encoding) {
+    FILE *input = redstore_decompress_open(buffer, content_length, encoding);
+    if (!input) {
+      response = redstore_page_new_with_message(
+        request, LIBRDF_LOG_ERROR, REDHTTP_INTERNAL_SERVER_ERROR, "Failed to decompress data."
+      );
+      goto CLEANUP;
+    }
+    // The stream closes the input when it is freed
+    stream = librdf_parser_parse_file_handle_as_stream(parser, input, 1, base_uri);
+    if (!stream)
+      fclose(input);
+  } else {
+    stream = librdf_parser_parse_counted_string_as_stream(parser, buffer, content_length, base_uri);
+  }
   if (!stream) {
     response = redstore_page_new_with_message(
       request, LIBRDF_LOG_INFO, REDHTTP_INTERNAL_SERVER_ERROR, "Failed to parse data."
@@ -183,12 +202,42 @@ CLEANUP:
   return response;
 }
 
+// Parse the data and pass it to stream_proc, once the graph can be written to
+redhttp_response_t *parse_data_from_buffer(redhttp_request_t * request, unsigned char *buffer,
+                                           size_t content_length, const char *parser_name,
+                                           const char *encoding, librdf_node *graph_node,
+                                           redstore_stream_processor stream_proc)
+{
+  return redstore_queue_write(request, graph_node, stream_proc, buffer, content_length,
+                              parser_name, encoding);
+}
+
+// Guess the parser from the start of the decompressed data
+static const char *guess_compressed_parser_name(const char *content_type,
+                                                const unsigned char *buffer, size_t length,
+                                                const char *encoding)
+{
+  unsigned char start[GUESS_BUFFER_SIZE + 1];
+  FILE *input = redstore_decompress_open(buffer, length, encoding);
+  size_t start_length;
+
+  if (!input)
+    return NULL;
+
+  start_length = fread(start, 1, GUESS_BUFFER_SIZE, input);
+  start[start_length] = '\0';
+  fclose(input);
+
+  return librdf_parser_guess_name2(world, content_type, start, NULL);
+}
+
 redhttp_response_t *parse_data_from_request_body(redhttp_request_t * request,
                                                  librdf_node *graph_node,
                                                  redstore_stream_processor stream_proc)
 {
   const char *content_length_str = redhttp_request_get_header(request, "Content-Length");
   const char *content_type = redhttp_request_get_header(request, "Content-Type");
+  const char *encoding = redhttp_request_get_header(request, "Content-Encoding");
   redhttp_response_t *response = NULL;
   unsigned char *buffer = NULL;
   const char *parser_name = NULL;
@@ -211,6 +260,17 @@ redhttp_response_t *parse_data_from_request_body(redhttp_request_t * request,
     goto CLEANUP;
   }
 
+  // Compressed data is only decompressed as it is parsed
+  if (encoding && strcmp(encoding, "identity") == 0)
+    encoding = NULL;
+  if (encoding && !redstore_decompress_supported(encoding)) {
+    response = redstore_page_new_with_message(
+      request, LIBRDF_LOG_INFO, REDHTTP_UNSUPPORTED_MEDIA_TYPE,
+      "Content encoding not supported: %s", encoding
+    );
+    goto CLEANUP;
+  }
+
   // Allocate memory and read in the input data
   buffer = malloc(content_length);
   if (!buffer) {
@@ -229,7 +289,11 @@ redhttp_response_t *parse_data_from_request_body(redhttp_request_t * request,
     goto CLEANUP;
   }
 
-  parser_name = librdf_parser_guess_name2(world, content_type, buffer, NULL);
+  if (encoding) {
+    parser_name = guess_compressed_parser_name(content_type, buffer, data_read, encoding);
+  } else {
+    parser_name = librdf_parser_guess_name2(world, content_type, buffer, NULL);
+  }
   if (!parser_name) {
     response = redstore_page_new_with_message(
       request, LIBRDF_LOG_INFO, REDHTTP_INTERNAL_SERVER_ERROR, "Failed to guess parser type."
@@ -237,8 +301,8 @@ redhttp_response_t *parse_data_from_request_body(redhttp_request_t * request,
     goto CLEANUP;
   }
 
-  response =
-      parse_data_from_buffer(request, buffer, data_read, parser_name, graph_node, stream_proc);
+  response = parse_data_from_buffer(request, buffer, data_read, parser_name, encoding,
+                                    graph_node, stream_proc);
 
 CLEANUP:
   if (buffer)
@@ -248,24 +312,17 @@ CLEANUP:
 }
 
 
-redhttp_response_t *handle_load_post(redhttp_request_t * request, void *user_data)
+// Fetch and parse the URI given in the request, once the graph can be written to
+static redhttp_response_t *load_uri_into_graph(redhttp_request_t * request, librdf_stream * unused,
+                                               librdf_node * graph)
 {
   const char *uri_arg = redhttp_request_get_argument(request, "uri");
   const char *base_arg = redhttp_request_get_argument(request, "base-uri");
-  const char *graph_arg = redhttp_request_get_argument(request, "graph");
   const char *parser_arg = redhttp_request_get_argument(request, "parser");
-  librdf_uri *uri = NULL, *base_uri = NULL, *graph_uri = NULL;
+  librdf_uri *uri = NULL, *base_uri = NULL;
   redhttp_response_t *response = NULL;
   librdf_parser *parser = NULL;
   librdf_stream *stream = NULL;
-  librdf_node *graph = NULL;
-
-  if (!uri_arg) {
-    response = redstore_page_new_with_message(
-      request, LIBRDF_LOG_DEBUG, REDHTTP_BAD_REQUEST, "Missing URI to load."
-    );
-    goto CLEANUP;
-  }
 
   uri = librdf_new_uri(world, (const unsigned char *) uri_arg);
   if (!uri) {
@@ -287,21 +344,8 @@ redhttp_response_t *handle_load_post(redhttp_request_t * request, void *user_dat
     goto CLEANUP;
   }
 
-  if (graph_arg) {
-    graph_uri = librdf_new_uri(world, (const unsigned char *) graph_arg);
-  } else {
-    graph_uri = librdf_new_uri(world, (const unsigned char *) uri_arg);
-  }
-  if (!graph_uri) {
-    response = redstore_page_new_with_message(
-      request, LIBRDF_LOG_ERROR, REDHTTP_BAD_REQUEST, "librdf_new_uri failed for Graph URI"
-    );
-    goto CLEANUP;
-  }
-
   redstore_info("Loading URI: %s", librdf_uri_as_string(uri));
   redstore_debug("Base URI: %s", librdf_uri_as_string(base_uri));
-  redstore_debug("Graph URI: %s", librdf_uri_as_string(graph_uri));
 
   if (parser_arg) {
     redstore_info("Parsing using: %s", parser_arg);
@@ -325,14 +369,6 @@ redhttp_response_t *handle_load_post(redhttp_request_t * request, void *user_dat
     goto CLEANUP;
   }
 
-  graph = librdf_new_node_from_uri(world, graph_uri);
-  if (!graph) {
-    return redstore_page_new_with_message(
-      request, LIBRDF_LOG_ERROR, REDHTTP_INTERNAL_SERVER_ERROR,
-      "librdf_new_node_from_uri failed for graph-uri."
-    );
-  }
-
   response = load_stream_into_graph(request, stream, graph);
 
 CLEANUP:
@@ -340,10 +376,6 @@ CLEANUP:
     librdf_free_stream(stream);
   if (parser)
     librdf_free_parser(parser);
-  if (graph)
-    librdf_free_node(graph);
-  if (graph_uri)
-    librdf_free_uri(graph_uri);
   if (base_uri)
     librdf_free_uri(base_uri);
   if (uri)
@@ -352,6 +384,49 @@ CLEANUP:
   return response;
 }
 
+redhttp_response_t *handle_load_post(redhttp_request_t * request, void *user_data)
+{
+  const char *uri_arg = redhttp_request_get_argument(request, "uri");
+  const char *graph_arg = redhttp_request_get_argument(request, "graph");
+  redhttp_response_t *response = NULL;
+  librdf_uri *graph_uri = NULL;
+  librdf_node *graph = NULL;
+
+  if (!uri_arg) {
+    return redstore_page_new_with_message(
+      request, LIBRDF_LOG_DEBUG, REDHTTP_BAD_REQUEST, "Missing URI to load."
+    );
+  }
+
+  if (graph_arg) {
+    graph_uri = librdf_new_uri(world, (const unsigned char *) graph_arg);
+  } else {
+    graph_uri = librdf_new_uri(world, (const unsigned char *) uri_arg);
+  }
+  if (!graph_uri) {
+    return redstore_page_new_with_message(
+      request, LIBRDF_LOG_ERROR, REDHTTP_BAD_REQUEST, "librdf_new_uri failed for Graph URI"
+    );
+  }
+
+  redstore_debug("Graph URI: %s", librdf_uri_as_string(graph_uri));
+
+  graph = librdf_new_node_from_uri(world, graph_uri);
+  if (!graph) {
+    response = redstore_page_new_with_message(
+      request, LIBRDF_LOG_ERROR, REDHTTP_INTERNAL_SERVER_ERROR,
+      "librdf_new_node_from_uri failed for graph-uri."
+    );
+  } else {
+    response = redstore_queue_write(request, graph, load_uri_into_graph, NULL, 0, NULL, NULL);
+    librdf_free_node(graph);
+  }
+
+  librdf_free_uri(graph_uri);
+
+  return response;
+}
+
 
 redhttp_response_t *handle_insert_post(redhttp_request_t * request, void *user_data)
 {
@@ -380,7 +455,7 @@ redhttp_response_t *handle_insert_post(redhttp_request_t * request, void *user_d
   }
 
   return parse_data_from_buffer(request, (unsigned char *) content, strlen(content), content_type,
-                                graph_node, load_stream_into_graph);
+                                NULL, graph_node, load_stream_into_graph);
 }
 
 redhttp_response_t *handle_delete_post(redhttp_request_t * request, void *user_data)
@@ -410,5 +485,5 @@ redhttp_response_t *handle_delete_post(redhttp_request_t * request, void *user_d
   }
 
   return parse_data_from_buffer(request, (unsigned char *) content, strlen(content), content_type,
-                                graph_node, delete_stream_from_graph);
+                                NULL, graph_node, delete_stream_from_graph);
 }
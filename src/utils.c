@@ -113,37 +113,7 @@ const raptor_syntax_description* redstore_negotiate_format(redhttp_request_t * r
     redstore_debug("format_arg: %s", format_arg);
     chosen_desc = redstore_get_format_by_name(desc_proc, format_arg);
   } else if (accept_str && accept_str[0] && strcmp("*/*", accept_str) != 0) {
-    redhttp_negotiate_t *accept = redhttp_negotiate_parse(accept_str);
-
-    if (accept) {
-      int best_score = -1;
-      unsigned int d,m,a;
-
-      for(d=0; 1; d++) {
-        const raptor_syntax_description* desc = desc_proc(world, d);
-        if (!desc)
-          break;
-
-        for (m=0; m < desc->mime_types_count; m++) {
-          const raptor_type_q mime_type = desc->mime_types[m];
-          const char* accept_type = NULL;
-          int accept_q = 0;
-          for (a=0; redhttp_negotiate_get(&accept, a, &accept_type, &accept_q)==0; a++) {
-            if (redhttp_negotiate_compare_types(mime_type.mime_type, accept_type)) {
-              int score = mime_type.q * accept_q;
-              if (score > best_score) {
-                best_score = score;
-                chosen_desc = desc;
-                if (chosen_mime)
-                  *chosen_mime = mime_type.mime_type;
-              }
-            }
-          }
-        }
-      }
-
-      redhttp_negotiate_free(&accept);
-    }
+    chosen_desc = redstore_negotiate_accept(desc_proc, accept_str, chosen_mime);
   } else if (default_format) {
     redstore_debug("Using default format: %s", default_format);
     chosen_desc = redstore_get_format_by_name(desc_proc, default_format);
@@ -172,14 +142,10 @@ char *redstore_negotiate_string(redhttp_request_t * request, const char* support
       strcpy(format_str, format_arg);
     redstore_debug("format_arg: %s", format_str);
   } else if (accept_str && accept_str[0] && strcmp("*/*", accept_str) != 0) {
-    redhttp_negotiate_t *accept = redhttp_negotiate_parse(accept_str);
-    redhttp_negotiate_t *supported = redhttp_negotiate_parse(supported_str);
-    format_str = redhttp_negotiate_choose(&supported, &accept);
+    format_str = redstore_negotiate_accept_string(supported_str, accept_str);
     redstore_debug("supported: %s", supported_str);
     redstore_debug("accept: %s", accept_str);
     redstore_debug("chosen: %s", format_str);
-    redhttp_negotiate_free(&accept);
-    redhttp_negotiate_free(&supported);
   } else if (default_format) {
     format_str = calloc(1, strlen(default_format) + 1);
     if (format_str)
@@ -214,3 +180,69 @@ int redstore_is_nquads_format(const char *str)
   else
     return 0;
 }
+
+// Returns true if a request might change the store; queries can also be sent using POST
+int redstore_is_write_request(const char *method, const char *path)
+{
+  if (strcmp(method, "GET") == 0 || strcmp(method, "HEAD") == 0)
+    return 0;
+
+  if (strcmp(method, "POST") == 0 && (strcmp(path, "/sparql") == 0 ||
+                                      strcmp(path, "/sparql/") == 0 ||
+                                      strcmp(path, "/query") == 0))
+    return 0;
+
+  return 1;
+}
+
+long redstore_get_option_long(const char *key, long default_value)
+{
+  long value;
+
+  if (!server_options)
+    return default_value;
+
+  // librdf returns -1 if the key is missing or not a number
+  value = librdf_hash_get_as_long(server_options, key);
+  if (value < 0)
+    return default_value;
+
+  return value;
+}
+
+// Returns a newly allocated copy of an option's value, or NULL if it is not set
+char *redstore_get_option_string(const char *key)
+{
+  char *value, *copy = NULL;
+
+  if (!server_options)
+    return NULL;
+
+  value = librdf_hash_get(server_options, key);
+  if (!value)
+    return NULL;
+
+  copy = calloc(1, strlen(value) + 1);
+  if (copy)
+    strcpy(copy, value);
+  librdf_free_memory(value);
+
+  return copy;
+}
+
+// Copy the whole of a temporary file, from the start, to another file
+int redstore_copy_file(FILE * from, FILE * to)
+{
+  char buffer[64 * 1024];
+  size_t len;
+
+  if (fseek(from, 0, SEEK_SET))
+    return -1;
+
+  while ((len = fread(buffer, 1, sizeof(buffer), from)) > 0) {
+    if (fwrite(buffer, 1, len, to) != len)
+      return -1;
+  }
+
+  return ferror(from) ? -1 : 0;
+}
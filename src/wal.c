@@ -0,0 +1,568 @@
+/*
+    RedStore - a lightweight RDF triplestore powered by Redland
+    Copyright (C) 2010-2011 Nicholas J Humfrey <njh@aelius.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Write-ahead log
+
+  Every change made through store.c is appended to the log as a record:
+
+    length      uint32, length of the payload
+    checksum    uint32, CRC-32 of the payload
+    payload     op (1 byte), sequence number (varint), graph node,
+                and subject, predicate and object nodes for add/remove
+
+  Each record is written before the change is made to the store, or
+  published to replicas, so a change is never seen before it is logged.
+  If the change then fails, the record is cut off the end of the log
+  again. Records are written straight away, so they survive the process
+  dying. Calls to fsync() are batched, to bound what is lost if the
+  machine itself goes down; with wal-sync-records=1, every record is
+  synced before its change is made.
+
+  A checkpoint writes a snapshot of the store and then empties the log.
+  The checkpoints made when the log grows too large, or too old, are
+  written by a forked child from its copy-on-write copy of an in-memory
+  store, so that requests aren't held up while the snapshot is written.
+  The length of the log is noted when the child is forked; once the child
+  reports success, the log is replaced by a copy of the records written
+  since, so nothing after the snapshot is lost. (Other storage modules
+  can't be read by a child while they are changed, so they, the shutdown
+  checkpoint and POST /snapshot write the snapshot in the server process.)
+
+  On startup the log is replayed on top of the snapshot; a torn record at
+  the end of the log is discarded. The log only makes sense on top of the
+  snapshot it follows, so the server refuses to start when there is a
+  snapshot but the store already holds data.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "redstore.h"
+
+#define WAL_MAGIC              "RSWAL\r\n\001"
+#define WAL_HEADER_SIZE        (8)
+#define WAL_RECORD_HEADER_SIZE (8)
+#define WAL_MAX_RECORD_SIZE    (64 * 1024 * 1024)
+
+#define DEFAULT_WAL_SYNC_RECORDS       (1000)
+#define DEFAULT_WAL_SYNC_INTERVAL      (1000)
+#define DEFAULT_CHECKPOINT_SIZE        (64 * 1024 * 1024)
+#define DEFAULT_CHECKPOINT_INTERVAL    (0)
+
+// Seconds to wait before trying again after a checkpoint fails
+#define CHECKPOINT_RETRY_INTERVAL      (10)
+
+#define WAL_COPY_SIZE          (64 * 1024)
+
+
+static int wal_fd = -1;
+static const char *wal_filename = NULL;
+static redstore_buffer_t wal_buffer = { NULL, 0, 0 };
+static uint64_t wal_sequence = 0;
+static size_t wal_size = 0;
+static size_t wal_last_length = 0;
+static unsigned long wal_unsynced = 0;
+static struct timeval wal_last_sync;
+static time_t wal_last_checkpoint = 0;
+static time_t checkpoint_failed = 0;
+
+// The child writing a checkpoint, and the length of the log when it forked
+static pid_t checkpoint_pid = 0;
+static size_t checkpoint_offset = 0;
+
+static long wal_sync_records = DEFAULT_WAL_SYNC_RECORDS;
+static long wal_sync_interval = DEFAULT_WAL_SYNC_INTERVAL;
+static long checkpoint_size = DEFAULT_CHECKPOINT_SIZE;
+static long checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
+
+static uint32_t crc_table[256];
+static int crc_table_ready = 0;
+
+
+static uint32_t crc32_update(uint32_t crc, const unsigned char *data, size_t length)
+{
+  size_t i;
+
+  if (!crc_table_ready) {
+    uint32_t n, k, c;
+    for (n = 0; n < 256; n++) {
+      c = n;
+      for (k = 0; k < 8; k++)
+        c = (c & 1) ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+      crc_table[n] = c;
+    }
+    crc_table_ready = 1;
+  }
+
+  crc = ~crc;
+  for (i = 0; i < length; i++)
+    crc = crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+
+  return ~crc;
+}
+
+static long elapsed_ms(struct timeval *since)
+{
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_usec - since->tv_usec) / 1000;
+}
+
+static int wal_sync(void)
+{
+  if (wal_fd < 0 || wal_unsynced == 0)
+    return 0;
+
+  if (fdatasync(wal_fd)) {
+    redstore_error("Failed to sync write-ahead log: %s", strerror(errno));
+    return -1;
+  }
+
+  wal_unsynced = 0;
+  gettimeofday(&wal_last_sync, NULL);
+
+  return 0;
+}
+
+// Apply a single log record to the model, without logging it again
+static int wal_apply(const unsigned char *ptr, const unsigned char *end, uint64_t * sequence)
+{
+  librdf_statement *statement = NULL;
+  librdf_node *graph = NULL;
+  librdf_model *target = NULL;
+  int op;
+  int err = -1;
+
+  if (!redstore_decode_change(ptr, end, &op, sequence, &graph, &statement))
+    return -1;
+
+  // Each graph is stored in its own shard
+  target = redstore_graph_model(graph);
+
+  switch (op) {
+  case WAL_OP_ADD:
+    if (graph) {
+      librdf_model_context_add_statement(target, graph, statement);
+    } else {
+      librdf_model_add_statement(target, statement);
+    }
+    break;
+
+  case WAL_OP_REMOVE:
+    if (graph) {
+      librdf_model_context_remove_statement(target, graph, statement);
+    } else {
+      librdf_model_remove_statement(target, statement);
+    }
+    break;
+
+  case WAL_OP_CLEAR_GRAPH:
+    if (!graph)
+      goto CLEANUP;
+    librdf_model_context_remove_statements(target, graph);
+    break;
+
+  default:
+    redstore_error("Unknown operation in write-ahead log: %d", op);
+    goto CLEANUP;
+  }
+
+  err = 0;
+
+CLEANUP:
+  if (statement)
+    librdf_free_statement(statement);
+  if (graph)
+    librdf_free_node(graph);
+
+  return err;
+}
+
+// Replay the log and return the length of the valid part of it
+static off_t wal_replay(int fd, size_t file_size)
+{
+  const unsigned char *map = NULL;
+  unsigned long count = 0;
+  size_t offset = WAL_HEADER_SIZE;
+
+  map = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    redstore_error("Failed to mmap write-ahead log: %s", strerror(errno));
+    return -1;
+  }
+#ifdef MADV_SEQUENTIAL
+  madvise((void *) map, file_size, MADV_SEQUENTIAL);
+#endif
+
+  if (memcmp(map, WAL_MAGIC, WAL_HEADER_SIZE) != 0) {
+    redstore_error("Not a RedStore write-ahead log: %s", wal_filename);
+    munmap((void *) map, file_size);
+    return -1;
+  }
+
+  while (offset + WAL_RECORD_HEADER_SIZE <= file_size) {
+    const unsigned char *payload = &map[offset + WAL_RECORD_HEADER_SIZE];
+    uint32_t length = redstore_get_uint32(&map[offset]);
+    uint32_t checksum = redstore_get_uint32(&map[offset + 4]);
+    uint64_t sequence = 0;
+
+    if (length > file_size - offset - WAL_RECORD_HEADER_SIZE)
+      break;
+    if (crc32_update(0, payload, length) != checksum)
+      break;
+
+    if (wal_apply(payload, payload + length, &sequence)) {
+      redstore_warn("Failed to apply record %lu of write-ahead log.", count + 1);
+    } else if (sequence > wal_sequence) {
+      wal_sequence = sequence;
+    }
+
+    offset += WAL_RECORD_HEADER_SIZE + length;
+    count++;
+  }
+
+  if (offset < file_size) {
+    redstore_warn("Discarding %lu bytes of incomplete record at end of write-ahead log.",
+                  (unsigned long) (file_size - offset));
+  }
+
+  redstore_info("Replayed %lu records from write-ahead log.", count);
+  munmap((void *) map, file_size);
+
+  return offset;
+}
+
+
+int redstore_wal_open(const char *filename)
+{
+  struct stat st;
+  off_t valid_size;
+
+  wal_sync_records = redstore_get_option_long("wal-sync-records", DEFAULT_WAL_SYNC_RECORDS);
+  wal_sync_interval = redstore_get_option_long("wal-sync-interval", DEFAULT_WAL_SYNC_INTERVAL);
+  checkpoint_size = redstore_get_option_long("checkpoint-size", DEFAULT_CHECKPOINT_SIZE);
+  checkpoint_interval =
+      redstore_get_option_long("checkpoint-interval", DEFAULT_CHECKPOINT_INTERVAL);
+
+  wal_filename = filename;
+  wal_fd = open(filename, O_RDWR | O_CREAT, 0644);
+  if (wal_fd < 0) {
+    redstore_error("Failed to open write-ahead log '%s': %s", filename, strerror(errno));
+    return -1;
+  }
+
+  if (fstat(wal_fd, &st)) {
+    redstore_error("Failed to stat write-ahead log: %s", strerror(errno));
+    goto ERROR;
+  }
+
+  if (st.st_size >= WAL_HEADER_SIZE) {
+    valid_size = wal_replay(wal_fd, st.st_size);
+    if (valid_size < 0)
+      goto ERROR;
+    if (valid_size < st.st_size && ftruncate(wal_fd, valid_size)) {
+      redstore_error("Failed to truncate write-ahead log: %s", strerror(errno));
+      goto ERROR;
+    }
+  } else {
+    // New (or too short to contain anything) - write the header
+    if (ftruncate(wal_fd, 0) || pwrite(wal_fd, WAL_MAGIC, WAL_HEADER_SIZE, 0) != WAL_HEADER_SIZE) {
+      redstore_error("Failed to initialise write-ahead log: %s", strerror(errno));
+      goto ERROR;
+    }
+    valid_size = WAL_HEADER_SIZE;
+  }
+
+  if (lseek(wal_fd, valid_size, SEEK_SET) < 0) {
+    redstore_error("Failed to seek in write-ahead log: %s", strerror(errno));
+    goto ERROR;
+  }
+
+  wal_size = valid_size;
+  wal_last_checkpoint = time(NULL);
+  gettimeofday(&wal_last_sync, NULL);
+  redstore_info("Write-ahead log: %s", filename);
+
+  return 0;
+
+ERROR:
+  close(wal_fd);
+  wal_fd = -1;
+  return -1;
+}
+
+int redstore_wal_append(int op, librdf_node * graph, librdf_statement * statement)
+{
+  size_t length;
+
+  if (wal_fd < 0)
+    return 0;
+
+  wal_last_length = 0;
+
+  // Leave space for the record header, filled in below
+  redstore_buffer_reset(&wal_buffer);
+  if (redstore_buffer_reserve(&wal_buffer, WAL_RECORD_HEADER_SIZE))
+    return -1;
+  wal_buffer.length = WAL_RECORD_HEADER_SIZE;
+
+  if (redstore_encode_change(&wal_buffer, op, wal_sequence + 1, graph, statement))
+    return -1;
+
+  length = wal_buffer.length - WAL_RECORD_HEADER_SIZE;
+  if (length > WAL_MAX_RECORD_SIZE) {
+    redstore_error("Write-ahead log record is too large.");
+    return -1;
+  }
+  redstore_put_uint32(&wal_buffer.data[0], length);
+  redstore_put_uint32(&wal_buffer.data[4],
+                      crc32_update(0, &wal_buffer.data[WAL_RECORD_HEADER_SIZE], length));
+
+  if (write(wal_fd, wal_buffer.data, wal_buffer.length) != (ssize_t) wal_buffer.length) {
+    redstore_error("Failed to write to write-ahead log: %s", strerror(errno));
+    // Don't leave a partial record behind for later records to follow
+    if (ftruncate(wal_fd, wal_size) == 0)
+      lseek(wal_fd, wal_size, SEEK_SET);
+    return -1;
+  }
+
+  wal_sequence++;
+  wal_size += wal_buffer.length;
+  wal_last_length = wal_buffer.length;
+  wal_unsynced++;
+
+  if (wal_sync_records > 0 && wal_unsynced >= (unsigned long) wal_sync_records)
+    return wal_sync();
+
+  return 0;
+}
+
+// Remove the record that was just appended, because its change could
+// not be made to the store
+int redstore_wal_cancel(void)
+{
+  if (wal_fd < 0 || wal_last_length == 0)
+    return 0;
+
+  if (ftruncate(wal_fd, wal_size - wal_last_length) ||
+      lseek(wal_fd, wal_size - wal_last_length, SEEK_SET) < 0) {
+    redstore_error("Failed to truncate write-ahead log: %s", strerror(errno));
+    return -1;
+  }
+
+  wal_sequence--;
+  wal_size -= wal_last_length;
+  wal_last_length = 0;
+  wal_unsynced++;
+
+  return 0;
+}
+
+int redstore_wal_is_open(void)
+{
+  return wal_fd >= 0;
+}
+
+int redstore_wal_get_sync_interval(void)
+{
+  return wal_sync_interval;
+}
+
+// Replace the log by one holding only the records after the offset, which
+// are not in the snapshot that has just been written. The new log is
+// synced before it replaces the old one; if the process dies before the
+// rename, the old log is replayed instead, which gives the same store.
+static int wal_discard_before(size_t offset)
+{
+  unsigned char buffer[WAL_COPY_SIZE];
+  char *tmp_filename = NULL;
+  size_t position = offset;
+  int fd = -1;
+
+  tmp_filename = malloc(strlen(wal_filename) + 5);
+  if (!tmp_filename) {
+    redstore_error("Failed to allocate memory for write-ahead log filename.");
+    return -1;
+  }
+  sprintf(tmp_filename, "%s.tmp", wal_filename);
+
+  fd = open(tmp_filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || write(fd, WAL_MAGIC, WAL_HEADER_SIZE) != WAL_HEADER_SIZE)
+    goto ERROR;
+
+  while (position < wal_size) {
+    size_t length = wal_size - position < sizeof(buffer) ? wal_size - position : sizeof(buffer);
+    if (pread(wal_fd, buffer, length, position) != (ssize_t) length ||
+        write(fd, buffer, length) != (ssize_t) length)
+      goto ERROR;
+    position += length;
+  }
+
+  if (fdatasync(fd) || rename(tmp_filename, wal_filename))
+    goto ERROR;
+
+  close(wal_fd);
+  wal_fd = fd;
+  wal_size = WAL_HEADER_SIZE + (wal_size - offset);
+  wal_last_length = 0;
+  wal_unsynced = 0;
+  gettimeofday(&wal_last_sync, NULL);
+  free(tmp_filename);
+
+  return 0;
+
+ERROR:
+  redstore_error("Failed to rewrite write-ahead log: %s", strerror(errno));
+  if (fd >= 0) {
+    close(fd);
+    unlink(tmp_filename);
+  }
+  free(tmp_filename);
+  return -1;
+}
+
+// Start writing a checkpoint in a child process
+static void checkpoint_start(void)
+{
+  pid_t pid;
+
+  // Make sure a failed child doesn't leave the log to be replayed twice
+  wal_sync();
+
+  pid = redstore_fork_child();
+  if (pid < 0) {
+    checkpoint_failed = time(NULL);
+    return;
+  } else if (pid == 0) {
+    // The log belongs to the parent
+    redstore_wal_detach();
+    _exit(redstore_snapshot_write(snapshot_filename) ? EXIT_FAILURE : EXIT_SUCCESS);
+  }
+
+  checkpoint_pid = pid;
+  checkpoint_offset = wal_size;
+  wal_last_checkpoint = time(NULL);
+  redstore_debug("Writing checkpoint in child process %d.", (int) pid);
+}
+
+// Called for each child process that exits
+void redstore_wal_reaped(pid_t pid, int status)
+{
+  if (pid != checkpoint_pid || checkpoint_pid <= 0)
+    return;
+
+  checkpoint_pid = 0;
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    redstore_error("Failed to write checkpoint; keeping the write-ahead log.");
+    checkpoint_failed = time(NULL);
+    return;
+  }
+
+  if (wal_fd >= 0 && wal_discard_before(checkpoint_offset) == 0) {
+    redstore_info("Checkpoint written; write-ahead log is now %lu bytes.",
+                  (unsigned long) wal_size);
+  }
+}
+
+int redstore_checkpoint(void)
+{
+  // Let a checkpoint being written by a child finish first, as both use
+  // the same temporary file; it is reaped without being waited for again
+  if (checkpoint_pid > 0) {
+    siginfo_t info;
+    while (waitid(P_PID, checkpoint_pid, &info, WEXITED | WNOWAIT) < 0 && errno == EINTR);
+    redstore_reap_children();
+  }
+
+  if (!snapshot_filename) {
+    redstore_error("A snapshot file is required to checkpoint the store.");
+    return -1;
+  }
+
+  if (redstore_snapshot_write(snapshot_filename))
+    return -1;
+
+  wal_last_checkpoint = time(NULL);
+  if (wal_fd < 0)
+    return 0;
+
+  // Everything in the log is now in the snapshot
+  if (ftruncate(wal_fd, WAL_HEADER_SIZE) || lseek(wal_fd, WAL_HEADER_SIZE, SEEK_SET) < 0) {
+    redstore_error("Failed to truncate write-ahead log: %s", strerror(errno));
+    return -1;
+  }
+  wal_size = WAL_HEADER_SIZE;
+  wal_last_length = 0;
+  wal_unsynced = 1;
+
+  return wal_sync();
+}
+
+void redstore_wal_tick(void)
+{
+  if (wal_fd < 0)
+    return;
+
+  if (wal_unsynced && elapsed_ms(&wal_last_sync) >= wal_sync_interval)
+    wal_sync();
+
+  if (checkpoint_pid > 0 || time(NULL) - checkpoint_failed < CHECKPOINT_RETRY_INTERVAL)
+    return;
+
+  if (wal_size > WAL_HEADER_SIZE) {
+    if ((checkpoint_size > 0 && wal_size >= (size_t) checkpoint_size) ||
+        (checkpoint_interval > 0 && time(NULL) - wal_last_checkpoint >= checkpoint_interval)) {
+      redstore_info("Checkpointing write-ahead log (%lu bytes).", (unsigned long) wal_size);
+      if (!snapshot_filename || !redstore_storage_is_in_memory()) {
+        if (redstore_checkpoint())
+          checkpoint_failed = time(NULL);
+      } else {
+        checkpoint_start();
+      }
+    }
+  }
+}
+
+// Stop using the log in a forked process, leaving it to the parent
+void redstore_wal_detach(void)
+{
+  if (wal_fd >= 0)
+    close(wal_fd);
+  wal_fd = -1;
+  wal_unsynced = 0;
+  checkpoint_pid = 0;
+}
+
+void redstore_wal_close(void)
+{
+  if (wal_fd >= 0) {
+    wal_sync();
+    close(wal_fd);
+    wal_fd = -1;
+  }
+
+  redstore_buffer_free(&wal_buffer);
+}
@@ -0,0 +1,429 @@
+/*
+    RedStore - a lightweight RDF triplestore powered by Redland
+    Copyright (C) 2010-2011 Nicholas J Humfrey <njh@aelius.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Pre-forked worker processes
+
+  Redland is not thread-safe, so to answer reads on several cores the
+  process that opened the store forks worker processes. Each worker
+  listens on the HTTP port itself, using SO_REUSEPORT, so the kernel
+  shares the connections out between them. The process that forked them
+  (the writer) doesn't listen on the port; it makes every change to the
+  store.
+
+  Each worker peeks at the request line of a new connection. Requests
+  which might change the store are handed to the writer, by passing the
+  socket over a Unix domain socket, before anything has been read from
+  it. The writer then answers them as if it had accepted the connection.
+  If the writer is so far behind that the Unix domain socket is full, the
+  worker doesn't wait for it: it answers the request itself with 503 and
+  Retry-After.
+
+  Each worker is also a replica of the writer (see replication.c), on a
+  second socket: it starts with a copy of the store, and receives every
+  change that the writer makes and applies it to the copy. Other storage
+  modules can not be shared safely with a forked process, so workers need
+  an in-memory store.
+
+  The writer answers a change as soon as it has made it, without waiting
+  for the workers, which apply the stream of changes in their own time.
+  So reads are only eventually consistent: a client that reads straight
+  after a write may be answered by a worker that hasn't applied it yet,
+  and may not see its own change.
+
+  Requests on HTTP/2 connections can't be handed over on their own, so
+  workers refuse writes made using HTTP/2.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include "redstore.h"
+
+#define DEFAULT_WORKERS        (0)
+#define MAX_WORKERS            (256)
+
+// Enough of the request line to find the method and path
+#define PEEK_SIZE              (1024)
+
+
+// Sent with the socket of a connection handed to the writer
+typedef struct {
+  socklen_t sa_len;
+  struct sockaddr_storage sa;
+} handover_t;
+
+// The sockets are pairs; the writer uses [0] and the worker uses [1]
+typedef struct {
+  pid_t pid;
+  int changes[2];
+  int handover[2];
+} worker_t;
+
+static redhttp_server_t *workers_server = NULL;
+
+// Writer
+static worker_t *workers = NULL;
+static int worker_count = 0;
+
+// Worker
+static int is_worker = 0;
+static int writer_fd = -1;
+
+
+// Hand a connection that might change the store over to the writer. If
+// the writer is too busy to take it, the worker keeps the connection and
+// refuses the request (see handle_replica_write()).
+static int worker_handover(int socket, struct sockaddr *sa, size_t sa_len)
+{
+  char control[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct iovec iov;
+  handover_t handover;
+
+  memset(&handover, 0, sizeof(handover));
+  handover.sa_len = sa_len <= sizeof(handover.sa) ? sa_len : sizeof(handover.sa);
+  memcpy(&handover.sa, sa, handover.sa_len);
+  iov.iov_base = &handover;
+  iov.iov_len = sizeof(handover);
+
+  memset(&msg, 0, sizeof(msg));
+  memset(control, 0, sizeof(control));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &socket, sizeof(int));
+
+  // Don't wait for the writer, which may be busy with a long request
+  while (sendmsg(writer_fd, &msg, MSG_DONTWAIT) < 0) {
+    if (errno != EINTR) {
+      redstore_warn("Failed to hand connection to writer: %s", strerror(errno));
+      return 0;
+    }
+  }
+
+  // The writer has its own copy of the socket now
+  close(socket);
+  return 1;
+}
+
+// Connection filter of a worker: look at the request line, and hand the
+// connection to the writer unless the request only reads from the store
+static int worker_connection(int socket, struct sockaddr *sa, size_t sa_len, void *user_data)
+{
+  char line[PEEK_SIZE + 1];
+  char *method, *path, *end;
+  ssize_t len;
+
+  do {
+    len = recv(socket, line, PEEK_SIZE, MSG_PEEK);
+  } while (len < 0 && errno == EINTR);
+
+  // Let the server deal with connections that are closed or broken
+  if (len <= 0)
+    return 0;
+  line[len] = '\0';
+
+  method = line;
+  path = strchr(method, ' ');
+  if (!path)
+    return worker_handover(socket, sa, sa_len);
+  *path++ = '\0';
+
+  // HTTP/2 connections (starting "PRI * HTTP/2.0") stay with the worker
+  if (strcmp(method, "PRI") == 0)
+    return 0;
+
+  // If the whole path hasn't arrived yet, the writer can answer it anyway
+  end = path + strcspn(path, " ?\r\n");
+  if (*end == '\0')
+    return redstore_is_write_request(method, "") ? worker_handover(socket, sa, sa_len) : 0;
+  *end = '\0';
+
+  if (redstore_is_write_request(method, path))
+    return worker_handover(socket, sa, sa_len);
+
+  return 0;
+}
+
+// A worker handed a connection to the writer
+static void writer_receive(int fd, void *user_data)
+{
+  char control[CMSG_SPACE(sizeof(int))];
+  worker_t *worker = (worker_t *) user_data;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct iovec iov;
+  handover_t handover;
+  ssize_t len;
+  int socket = -1;
+
+  iov.iov_base = &handover;
+  iov.iov_len = sizeof(handover);
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  len = recvmsg(fd, &msg, 0);
+  if (len < 0 && (errno == EINTR || errno == EAGAIN))
+    return;
+
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+      memcpy(&socket, CMSG_DATA(cmsg), sizeof(int));
+  }
+
+  if (len <= 0) {
+    // The worker has gone; it is reaped with the other child processes
+    redhttp_server_remove_watch(workers_server, fd);
+    close(fd);
+    worker->handover[0] = -1;
+    return;
+  }
+
+  if (socket < 0)
+    return;
+  if (len != sizeof(handover)) {
+    close(socket);
+    return;
+  }
+
+  // The request takes ownership of the socket
+  redhttp_server_handle_request(workers_server, socket, (struct sockaddr *) &handover.sa,
+                                handover.sa_len);
+}
+
+// Set up a newly forked worker
+static int worker_start(int index, const char *address, const char *port)
+{
+  int changes_fd = workers[index].changes[1];
+  int i;
+
+  is_worker = 1;
+  writer_fd = workers[index].handover[1];
+
+  // The other sockets belong to the writer, and to the other workers
+  for (i = 0; i < worker_count; i++) {
+    close(workers[i].changes[0]);
+    close(workers[i].handover[0]);
+    if (i != index) {
+      close(workers[i].changes[1]);
+      close(workers[i].handover[1]);
+    }
+  }
+  free(workers);
+  workers = NULL;
+  worker_count = 0;
+
+  // Only the writer keeps the write-ahead log and writes snapshots
+  redstore_wal_detach();
+  snapshot_filename = NULL;
+
+  if (redstore_replication_follow(changes_fd)) {
+    redstore_error("Worker %d failed to follow changes from writer.", index + 1);
+    return -1;
+  }
+
+  redhttp_server_set_connection_filter(workers_server, worker_connection, NULL);
+  redhttp_server_set_reuse_port(workers_server, 1);
+  redstore_info("Worker %d starting HTTP server on port %s", index + 1, port);
+  if (redhttp_server_listen(workers_server, address, port, PF_UNSPEC)) {
+    redstore_error("Worker %d failed to create HTTP server socket.", index + 1);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+int redstore_workers_init(redhttp_server_t * server, const char *address, const char *port)
+{
+  long count = redstore_get_option_long("workers", DEFAULT_WORKERS);
+  int i;
+
+  workers_server = server;
+  if (count == 0)
+    return 0;
+
+  if (count < 0 || count > MAX_WORKERS) {
+    redstore_error("The number of workers must be between 0 and %d.", MAX_WORKERS);
+    return -1;
+  }
+  if (!redstore_storage_is_in_memory()) {
+    redstore_error("Workers can only share an in-memory store.");
+    return -1;
+  }
+  if (redhttp_server_set_reuse_port(server, 1)) {
+    redstore_error("Workers need SO_REUSEPORT, which is not supported on this system.");
+    return -1;
+  }
+  // Only the workers listen on the port
+  redhttp_server_set_reuse_port(server, 0);
+
+  workers = calloc(count, sizeof(worker_t));
+  if (!workers) {
+    redstore_error("Failed to allocate memory for worker table.");
+    return -1;
+  }
+
+  // Create all the sockets first, so that each worker can close the others
+  for (i = 0; i < count; i++) {
+    worker_t *worker = &workers[i];
+
+    worker->pid = -1;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, worker->changes)) {
+      redstore_error("Failed to create socket for worker: %s", strerror(errno));
+      return -1;
+    }
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, worker->handover)) {
+      redstore_error("Failed to create socket for worker: %s", strerror(errno));
+      close(worker->changes[0]);
+      close(worker->changes[1]);
+      return -1;
+    }
+    worker_count++;
+  }
+
+  // The workers start with the store as it is now, so changes queued for
+  // replicas must not be sent to them as well
+  redstore_replication_flush();
+  fflush(stdout);
+  fflush(stderr);
+
+  for (i = 0; i < worker_count; i++) {
+    pid_t pid = fork();
+
+    if (pid < 0) {
+      redstore_error("Failed to fork worker process: %s", strerror(errno));
+      return -1;
+    } else if (pid == 0) {
+      // Don't run the clean up of the writer if the worker fails
+      if (worker_start(i, address, port))
+        exit(EXIT_FAILURE);
+      return 0;
+    }
+    workers[i].pid = pid;
+  }
+
+  for (i = 0; i < worker_count; i++) {
+    worker_t *worker = &workers[i];
+
+    close(worker->changes[1]);
+    close(worker->handover[1]);
+    worker->changes[1] = worker->handover[1] = -1;
+
+    if (redstore_replication_add_replica(worker->changes[0]) ||
+        redhttp_server_add_watch(server, worker->handover[0], writer_receive, worker)) {
+      redstore_error("Failed to set up connections to worker %d.", i + 1);
+      return -1;
+    }
+    // The replication code closes it from now on
+    worker->changes[0] = -1;
+  }
+
+  redstore_info("Forked %d worker processes to serve requests.", worker_count);
+  return 0;
+}
+
+// Returns true if this process is a worker
+int redstore_is_worker(void)
+{
+  return is_worker;
+}
+
+// Returns the number of workers, if this process is their writer
+int redstore_workers_count(void)
+{
+  int i, count = 0;
+
+  for (i = 0; i < worker_count; i++) {
+    if (workers[i].pid > 0)
+      count++;
+  }
+
+  return count;
+}
+
+// Called for each child process that exits; returns true if it was a worker
+int redstore_workers_reaped(pid_t pid, int status)
+{
+  int i;
+
+  for (i = 0; i < worker_count; i++) {
+    if (workers[i].pid == pid) {
+      redstore_error("Worker process %d exited with status %d.", (int) pid, status);
+      workers[i].pid = -1;
+
+      // Carry on with the others, but stop if there are none left
+      if (redstore_workers_count() == 0) {
+        redstore_error("All the worker processes have exited.");
+        exit_code = EXIT_FAILURE;
+        running = 0;
+      }
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// Stop the workers, and wait for them to finish their requests
+void redstore_workers_free(void)
+{
+  int i;
+
+  for (i = 0; i < worker_count; i++) {
+    if (workers[i].pid > 0)
+      kill(workers[i].pid, SIGTERM);
+  }
+
+  for (i = 0; i < worker_count; i++) {
+    if (workers[i].pid > 0) {
+      while (waitpid(workers[i].pid, NULL, 0) < 0 && errno == EINTR);
+    }
+    if (workers[i].handover[0] >= 0)
+      close(workers[i].handover[0]);
+    if (workers[i].changes[0] >= 0)
+      close(workers[i].changes[0]);
+  }
+
+  if (workers)
+    free(workers);
+  workers = NULL;
+  worker_count = 0;
+
+  if (writer_fd >= 0)
+    close(writer_fd);
+  writer_fd = -1;
+}
@@ -0,0 +1,551 @@
+/*
+    RedStore - a lightweight RDF triplestore powered by Redland
+    Copyright (C) 2010-2011 Nicholas J Humfrey <njh@aelius.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Queued writes
+
+  Every request that changes the store is queued as a write job, which
+  holds the lock on the graph it changes (see locks.c) while it is being
+  applied. If the lock is free, and there is no data to parse, the write
+  is applied straight away.
+
+  Large request bodies are parsed by a child process, while the server
+  carries on with other requests. The child sends the parsed statements
+  back over a pipe, as a list of records:
+
+    type        1 byte, 'T' for a triple, 'E' for an error, 'D' for done
+    length      varint, length of the payload
+    payload     triple: the subject, predicate and object nodes
+                error: the error message
+
+  Once the body has been parsed and the lock has been granted, the
+  statements are applied to the store and the response is sent. So
+  writes to different graphs are parsed in parallel and applied in the
+  order they are ready, while writes to the same graph are applied in
+  the order they arrived. Applying the statements is not concurrent:
+  Redland is not thread-safe, so the server applies one write at a time.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "redstore.h"
+
+#define DEFAULT_PARSE_FORK_SIZE   (256 * 1024)
+#define PARSE_FLUSH_SIZE          (64 * 1024)
+#define RECEIVE_SIZE              (64 * 1024)
+
+#define RECORD_TRIPLE             'T'
+#define RECORD_ERROR              'E'
+#define RECORD_DONE               'D'
+
+
+typedef struct write_job_s {
+  redhttp_request_t *request;
+  librdf_node *graph;
+  redstore_stream_processor stream_proc;
+
+  // Data to be parsed in the parent, if there is no child
+  unsigned char *buffer;
+  size_t length;
+  char *parser_name;
+  char *encoding;
+
+  // Statements parsed by a child process
+  int parse_fd;
+  redstore_buffer_t parsed;
+
+  int parsed_done;
+  int locked;
+  struct write_job_s *next;
+} write_job_t;
+
+typedef struct {
+  const unsigned char *ptr;
+  const unsigned char *end;
+  librdf_statement *statement;
+} parsed_stream_t;
+
+
+static redhttp_server_t *writes_server = NULL;
+static write_job_t *jobs = NULL;
+static long parse_fork_size = DEFAULT_PARSE_FORK_SIZE;
+
+// Used by the child process
+static int parse_output_fd = -1;
+static int parse_output_failed = 0;
+static redstore_buffer_t parse_output = { NULL, 0, 0 };
+
+
+static const unsigned char *read_record(const unsigned char *ptr, const unsigned char *end,
+                                        int *type, const unsigned char **payload, size_t * length)
+{
+  uint64_t value;
+
+  if (ptr >= end)
+    return NULL;
+
+  *type = *ptr++;
+  ptr = redstore_decode_varint(ptr, end, &value);
+  if (!ptr || value > (uint64_t) (end - ptr))
+    return NULL;
+
+  *payload = ptr;
+  *length = value;
+
+  return ptr + value;
+}
+
+static int append_record(redstore_buffer_t * buffer, int type, const void *data, size_t length)
+{
+  if (redstore_buffer_append_byte(buffer, type) ||
+      redstore_buffer_append_varint(buffer, length) ||
+      redstore_buffer_append(buffer, data, length))
+    return -1;
+
+  return 0;
+}
+
+static int flush_parse_output(void)
+{
+  size_t written = 0;
+
+  while (written < parse_output.length) {
+    ssize_t len = write(parse_output_fd, parse_output.data + written,
+                        parse_output.length - written);
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len <= 0)
+      return -1;
+    written += len;
+  }
+
+  redstore_buffer_reset(&parse_output);
+  return 0;
+}
+
+// Stream processor used in the child, to send the statements to the parent
+static redhttp_response_t *send_parsed_stream(redhttp_request_t * request, librdf_stream * stream,
+                                              librdf_node * graph)
+{
+  redstore_buffer_t triple = { NULL, 0, 0 };
+
+  while (!librdf_stream_end(stream)) {
+    librdf_statement *statement = librdf_stream_get_object(stream);
+
+    redstore_buffer_reset(&triple);
+    if (redstore_encode_node(&triple, librdf_statement_get_subject(statement)) ||
+        redstore_encode_node(&triple, librdf_statement_get_predicate(statement)) ||
+        redstore_encode_node(&triple, librdf_statement_get_object(statement)) ||
+        append_record(&parse_output, RECORD_TRIPLE, triple.data, triple.length) ||
+        (parse_output.length >= PARSE_FLUSH_SIZE && flush_parse_output())) {
+      parse_output_failed = 1;
+      break;
+    }
+
+    librdf_stream_next(stream);
+  }
+
+  redstore_buffer_free(&triple);
+  return NULL;
+}
+
+static void parse_in_child(write_job_t * job, const unsigned char *buffer, size_t length)
+{
+  redhttp_response_t *response = NULL;
+
+  response = process_data_from_buffer(job->request, buffer, length, job->parser_name,
+                                      job->encoding, job->graph, send_parsed_stream);
+
+  // The parent reports a failure if the records are not finished
+  if (parse_output_failed)
+    _exit(EXIT_FAILURE);
+
+  if (response || error_buffer) {
+    const char *message = "Failed to parse data.";
+    if (error_buffer)
+      message = (const char *) raptor_stringbuffer_as_string(error_buffer);
+    append_record(&parse_output, RECORD_ERROR, message, strlen(message));
+  } else {
+    append_record(&parse_output, RECORD_DONE, NULL, 0);
+  }
+
+  _exit(flush_parse_output() ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+static void receive_parsed(int fd, void *user_data)
+{
+  write_job_t *job = (write_job_t *) user_data;
+  ssize_t got;
+
+  if (redstore_buffer_reserve(&job->parsed, RECEIVE_SIZE)) {
+    redstore_error("Failed to allocate memory for parsed statements.");
+    got = 0;
+  } else {
+    got = read(fd, job->parsed.data + job->parsed.length, RECEIVE_SIZE);
+    if (got < 0 && (errno == EINTR || errno == EAGAIN))
+      return;
+  }
+
+  if (got > 0) {
+    job->parsed.length += got;
+  } else {
+    redhttp_server_remove_watch(writes_server, fd);
+    close(fd);
+    job->parse_fd = -1;
+    job->parsed_done = 1;
+  }
+}
+
+// Fork a child to parse the data; returns -1 if the parent should parse it
+static int start_parser(write_job_t * job, const unsigned char *buffer, size_t length)
+{
+  int fds[2];
+  pid_t pid;
+
+  if (pipe(fds)) {
+    redstore_error("Failed to create pipe for parser: %s", strerror(errno));
+    return -1;
+  }
+
+  pid = redstore_fork_child();
+  if (pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  } else if (pid == 0) {
+    close(fds[0]);
+    parse_output_fd = fds[1];
+    parse_in_child(job, buffer, length);
+  }
+
+  close(fds[1]);
+  if (redhttp_server_add_watch(writes_server, fds[0], receive_parsed, job)) {
+    // The child will get SIGPIPE and the data will be parsed in the parent
+    close(fds[0]);
+    return -1;
+  }
+
+  redstore_debug("Parsing %lu bytes in child process %d.", (unsigned long) length, (int) pid);
+  job->parse_fd = fds[0];
+
+  return 0;
+}
+
+
+static int parsed_stream_is_end(void *data)
+{
+  parsed_stream_t *context = (parsed_stream_t *) data;
+  return context->statement == NULL;
+}
+
+static int parsed_stream_next(void *data)
+{
+  parsed_stream_t *context = (parsed_stream_t *) data;
+  librdf_node *nodes[3] = { NULL, NULL, NULL };
+  const unsigned char *payload = NULL, *ptr = NULL, *end = NULL;
+  size_t length = 0;
+  int type = 0;
+  int i;
+
+  if (context->statement) {
+    librdf_free_statement(context->statement);
+    context->statement = NULL;
+  }
+
+  context->ptr = read_record(context->ptr, context->end, &type, &payload, &length);
+  if (!context->ptr || type != RECORD_TRIPLE)
+    return 1;
+
+  ptr = payload;
+  end = payload + length;
+  for (i = 0; i < 3 && ptr; i++)
+    ptr = redstore_decode_node(ptr, end, &nodes[i]);
+
+  if (ptr && nodes[0] && nodes[1] && nodes[2]) {
+    context->statement = librdf_new_statement_from_nodes(world, nodes[0], nodes[1], nodes[2]);
+  } else {
+    for (i = 0; i < 3; i++) {
+      if (nodes[i])
+        librdf_free_node(nodes[i]);
+    }
+  }
+
+  return context->statement == NULL;
+}
+
+static void *parsed_stream_get(void *data, int flags)
+{
+  parsed_stream_t *context = (parsed_stream_t *) data;
+
+  if (flags == LIBRDF_STREAM_GET_METHOD_GET_OBJECT)
+    return context->statement;
+
+  return NULL;
+}
+
+static void parsed_stream_finished(void *data)
+{
+  parsed_stream_t *context = (parsed_stream_t *) data;
+
+  if (context->statement)
+    librdf_free_statement(context->statement);
+  free(context);
+}
+
+static librdf_stream *new_parsed_stream(write_job_t * job)
+{
+  parsed_stream_t *context = calloc(1, sizeof(parsed_stream_t));
+
+  if (!context)
+    return NULL;
+
+  context->ptr = job->parsed.data;
+  context->end = job->parsed.data + job->parsed.length;
+  parsed_stream_next(context);
+
+  return librdf_new_stream(world, context, parsed_stream_is_end, parsed_stream_next,
+                           parsed_stream_get, parsed_stream_finished);
+}
+
+// Check that the child parsed everything; errors are put in the error buffer
+static int check_parsed(write_job_t * job)
+{
+  const unsigned char *ptr = job->parsed.data;
+  const unsigned char *end = job->parsed.data + job->parsed.length;
+  const unsigned char *payload = NULL;
+  size_t length = 0;
+  int type = 0;
+
+  while (ptr < end) {
+    ptr = read_record(ptr, end, &type, &payload, &length);
+    if (!ptr)
+      break;
+
+    if (type == RECORD_DONE) {
+      return 0;
+    } else if (type == RECORD_ERROR) {
+      error_buffer = raptor_new_stringbuffer();
+      if (error_buffer)
+        raptor_stringbuffer_append_counted_string(error_buffer, payload, length, 1);
+      return -1;
+    }
+  }
+
+  redstore_error("Parser process did not finish.");
+  return -1;
+}
+
+
+static void job_lock_granted(void *data)
+{
+  write_job_t *job = (write_job_t *) data;
+  job->locked = 1;
+}
+
+static void job_free(write_job_t * job)
+{
+  if (job->parse_fd >= 0) {
+    redhttp_server_remove_watch(writes_server, job->parse_fd);
+    close(job->parse_fd);
+  }
+  if (job->graph)
+    librdf_free_node(job->graph);
+  if (job->buffer)
+    free(job->buffer);
+  if (job->parser_name)
+    free(job->parser_name);
+  if (job->encoding)
+    free(job->encoding);
+  redstore_buffer_free(&job->parsed);
+  free(job);
+}
+
+static redhttp_response_t *job_apply(write_job_t * job)
+{
+  redhttp_response_t *response = NULL;
+  librdf_stream *stream = NULL;
+
+  if (job->parsed_done) {
+    if (check_parsed(job)) {
+      response = redstore_page_new_with_message(
+        job->request, LIBRDF_LOG_INFO, REDHTTP_INTERNAL_SERVER_ERROR, "Failed to parse data."
+      );
+    } else if (!(stream = new_parsed_stream(job))) {
+      response = redstore_page_new_with_message(
+        job->request, LIBRDF_LOG_ERROR, REDHTTP_INTERNAL_SERVER_ERROR,
+        "Failed to read parsed data."
+      );
+    } else {
+      response = job->stream_proc(job->request, stream, job->graph);
+      librdf_free_stream(stream);
+    }
+  } else if (job->parser_name) {
+    response = process_data_from_buffer(job->request, job->buffer, job->length,
+                                        job->parser_name, job->encoding, job->graph,
+                                        job->stream_proc);
+  } else {
+    response = job->stream_proc(job->request, NULL, job->graph);
+  }
+
+  if (!response) {
+    response = redstore_page_new_with_message(
+      job->request, LIBRDF_LOG_ERROR, REDHTTP_INTERNAL_SERVER_ERROR, "Failed to apply changes."
+    );
+  }
+
+  redstore_lock_release(job->graph);
+
+  return response;
+}
+
+
+int redstore_writes_init(redhttp_server_t * server)
+{
+  writes_server = server;
+  parse_fork_size = redstore_get_option_long("parse-fork-size", DEFAULT_PARSE_FORK_SIZE);
+
+  return 0;
+}
+
+// Apply a change to the store once the graph's lock is free. If there is
+// data, it is parsed with the named parser and passed to stream_proc;
+// encoding is the Content-Encoding of the data, or NULL.
+redhttp_response_t *redstore_queue_write(redhttp_request_t * request, librdf_node * graph,
+                                         redstore_stream_processor stream_proc,
+                                         const unsigned char *buffer, size_t length,
+                                         const char *parser_name, const char *encoding)
+{
+  redhttp_response_t *response = NULL;
+  write_job_t *job = NULL, **tail = NULL;
+  int locked;
+
+  job = calloc(1, sizeof(write_job_t));
+  if (!job)
+    goto MEMORY_ERROR;
+
+  job->request = request;
+  job->stream_proc = stream_proc;
+  job->parse_fd = -1;
+  if (graph) {
+    job->graph = librdf_new_node_from_node(graph);
+    if (!job->graph)
+      goto MEMORY_ERROR;
+  }
+
+  if (buffer) {
+    job->parser_name = strdup(parser_name);
+    if (!job->parser_name)
+      goto MEMORY_ERROR;
+    if (encoding) {
+      job->encoding = strdup(encoding);
+      if (!job->encoding)
+        goto MEMORY_ERROR;
+    }
+
+    if (writes_server && parse_fork_size > 0 && length >= (size_t) parse_fork_size)
+      start_parser(job, buffer, length);
+
+    // Keep a copy of the data, in case the write has to wait for the lock
+    if (job->parse_fd < 0) {
+      job->buffer = malloc(length + 1);
+      if (!job->buffer)
+        goto MEMORY_ERROR;
+      memcpy(job->buffer, buffer, length);
+      job->length = length;
+    }
+  }
+
+  locked = redstore_lock_acquire(job->graph, job_lock_granted, job);
+  if (locked < 0)
+    goto MEMORY_ERROR;
+
+  if (locked && job->parse_fd < 0) {
+    // Nothing to wait for
+    response = job_apply(job);
+    job_free(job);
+    return response;
+  }
+
+  job->locked = locked;
+  for (tail = &jobs; *tail; tail = &(*tail)->next);
+  *tail = job;
+
+  // The response is sent by redstore_writes_run()
+  redhttp_request_set_deferred(request, 1);
+  response = redhttp_response_new(REDHTTP_OK, NULL);
+  redhttp_response_set_headers_sent(response, 1);
+
+  return response;
+
+MEMORY_ERROR:
+  if (job)
+    job_free(job);
+  return redstore_page_new_with_message(
+    request, LIBRDF_LOG_ERROR, REDHTTP_INTERNAL_SERVER_ERROR, "Failed to queue write."
+  );
+}
+
+// Apply the queued writes that have their data and their lock
+void redstore_writes_run(void)
+{
+  write_job_t **ptr = &jobs;
+
+  while (*ptr) {
+    write_job_t *job = *ptr;
+    redhttp_response_t *response = NULL;
+
+    if (!job->locked || job->parse_fd >= 0) {
+      ptr = &job->next;
+      continue;
+    }
+
+    *ptr = job->next;
+
+    // Errors from earlier requests do not apply to this one
+    if (error_buffer) {
+      raptor_free_stringbuffer(error_buffer);
+      error_buffer = NULL;
+    }
+
+    response = job_apply(job);
+    redhttp_request_finish(job->request, response);
+    job_free(job);
+
+    // Releasing the lock may have granted it to an earlier job
+    ptr = &jobs;
+  }
+}
+
+void redstore_writes_free(void)
+{
+  while (jobs) {
+    write_job_t *job = jobs;
+    jobs = job->next;
+
+    redhttp_request_finish(job->request, redstore_page_new_with_message(
+      job->request, LIBRDF_LOG_WARN, REDHTTP_SERVICE_UNAVAILABLE, "Server is shutting down."
+    ));
+    job_free(job);
+  }
+
+  redstore_buffer_free(&parse_output);
+}
@@ -7,7 +7,8 @@ use redstore_testlib;
 use warnings;
 use strict;
 
-use Test::More tests => 94;
+use Test::More tests => 139;
+use IO::Compress::Gzip qw(gzip);
 
 my $RFC822_DATE = qr/^(\w{3},)? \d{1,2} \w{3} \d{2} \d{2}:\d{2}:\d{2}/;
 
@@ -97,6 +98,13 @@ is($response->code, 200, "Getting favicon.ico is successful");
 is($response->content_type, 'image/x-icon', "Getting favicon.ico set the content type");
 ok($response->content_length > 100, "favicon.ico is more than 100 bytes long");
 like($response->last_modified, qr/^\d{10}$/, "Should have a last modified date set");
+my $etag = $response->header('ETag');
+ok(defined $etag, "favicon.ico should have an ETag");
+
+# Test getting the favicon again with the ETag
+$response = $ua->get($base_url.'favicon.ico', 'If-None-Match' => $etag);
+is($response->code, 304, "Getting favicon.ico with a matching ETag is not modified");
+is($response->content, '', "Not modified response for favicon.ico has no content");
 
 # Test getting robots.txt
 $response = $ua->get($base_url.'robots.txt');
@@ -222,12 +230,149 @@ like($response->content, qr/Missing the 'content' argument/, "Response mentions
     is(scalar(@lines), 1, "Number of remaining triples is correct");
 }
 
+# Test getting a graph as N-Triples and N-Quads
+$response = $ua->get($base_url.'data/?graph=test%3Ag&format=ntriples');
+is($response->code, 200, "Getting a graph as N-Triples is successful");
+is($response->content, "<test:s4> <test:p4> <test:o4> .\n", "Graph as N-Triples is correct");
+$response = $ua->get($base_url.'data/?graph=test%3Ag&format=nquads');
+is($response->code, 200, "Getting a graph as N-Quads is successful");
+is($response->content, "<test:s4> <test:p4> <test:o4> <test:g> .\n", "Graph as N-Quads is correct");
+
+# Test that adding a triple twice, or deleting a missing one, doesn't change the counts
+{
+    my $count_triples = sub {
+        my $response = $ua->get($base_url.'description', 'Accept' => 'text/html');
+        return $response->content =~ m[<th>Triple Count</th><td>(\d+)</td>] ? $1 : undef;
+    };
+    my $before = $count_triples->();
+    ok(defined $before, "Description page shows the number of triples");
+
+    foreach my $attempt (1, 2) {
+        $response = $ua->post( $base_url.'insert', {
+            'content' => "<test:s5> <test:p5> <test:o5> .\n",
+            'content-type' => 'ntriples',
+            'graph' => 'test:dup'
+        });
+        is($response->code, 200, "POSTing the same triple to /insert is successful (attempt $attempt)");
+    }
+    is($count_triples->(), $before + 1, "Adding the same triple twice counts it once");
+
+    $response = $ua->post( $base_url.'delete', {
+        'content' => "<test:s6> <test:p6> <test:o6> .\n",
+        'content-type' => 'ntriples',
+        'graph' => 'test:dup'
+    });
+    is($response->code, 200, "POSTing a missing triple to /delete is successful");
+    is($count_triples->(), $before + 1, "Deleting a missing triple doesn't change the count");
+    $response = $ua->get($base_url.'graphs', 'Accept' => 'text/plain');
+    like($response->content, qr[^test:dup$]m, "Graph is still listed after deleting a missing triple");
+
+    $response = $ua->post( $base_url.'delete', {
+        'content' => "<test:s5> <test:p5> <test:o5> .\n",
+        'content-type' => 'ntriples',
+        'graph' => 'test:dup'
+    });
+    is($count_triples->(), $before, "Deleting the triple restores the count");
+    $response = $ua->get($base_url.'graphs', 'Accept' => 'text/plain');
+    unlike($response->content, qr[^test:dup$]m, "Graph is no longer listed once it is empty");
+}
+
+# Test that a triple in the default graph is kept apart from the same triple in a named graph
+{
+    $response = $ua->post( $base_url.'insert', {
+        'content' => "<test:s7> <test:p7> <test:o7> .\n",
+        'content-type' => 'ntriples',
+        'graph' => 'test:shared'
+    });
+    is($response->code, 200, "POSTing a triple into a named graph is successful");
+    $response = $ua->post( $base_url.'insert', {
+        'content' => "<test:s7> <test:p7> <test:o7> .\n",
+        'content-type' => 'ntriples',
+    });
+    is($response->code, 200, "POSTing the same triple into the default graph is successful");
+    $request = HTTP::Request->new( 'DELETE', $base_url.'data/?graph=test%3Ashared' );
+    $response = $ua->request($request);
+    is($response->code, 200, "DELETEing the named graph is successful");
+    $response = $ua->get($base_url.'dump');
+    like($response->content, qr[^<test:s7> <test:p7> <test:o7> \.$]m, "Triple is still in the default graph");
+}
+
 # Test POSTing to /delete without a content argument
 $response = $ua->post( $base_url.'delete');
 is($response->code, 400, "POSTing to /delete without any content should fail");
 like($response->content, qr/Missing the 'content' argument/, "Response mentions missing content argument");
 
+# Test dumping the whole store as N-Quads
+$response = $ua->get($base_url.'dump');
+is($response->code, 200, "Getting a dump of the store is successful");
+is($response->content_type, 'application/n-quads', "Dump is of type application/n-quads");
+like($response->content, qr[^<test:s2> <test:p2> <test:o2> \.$]m, "Dump contains triple in the default graph");
+like($response->content, qr[^<test:s4> <test:p4> <test:o4> <test:g> \.$]m, "Dump contains quad in a named graph");
+
+# Test running an analytic query in a child process
+$response = $ua->get($base_url."query?query=ASK+%7B%3Chttp%3A%2F%2Fwww.example.com%2Fjoe%2Ffoaf.rdf%3E+%3Fp+%3Fo%7D&format=json&analytic=1");
+is($response->code, 200, "Analytic SPARQL ASK query is successful");
+like($response->content, qr["boolean" : true], "Analytic SPARQL ASK Query result is 'true'");
+
+# Test getting SELECT results as CSV
+$response = $ua->get($base_url."query?query=SELECT+%3Fo+WHERE+%7B%3Ctest%3As2%3E+%3Ctest%3Ap2%3E+%3Fo%7D&format=csv");
+is($response->code, 200, "SPARQL SELECT query as CSV is successful");
+is($response->content, "o\r\ntest:o2\r\n", "SPARQL SELECT query as CSV has a header and one row");
+
+# Test getting SELECT results as TSV
+$response = $ua->get($base_url."query?query=SELECT+%3Fo+WHERE+%7B%3Ctest%3As2%3E+%3Ctest%3Ap2%3E+%3Fo%7D&format=tsv");
+is($response->code, 200, "SPARQL SELECT query as TSV is successful");
+is($response->content, "?o\n<test:o2>\n", "SPARQL SELECT query as TSV has a header and one row");
+
+# Test getting SELECT results as JSON
+$response = $ua->get($base_url."query?query=SELECT+%3Fo+WHERE+%7B%3Ctest%3As2%3E+%3Ctest%3Ap2%3E+%3Fo%7D&format=json");
+is($response->code, 200, "SPARQL SELECT query as JSON is successful");
+like($response->content, qr[\{"o":\{"type":"uri","value":"test:o2"\}\}], "SPARQL SELECT query as JSON contains the binding");
+
+# Test getting SELECT results in the binary format
+$response = $ua->get($base_url."query?query=SELECT+%3Fo+WHERE+%7B%3Ctest%3As2%3E+%3Ctest%3Ap2%3E+%3Fo%7D", 'Accept' => 'application/x-redstore-results');
+is($response->code, 200, "SPARQL SELECT query in binary format is successful");
+is($response->content_type, "application/x-redstore-results", "SPARQL SELECT query in binary format has the right content type");
+is($response->content, "RSR1\x00\x01\x01o\x01\x00\x01\x01\x07test:o2\x01\x00", "SPARQL SELECT query in binary format has one block with one term");
+
+
+
+# Test getting compressed responses
+$response = $ua->get($base_url."query?query=SELECT+%3Fo+WHERE+%7B%3Ctest%3As2%3E+%3Ctest%3Ap2%3E+%3Fo%7D&format=tsv", 'Accept-Encoding' => 'gzip');
+is($response->code, 200, "SPARQL SELECT query with Accept-Encoding is successful");
+my $description_response = $ua->get($base_url."description", 'Accept' => 'text/html', 'Accept-Encoding' => 'gzip;q=0.5, zstd;q=0');
+is($description_response->code, 200, "Getting description page with Accept-Encoding is successful");
+SKIP: {
+    skip "RedStore was built without zlib", 3 unless $response->header('Content-Encoding');
+    is($response->header('Content-Encoding'), 'gzip', "Streamed response is gzip compressed");
+    is($response->decoded_content, "?o\n<test:o2>\n", "Streamed response decompresses to the results");
+    is($description_response->header('Content-Encoding'), 'gzip', "Description page is gzip compressed");
+}
+
+# Test uploading compressed data
+my $gzipped;
+gzip(\"<test:s3> <test:p3> <test:o3> .\n" => \$gzipped);
+$request = HTTP::Request->new('PUT', $base_url.'data/compressed', [
+    'Content-Type' => 'text/plain', 'Content-Encoding' => 'br'
+], $gzipped);
+$response = $ua->request($request);
+is($response->code, 415, "Uploading data with an unsupported Content-Encoding fails");
+SKIP: {
+    skip "RedStore was built without zlib", 2 unless $description_response->header('Content-Encoding');
+    $request->header('Content-Encoding' => 'gzip');
+    $response = $ua->request($request);
+    is($response->code, 201, "Uploading gzip compressed data is successful");
+    $response = $ua->get($base_url.'data/compressed', 'Accept' => 'text/plain');
+    is($response->content, "<test:s3> <test:p3> <test:o3> .\n", "Gzip compressed data was decompressed and loaded");
+}
 
+# Test that a response too small to compress still varies with Accept-Encoding
+$response = $ua->get($base_url.'data/missing', 'Accept-Encoding' => 'gzip');
+SKIP: {
+    skip "RedStore was built without zlib", 2 unless $description_response->header('Content-Encoding');
+    ok(!defined $response->header('Content-Encoding'), "Small response is not compressed");
+    like($response->header('Vary') || '', qr/Accept-Encoding/, "Small response has Vary: Accept-Encoding");
+}
 
 
 END {